@@ -0,0 +1,266 @@
+#include "Bitmap.h"
+#include "BlockDevice.h"
+#include "BlockGroup.h"
+#include "BufferCache.h"
+#include "Crc32c.h"
+#include "FileSystem.h"
+#include "Inode.h"
+#include "Journal.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Benchmarks for the allocation, metadata, journal and data paths. Run with
+// --benchmark_format=json (or --benchmark_out=<file> --benchmark_out_format=json)
+// for machine-readable results; each scenario works on its own scratch image
+// in the current directory and removes it afterwards.
+
+namespace {
+
+const uint64_t MiB = 1024 * 1024;
+
+// A zero-filled image; sparse, so large ones are cheap
+void createImage(const std::string &path, uint64_t size) {
+    std::ofstream image(path, std::ios::binary | std::ios::trunc);
+    image.seekp(static_cast<std::streamoff>(size - 1));
+    image.put(0);
+}
+
+// Sets 'percent' of the bits, chosen at random but the same on every run
+void fillBitmap(Bitmap &bitmap, int64_t percent) {
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> roll(0, 99);
+    for (size_t i = 0; i < bitmap.size(); ++i) {
+        if (roll(random) < percent) {
+            bitmap.set(i);
+        }
+    }
+}
+
+const uint32_t BITMAP_BITS = 8 * 4096; // one 4 KiB bitmap block
+
+// FileSystem reports every create and delete on std::cout; keep that out of
+// the timings and out of the results, which are written there as well
+class QuietOutput {
+public:
+    QuietOutput() : saved(std::cout.rdbuf(&discard)) {}
+    ~QuietOutput() { std::cout.rdbuf(saved); }
+
+private:
+    struct Discard : std::streambuf {
+        int overflow(int c) override { return traits_type::not_eof(c); }
+    } discard;
+    std::streambuf *saved;
+};
+
+} // namespace
+
+// Next-fit search of an inode bitmap at a given fill ratio (percent)
+static void BM_FindFreeInode(benchmark::State &state) {
+    createImage("bench_alloc.img", MiB);
+    BlockGroup group("bench_alloc.img");
+    Bitmap bitmap(BITMAP_BITS);
+    fillBitmap(bitmap, state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(group.findFreeInode(bitmap));
+    }
+    state.SetItemsProcessed(state.iterations());
+    std::remove("bench_alloc.img");
+}
+BENCHMARK(BM_FindFreeInode)->ArgName("fill")->Arg(0)->Arg(50)->Arg(90)->Arg(99)->Arg(100);
+
+static void BM_FindFreeBlock(benchmark::State &state) {
+    createImage("bench_alloc.img", MiB);
+    BlockGroup group("bench_alloc.img");
+    Bitmap bitmap(BITMAP_BITS);
+    fillBitmap(bitmap, state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(group.findFreeBlock(bitmap));
+    }
+    state.SetItemsProcessed(state.iterations());
+    std::remove("bench_alloc.img");
+}
+BENCHMARK(BM_FindFreeBlock)->ArgName("fill")->Arg(0)->Arg(50)->Arg(90)->Arg(99)->Arg(100);
+
+// createFile followed by deleteFile, for files of a given size in bytes
+static void BM_CreateDeleteChurn(benchmark::State &state) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 64 * MiB;
+    {
+        QuietOutput quiet;
+        FileSystem fs("bench_fs.img");
+        if (!fs.initialize(mkfs)) {
+            state.SkipWithError("mkfs failed");
+            return;
+        }
+        uint32_t size = static_cast<uint32_t>(state.range(0));
+        for (auto _ : state) {
+            int inodeNumber = fs.createFile(0x1A4, size);
+            if (inodeNumber < 0) {
+                state.SkipWithError("createFile failed");
+                break;
+            }
+            fs.deleteFile(inodeNumber);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    std::remove("bench_fs.img");
+}
+BENCHMARK(BM_CreateDeleteChurn)->ArgName("size")->Arg(0)->Arg(4096)->Arg(64 * 1024);
+
+// CRC32C of a buffer of a given size, accelerated (0) or table-driven (1); 96
+// bytes is an inode, 4 KiB a block and 64 KiB a large journal transaction
+static void BM_Crc32c(benchmark::State &state) {
+    std::vector<char> data(static_cast<size_t>(state.range(0)), 'c');
+    bool portable = state.range(1) != 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(portable ? Crc32c::extendPortable(0, data.data(), data.size())
+                                          : Crc32c::compute(data.data(), data.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(portable ? "table" : Crc32c::implementation());
+}
+BENCHMARK(BM_Crc32c)->ArgNames({"bytes", "table"})->ArgsProduct({{96, 4096, 64 * 1024}, {0, 1}});
+
+// Inode reads and writes through the buffer cache, cycling over a working set
+// of a given number of inodes; the larger sets do not fit in the cache
+static void BM_InodeReadWrite(benchmark::State &state) {
+    uint32_t inodeCount = static_cast<uint32_t>(state.range(0));
+    createImage("bench_inode.img", 4096 + uint64_t(inodeCount) * sizeof(Inode::Ext4Inode));
+    {
+        auto cache = std::make_shared<BufferCache>(std::make_shared<BlockDevice>("bench_inode.img"));
+        Inode inode(cache, 4096);
+        inode.createInode(0x1A4, 0);
+        for (uint32_t i = 0; i < inodeCount; ++i) {
+            inode.writeInodeToDisk(i);
+        }
+        cache->flush();
+
+        uint32_t next = 0;
+        for (auto _ : state) {
+            inode.readInodeFromDisk(next);
+            ++inode.getInode().i_size;
+            inode.writeInodeToDisk(next);
+            next = next + 1 == inodeCount ? 0 : next + 1;
+        }
+        cache->flush();
+        state.SetItemsProcessed(state.iterations());
+    }
+    std::remove("bench_inode.img");
+}
+BENCHMARK(BM_InodeReadWrite)->ArgName("inodes")->Arg(64)->Arg(64 * 1024);
+
+// writeJournal of 32 records of a given size, then flush() to commit them
+static void BM_JournalWrite(benchmark::State &state) {
+    const uint64_t region = 4 * MiB;
+    const int recordsPerCommit = 32;
+    createImage("bench_journal.img", 4096 + region);
+    {
+        auto device = std::make_shared<BlockDevice>("bench_journal.img");
+        Journal journal(device, 4096, region);
+        std::vector<char> record(static_cast<size_t>(state.range(0)), 'j');
+        Journal::Ext4JournalHeader header = {Journal::MAGIC_NUMBER, 1, 0};
+        for (auto _ : state) {
+            for (int i = 0; i < recordsPerCommit; ++i) {
+                ++header.j_sequence;
+                journal.writeJournal(header, record.data(), static_cast<uint32_t>(record.size()));
+            }
+            journal.flush();
+            // Nothing goes home here, so everything committed can be reclaimed
+            journal.checkpoint(journal.getCommittedTransaction());
+        }
+        state.SetItemsProcessed(state.iterations() * recordsPerCommit);
+        state.SetBytesProcessed(state.iterations() * recordsPerCommit * static_cast<int64_t>(record.size()));
+    }
+    std::remove("bench_journal.img");
+}
+BENCHMARK(BM_JournalWrite)->ArgName("record")->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// readJournal of 1 MiB worth of committed records of a given size
+static void BM_JournalRead(benchmark::State &state) {
+    const uint64_t region = 4 * MiB;
+    createImage("bench_journal.img", 4096 + region);
+    {
+        auto device = std::make_shared<BlockDevice>("bench_journal.img");
+        Journal journal(device, 4096, region);
+        std::vector<char> record(static_cast<size_t>(state.range(0)), 'j');
+        int64_t recordCount = static_cast<int64_t>(MiB) / state.range(0);
+        for (int64_t i = 0; i < recordCount; ++i) {
+            Journal::Ext4JournalHeader header = {Journal::MAGIC_NUMBER, 1, static_cast<uint32_t>(i)};
+            journal.writeJournal(header, record.data(), static_cast<uint32_t>(record.size()));
+        }
+        journal.flush();
+
+        std::vector<Journal::JournalEntry> entries;
+        for (auto _ : state) {
+            entries.clear();
+            journal.readJournal(entries);
+            benchmark::DoNotOptimize(entries.data());
+        }
+        state.SetItemsProcessed(state.iterations() * recordCount);
+        state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(MiB));
+    }
+    std::remove("bench_journal.img");
+}
+BENCHMARK(BM_JournalRead)->ArgName("record")->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// 4 KiB reads or writes at sequential or random offsets of a file covering
+// half of an image of a given size in MiB
+static void BM_DataIO(benchmark::State &state) {
+    const size_t ioSize = 4096;
+    uint64_t imageSize = static_cast<uint64_t>(state.range(0)) * MiB;
+    bool random = state.range(1) != 0;
+    bool isWrite = state.range(2) != 0;
+    MkfsOptions mkfs;
+    mkfs.imageSize = imageSize;
+    {
+        QuietOutput quiet;
+        FileSystem fs("bench_data.img");
+        if (!fs.initialize(mkfs)) {
+            state.SkipWithError("mkfs failed");
+            return;
+        }
+        uint32_t fileSize = static_cast<uint32_t>(imageSize / 2);
+        int file = fs.createFile(0x1A4, fileSize);
+        if (file < 0) {
+            state.SkipWithError("createFile failed");
+            return;
+        }
+        std::vector<char> buffer(MiB, 'd');
+        for (uint64_t offset = 0; offset < fileSize; offset += buffer.size()) {
+            fs.write(file, offset, buffer.data(), std::min<uint64_t>(buffer.size(), fileSize - offset));
+        }
+        fs.sync();
+
+        // The same random offsets on every run
+        std::vector<uint64_t> offsets(4096);
+        std::mt19937_64 generator(7);
+        for (uint64_t &offset : offsets) {
+            offset = generator() % (fileSize / ioSize) * ioSize;
+        }
+        size_t next = 0;
+        uint64_t sequential = 0;
+        for (auto _ : state) {
+            uint64_t offset = random ? offsets[next++ % offsets.size()] : sequential;
+            sequential = sequential + ioSize >= fileSize ? 0 : sequential + ioSize;
+            int64_t done = isWrite ? fs.write(file, offset, buffer.data(), ioSize)
+                                   : fs.read(file, offset, buffer.data(), ioSize);
+            if (done != static_cast<int64_t>(ioSize)) {
+                state.SkipWithError("short transfer");
+                break;
+            }
+        }
+        state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(ioSize));
+    }
+    std::remove("bench_data.img");
+}
+BENCHMARK(BM_DataIO)
+    ->ArgNames({"imageMiB", "random", "write"})
+    ->ArgsProduct({{16, 64, 256}, {0, 1}, {0, 1}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,55 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bit-packed allocation bitmap stored as 64-bit words, in the same layout it
+// has on disk. Bit i lives in word i / 64 at position i % 64. Bits past size()
+// in the last word are kept set so searches never return them.
+class Bitmap {
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    Bitmap() : bits(0) {}
+    explicit Bitmap(size_t bits);
+
+    void resize(size_t newBits);
+    size_t size() const { return bits; }
+    size_t wordCount() const { return words.size(); }
+    size_t byteSize() const { return words.size() * sizeof(uint64_t); }
+
+    bool test(size_t index) const { return (words[index / 64] >> (index % 64)) & 1; }
+    void set(size_t index) { words[index / 64] |= uint64_t(1) << (index % 64); }
+    void clear(size_t index) { words[index / 64] &= ~(uint64_t(1) << (index % 64)); }
+
+    void setRange(size_t start, size_t count);
+    void clearRange(size_t start, size_t count);
+
+    // First clear bit at or after 'from', or npos
+    size_t findFirstZero(size_t from = 0) const;
+    // First set bit at or after 'from', or size() when the rest is clear
+    size_t findFirstOne(size_t from) const;
+    // Next-fit: first clear bit at or after 'hint', wrapping around to the start
+    size_t findNextZero(size_t hint) const;
+    size_t countZeros() const;
+    // Set bits in [start, start + count)
+    size_t countOnes(size_t start, size_t count) const;
+    // Best fit: start of the smallest clear run of at least 'length' bits, or of
+    // the longest clear run when none is long enough. runLength gets its length.
+    size_t findBestFitRun(size_t length, size_t &runLength) const;
+
+    uint64_t *data() { return words.data(); }
+    const uint64_t *data() const { return words.data(); }
+    // Re-establishes the tail padding after the words were loaded from disk
+    void padTail();
+
+private:
+    size_t findNonFullWord(size_t firstWord, size_t endWord) const;
+
+    std::vector<uint64_t> words;
+    size_t bits;
+};
+
+#endif // BITMAP_H
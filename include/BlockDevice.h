@@ -0,0 +1,109 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include "IoEngine.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+// Thin wrapper around one file descriptor on the disk image. All metadata and
+// data access goes through positional pread/pwrite so that FileSystem can open
+// the image once and share it between BlockGroup, Inode and Journal.
+//
+// Alternatively the image can be memory-mapped once with map(). read/write then
+// become memcpy to and from the mapping, and flush/sync msync the pages
+// written since the last call. Growing the image remaps its tail under an
+// exclusive lock; mapped reads and writes share it.
+//
+// io() gives asynchronous access to the same image through an IoEngine, for
+// callers that have many independent transfers to make at once.
+class BlockDevice {
+public:
+    static const uint32_t DEFAULT_BLOCK_SIZE = 1024;
+    // Address space reserved for a mapped image so it can grow without moving
+    static const uint64_t DEFAULT_MAP_RESERVE = uint64_t(64) << 30;
+
+    BlockDevice(const std::string &path, uint32_t blockSize = DEFAULT_BLOCK_SIZE, bool directIO = false);
+    ~BlockDevice();
+
+    BlockDevice(const BlockDevice &) = delete;
+    BlockDevice &operator=(const BlockDevice &) = delete;
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Byte-addressed positional I/O. Short transfers are retried until the
+    // whole range is done; reads past the end of the image return zeros.
+    bool read(uint64_t offset, void *buffer, size_t length);
+    bool write(uint64_t offset, const void *buffer, size_t length);
+
+    // Block-addressed I/O in units of getBlockSize().
+    bool readBlocks(uint64_t blockNumber, void *buffer, size_t count);
+    bool writeBlocks(uint64_t blockNumber, const void *buffer, size_t count);
+
+    // The device's asynchronous engine, started on first use
+    IoEngine &io();
+
+    // Hint that a range will be read soon so the kernel starts fetching it
+    void readahead(uint64_t offset, uint64_t length);
+
+    bool truncate(uint64_t newSize);
+    // Reserves disk space for a range with fallocate(), extending the image if needed
+    bool allocate(uint64_t offset, uint64_t length);
+    // Deallocates a range with fallocate(PUNCH_HOLE); it reads as zeros and the
+    // image keeps its size. False where the file system does not support it.
+    bool punchHole(uint64_t offset, uint64_t length);
+    uint64_t size() const;
+
+    bool map(uint64_t reserveBytes = DEFAULT_MAP_RESERVE);
+    bool isMapped() const { return mapping != nullptr; }
+    // madvise() on a mapped range; no-op otherwise
+    void advise(uint64_t offset, uint64_t length, int advice);
+
+    // flush() makes written data durable (fdatasync), sync() also persists
+    // file metadata such as the image size (fsync).
+    bool flush();
+    bool sync();
+
+    const std::string& getPath() const { return path; }
+    uint32_t getBlockSize() const { return blockSize; }
+    bool isDirectIO() const { return directIO; }
+    int getFd() const { return fd; }
+
+private:
+    friend class IoEngine;
+
+    bool isAligned(uint64_t offset, const void *buffer, size_t length) const;
+    bool readAligned(uint64_t offset, void *buffer, size_t length);
+    bool writeAligned(uint64_t offset, const void *buffer, size_t length);
+    bool readUnaligned(uint64_t offset, void *buffer, size_t length);
+    bool writeUnaligned(uint64_t offset, const void *buffer, size_t length);
+    bool resize(uint64_t newSize);
+    bool remap(uint64_t fileSize);
+    void unmap();
+    void markWritten(uint64_t offset, size_t length);
+    bool syncMapping();
+
+    std::string path;
+    uint32_t blockSize;
+    bool directIO;
+    int fd;
+
+    char *mapping;          // start of the reserved range, nullptr when not mapped
+    uint64_t mapReserve;    // bytes of address space reserved
+    uint64_t pageSize;
+    // Exclusive while the image is resized; guards mappedLength and fileSize
+    mutable std::shared_mutex mapMutex;
+    uint64_t mappedLength;  // bytes currently backed by the file (page multiple)
+    uint64_t fileSize;      // image size while mapped
+    std::mutex writtenMutex;
+    std::map<uint64_t, uint64_t> written; // page ranges stored into since the last msync: start -> end
+
+    std::once_flag engineStarted;
+    std::unique_ptr<IoEngine> engine;
+};
+
+#endif // BLOCKDEVICE_H
@@ -1,7 +1,11 @@
 #ifndef BLOCKGROUP_H
 #define BLOCKGROUP_H
 
+#include "Bitmap.h"
+#include "BufferCache.h"
+#include <atomic>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -15,23 +19,120 @@ public:
         uint16_t bg_free_inodes_count;
         uint16_t bg_used_dirs_count;
         uint16_t bg_flags;
-        uint32_t bg_reserved[3];
+        uint16_t bg_free_blocks_count_hi; // upper halves, as in ext4's 64-byte descriptor
+        uint16_t bg_free_inodes_count_hi;
+        uint32_t bg_refcount_table; // first block of the reference count table, or 0
+        uint32_t bg_checksum; // CRC32C of the fields above, seeded with the group number
     };
 
+    // Free blocks and inodes summed over the groups that share it
+    struct FreeTotals {
+        std::atomic<uint64_t> blocks{0};
+        std::atomic<uint64_t> inodes{0};
+    };
+
+    // bg_flags, as in ext4. mkfs leaves every group uninitialized so that it only
+    // has to write the descriptor table; the bitmaps are set up on first load.
+    static const uint16_t INODE_UNINIT = 0x1;
+    static const uint16_t BLOCK_UNINIT = 0x2;
+    static const uint16_t INODE_ZEROED = 0x4; // inode table reads back as zeros
+
     BlockGroup(const std::string &disk);
+    // 'descTableStart' is the byte offset of the group descriptor table
+    BlockGroup(std::shared_ptr<BufferCache> cache, uint64_t descTableStart = 0);
 
-    void readGroupDescFromDisk(uint32_t groupNumber);
+    // False if the descriptor cannot be read or fails its checksum
+    bool readGroupDescFromDisk(uint32_t groupNumber);
+    // Sets the checksum and writes the descriptor
     void writeGroupDescToDisk(uint32_t groupNumber);
+    // A descriptor that was never written (all zeros) verifies
+    static void setChecksum(Ext4GroupDesc &desc, uint32_t groupNumber);
+    static bool verifyChecksum(const Ext4GroupDesc &desc, uint32_t groupNumber);
+
+    // The descriptor's free counts, 32 bits wide across the lo/hi fields
+    static uint32_t getFreeBlocksCount(const Ext4GroupDesc &desc);
+    static uint32_t getFreeInodesCount(const Ext4GroupDesc &desc);
+    static void setFreeCounts(Ext4GroupDesc &desc, uint32_t freeBlocks, uint32_t freeInodes);
+    // Every allocation and release updates the descriptor's free counts in the
+    // same call. These copies can be read without holding the group's lock, to
+    // skip a full group without loading its bitmaps.
+    uint32_t getFreeBlocks() const { return freeBlocks.load(std::memory_order_relaxed); }
+    uint32_t getFreeInodes() const { return freeInodes.load(std::memory_order_relaxed); }
+    // Changes to the free counts are also applied to 'totals'
+    void setTotals(FreeTotals *totals) { this->totals = totals; }
+    // Sets the free counts from the loaded bitmaps
+    void recountFree();
     int findFreeInode(const std::vector<bool> &inodeBitmap) const;
     int findFreeBlock(const std::vector<bool> &blockBitmap) const;
     void freeBlock(std::vector<bool> &blockBitmap, int blockIndex);
 
-    const std::string& getDisk() const { return disk; }
+    // Packed bitmaps. The searches are next-fit: they resume from the last
+    // allocation instead of rescanning the full prefix of the bitmap.
+    int findFreeInode(const Bitmap &inodeBitmap);
+    int findFreeBlock(const Bitmap &blockBitmap);
+    void freeBlock(Bitmap &blockBitmap, int blockIndex);
+
+    // The group's own bitmaps, kept in memory and written back one word at a time.
+    // For a BLOCK_UNINIT group the first 'metadataBlocks' blocks (bitmaps, inode
+    // table, ...) are marked in use and the flags are cleared.
+    bool readBitmapsFromDisk(uint32_t blocksCount, uint32_t inodesCount, uint32_t metadataBlocks = 0);
+    bool writeBitmapsToDisk();
+    int allocateInode();
+    void releaseInode(uint32_t inodeIndex);
+    // Batch forms: one pass over the bitmap and one write of the words touched.
+    // allocateInodes appends up to 'count' indexes and returns how many it took.
+    uint32_t allocateInodes(uint32_t count, std::vector<uint32_t> &inodeIndexes);
+    void releaseInodes(const std::vector<uint32_t> &inodeIndexes);
+    int allocateBlock();
+    void releaseBlock(uint32_t blockIndex);
+    // Contiguous allocation: continues at 'goal' when that block is free, otherwise
+    // takes the best-fit run for 'count' (or the longest run if none is long enough).
+    // Returns the first block of the run and sets 'allocated' to its length.
+    int allocateBlocks(uint32_t count, uint32_t &allocated, int goal = -1);
+    // Drops one owner from each block; only blocks left without one are freed
+    void releaseBlocks(uint32_t firstBlock, uint32_t count);
+
+    // Reference counts for blocks shared by several files (clones). The table
+    // holds one uint32_t per block of the group: its owners beyond the first.
+    // A group gets a table the first time one of its blocks is shared; until
+    // then every block in use has one owner.
+    static uint32_t refcountTableBlocks(uint32_t blocksPerGroup, uint32_t blockSize);
+    bool hasRefcountTable() const { return groupDesc.bg_refcount_table != 0; }
+    // The table's blocks must read back as zeros
+    void setRefcountTable(uint32_t firstBlock);
+    // Owners of blocks [firstBlock, firstBlock + count); 0 for a free block
+    bool getRefcounts(uint32_t firstBlock, uint32_t count, std::vector<uint32_t> &refcounts);
+    // Adds an owner to every block of the range, which must be in use. False
+    // without a table.
+    bool addReferences(uint32_t firstBlock, uint32_t count);
+
+    const std::string& getDisk() const { return cache->getDevice()->getPath(); }
     Ext4GroupDesc& getGroupDesc() { return groupDesc; }
+    Bitmap& getBlockBitmap() { return blockBitmap; }
+    Bitmap& getInodeBitmap() { return inodeBitmap; }
 
 private:
-    std::string disk;
+    void writeBitmapWord(uint32_t bitmapBlock, const Bitmap &bitmap, size_t bitIndex);
+    bool writeBitmapRange(uint32_t bitmapBlock, const Bitmap &bitmap, size_t firstBit, size_t count);
+    bool readBitmap(uint32_t bitmapBlock, Bitmap &bitmap, uint32_t bits);
+    void freeRange(uint32_t firstBlock, uint32_t count);
+    // Table entries (extra owners) of a block range
+    bool readShares(uint32_t firstBlock, uint32_t count, std::vector<uint32_t> &shares);
+    bool writeShares(uint32_t firstBlock, const std::vector<uint32_t> &shares);
+    // Adds the deltas to the free counts and writes the descriptor
+    void adjustFree(int64_t blocks, int64_t inodes);
+
+    std::shared_ptr<BufferCache> cache;
+    uint64_t descTableStart;
+    uint32_t groupNumber;
     Ext4GroupDesc groupDesc;
+    Bitmap blockBitmap;
+    Bitmap inodeBitmap;
+    size_t inodeHint;
+    size_t blockHint;
+    std::atomic<uint32_t> freeBlocks;
+    std::atomic<uint32_t> freeInodes;
+    FreeTotals *totals;
 };
 
 #endif // BLOCKGROUP_H
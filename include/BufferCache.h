@@ -0,0 +1,110 @@
+#ifndef BUFFERCACHE_H
+#define BUFFERCACHE_H
+
+#include "BlockDevice.h"
+#include "Journal.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Write-back cache of metadata blocks sitting between the components and the
+// BlockDevice. Blocks are evicted in LRU order; dirty blocks are written back
+// in sorted, coalesced batches on flush() or when eviction needs room.
+//
+// A memory-mapped device is cached the same way: misses are copied out of the
+// mapping, and changes are staged here and only copied back into it once
+// their journal records are committed, since a store into the shared mapping
+// may reach the disk at any time.
+//
+// With a journal attached every metadata write is also logged as a redo record,
+// and freed blocks are logged as revokes. A dirty block is written home only
+// once the newest transaction logging it has committed; until then eviction
+// passes it over. Writeback never forces a commit, which would have to wait
+// for open Journal::Handles: flush() and sync() commit first, outside the lock.
+//
+// The cache may be shared by several threads: every operation holds one
+// internal mutex, so a write and its journal record are never separated by
+// another thread's writeback.
+class BufferCache {
+public:
+    static const size_t DEFAULT_CAPACITY = 256; // blocks
+    static const size_t WRITEBACK_BATCH = 32;   // dirty blocks written per eviction
+
+    BufferCache(std::shared_ptr<BlockDevice> device, size_t capacityBlocks = DEFAULT_CAPACITY);
+    ~BufferCache();
+
+    BufferCache(const BufferCache &) = delete;
+    BufferCache &operator=(const BufferCache &) = delete;
+
+    // Byte-range access; the range may span several blocks
+    bool read(uint64_t offset, void *buffer, size_t length);
+    // 'logged' is false when the change was already journaled with logWrite()
+    bool write(uint64_t offset, const void *buffer, size_t length, bool logged = true);
+    // Journals a change now whose write to the cache comes later (InodeCache)
+    void logWrite(uint64_t offset, const void *data, size_t length);
+
+    // Pinned blocks are never evicted (bitmaps, group descriptors)
+    void pin(uint64_t blockNumber);
+    void unpin(uint64_t blockNumber);
+
+    // Forgets one block without writing it back, for metadata blocks that were
+    // freed and may be reused as file data
+    void discard(uint64_t blockNumber);
+
+    bool flush();
+    bool sync();
+    // Drops every cached block, dirty or not. Used after the image is reformatted.
+    void invalidate();
+
+    // In write-through mode every write also goes straight to the device
+    void setWriteThrough(bool enabled) { writeThrough = enabled; }
+    void setJournal(Journal *journal) { this->journal = journal; }
+
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+    uint64_t getWritebacks() const { return writebacks; }
+    size_t getCachedCount() const { return buffers.size(); }
+    size_t getDirtyCount() const { return dirtyCount; }
+    size_t getCapacity() const { return capacity; }
+    const std::shared_ptr<BlockDevice>& getDevice() const { return device; }
+
+private:
+    struct Buffer {
+        std::vector<char> data;
+        bool dirty = false;
+        std::list<uint64_t>::iterator lruPosition;
+    };
+
+    Buffer *getBuffer(uint64_t blockNumber, bool loadFromDisk);
+    void makeRoom();
+    bool homeLimit(uint32_t &committed);
+    bool isCommitted(uint64_t blockNumber, uint32_t committed) const;
+    bool writeBack(std::vector<uint64_t> &blockNumbers);
+    bool flushLocked();
+    void logRecord(uint32_t type, uint64_t offset, const void *data, size_t length);
+
+    std::shared_ptr<BlockDevice> device;
+    std::mutex mutex;
+    size_t capacity;
+    uint32_t blockSize;
+    bool writeThrough;
+    Journal *journal;
+    std::vector<char> record; // scratch for journal records
+
+    std::unordered_map<uint64_t, Buffer> buffers;
+    std::list<uint64_t> lru; // most recently used at the front
+    std::unordered_set<uint64_t> pinned;
+    std::unordered_map<uint64_t, uint32_t> loggedIn; // block -> newest transaction logging it
+    size_t dirtyCount;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+};
+
+#endif // BUFFERCACHE_H
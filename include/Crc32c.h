@@ -0,0 +1,27 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli), the checksum ext4 and JBD2 use for metadata.
+//
+// On x86-64 CPUs with SSE4.2 the crc32 instruction does 8 bytes per step.
+// With PCLMULQDQ as well, long buffers are split into three lanes that are
+// checksummed in parallel (the instruction has a latency of three cycles but
+// issues every cycle) and joined with carry-less multiplications. Other CPUs
+// use slicing-by-8 tables. The implementation is picked once, at first use.
+class Crc32c {
+public:
+    // Continues 'crc' over 'data'; start with 0. Checksumming a buffer in
+    // pieces gives the same result as checksumming it at once.
+    static uint32_t extend(uint32_t crc, const void *data, size_t length);
+    static uint32_t compute(const void *data, size_t length) { return extend(0, data, length); }
+
+    // The table-driven version, whatever the CPU supports
+    static uint32_t extendPortable(uint32_t crc, const void *data, size_t length);
+    // "sse4.2+pclmul", "sse4.2" or "table"
+    static const char *implementation();
+};
+
+#endif // CRC32C_H
@@ -0,0 +1,116 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "BufferCache.h"
+#include "Inode.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// ext4-style directory stored in the blocks of a directory inode. A directory
+// that fits in one block is a plain list of entries. Once that block is full
+// it becomes a hash tree (htree): block 0 keeps "." and ".." followed by an
+// index of (hash, block) pairs sorted by name hash, optionally one level of
+// index nodes below it, and the entries live in leaf blocks each covering a
+// hash range. A lookup reads at most three blocks whatever the directory size.
+//
+// Every block is laid out as directory entries, so the index blocks read as
+// blocks holding no entries and list() can scan all blocks in order.
+class Directory {
+public:
+    // Followed by the name (not NUL-terminated), padded to 4 bytes
+    struct Ext4DirEntry {
+        uint32_t inode;     // 0 for an unused entry
+        uint16_t rec_len;   // bytes up to the next entry
+        uint8_t name_len;
+        uint8_t file_type;
+    };
+
+    // Follows the "." and ".." entries of an indexed directory's block 0
+    struct DxRootInfo {
+        uint32_t reserved_zero;
+        uint8_t hash_version;
+        uint8_t info_length;
+        uint8_t indirect_levels; // index node levels between the root and the leaves
+        uint8_t unused_flags;
+    };
+
+    // Overlays the hash of the first DxEntry of an index block
+    struct DxCountLimit {
+        uint16_t limit;
+        uint16_t count;
+    };
+
+    // Leaf (or index node) 'block' holds the names hashing to [hash, next hash).
+    // Bit 0 of the hash is set when the range continues a run of equal hashes
+    // from the previous block.
+    struct DxEntry {
+        uint32_t hash;
+        uint32_t block; // logical block within the directory
+    };
+
+    struct Entry {
+        std::string name;
+        uint32_t inode;
+        uint8_t fileType;
+    };
+
+    // file_type values
+    static const uint8_t FT_UNKNOWN = 0;
+    static const uint8_t FT_REG_FILE = 1;
+    static const uint8_t FT_DIR = 2;
+    // i_flags: the directory has an htree index
+    static const uint32_t INDEX_FL = 0x1000;
+    static const uint8_t HASH_FNV1A = 6;
+    static const uint8_t MAX_INDIRECT_LEVELS = 1;
+    static const size_t MAX_NAME_LENGTH = 255;
+
+    // Returns the physical block holding logical block 'logical' of the
+    // directory, mapping a new block first when 'allocate' is set; -1 on failure
+    using BlockMapper = std::function<int64_t(uint32_t logical, bool allocate)>;
+
+    // 'dir' is the directory's inode; i_size and i_flags are updated in it and
+    // the caller writes it back
+    Directory(std::shared_ptr<BufferCache> cache, Inode::Ext4Inode &dir, BlockMapper mapBlock);
+
+    // Writes the first block of an empty directory: "." and ".."
+    bool init(uint32_t self, uint32_t parent);
+    bool lookup(const std::string &name, uint32_t &inodeNumber, uint8_t *fileType = nullptr);
+    // The caller makes sure the name is not present yet
+    bool add(const std::string &name, uint32_t inodeNumber, uint8_t fileType);
+    bool remove(const std::string &name);
+    // All entries, "." and ".." included, in block order
+    bool list(std::vector<Entry> &entries);
+    // True when only "." and ".." are left
+    bool isEmpty();
+
+    static uint32_t hash(const std::string &name);
+
+private:
+    // One index block on the path from the root to a leaf
+    struct Frame {
+        uint32_t block;
+        std::vector<char> data;
+        size_t entriesOffset; // where the DxCountLimit / DxEntry array starts
+        size_t position;      // entry followed to the next level
+    };
+
+    bool readBlock(uint32_t logical, std::vector<char> &data);
+    bool writeBlock(uint32_t logical, const std::vector<char> &data);
+    int64_t appendBlock();
+    bool probe(uint32_t nameHash, std::vector<Frame> &frames);
+    bool nextLeaf(std::vector<Frame> &frames, uint32_t nameHash, uint32_t &leaf);
+    bool convertToIndex();
+    bool makeIndexRoom(std::vector<Frame> &frames);
+    bool splitLeaf(std::vector<Frame> &frames);
+    void insertIndexEntry(Frame &frame, uint32_t entryHash, uint32_t block);
+
+    std::shared_ptr<BufferCache> cache;
+    Inode::Ext4Inode &dir;
+    BlockMapper mapBlock;
+    uint32_t blockSize;
+};
+
+#endif // DIRECTORY_H
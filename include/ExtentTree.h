@@ -0,0 +1,81 @@
+#ifndef EXTENTTREE_H
+#define EXTENTTREE_H
+
+#include "BufferCache.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// ext4-style extent mapping stored in an inode's i_block[15]. Up to four
+// extents live inline in i_block; beyond that the root turns into an index
+// whose leaves (and, for very fragmented files, further index levels) are
+// whole blocks read and written through the BufferCache.
+class ExtentTree {
+public:
+    struct Ext4ExtentHeader {
+        uint16_t eh_magic;
+        uint16_t eh_entries;
+        uint16_t eh_max;
+        uint16_t eh_depth;
+        uint32_t eh_generation;
+    };
+
+    struct Ext4Extent {
+        uint32_t ee_block;    // first logical block
+        uint16_t ee_len;
+        uint16_t ee_start_hi;
+        uint32_t ee_start_lo; // first physical block
+    };
+
+    struct Ext4ExtentIdx {
+        uint32_t ei_block;    // first logical block covered by the child
+        uint32_t ei_leaf_lo;  // child node block
+        uint16_t ei_leaf_hi;
+        uint16_t ei_unused;
+    };
+
+    // In-memory form of one mapping: logical blocks [logical, logical + length)
+    // live at physical blocks [physical, physical + length)
+    struct Extent {
+        uint32_t logical;
+        uint64_t physical;
+        uint32_t length;
+    };
+
+    static const uint16_t MAGIC = 0xF30A;
+    static const uint16_t MAX_EXTENT_LENGTH = 32768;
+    static const uint16_t MAX_DEPTH = 5;
+
+    // Allocator returns a physical block number for a tree node, or -1
+    using NodeAllocator = std::function<int64_t()>;
+    using NodeReleaser = std::function<void(uint64_t)>;
+
+    ExtentTree(std::shared_ptr<BufferCache> cache);
+
+    static void initRoot(uint32_t iBlock[15]);
+    static bool hasRoot(const uint32_t iBlock[15]);
+
+    // All extents in logical order
+    bool load(const uint32_t iBlock[15], std::vector<Extent> &extents) const;
+    // Rewrites the whole mapping: adjacent extents are merged, the tree is
+    // rebuilt bottom-up reusing the old node blocks where possible
+    bool store(uint32_t iBlock[15], std::vector<Extent> extents,
+               const NodeAllocator &allocateNode, const NodeReleaser &releaseNode);
+    // Finds the extent containing 'logical' without materialising the mapping
+    bool lookup(const uint32_t iBlock[15], uint32_t logical, Extent &found) const;
+    // Physical blocks holding index and leaf nodes (not data)
+    bool collectNodeBlocks(const uint32_t iBlock[15], std::vector<uint64_t> &blocks) const;
+
+    static void normalize(std::vector<Extent> &extents);
+
+private:
+    bool loadNode(const char *node, uint16_t depth, std::vector<Extent> &extents,
+                  std::vector<uint64_t> *nodeBlocks) const;
+    uint16_t nodeCapacity() const;
+
+    std::shared_ptr<BufferCache> cache;
+    uint32_t blockSize;
+};
+
+#endif // EXTENTTREE_H
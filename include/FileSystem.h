@@ -1,23 +1,325 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include "BlockDevice.h"
 #include "BlockGroup.h"
+#include "BufferCache.h"
+#include "Directory.h"
+#include "ExtentTree.h"
 #include "Inode.h"
+#include "InodeCache.h"
 #include "Journal.h"
+#include "Stats.h"
+#include "Superblock.h"
+#include "Trace.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+struct FileSystemOptions {
+    bool directIO = false;                             // open the image with O_DIRECT
+    size_t cacheBlocks = BufferCache::DEFAULT_CAPACITY; // metadata cache size, in blocks
+    size_t cachedInodes = InodeCache::DEFAULT_CAPACITY; // inode cache size, in inodes
+    bool mmapImage = false;                            // map the image; metadata is staged until committed
+    bool collectStats = true;                          // per-operation counters and latency histograms
+    bool inlineData = true;                            // keep regular files of up to 60 bytes in the inode
+    size_t dirtyLimit = 8 * 1024 * 1024;               // buffered file data before writers flush; 0 writes through
+    uint32_t writebackIntervalMs = 5000;               // background flush of buffered file data; 0 disables it
+    bool deferReclaim = true;                          // deleted files' blocks are freed by a background thread
+    JournalOptions journal;                            // group commit interval and batch size
+    std::string traceFile;                             // record every operation to this trace (see Trace.h)
+};
+
+// Geometry for FileSystem::initialize (mkfs). The image is split into block
+// groups of 8 * blockSize blocks, each with its own bitmaps and inode table.
+struct MkfsOptions {
+    uint64_t imageSize = 1024 * 1024;
+    uint32_t blockSize = BlockDevice::DEFAULT_BLOCK_SIZE; // power of two, 1 KiB to 64 KiB
+    uint32_t inodesPerGroup = 256;                        // at most 8 * blockSize
+    uint32_t journalBlocks = 64;
+    bool preallocate = false; // reserve the image's space with fallocate instead of leaving it sparse
+};
+
+// How scattered a file's blocks are, from its block map
+struct Fragmentation {
+    uint32_t blocks = 0;
+    uint32_t fragments = 0; // physically contiguous runs
+    uint32_t ideal = 0;     // runs it needs at best: one per block group it must span
+};
+
+struct DefragOptions {
+    uint64_t bytesPerSecond = 32 * 1024 * 1024; // copy rate, which leaves the disk to foreground I/O; 0 for no limit
+    size_t chunkBytes = 1024 * 1024;            // size of each copy read and write
+};
+
+struct DefragReport {
+    uint64_t filesScanned = 0;
+    uint64_t filesFragmented = 0; // in more runs than they need
+    uint64_t filesImproved = 0;
+    uint64_t filesSkipped = 0;    // written to or deleted meanwhile, with holes, or sharing blocks
+    uint64_t fragmentsBefore = 0; // over the fragmented files
+    uint64_t fragmentsAfter = 0;
+    uint64_t blocksMoved = 0;
+};
+
+// File system totals, as returned by FileSystem::statfs
+struct StatFs {
+    uint32_t blockSize = 0;
+    uint64_t blocks = 0; // including the metadata and the journal
+    uint64_t freeBlocks = 0;
+    uint64_t inodes = 0;
+    uint64_t freeInodes = 0;
+};
+
+// File operations (create, unlink, read, write, stat, sync, ...) may be
+// called from many threads at once. Each block group has its own lock and each
+// thread starts allocating in its own home group, so concurrent creates mostly
+// touch different groups. Operations on one inode are serialized by a striped
+// reader/writer lock. initialize() must not run concurrently with anything.
 class FileSystem {
 public:
-    FileSystem(const std::string &disk);
-    void initialize();
-    void createFile(uint16_t mode, uint32_t size);
+    // Mounts the image if it holds a file system, replaying the journal if it
+    // was not unmounted cleanly
+    FileSystem(const std::string &disk, const FileSystemOptions &options = FileSystemOptions());
+    ~FileSystem();
+    // mkfs: writes the superblock and the group descriptor table of a fresh,
+    // sparse image and mounts it. Bitmaps and inode tables are not written;
+    // each group sets itself up the first time it is used.
+    bool initialize(const MkfsOptions &mkfsOptions = MkfsOptions());
+    // Returns the new inode number, or -1. 'size' bytes of storage are allocated
+    // up front as a few contiguous extents, or none for a file small enough to
+    // be stored inline.
+    int createFile(uint16_t mode, uint32_t size);
+    // Deleting (deleteFile, deleteFiles, unlink) only puts the inode on the
+    // orphan list, so it takes the same time for any file size. The reclaimer
+    // thread frees the orphans' blocks and inode numbers in batches, and punches
+    // the freed data out of the image so that a sparse image shrinks. Until then
+    // the blocks are not counted as free.
     void deleteFile(uint32_t inodeNumber);
+    // Batch forms for many files at once. Each group's inode bitmap is updated in
+    // one pass, inodes are journaled in runs of adjacent inodes and the batch
+    // commits in as few journal transactions as the journal size allows.
+    // createFiles appends the new inode numbers to 'created' and returns false
+    // if it ran out of inodes or space first; deleteFiles returns false if any
+    // inode was not in use.
+    bool createFiles(uint32_t count, uint16_t mode, uint32_t size, std::vector<uint32_t> &created);
+    bool deleteFiles(const std::vector<uint32_t> &inodeNumbers);
+    // Reflink copy of a regular file: a new inode (without a name, like
+    // createFile's) that shares the source's data blocks, whatever its size.
+    // The blocks' reference counts go up by one. The first write to a shared
+    // block, by either file, moves the writer onto a copy of it, and deleting
+    // either file only drops its references. Returns the new inode number, or -1.
+    int clone(uint32_t sourceInode);
+
+    // Named files. The root directory is ROOT_INODE; a mode with the
+    // Inode::DIRECTORY type bits creates a directory. lookup and create return
+    // an inode number, or -1. unlink removes a file, or an empty directory.
+    int lookup(uint32_t parent, const std::string &name);
+    int create(uint32_t parent, const std::string &name, uint16_t mode);
+    bool unlink(uint32_t parent, const std::string &name);
+    bool listDirectory(uint32_t directory, std::vector<Directory::Entry> &entries);
+
+    // Byte-granular file I/O on arbitrary binary content. Returns the number of
+    // bytes transferred (short at end of file for reads), or -1 on error. Writes
+    // past the file's allocated blocks are buffered; their blocks are allocated,
+    // as one run, when the file is flushed by fsync(), sync(), the background
+    // writeback thread or a writer that takes the buffered data over
+    // FileSystemOptions::dirtyLimit. A regular file whose bytes fit in i_block
+    // keeps them there (Inode::INLINE_DATA_FL) and is moved to blocks by the
+    // first flush after it outgrows them.
+    int64_t read(uint32_t inodeNumber, uint64_t offset, char *buffer, size_t length);
+    int64_t write(uint32_t inodeNumber, uint64_t offset, const char *buffer, size_t length);
+    // Allocates and writes the file's buffered data and commits the journal
+    bool fsync(uint32_t inodeNumber);
+    // Flushes every file, frees the blocks of deleted files, commits the
+    // journal, writes metadata home and checkpoints the journal
+    void sync();
+    // Frees the blocks of every deleted file now
+    bool reclaim();
+
+    bool stat(uint32_t inodeNumber, Inode::Ext4Inode &result);
+    // O(1): the free counts are kept up to date by every allocation and release
+    bool statfs(StatFs &result) const;
+    bool getExtents(uint32_t inodeNumber, std::vector<ExtentTree::Extent> &extents);
+    // False unless the inode is a regular file with an extent tree
+    bool getFragmentation(uint32_t inodeNumber, Fragmentation &result);
+
+    // Online defragmentation of every regular file, or of one. A fragmented
+    // file is moved a segment at a time: a contiguous run is allocated, the
+    // segment is copied there in chunkBytes reads and writes paced to
+    // bytesPerSecond, and its block map is switched to the copy in one
+    // transaction that frees the old blocks. A segment is only moved when that
+    // leaves the file in fewer runs. The file stays readable throughout; a
+    // write to it during a copy abandons that segment. False on I/O errors.
+    bool defragment(const DefragOptions &defragOptions, DefragReport &report);
+    bool defragmentFile(uint32_t inodeNumber, const DefragOptions &defragOptions, DefragReport &report);
+
+    // Inodes below the root are reserved, as in ext4
+    static const uint32_t ROOT_INODE = 2;
+
+    bool isMounted() const { return journal != nullptr; }
+    const Superblock::Ext4Superblock& getSuperblock() const { return superblock->getSuperblock(); }
+    uint32_t getGroupCount() const { return static_cast<uint32_t>(groups.size()); }
+    const BufferCache& getCache() const { return *cache; }
+    const InodeCache& getInodeCache() const { return *inodes; }
+    Journal& getJournal() { return *journal; }
+    // Null unless FileSystemOptions::collectStats; kept across remounts
+    const Stats* getStats() const { return stats.get(); }
+    // Deleted files whose blocks are not freed yet
+    size_t getOrphanCount() const;
     // Other file system operations...
 
 private:
-    BlockGroup blockGroup;
-    Inode inode;
-    Journal journal;
+    // Per-inode sequential read detection for adaptive readahead
+    struct ReadaheadState {
+        uint64_t nextOffset = 0;   // where a sequential reader continues
+        uint32_t window = 0;       // current readahead window, in blocks
+        uint64_t prefetchedTo = 0; // end of the last range handed to the kernel
+    };
+
+    // Data written past a file's allocated blocks, one zero-filled page per
+    // logical block. Pages are only touched with the inode's lock held.
+    struct DirtyFile {
+        std::map<uint32_t, std::vector<char>> pages;
+        uint64_t size = 0;   // file size including the buffered data
+        uint32_t blocks = 0; // blocks the flush will allocate, reserved in 'reservedBlocks'
+    };
+
+    // One block group: its descriptor and bitmaps, and where its slice of the
+    // inode table starts. 'lock' guards the bitmaps and the descriptor.
+    struct Group {
+        Group(std::shared_ptr<BufferCache> cache, uint64_t descTableStart, uint64_t inodeTableStart)
+            : blockGroup(cache, descTableStart), inodeTableStart(inodeTableStart) {}
+
+        std::mutex lock;
+        BlockGroup blockGroup;
+        uint64_t inodeTableStart;
+        bool loaded = false; // bitmaps read
+    };
+
+    // Spaces defragmentation copies out to DefragOptions::bytesPerSecond
+    struct CopyPacer {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t bytes = 0;
+
+        void pace(size_t copied, uint64_t bytesPerSecond);
+    };
+
+    static const size_t INODE_LOCKS = 64;
+
+    void mapImage();
+    void openDevice(uint32_t blockSize);
+    bool mount();
+    void unmount();
+    Group *lockGroup(uint32_t groupNumber, std::unique_lock<std::mutex> &lock);
+    uint32_t homeGroup() const;
+    uint64_t inodeTableStart(uint32_t inodeNumber) const;
+    uint32_t inodeIndex(uint32_t inodeNumber) const { return inodeNumber % getSuperblock().s_inodes_per_group; }
+    std::shared_mutex &inodeLock(uint32_t inodeNumber) { return inodeLocks[inodeNumber % INODE_LOCKS]; }
+    bool loadInode(uint32_t inodeNumber, InodeCache::Handle &inode);
+    // Joins the caller's transaction, if any, so it never checkpoints: callers
+    // do that before opening their transaction
+    int createInode(uint16_t mode, uint32_t size, uint32_t firstGroup);
+    // lookup and stat without a trace record, for use within other operations
+    int lookupEntry(uint32_t parent, const std::string &name);
+    bool statInode(uint32_t inodeNumber, Inode::Ext4Inode &result);
+    // Puts loaded inodes on the orphan list; the caller holds their locks
+    void orphanInodes(const std::vector<InodeCache::Handle> &handles);
+    void loadOrphans();
+    size_t reclaimBatch(bool &ok);
+    void reclaimLoop();
+    void punchExtents(std::vector<ExtentTree::Extent> &extents);
+    bool loadFileExtents(uint32_t inodeNumber, std::vector<ExtentTree::Extent> &extents, uint32_t *flags = nullptr);
+    Fragmentation fragmentation(const std::vector<ExtentTree::Extent> &extents) const;
+    bool defragmentInode(uint32_t inodeNumber, const DefragOptions &defragOptions, DefragReport &report,
+                         CopyPacer &pacer);
+    bool moveSegment(uint32_t inodeNumber, const std::vector<ExtentTree::Extent> &extents, uint32_t logical,
+                     uint32_t count, uint64_t target, const DefragOptions &defragOptions, CopyPacer &pacer);
+    void setDefragRun(uint64_t firstBlock, uint32_t count);
+    uint32_t batchInodes() const;
+    void allocateInodes(uint32_t count, bool directories, uint32_t firstGroup, std::vector<uint32_t> &inodeNumbers);
+    // (inode number, was a directory) pairs
+    void releaseInodeNumbers(const std::vector<std::pair<uint32_t, bool>> &released);
+    Directory openDirectory(Inode::Ext4Inode &dir);
+    bool initDirectory(uint32_t inodeNumber, uint32_t parent);
+    bool transferData(const Inode::Ext4Inode &fileInode, uint64_t offset, char *buffer, size_t length, bool isWrite);
+    void updateReadahead(const Inode::Ext4Inode &fileInode, uint32_t inodeNumber, uint64_t offset, size_t length);
+    bool storesInline(uint16_t mode, uint32_t size) const;
+    uint32_t mappedBlocks(const Inode::Ext4Inode &fileInode);
+    bool bufferData(uint32_t inodeNumber, uint32_t mappedBlocks, uint64_t offset, const char *buffer, size_t length);
+    const DirtyFile *findDirty(uint32_t inodeNumber);
+    bool flushFile(uint32_t inodeNumber, Inode::Ext4Inode &fileInode);
+    bool flushAll();
+    void discardDirty(uint32_t inodeNumber);
+    void writebackLoop();
+    bool allocateFileBlocks(Inode::Ext4Inode &fileInode, uint32_t firstLogical, uint32_t count, uint32_t preferredGroup);
+    int64_t allocateBlocks(uint32_t count, uint32_t &allocated, uint64_t goal, uint32_t preferredGroup);
+    void releaseBlocks(uint64_t firstBlock, uint32_t count);
+    void releaseExtents(std::vector<ExtentTree::Extent> &extents);
+    // Shared blocks (see BlockGroup's reference counts)
+    bool ensureRefcountTable(uint32_t groupNumber);
+    bool addReferences(const std::vector<ExtentTree::Extent> &extents);
+    // Appends the parts of 'extent' whose blocks are shared, or those that are not
+    bool selectRuns(const ExtentTree::Extent &extent, bool shared, std::vector<ExtentTree::Extent> &runs);
+    bool unshareBlocks(uint32_t inodeNumber, Inode::Ext4Inode &fileInode, uint64_t offset, size_t length);
+    bool storeExtents(Inode::Ext4Inode &fileInode, const std::vector<ExtentTree::Extent> &extents, uint32_t preferredGroup);
+    // Frees the file's extent tree nodes and appends its data extents to
+    // 'freed' for the caller to free in bulk
+    void releaseFileBlocks(Inode::Ext4Inode &fileInode, std::vector<ExtentTree::Extent> &freed);
+    void updateBlockCount(Inode::Ext4Inode &fileInode);
+    void recover();
+    void recountFreeSpace();
+    bool checkpoint();
+    void checkpointIfNeeded();
+
+    std::string disk;
+    FileSystemOptions options;
+    std::unique_ptr<Stats> stats;
+    std::unique_ptr<TraceRecorder> trace;
+    std::shared_ptr<BlockDevice> device;
+    std::shared_ptr<BufferCache> cache;
+    std::unique_ptr<Superblock> superblock;
+    std::vector<std::unique_ptr<Group>> groups;
+    BlockGroup::FreeTotals freeTotals;
+    std::unique_ptr<InodeCache> inodes;
+    std::unique_ptr<Journal> journal;
+    ExtentTree extentTree;
+    std::array<std::shared_mutex, INODE_LOCKS> inodeLocks;
+    std::mutex checkpointMutex;
+    std::mutex readaheadMutex;
+    std::unordered_map<uint32_t, ReadaheadState> readahead;
+    // Buffered file data; 'dirtyMutex' guards the map and the counters, the
+    // inode locks guard each file's pages
+    std::mutex dirtyMutex;
+    std::unordered_map<uint32_t, DirtyFile> dirty;
+    size_t dirtyBytes = 0;
+    uint64_t reservedBlocks = 0;
+    std::condition_variable writebackWanted;
+    bool writebackRequested = false;
+    bool stopWriteback = false;
+    std::thread writeback;
+    // Deleted inodes, oldest first: the on-disk list (which starts at the
+    // newest) reversed. 'orphanMutex' guards it and the superblock, which it
+    // is written with.
+    mutable std::mutex orphanMutex;
+    std::vector<uint32_t> orphans;
+    std::mutex reclaimMutex; // one batch at a time
+    std::condition_variable reclaimWanted;
+    bool stopReclaim = false;
+    std::thread reclaimer;
+    std::mutex defragMutex; // one defragmentation at a time
+    // The file whose segment is being copied; a write to it sets 'defragRaced'
+    std::atomic<uint32_t> defragInode{0};
+    std::atomic<bool> defragRaced{false};
 };
 
 #endif // FILESYSTEM_H
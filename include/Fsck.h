@@ -0,0 +1,153 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "Bitmap.h"
+#include "BlockDevice.h"
+#include "BlockGroup.h"
+#include "BufferCache.h"
+#include "Inode.h"
+#include "InodeScanner.h"
+#include "Superblock.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct FsckOptions {
+    bool repair = false;    // fix what can be fixed; otherwise the image is only read
+    unsigned threads = 0;   // workers; 0 uses one per hardware thread
+    size_t scanBytes = InodeScanner::DEFAULT_CHUNK_BYTES; // inode table read per I/O
+    size_t maxProblems = 1000; // problems described in the report; all are counted
+};
+
+struct FsckReport {
+    uint64_t inodesInUse = 0;
+    uint64_t directories = 0;
+    uint64_t blocksInUse = 0;  // including the metadata and the journal
+    uint64_t unattached = 0;   // files with no directory entry (createFile makes these)
+    uint64_t orphans = 0;      // deleted files whose blocks are not freed yet
+    uint64_t sharedBlocks = 0; // blocks owned by more than one file (clones)
+    uint64_t inodeTableReads = 0;
+    uint64_t errors = 0;
+    uint64_t repaired = 0;
+    bool journalReplayed = false;
+    std::vector<std::string> problems;
+
+    bool clean() const { return errors == 0; }
+};
+
+// Offline consistency check of an unmounted image, in the spirit of e2fsck.
+// A journal that was not checkpointed is replayed first (only when repairing).
+// The groups are then checked in three parallel passes, each group on its own
+// worker:
+//   1. The inode table is streamed with an InodeScanner. Every inode is
+//      checked against its checksum and the inode bitmap, and the blocks of
+//      the ones in use (data and extent tree nodes) are claimed in a shared
+//      atomic bitmap, which catches blocks claimed twice. Orphans (deleted
+//      files the reclaimer has not freed yet) still own their blocks.
+//   2. Directories are listed. Entries naming inodes that are not in use are
+//      reported, and the entries naming each inode are counted.
+//   3. Link counts are compared with those entries. The block bitmap is compared
+//      with the claimed blocks, the reference count table with the number of
+//      inodes claiming each block, and the descriptor's free and directory
+//      counts with both bitmaps.
+// A block claimed by several inodes is only an error where the group's
+// reference count table does not say it is shared.
+// Repairs are applied afterwards by one thread. Blocks claimed twice are only
+// reported.
+class Fsck {
+public:
+    Fsck(const std::string &disk, const FsckOptions &options = FsckOptions());
+    ~Fsck();
+
+    Fsck(const Fsck &) = delete;
+    Fsck &operator=(const Fsck &) = delete;
+
+    // False when the image could not be checked at all (no file system, I/O
+    // errors); damage that was found is in the report
+    bool run(FsckReport &report);
+
+private:
+    // A file or directory found in use
+    struct LiveInode {
+        uint32_t number;
+        uint16_t links;
+        bool directory;
+    };
+
+    struct GroupState {
+        BlockGroup::Ext4GroupDesc desc;
+        bool descDamaged = false;
+        Bitmap inodeBitmap; // as on disk
+        Bitmap blockBitmap;
+        Bitmap liveInodes;  // as found in the inode table
+        // The reference count table (owners beyond the first), if the group
+        // has one, and the inodes found claiming each block
+        std::vector<uint32_t> shares;
+        std::unique_ptr<std::atomic<uint32_t>[]> owners;
+        std::vector<LiveInode> live;
+        std::vector<std::pair<uint32_t, Inode::Ext4Inode>> directories;
+        std::vector<uint32_t> damaged; // inodes to clear
+        uint32_t usedDirs = 0;
+        uint32_t orphans = 0;
+        // Set by pass 3
+        uint32_t freeBlocks = 0;
+        uint32_t freeInodes = 0;
+        bool inodeBitmapWrong = false;
+        bool blockBitmapWrong = false;
+        bool sharesWrong = false;
+    };
+
+    // A directory entry naming an inode that is not in use
+    struct DanglingEntry {
+        uint32_t directory;
+        std::string name;
+    };
+
+    bool openImage();
+    bool replayJournal(FsckReport &report);
+    bool loadGroups();
+    void loadOrphans();
+    bool readBitmap(uint64_t block, Bitmap &bitmap, uint32_t bits);
+    // Runs 'work' for every group, spread over the workers; each worker gets
+    // its own cache for extent tree and directory blocks
+    void forEachGroup(const std::function<void(uint32_t group, std::shared_ptr<BufferCache> &cache)> &work);
+    void scanInodes(uint32_t group, std::shared_ptr<BufferCache> &cache);
+    bool claimBlocks(uint32_t inodeNumber, const Inode::Ext4Inode &inode, std::shared_ptr<BufferCache> &cache);
+    // Claims [first, first + count); returns the blocks that were claimed already
+    // and are not shared
+    uint64_t claimRun(uint64_t first, uint64_t count);
+    void walkDirectories(uint32_t group, std::shared_ptr<BufferCache> &cache);
+    void compareGroup(uint32_t group);
+    bool isLive(uint32_t inodeNumber) const;
+    bool applyRepairs();
+    void problem(const std::string &description, bool repairable = true);
+
+    std::string disk;
+    FsckOptions options;
+    std::shared_ptr<BlockDevice> device;
+    std::shared_ptr<BufferCache> imageCache; // write-through; for the superblock and repairs
+    std::unique_ptr<Superblock> superblock;
+    std::vector<GroupState> groups;
+    // The orphan list, read before the passes; 'orphanListEnd' is where a
+    // broken list is cut (the last good orphan, or 0 for the superblock)
+    std::unordered_set<uint32_t> orphans;
+    bool orphanListBroken;
+    uint32_t orphanListEnd;
+    // One bit per block of the image, set by the inode (or metadata) owning it
+    std::vector<std::atomic<uint64_t>> claimed;
+    // Directory entries naming each inode, "." and ".." included
+    std::vector<std::atomic<uint32_t>> references;
+    std::vector<DanglingEntry> dangling;
+    std::vector<std::pair<uint32_t, uint32_t>> linkFixes;       // (inode, links)
+    std::vector<std::pair<uint32_t, uint32_t>> blockCountFixes; // (inode, i_blocks)
+    std::mutex mutex; // guards the fixes and the report
+    FsckReport *report;
+    uint64_t repairs;
+};
+
+#endif // FSCK_H
@@ -1,7 +1,9 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include "BufferCache.h"
 #include <cstdint>
+#include <memory>
 #include <string>
 
 class Inode {
@@ -19,19 +21,44 @@ public:
         uint32_t i_blocks;
         uint32_t i_flags;
         uint32_t i_block[15];
+        uint32_t i_checksum; // CRC32C of the fields above, seeded with the inode's offset
     };
 
-    Inode(const std::string &disk, uint32_t inodeTableStart);
-    void readInodeFromDisk(uint32_t inodeNumber);
+    // i_flags: i_block holds an extent tree (see ExtentTree)
+    static const uint32_t EXTENTS_FL = 0x80000;
+    // i_flags: i_block holds the file's bytes themselves, up to INLINE_DATA_SIZE
+    static const uint32_t INLINE_DATA_FL = 0x10000000;
+    // i_flags: some of the file's blocks may be shared with clones, so writes
+    // check their reference counts first
+    static const uint32_t SHARED_FL = 0x02000000;
+    static const uint32_t INLINE_DATA_SIZE = sizeof(Ext4Inode::i_block);
+    // File type bits of i_mode
+    static const uint16_t TYPE_MASK = 0xF000;
+    static const uint16_t DIRECTORY = 0x4000;
+    static const uint16_t REGULAR_FILE = 0x8000;
+
+    Inode(const std::string &disk, uint64_t inodeTableStart);
+    Inode(std::shared_ptr<BufferCache> cache, uint64_t inodeTableStart);
+    // False if the inode cannot be read or fails its checksum
+    bool readInodeFromDisk(uint32_t inodeNumber);
     void writeInodeToDisk(uint32_t inodeNumber);
     void createInode(uint16_t mode, uint32_t size);
+    // Fills in a new inode: 'mode', 'size', one link, no blocks
+    static void initInode(Ext4Inode &inode, uint16_t mode, uint32_t size);
+    // Checksums of an inode stored at byte 'offset' of the image. Set when the
+    // inode is written; a slot that was never written (all zeros) verifies.
+    static void setChecksum(Ext4Inode &inode, uint64_t offset);
+    static bool verifyChecksum(const Ext4Inode &inode, uint64_t offset);
     void deleteInode();
 
     const Ext4Inode& getInode() const { return inode; }
+    Ext4Inode& getInode() { return inode; }
 
 private:
-    std::string disk;
-    uint32_t inodeTableStart;
+    uint64_t inodeOffset(uint32_t inodeNumber) const;
+
+    std::shared_ptr<BufferCache> cache;
+    uint64_t inodeTableStart;
     Ext4Inode inode;
 };
 
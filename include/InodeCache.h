@@ -0,0 +1,123 @@
+#ifndef INODECACHE_H
+#define INODECACHE_H
+
+#include "BufferCache.h"
+#include "Inode.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// In-memory inode table keyed by inode number. get() hands out
+// reference-counted handles to a decoded inode; unreferenced inodes are
+// evicted in LRU order once the cache is full.
+//
+// A modified inode is journaled when it is marked dirty, but it reaches the
+// BufferCache only on flush(): dirty inodes are sorted and written as whole
+// runs of inode-table blocks, one read and one write per run, however many
+// times each inode changed in between.
+//
+// Slots come from slabs of SLAB_INODES and are chained into the hash table
+// and the LRU list in place, so caching an inode allocates nothing.
+class InodeCache {
+private:
+    struct Slot;
+
+public:
+    static const size_t DEFAULT_CAPACITY = 4096; // inodes
+    static const size_t SLAB_INODES = 256;
+
+    // Byte offset of an inode in the image
+    using Locator = std::function<uint64_t(uint32_t inodeNumber)>;
+
+    // Keeps an inode in the cache. The inode itself is guarded by the caller
+    // (FileSystem's per-inode locks), not by the cache.
+    class Handle {
+    public:
+        Handle() : owner(nullptr), slot(nullptr) {}
+        Handle(const Handle &other);
+        Handle(Handle &&other) noexcept;
+        Handle &operator=(Handle other) noexcept;
+        ~Handle();
+
+        explicit operator bool() const { return slot != nullptr; }
+        Inode::Ext4Inode &operator*() const;
+        Inode::Ext4Inode *operator->() const { return &**this; }
+        uint32_t number() const;
+        // Journals the inode as it is now and queues it for writeback
+        void markDirty();
+
+    private:
+        friend class InodeCache;
+        Handle(InodeCache *owner, Slot *slot) : owner(owner), slot(slot) {}
+
+        InodeCache *owner;
+        Slot *slot;
+    };
+
+    InodeCache(std::shared_ptr<BufferCache> cache, Locator locate, size_t capacity = DEFAULT_CAPACITY);
+    ~InodeCache();
+
+    InodeCache(const InodeCache &) = delete;
+    InodeCache &operator=(const InodeCache &) = delete;
+
+    // Reads the inode on a miss; an empty handle if it cannot be read
+    Handle get(uint32_t inodeNumber);
+    // A zeroed inode for a freshly allocated number, without reading it
+    Handle create(uint32_t inodeNumber);
+    // Marks many inodes dirty at once; each run of adjacent inodes is journaled
+    // as a single record
+    void markDirty(const std::vector<Handle> &handles);
+    // Writes every dirty inode to the BufferCache
+    bool flush();
+
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+    uint64_t getBlockWrites() const { return blockWrites; }
+    size_t getCachedCount() const { return cached; }
+    size_t getDirtyCount() const { return dirtyCount; }
+
+private:
+    struct Slot {
+        Inode::Ext4Inode inode;   // live copy, used through handles
+        Inode::Ext4Inode pending; // as of the last markDirty(); what flush() writes
+        uint32_t number;
+        uint32_t refs;
+        bool dirty;
+        Slot *hashNext;
+        Slot *lruPrev;            // towards the most recently used
+        Slot *lruNext;
+    };
+
+    Handle acquire(uint32_t inodeNumber, bool read);
+    Slot *find(uint32_t inodeNumber) const;
+    Slot *allocateSlot();
+    void unlinkHash(Slot *slot);
+    void unlinkLru(Slot *slot);
+    void pushLru(Slot *slot);
+    void release(Slot *slot);
+    void markDirty(Slot *slot);
+    bool flushLocked();
+
+    std::shared_ptr<BufferCache> cache;
+    Locator locate;
+    size_t capacity;
+    uint32_t blockSize;
+    std::mutex mutex;
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    std::vector<Slot *> freeSlots;
+    std::vector<Slot *> buckets; // hash chains, power-of-two count
+    Slot *lruHead;               // most recently used
+    Slot *lruTail;
+
+    size_t cached;
+    size_t dirtyCount;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t blockWrites;
+};
+
+#endif // INODECACHE_H
@@ -0,0 +1,56 @@
+#ifndef INODESCANNER_H
+#define INODESCANNER_H
+
+#include "BlockDevice.h"
+#include "Inode.h"
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Streams one group's inode table in large sequential reads instead of one
+// read per inode. The table is read in chunks of 'chunkBytes' (rounded down
+// to whole inodes); the next chunk is already in flight on the device's IoEngine
+// while the caller works through the current one.
+class InodeScanner {
+public:
+    static const size_t DEFAULT_CHUNK_BYTES = 1024 * 1024;
+
+    // Inodes [firstInode, firstInode + count) of a table whose first inode is
+    // at byte 'tableOffset'
+    InodeScanner(std::shared_ptr<BlockDevice> device, uint64_t tableOffset, uint32_t firstInode, uint32_t count,
+                 size_t chunkBytes = DEFAULT_CHUNK_BYTES);
+    // Waits for the read in flight
+    ~InodeScanner();
+
+    InodeScanner(const InodeScanner &) = delete;
+    InodeScanner &operator=(const InodeScanner &) = delete;
+
+    // The next inode's index within the table and its contents, valid until the
+    // next call. False at the end of the range or when a read failed.
+    bool next(uint32_t &index, const Inode::Ext4Inode *&inode);
+    bool failed() const { return error; }
+    // Reads issued so far
+    uint64_t getReads() const { return reads; }
+
+private:
+    void prefetch();
+
+    std::shared_ptr<BlockDevice> device;
+    uint64_t tableOffset;
+    uint32_t end;           // one past the last index to return
+    uint32_t chunkInodes;
+    uint32_t position;      // index returned next
+    uint32_t chunkStart;    // index of current[0]
+    uint32_t chunkLength;   // inodes in current
+    uint32_t pendingStart;  // index of the first inode of the read in flight
+    uint32_t pendingLength; // 0 when nothing is in flight
+    std::vector<Inode::Ext4Inode> current;
+    std::vector<Inode::Ext4Inode> pending;
+    std::future<bool> inFlight;
+    uint64_t reads;
+    bool error;
+};
+
+#endif // INODESCANNER_H
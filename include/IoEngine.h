@@ -0,0 +1,125 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class BlockDevice;
+
+// Asynchronous positional reads and writes on a BlockDevice, so that many
+// requests can be in flight at once instead of one pread/pwrite at a time.
+//
+// The io_uring backend keeps up to 'queueDepth' requests in the kernel and
+// reaps completions on one thread. Where io_uring is unavailable (old kernel,
+// seccomp) a pool of worker threads issues blocking pread/pwrite instead. A
+// request the ring refuses is done with a blocking call, and if waiting on the
+// ring fails the engine moves to the thread pool for good.
+// Requests the device has to handle itself (a mapped image, or unaligned
+// O_DIRECT transfers through the bounce buffer) complete synchronously.
+class IoEngine {
+public:
+    enum class Backend { Auto, Uring, ThreadPool };
+
+    static const unsigned DEFAULT_QUEUE_DEPTH = 64;
+    static const unsigned MAX_POOL_THREADS = 8;
+
+    using Callback = std::function<void(bool ok)>;
+
+    struct Request {
+        bool isWrite;
+        uint64_t offset;
+        void *buffer;
+        size_t length;
+        bool ok; // set on completion
+    };
+
+    IoEngine(BlockDevice &device, unsigned queueDepth = DEFAULT_QUEUE_DEPTH, Backend backend = Backend::Auto);
+    // Waits for every request in flight
+    ~IoEngine();
+
+    IoEngine(const IoEngine &) = delete;
+    IoEngine &operator=(const IoEngine &) = delete;
+
+    // 'done' runs on a completion thread, or inline for synchronous requests.
+    // Reads past the end of the image return zeros, as with BlockDevice::read.
+    void submit(bool isWrite, uint64_t offset, void *buffer, size_t length, Callback done);
+    std::future<bool> read(uint64_t offset, void *buffer, size_t length);
+    std::future<bool> write(uint64_t offset, const void *buffer, size_t length);
+    // Submits every request, then waits for all of them; false if any failed.
+    // A single request is simply done on the calling thread.
+    bool submitAndWait(std::vector<Request> &requests);
+
+    bool usesUring() const { return ringFd >= 0 && !ringFailed; }
+    unsigned getQueueDepth() const { return queueDepth; }
+    uint64_t getSubmitted() const { return submitted; }
+    // Largest number of requests seen in flight together
+    unsigned getPeakInFlight() const { return peakInFlight; }
+
+private:
+    struct Operation {
+        bool isWrite;
+        uint64_t offset;
+        char *buffer;
+        size_t length;
+        size_t done; // bytes transferred so far
+        Callback callback;
+    };
+
+    bool setupUring();
+    void teardownUring();
+    // False if the kernel refused the submission; the operation is not queued
+    bool queueUring(Operation *operation);
+    // Queues the rest of a partly done operation again
+    void resubmit(Operation *operation);
+    void reapLoop();
+    void fallBackToPool();
+    // Does the rest of an operation with a blocking call and completes it
+    void finishBlocking(Operation *operation);
+    void complete(Operation *operation, bool ok);
+    void workerLoop();
+
+    BlockDevice &device;
+    unsigned queueDepth;
+    std::mutex mutex;
+    std::condition_variable space;   // inFlight dropped below queueDepth
+    std::condition_variable drained; // inFlight reached zero
+    unsigned inFlight;
+    unsigned peakInFlight;
+    uint64_t submitted;
+    bool stopping;
+
+    // io_uring: the ring fd, its mapped rings, and the reaper thread
+    int ringFd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    void *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    void *cqes;
+    unsigned inRing; // operations the kernel holds; guarded by 'mutex'
+    std::atomic<bool> ringFailed;
+    std::thread reaper;
+
+    // Thread pool fallback
+    std::deque<Operation *> pending;
+    std::condition_variable work;
+    std::vector<std::thread> workers;
+};
+
+#endif // IOENGINE_H
@@ -1,10 +1,41 @@
 #ifndef JOURNAL_H
 #define JOURNAL_H
 
+#include "BlockDevice.h"
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+struct JournalOptions {
+    uint32_t commitIntervalMs = 5;     // longest a record waits for its transaction to commit
+    size_t maxBatchBytes = 64 * 1024;  // commit early once this many record bytes are queued
+    bool readOnly = false;             // only load an existing journal: never format the region, log or checkpoint
+};
+
+// Write-ahead log kept in a fixed, preallocated region of the disk image. The
+// region starts with a journal superblock; the rest is a ring of transactions.
+// writeJournal() only queues a record. A committer thread gathers everything
+// queued within one commit interval (or up to maxBatchBytes) into a single
+// transaction, writes it with one pwrite and makes it durable with one
+// fdatasync, so concurrent writers share the cost of the flush.
+//
+// Transactions stay in the ring until the owner checkpoints them, i.e. reports
+// that the changes they describe have been written home. Recovery streams the
+// transactions after the last checkpoint through a Cursor. Live transactions
+// are never overwritten: a commit that does not fit fails and stops the
+// journal, so the owner checkpoints well before the ring fills (FileSystem
+// does once needsCheckpoint() reports it half full).
+//
+// Everything on disk is checksummed with CRC32C: the descriptor before its
+// record length is trusted, each record, and the whole transaction in its
+// commit record. Loading stops at the first transaction that does not verify,
+// so a torn write ends the log cleanly.
 class Journal {
 public:
     struct Ext4JournalHeader {
@@ -18,14 +49,171 @@ public:
         std::vector<char> data;
     };
 
+    // Block 0 of the region
+    struct JournalSuperblock {
+        Ext4JournalHeader s_header; // j_blocktype = SUPERBLOCK
+        uint32_t s_blocksize;
+        uint32_t s_maxlen;   // region length in bytes
+        uint32_t s_first;    // offset of the ring within the region
+        uint32_t s_sequence; // transaction expected at s_start
+        uint32_t s_start;    // ring offset of the oldest live transaction
+    };
+
+    // On-disk transaction: descriptor, records, commit; padded to a block.
+    // A record is its header, the data size, a checksum of those and the
+    // data, then the data.
+    struct TransactionHeader {
+        Ext4JournalHeader t_header; // j_blocktype = DESCRIPTOR_BLOCK
+        uint32_t t_records;
+        uint32_t t_length;          // bytes of records that follow
+        uint32_t t_checksum;        // over the fields above
+    };
+
+    struct CommitRecord {
+        Ext4JournalHeader c_header; // j_blocktype = COMMIT_BLOCK
+        uint32_t c_checksum;        // over the records, seeded with the transaction number
+    };
+
+    static const uint32_t MAGIC_NUMBER = 0xC03B3998;
+    // j_blocktype values, as in JBD2
+    static const uint32_t DESCRIPTOR_BLOCK = 1;
+    static const uint32_t COMMIT_BLOCK = 2;
+    static const uint32_t SUPERBLOCK = 4;
+    static const uint32_t REVOKE_BLOCK = 5;
+    // Record type for a redo image of a metadata byte range: the offset
+    // (uint64_t) followed by the bytes
+    static const uint32_t METADATA_BLOCK = 6;
+    static const uint64_t DEFAULT_REGION_SIZE = 64 * 1024;
+
+    // A journal on its own image, occupying its first DEFAULT_REGION_SIZE bytes
     Journal(const std::string &disk);
-    void writeJournal(const JournalEntry &entry);
+    // A journal in [regionStart, regionStart + regionLength) of a shared device.
+    // An existing journal there is loaded; otherwise the region is formatted,
+    // unless the journal is read-only.
+    Journal(std::shared_ptr<BlockDevice> device, uint64_t regionStart = 0,
+            uint64_t regionLength = DEFAULT_REGION_SIZE, const JournalOptions &options = JournalOptions());
+    ~Journal();
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    // Queues a record and returns the transaction it will commit in, or 0 if it
+    // cannot be logged (too large, or j_magic is not MAGIC_NUMBER). Use waitForCommit() or flush() to wait for durability.
+    uint32_t writeJournal(const JournalEntry &entry);
+    uint32_t writeJournal(const Ext4JournalHeader &header, const void *data, uint32_t dataSize);
+    bool waitForCommit(uint32_t transaction);
+    // Commits whatever is queued and waits for it. Fails without waiting when
+    // the calling thread holds a Handle, whose transaction could not commit.
+    bool flush();
+    // Every record still in the ring, oldest first
     void readJournal(std::vector<JournalEntry> &journalEntries);
+    // Trims an in-memory list of entries; on-disk space is reclaimed by checkpoint()
     void manageJournal(std::vector<JournalEntry> &journalEntries, size_t maxEntries);
+    // Empties the region and writes a fresh superblock
+    bool format();
+
+    // Reclaims transactions up to and including 'transaction', whose changes
+    // the caller has made durable at their home location
+    bool checkpoint(uint32_t transaction);
+    // True once half of the ring is taken by live, committing and queued records
+    bool needsCheckpoint();
+    uint32_t getCommittedTransaction();
+    // False if the region held no valid journal (read-only) or could not be formatted
+    bool isOpen();
+
+    // Streams the records of the transactions after the last checkpoint, oldest
+    // first. Only one transaction is held in memory, in a buffer reused for every
+    // transaction; commits wait while a Cursor exists.
+    class Cursor {
+    public:
+        explicit Cursor(Journal &journal);
+        // False at the end of the log. 'data' stays valid until the next call.
+        bool next(Ext4JournalHeader &header, const char *&data, uint32_t &dataSize);
+        // Transaction of the record last returned by next()
+        uint32_t transaction() const { return current; }
+
+    private:
+        Journal &journal;
+        std::unique_lock<std::mutex> lock;
+        uint32_t position;
+        uint32_t nextTransaction;
+        size_t remaining; // transactions not read yet
+        uint32_t current;
+        std::vector<char> payload;
+        size_t offset;
+    };
+
+    // Keeps the running transaction open while it exists, as a JBD2 handle
+    // does, so that the records of a multi-step update commit together. A
+    // commit, forced or not, first closes the transaction to new Handles and
+    // waits for the open ones to finish; a Handle opened inside another on the
+    // same thread joins it without waiting. Open the outermost Handle before
+    // taking any lock that a Handle holder may wait for.
+    class Handle {
+    public:
+        explicit Handle(Journal &journal);
+        ~Handle();
+        Handle(const Handle &) = delete;
+        Handle &operator=(const Handle &) = delete;
+
+    private:
+        Journal &journal;
+    };
+
+    // Holds off new Handles of other threads and waits for the open ones to
+    // finish, as jbd2_journal_lock_updates() does, so that nothing is logged
+    // until unlockUpdates(). The caller must not hold a Handle.
+    void lockUpdates();
+    void unlockUpdates();
+
+    uint64_t getCommitCount() const { return commits; }
+    uint64_t getRecordCount() const { return records; }
 
-    static const uint32_t MAGIC_NUMBER = 0xC03B3998;
 private:
-    std::string disk;
+    void start();
+    bool load();
+    void committerLoop();
+    bool commitTransaction(uint32_t transaction, const std::vector<char> &payload, uint32_t recordCount);
+    bool writeSuperblock();
+    bool readTransaction(uint32_t position, uint32_t transaction, std::vector<char> &payload, uint32_t &size);
+    bool readRing(uint32_t position, void *buffer, size_t length);
+    bool writeRing(uint32_t position, const void *buffer, size_t length);
+    uint32_t transactionSize(size_t payloadLength) const;
+
+    std::shared_ptr<BlockDevice> device;
+    uint64_t regionStart;
+    uint32_t regionLength;
+    uint32_t blockSize;
+    uint32_t ringSize;
+    JournalOptions options;
+
+    // Ring state; owned by whoever holds ringMutex (normally the committer)
+    std::mutex ringMutex;
+    JournalSuperblock superblock;
+    uint32_t head;                // ring offset where the next transaction goes
+    std::atomic<uint32_t> used;   // bytes held by live transactions
+    std::deque<uint32_t> live;    // sizes of live transactions, oldest first
+
+    // Running transaction, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable commitWanted;
+    std::condition_variable commitDone;
+    std::condition_variable handlesAllowed; // new Handles may start
+    std::condition_variable handlesClosed;  // the last open Handle finished
+    std::vector<char> running;    // serialized records
+    uint32_t committingBytes;     // size of the transaction being written
+    uint32_t runningRecords;
+    uint32_t runningTransaction;
+    uint32_t committedTransaction;
+    uint32_t openHandles;         // Handles holding the running transaction open
+    bool commitLocked;            // closed to new Handles until it commits
+    bool updatesLocked;           // new Handles held off by lockUpdates()
+    std::thread::id updatesOwner;
+    bool stopping;
+    bool failed;
+    std::atomic<uint64_t> commits;
+    std::atomic<uint64_t> records;
+    std::thread committer;
 };
 
 #endif // JOURNAL_H
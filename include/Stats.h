@@ -0,0 +1,125 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Per-operation counters and latency histograms.
+//
+// Each thread records into its own counters, which are only summed when
+// someone asks for a snapshot, so recording never contends on a shared cache
+// line. Latencies go into log-bucketed histograms with four buckets per power
+// of two, which bounds a percentile's error to 25%.
+//
+// Operations are timed with a Scope. The outermost Scope on a thread picks the
+// Stats instance; Scopes opened further down (BlockGroup, InodeCache, Journal)
+// record into the same one, or do nothing when no Stats is active. Syscalls and
+// bytes reported with countIo() are charged to every Scope open on the thread,
+// so a create includes the I/O of the inode writes it made.
+class Stats {
+public:
+    enum Operation {
+        CREATE,
+        DELETE,
+        READ,          // file data
+        WRITE,
+        INODE_READ,
+        INODE_WRITE,
+        BITMAP_SEARCH,
+        JOURNAL_WRITE, // queueing a record
+        JOURNAL_FLUSH, // waiting for a commit
+        CHECKPOINT,
+        RECLAIM,       // freeing the blocks of deleted files
+        CLONE,
+        OPERATION_COUNT
+    };
+
+    // Buckets 0-3 hold 0-3 ns; after that four per power of two up to 2^64 ns
+    static const size_t HISTOGRAM_BUCKETS = 252;
+
+    struct OperationStats {
+        uint64_t count = 0;
+        uint64_t totalNanos = 0;
+        uint64_t maxNanos = 0;
+        uint64_t bytes = 0;
+        uint64_t syscalls = 0;
+        std::array<uint64_t, HISTOGRAM_BUCKETS> histogram{};
+
+        // Upper bound of the bucket holding the given quantile (0.5, 0.99, ...)
+        uint64_t percentile(double quantile) const;
+    };
+
+    using Snapshot = std::array<OperationStats, OPERATION_COUNT>;
+
+    class Scope {
+    public:
+        // A null 'stats' makes the scope, and any nested in it, a no-op
+        Scope(Stats *stats, Operation operation);
+        // Records into the Stats of the enclosing scope, if any
+        explicit Scope(Operation operation);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        friend class Stats;
+
+        void open(Stats *stats);
+
+        Stats *stats;
+        Operation operation;
+        Scope *parent;
+        uint64_t bytes;
+        uint64_t syscalls;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    Stats();
+    ~Stats();
+
+    Stats(const Stats &) = delete;
+    Stats &operator=(const Stats &) = delete;
+
+    // One system call that moved 'bytes'; charged to the scopes open on this thread
+    static void countIo(uint64_t bytes);
+    void record(Operation operation, uint64_t nanos, uint64_t bytes = 0, uint64_t syscalls = 0);
+
+    Snapshot snapshot() const;
+    // {"create": {"count": ..., "p50_ns": ..., ...}, ...}
+    std::string toJson() const;
+
+    static const char *operationName(Operation operation);
+    static size_t bucketOf(uint64_t nanos);
+    static uint64_t bucketLimit(size_t bucket);
+
+private:
+    // Written only by its own thread, read by snapshot(); relaxed atomics make
+    // that legal without costing more than plain stores on x86
+    struct Counters {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> totalNanos{0};
+        std::atomic<uint64_t> maxNanos{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> syscalls{0};
+        std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> histogram{};
+    };
+
+    struct ThreadCounters {
+        std::array<Counters, OPERATION_COUNT> operations;
+    };
+
+    ThreadCounters &localCounters();
+
+    const uint64_t id; // tells this instance apart in thread-local caches
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadCounters>> threads;
+};
+
+#endif // STATS_H
@@ -0,0 +1,73 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#include "BufferCache.h"
+#include <cstdint>
+#include <memory>
+
+// The superblock lives at the start of block 0 and describes the geometry of
+// the image: block size, block groups and where the journal is. The group
+// descriptor table follows in block 1.
+class Superblock {
+public:
+    struct Ext4Superblock {
+        uint32_t s_inodes_count;
+        uint32_t s_blocks_count;
+        uint32_t s_first_data_block;
+        uint32_t s_log_block_size;   // block size is 1024 << s_log_block_size
+        uint32_t s_blocks_per_group;
+        uint32_t s_inodes_per_group;
+        uint16_t s_magic;
+        uint16_t s_inode_size;
+        uint32_t s_journal_block;    // first block of the journal region
+        uint32_t s_journal_blocks;
+        uint32_t s_mkfs_time;
+        uint32_t s_feature_compat;   // COMPAT_* flags
+        // Totals over the group descriptors as of the last checkpoint. The
+        // descriptors are authoritative; these are summed from them at mount.
+        uint32_t s_free_blocks_count;
+        uint32_t s_free_inodes_count;
+        // First inode of the orphan list: deleted inodes whose blocks are not
+        // freed yet, each pointing to the next through i_dtime (0 ends it)
+        uint32_t s_last_orphan;
+        // A run allocated for a file being defragmented, not yet in its block
+        // map. Freed at mount when a crash left it set.
+        uint32_t s_defrag_block;
+        uint32_t s_defrag_blocks;
+    };
+
+    static const uint16_t MAGIC = 0xEF53;
+    // The group descriptors' free block and inode counts are maintained
+    static const uint32_t COMPAT_FREE_COUNTS = 0x1;
+    static const uint32_t GROUP_DESC_BLOCK = 1;
+
+    Superblock(std::shared_ptr<BufferCache> cache);
+    // False when the image holds no valid superblock
+    bool readSuperblockFromDisk();
+    void writeSuperblockToDisk();
+
+    Ext4Superblock& getSuperblock() { return superblock; }
+    const Ext4Superblock& getSuperblock() const { return superblock; }
+
+    uint32_t getBlockSize() const { return 1024u << superblock.s_log_block_size; }
+    uint32_t getGroupCount() const;
+    uint64_t getGroupFirstBlock(uint32_t group) const;
+    uint32_t getBlocksInGroup(uint32_t group) const;
+    uint32_t getInodeTableBlocks() const;
+    uint32_t getGroupDescBlocks() const;
+
+    // Each group starts with its block bitmap, inode bitmap and inode table.
+    // Group 0 has the superblock and descriptor table in front of them and the
+    // journal right after its inode table.
+    uint64_t getBlockBitmapBlock(uint32_t group) const;
+    uint64_t getInodeBitmapBlock(uint32_t group) const { return getBlockBitmapBlock(group) + 1; }
+    uint64_t getInodeTableBlock(uint32_t group) const { return getBlockBitmapBlock(group) + 2; }
+    // Blocks at the start of the group taken by the metadata above
+    uint32_t getMetadataBlocks(uint32_t group) const;
+
+private:
+    std::shared_ptr<BufferCache> cache;
+    Ext4Superblock superblock;
+};
+
+#endif // SUPERBLOCK_H
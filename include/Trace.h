@@ -0,0 +1,153 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Workload traces: the FileSystem calls made by an application, with their
+// arguments, results, start times and durations, for TraceReplay to run again
+// against a fresh image.
+//
+// A trace file starts with a fixed Header holding the image geometry, followed
+// by one record per call in the order the calls returned. A record is the
+// operation (one byte), then LEB128 varints: the thread, the start and the
+// duration in nanoseconds since the trace began, the inode, the mode, the
+// offset, the length, the result (zigzag encoded), the name's length and bytes,
+// and the count of inode numbers and the numbers. A typical record takes 10 to
+// 20 bytes. The data of writes is not recorded, only its length.
+class Trace {
+public:
+    enum Operation : uint8_t {
+        CREATE_FILE,
+        DELETE_FILE,
+        CREATE_FILES,
+        DELETE_FILES,
+        CREATE,
+        LOOKUP,
+        UNLINK,
+        LIST_DIRECTORY,
+        READ,
+        WRITE,
+        FSYNC,
+        SYNC,
+        STAT,
+        CLONE,
+        OPERATION_COUNT
+    };
+
+    static const uint32_t MAGIC = 0x52545346; // "FSTR"
+    static const uint32_t VERSION = 1;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        // Geometry of the image the trace was recorded on, for mkfs at replay
+        uint64_t imageSize;
+        uint32_t blockSize;
+        uint32_t inodesPerGroup;
+        uint32_t journalBlocks;
+        uint32_t reserved;
+    };
+
+    struct Record {
+        Operation operation = CREATE_FILE;
+        uint32_t thread = 0;   // numbered in order of each thread's first call
+        uint64_t start = 0;    // nanoseconds since the trace began
+        uint64_t duration = 0; // nanoseconds
+        uint32_t inode = 0;    // the file or directory operated on, or the parent
+        uint32_t mode = 0;
+        uint64_t offset = 0;   // createFile(s): the size
+        uint64_t length = 0;   // createFiles: the count
+        int64_t result = 0;    // an inode number, a byte or entry count, or 1; -1 on failure
+        std::string name;
+        std::vector<uint32_t> inodes; // deleteFiles' inodes, createFiles' new ones
+    };
+
+    static const char *operationName(Operation operation);
+};
+
+// Appends records to a trace file. Records are encoded into a buffer that is
+// written out in 64 KiB pieces; any thread may record.
+class TraceRecorder {
+public:
+    explicit TraceRecorder(const std::string &path);
+    // Writes out what is buffered
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    bool isOpen() const { return !failed; }
+    // Rewrites the header; called at every mount
+    void setGeometry(uint64_t imageSize, uint32_t blockSize, uint32_t inodesPerGroup, uint32_t journalBlocks);
+    // Nanoseconds since the trace began
+    uint64_t now() const;
+    // Fills in the calling thread's number and appends the record
+    void record(Trace::Record &record);
+    bool flush();
+    uint64_t getRecordCount() const;
+
+    // Times one call and records it when it goes out of scope. The result
+    // defaults to -1 (failure) until setResult() is called. A null recorder
+    // makes it a no-op.
+    class Event {
+    public:
+        Event(TraceRecorder *recorder, Trace::Operation operation, uint32_t inode = 0, uint64_t offset = 0,
+              uint64_t length = 0, uint32_t mode = 0);
+        ~Event();
+
+        Event(const Event &) = delete;
+        Event &operator=(const Event &) = delete;
+
+        void setResult(int64_t result) { record.result = result; }
+        void setName(const std::string &name);
+        void setInodes(const std::vector<uint32_t> &inodes);
+
+    private:
+        TraceRecorder *recorder;
+        Trace::Record record;
+    };
+
+private:
+    static const size_t BUFFER_BYTES = 64 * 1024;
+
+    bool writeOut(); // the caller holds 'mutex'
+
+    std::ofstream out;
+    Trace::Header header;
+    const std::chrono::steady_clock::time_point started;
+    mutable std::mutex mutex;
+    std::vector<char> buffer;
+    std::unordered_map<std::thread::id, uint32_t> threads;
+    uint64_t records;
+    bool failed;
+};
+
+// Reads a trace file record by record
+class TraceReader {
+public:
+    explicit TraceReader(const std::string &path);
+
+    // False if the file cannot be read or is not a trace
+    bool isOpen() const { return opened; }
+    const Trace::Header &getHeader() const { return header; }
+    // The next record; false at the end of the trace or at a damaged record
+    bool next(Trace::Record &record);
+    bool failed() const { return error; }
+
+private:
+    bool readVarint(uint64_t &value);
+
+    std::ifstream in;
+    Trace::Header header;
+    bool opened;
+    bool error;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,86 @@
+#ifndef TRACEREPLAY_H
+#define TRACEREPLAY_H
+
+#include "FileSystem.h"
+#include "Stats.h"
+#include "Trace.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ReplayOptions {
+    bool realTime = false; // keep the trace's timing; otherwise as fast as possible
+    unsigned threads = 1;  // workers; the trace's threads are spread over them
+    FileSystemOptions fileSystem;
+};
+
+struct ReplayReport {
+    uint64_t operations = 0;
+    uint64_t mismatches = 0; // calls that failed where the recorded one succeeded, or the other way round
+    double seconds = 0;
+    std::array<Stats::OperationStats, Trace::OPERATION_COUNT> perOperation{}; // as replayed
+};
+
+// Runs a recorded trace against a fresh image formatted with the trace's
+// geometry.
+//
+// Inode numbers handed out during the replay need not match the recorded
+// ones, so every inode argument is mapped through the record that produced it
+// (the latest earlier createFile, createFiles, create, lookup or clone that
+// returned it); numbers with no producer, the root's among them, are used as
+// they are. Recorded thread t is replayed by worker t % threads, each worker
+// keeping the trace's order, and a call whose inode comes from another
+// worker's record waits for that record. Writes store a fixed pattern of the
+// recorded length.
+class TraceReplay {
+public:
+    TraceReplay(const std::string &trace, const std::string &image, const ReplayOptions &options = ReplayOptions());
+
+    // False when the trace cannot be read or the image cannot be formatted
+    bool run(ReplayReport &report);
+
+private:
+    static const size_t NO_SOURCE = SIZE_MAX;
+
+    // Where a recorded inode argument came from: a record and the position
+    // within its result
+    struct Source {
+        size_t record;
+        uint32_t position;
+    };
+
+    using OperationStats = std::array<Stats::OperationStats, Trace::OPERATION_COUNT>;
+
+    bool load();
+    void replay(unsigned worker, FileSystem &fs, std::chrono::steady_clock::time_point begin, OperationStats &stats,
+                uint64_t &mismatches);
+    // Makes the call and returns its result in the recorded result's terms;
+    // 'made' gets the inode numbers it returned
+    int64_t execute(const Trace::Record &record, const std::vector<uint32_t> &arguments, FileSystem &fs,
+                    std::vector<char> &data, std::vector<char> &pattern, std::vector<uint32_t> &made);
+    // The replayed number for argument 'argument' of record 'index'
+    uint32_t translate(size_t index, size_t argument);
+    void finish(size_t index, std::vector<uint32_t> produced);
+
+    std::string tracePath;
+    std::string image;
+    ReplayOptions options;
+    Trace::Header header;
+    std::vector<Trace::Record> records;
+    // Per record: the source of its inode argument, then of each of its
+    // inodes (deleteFiles)
+    std::vector<std::vector<Source>> sources;
+    // Per record: the inode numbers its replay produced
+    std::vector<std::vector<uint32_t>> produced;
+    std::unique_ptr<std::atomic<bool>[]> done;
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+#endif // TRACEREPLAY_H
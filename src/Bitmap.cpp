@@ -0,0 +1,214 @@
+#include "Bitmap.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_X86 1
+#endif
+
+const size_t Bitmap::npos;
+
+namespace {
+const uint64_t FULL_WORD = ~uint64_t(0);
+// Below this many words the scalar loop wins over vector setup
+const size_t SIMD_MIN_WORDS = 16;
+
+size_t scanScalar(const uint64_t *words, size_t first, size_t end) {
+    for (size_t w = first; w < end; ++w) {
+        if (words[w] != FULL_WORD) {
+            return w;
+        }
+    }
+    return end;
+}
+
+#ifdef BITMAP_HAVE_X86
+// SSE2 is part of the x86-64 baseline: two words per compare
+size_t scanSse2(const uint64_t *words, size_t first, size_t end) {
+    const __m128i ones = _mm_set1_epi32(-1);
+    size_t w = first;
+    for (; w + 2 <= end; w += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + w));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, ones)) != 0xFFFF) {
+            break;
+        }
+    }
+    return scanScalar(words, w, end);
+}
+
+__attribute__((target("avx2")))
+size_t scanAvx2(const uint64_t *words, size_t first, size_t end) {
+    const __m256i ones = _mm256_set1_epi32(-1);
+    size_t w = first;
+    for (; w + 8 <= end; w += 8) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + w));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + w + 4));
+        __m256i both = _mm256_and_si256(a, b);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(both, ones)) != -1) {
+            break;
+        }
+    }
+    return scanScalar(words, w, end);
+}
+
+bool cpuHasAvx2() {
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    return hasAvx2;
+}
+#endif
+}
+
+Bitmap::Bitmap(size_t bits) : bits(0) {
+    resize(bits);
+}
+
+void Bitmap::resize(size_t newBits) {
+    size_t oldBits = bits;
+    words.resize((newBits + 63) / 64, 0);
+    bits = newBits;
+    // Bits that were tail padding and are now inside the bitmap start out clear
+    for (size_t i = oldBits; i < newBits && i % 64 != 0; ++i) {
+        clear(i);
+    }
+    padTail();
+}
+
+void Bitmap::padTail() {
+    if (bits % 64 != 0) {
+        words.back() |= FULL_WORD << (bits % 64);
+    }
+}
+
+size_t Bitmap::findNonFullWord(size_t firstWord, size_t endWord) const {
+    const uint64_t *data = words.data();
+#ifdef BITMAP_HAVE_X86
+    if (endWord - firstWord >= SIMD_MIN_WORDS) {
+        return cpuHasAvx2() ? scanAvx2(data, firstWord, endWord) : scanSse2(data, firstWord, endWord);
+    }
+#endif
+    return scanScalar(data, firstWord, endWord);
+}
+
+void Bitmap::setRange(size_t start, size_t count) {
+    for (size_t i = start; i < start + count; ++i) {
+        if (i % 64 == 0 && i + 64 <= start + count) {
+            words[i / 64] = FULL_WORD;
+            i += 63;
+        } else {
+            set(i);
+        }
+    }
+}
+
+void Bitmap::clearRange(size_t start, size_t count) {
+    for (size_t i = start; i < start + count; ++i) {
+        if (i % 64 == 0 && i + 64 <= start + count) {
+            words[i / 64] = 0;
+            i += 63;
+        } else {
+            clear(i);
+        }
+    }
+}
+
+size_t Bitmap::findFirstZero(size_t from) const {
+    if (from >= bits) {
+        return npos;
+    }
+
+    // Partial first word: ignore bits below 'from'
+    size_t w = from / 64;
+    uint64_t free = ~words[w] & (FULL_WORD << (from % 64));
+    if (free == 0) {
+        w = findNonFullWord(w + 1, words.size());
+        if (w == words.size()) {
+            return npos;
+        }
+        free = ~words[w];
+    }
+    size_t index = w * 64 + static_cast<size_t>(__builtin_ctzll(free));
+    return index < bits ? index : npos;
+}
+
+size_t Bitmap::findNextZero(size_t hint) const {
+    if (hint >= bits) {
+        hint = 0;
+    }
+    size_t index = findFirstZero(hint);
+    if (index == npos && hint != 0) {
+        index = findFirstZero(0);
+    }
+    return index;
+}
+
+size_t Bitmap::findFirstOne(size_t from) const {
+    if (from >= bits) {
+        return bits;
+    }
+    size_t w = from / 64;
+    uint64_t used = words[w] & (FULL_WORD << (from % 64));
+    while (used == 0) {
+        if (++w == words.size()) {
+            return bits;
+        }
+        used = words[w];
+    }
+    size_t index = w * 64 + static_cast<size_t>(__builtin_ctzll(used));
+    return index < bits ? index : bits;
+}
+
+size_t Bitmap::findBestFitRun(size_t length, size_t &runLength) const {
+    size_t bestStart = npos;
+    size_t bestLength = 0;
+    size_t longestStart = npos;
+    size_t longestLength = 0;
+
+    size_t start = findFirstZero(0);
+    while (start != npos) {
+        size_t end = findFirstOne(start);
+        size_t run = end - start;
+        if (run >= length && (bestStart == npos || run < bestLength)) {
+            bestStart = start;
+            bestLength = run;
+            if (run == length) {
+                break; // Exact fit
+            }
+        }
+        if (run > longestLength) {
+            longestStart = start;
+            longestLength = run;
+        }
+        start = findFirstZero(end);
+    }
+
+    if (bestStart != npos) {
+        runLength = bestLength;
+        return bestStart;
+    }
+    runLength = longestLength;
+    return longestStart;
+}
+
+size_t Bitmap::countZeros() const {
+    size_t setBits = 0;
+    for (uint64_t word : words) {
+        setBits += static_cast<size_t>(__builtin_popcountll(word));
+    }
+    return words.size() * 64 - setBits;
+}
+
+size_t Bitmap::countOnes(size_t start, size_t count) const {
+    size_t setBits = 0;
+    size_t end = start + count;
+    while (start < end) {
+        size_t w = start / 64;
+        size_t lastBit = std::min<size_t>(end, (w + 1) * 64);
+        uint64_t mask = FULL_WORD << (start % 64);
+        if (lastBit % 64 != 0) {
+            mask &= FULL_WORD >> (64 - lastBit % 64);
+        }
+        setBits += static_cast<size_t>(__builtin_popcountll(words[w] & mask));
+        start = lastBit;
+    }
+    return setBits;
+}
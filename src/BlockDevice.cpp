@@ -0,0 +1,394 @@
+#include "BlockDevice.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// O_DIRECT requires buffer, offset and length to be aligned to the logical
+// sector size of the underlying device; 4 KiB covers every common device.
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+}
+
+const uint32_t BlockDevice::DEFAULT_BLOCK_SIZE;
+const uint64_t BlockDevice::DEFAULT_MAP_RESERVE;
+
+BlockDevice::BlockDevice(const std::string &path, uint32_t blockSize, bool directIO)
+    : path(path), blockSize(blockSize), directIO(directIO), fd(-1),
+      mapping(nullptr), mapReserve(0), pageSize(static_cast<uint64_t>(::sysconf(_SC_PAGESIZE))), mappedLength(0),
+      fileSize(0) {
+    int flags = O_RDWR | O_CREAT;
+#ifdef O_DIRECT
+    if (directIO) {
+        fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+        if (fd < 0) {
+            // Some filesystems (tmpfs for one) reject O_DIRECT; fall back to buffered I/O.
+            std::cerr << "O_DIRECT not supported for " << path << ", using buffered I/O" << std::endl;
+            this->directIO = false;
+        }
+    }
+#else
+    this->directIO = false;
+#endif
+    if (fd < 0) {
+        fd = ::open(path.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        std::cerr << "Error opening disk file " << path << ": " << std::strerror(errno) << std::endl;
+    }
+}
+
+BlockDevice::~BlockDevice() {
+    engine.reset();
+    unmap();
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool BlockDevice::read(uint64_t offset, void *buffer, size_t length) {
+    if (fd < 0) {
+        return false;
+    }
+    if (mapping) {
+        std::shared_lock<std::shared_mutex> lock(mapMutex);
+        size_t available = offset < fileSize ? static_cast<size_t>(std::min<uint64_t>(length, fileSize - offset)) : 0;
+        std::memcpy(buffer, mapping + offset, available);
+        std::memset(static_cast<char *>(buffer) + available, 0, length - available);
+        return true;
+    }
+    if (directIO && !isAligned(offset, buffer, length)) {
+        return readUnaligned(offset, buffer, length);
+    }
+    return readAligned(offset, buffer, length);
+}
+
+bool BlockDevice::write(uint64_t offset, const void *buffer, size_t length) {
+    if (fd < 0) {
+        return false;
+    }
+    if (mapping) {
+        std::shared_lock<std::shared_mutex> lock(mapMutex);
+        while (offset + length > fileSize) {
+            // Grow the file first: stores past the end of the file would not
+            // persist. Another writer may have grown it in between.
+            lock.unlock();
+            {
+                std::unique_lock<std::shared_mutex> growth(mapMutex);
+                if (offset + length > fileSize && !resize(offset + length)) {
+                    return false;
+                }
+            }
+            lock.lock();
+        }
+        std::memcpy(mapping + offset, buffer, length);
+        markWritten(offset, length);
+        return true;
+    }
+    if (directIO && !isAligned(offset, buffer, length)) {
+        return writeUnaligned(offset, buffer, length);
+    }
+    return writeAligned(offset, buffer, length);
+}
+
+bool BlockDevice::readBlocks(uint64_t blockNumber, void *buffer, size_t count) {
+    return read(blockNumber * blockSize, buffer, count * blockSize);
+}
+
+bool BlockDevice::writeBlocks(uint64_t blockNumber, const void *buffer, size_t count) {
+    return write(blockNumber * blockSize, buffer, count * blockSize);
+}
+
+IoEngine &BlockDevice::io() {
+    std::call_once(engineStarted, [this]() { engine = std::make_unique<IoEngine>(*this); });
+    return *engine;
+}
+
+void BlockDevice::readahead(uint64_t offset, uint64_t length) {
+    if (mapping) {
+        advise(offset, length, MADV_WILLNEED);
+        return;
+    }
+    // O_DIRECT bypasses the page cache, so there is nothing to prefetch into
+    if (fd >= 0 && !directIO) {
+        ::posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+    }
+}
+
+bool BlockDevice::truncate(uint64_t newSize) {
+    std::unique_lock<std::shared_mutex> lock(mapMutex);
+    return resize(newSize);
+}
+
+// The caller holds mapMutex exclusively
+bool BlockDevice::resize(uint64_t newSize) {
+    if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(newSize)) != 0) {
+        std::cerr << "Error resizing disk file " << path << std::endl;
+        return false;
+    }
+    return !mapping || remap(newSize);
+}
+
+bool BlockDevice::allocate(uint64_t offset, uint64_t length) {
+    std::unique_lock<std::shared_mutex> lock(mapMutex);
+    if (fd < 0 || ::fallocate(fd, 0, static_cast<off_t>(offset), static_cast<off_t>(length)) != 0) {
+        std::cerr << "Error allocating space in disk file " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return !mapping || offset + length <= fileSize || remap(offset + length);
+}
+
+bool BlockDevice::punchHole(uint64_t offset, uint64_t length) {
+    if (fd < 0 || ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset),
+                              static_cast<off_t>(length)) != 0) {
+        if (errno != EOPNOTSUPP) {
+            std::cerr << "Error punching a hole in disk file " << path << ": " << std::strerror(errno) << std::endl;
+        }
+        return false;
+    }
+    return true;
+}
+
+uint64_t BlockDevice::size() const {
+    if (mapping) {
+        std::shared_lock<std::shared_mutex> lock(mapMutex);
+        return fileSize;
+    }
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(st.st_size);
+}
+
+bool BlockDevice::flush() {
+    Stats::countIo(0);
+    if (mapping && !syncMapping()) {
+        return false;
+    }
+    return fd >= 0 && ::fdatasync(fd) == 0;
+}
+
+bool BlockDevice::sync() {
+    Stats::countIo(0);
+    if (mapping && !syncMapping()) {
+        return false;
+    }
+    return fd >= 0 && ::fsync(fd) == 0;
+}
+
+// Records the pages a mapped write stored into, merged with overlapping and
+// adjacent ranges, for the next syncMapping()
+void BlockDevice::markWritten(uint64_t offset, size_t length) {
+    uint64_t start = offset - offset % pageSize;
+    uint64_t end = (offset + length + pageSize - 1) / pageSize * pageSize;
+    std::lock_guard<std::mutex> lock(writtenMutex);
+    auto it = written.upper_bound(start);
+    if (it != written.begin() && std::prev(it)->second >= start) {
+        --it;
+        start = it->first;
+    }
+    while (it != written.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = written.erase(it);
+    }
+    written[start] = end;
+}
+
+// msyncs only the pages written since the last call, not the whole mapping
+bool BlockDevice::syncMapping() {
+    std::map<uint64_t, uint64_t> ranges;
+    {
+        std::lock_guard<std::mutex> lock(writtenMutex);
+        ranges.swap(written);
+    }
+    std::shared_lock<std::shared_mutex> lock(mapMutex);
+    for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+        uint64_t end = std::min(it->second, mappedLength);
+        if (it->first < end && ::msync(mapping + it->first, end - it->first, MS_SYNC) != 0) {
+            // Left for the next attempt
+            for (; it != ranges.end(); ++it) {
+                markWritten(it->first, it->second - it->first);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockDevice::map(uint64_t reserveBytes) {
+    if (fd < 0) {
+        return false;
+    }
+    if (mapping) {
+        return true;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    // Reserve the address range up front; the file is mapped into its start
+    // and extended in place, so growing it never moves the mapping
+    void *reserved = ::mmap(nullptr, reserveBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        std::cerr << "Error reserving address space for " << path << std::endl;
+        return false;
+    }
+    std::unique_lock<std::shared_mutex> lock(mapMutex);
+    mapping = static_cast<char *>(reserved);
+    mapReserve = reserveBytes;
+    mappedLength = 0;
+    if (!remap(static_cast<uint64_t>(st.st_size))) {
+        lock.unlock();
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+void BlockDevice::advise(uint64_t offset, uint64_t length, int advice) {
+    if (!mapping) {
+        return;
+    }
+    std::shared_lock<std::shared_mutex> lock(mapMutex);
+    if (offset >= mappedLength) {
+        return;
+    }
+    uint64_t start = offset - offset % pageSize;
+    uint64_t end = std::min(offset + length, mappedLength);
+    ::madvise(mapping + start, end - start, advice);
+}
+
+// The caller holds mapMutex exclusively
+bool BlockDevice::remap(uint64_t newFileSize) {
+    uint64_t wanted = (newFileSize + pageSize - 1) / pageSize * pageSize;
+    if (wanted > mapReserve) {
+        std::cerr << "Disk image " << path << " outgrew its mapping" << std::endl;
+        return false;
+    }
+
+    if (wanted > mappedLength) {
+        void *tail = ::mmap(mapping + mappedLength, wanted - mappedLength, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(mappedLength));
+        if (tail == MAP_FAILED) {
+            std::cerr << "Error mapping disk file " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    } else if (wanted < mappedLength) {
+        // Hand the tail back to the reservation
+        ::mmap(mapping + wanted, mappedLength - wanted, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    }
+    mappedLength = wanted;
+    fileSize = newFileSize;
+    return true;
+}
+
+void BlockDevice::unmap() {
+    if (mapping) {
+        if (mappedLength > 0) {
+            ::msync(mapping, mappedLength, MS_SYNC);
+        }
+        ::munmap(mapping, mapReserve);
+        mapping = nullptr;
+        mappedLength = 0;
+        written.clear();
+    }
+}
+
+bool BlockDevice::isAligned(uint64_t offset, const void *buffer, size_t length) const {
+    return offset % DIRECT_IO_ALIGNMENT == 0 && length % DIRECT_IO_ALIGNMENT == 0 &&
+           reinterpret_cast<uintptr_t>(buffer) % DIRECT_IO_ALIGNMENT == 0;
+}
+
+bool BlockDevice::readAligned(uint64_t offset, void *buffer, size_t length) {
+    char *out = static_cast<char *>(buffer);
+    while (length > 0) {
+        ssize_t n = ::pread(fd, out, length, static_cast<off_t>(offset));
+        Stats::countIo(n > 0 ? static_cast<uint64_t>(n) : 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error reading disk file " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        if (n == 0) {
+            // Past the end of the image: behave like a sparse, zero-filled disk.
+            std::memset(out, 0, length);
+            return true;
+        }
+        out += n;
+        offset += static_cast<uint64_t>(n);
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool BlockDevice::writeAligned(uint64_t offset, const void *buffer, size_t length) {
+    const char *in = static_cast<const char *>(buffer);
+    while (length > 0) {
+        ssize_t n = ::pwrite(fd, in, length, static_cast<off_t>(offset));
+        Stats::countIo(n > 0 ? static_cast<uint64_t>(n) : 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error writing disk file " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        in += n;
+        offset += static_cast<uint64_t>(n);
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Bounce-buffer paths for O_DIRECT: widen the request to aligned boundaries,
+// and for writes read-modify-write the partial head and tail sectors.
+bool BlockDevice::readUnaligned(uint64_t offset, void *buffer, size_t length) {
+    uint64_t start = offset - offset % DIRECT_IO_ALIGNMENT;
+    uint64_t end = offset + length;
+    end += (DIRECT_IO_ALIGNMENT - end % DIRECT_IO_ALIGNMENT) % DIRECT_IO_ALIGNMENT;
+    size_t span = static_cast<size_t>(end - start);
+
+    void *bounce = std::aligned_alloc(DIRECT_IO_ALIGNMENT, span);
+    if (!bounce) {
+        return false;
+    }
+    bool ok = readAligned(start, bounce, span);
+    if (ok) {
+        std::memcpy(buffer, static_cast<char *>(bounce) + (offset - start), length);
+    }
+    std::free(bounce);
+    return ok;
+}
+
+bool BlockDevice::writeUnaligned(uint64_t offset, const void *buffer, size_t length) {
+    uint64_t start = offset - offset % DIRECT_IO_ALIGNMENT;
+    uint64_t end = offset + length;
+    end += (DIRECT_IO_ALIGNMENT - end % DIRECT_IO_ALIGNMENT) % DIRECT_IO_ALIGNMENT;
+    size_t span = static_cast<size_t>(end - start);
+
+    void *bounce = std::aligned_alloc(DIRECT_IO_ALIGNMENT, span);
+    if (!bounce) {
+        return false;
+    }
+    bool ok = true;
+    if (start != offset || end != offset + length) {
+        ok = readAligned(start, bounce, span);
+    }
+    if (ok) {
+        std::memcpy(static_cast<char *>(bounce) + (offset - start), buffer, length);
+        ok = writeAligned(start, bounce, span);
+    }
+    std::free(bounce);
+    return ok;
+}
@@ -1,31 +1,99 @@
 #include "BlockGroup.h"
-#include <fstream>
+#include "Crc32c.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
 
-BlockGroup::BlockGroup(const std::string &disk) : disk(disk) {}
+const uint16_t BlockGroup::INODE_UNINIT;
+const uint16_t BlockGroup::BLOCK_UNINIT;
+const uint16_t BlockGroup::INODE_ZEROED;
 
-void BlockGroup::readGroupDescFromDisk(uint32_t groupNumber) {
-    std::ifstream diskFile(disk, std::ios::binary);
-    if (!diskFile) {
-        std::cerr << "Error opening disk file" << std::endl;
-        return;
-    }
+BlockGroup::BlockGroup(const std::string &disk)
+    : cache(std::make_shared<BufferCache>(std::make_shared<BlockDevice>(disk))), descTableStart(0), groupNumber(0),
+      groupDesc(), inodeHint(0), blockHint(0), freeBlocks(0), freeInodes(0), totals(nullptr) {
+    // A standalone group has nobody to flush it, so keep the disk current
+    cache->setWriteThrough(true);
+}
+
+BlockGroup::BlockGroup(std::shared_ptr<BufferCache> cache, uint64_t descTableStart)
+    : cache(std::move(cache)), descTableStart(descTableStart), groupNumber(0), groupDesc(),
+      inodeHint(0), blockHint(0), freeBlocks(0), freeInodes(0), totals(nullptr) {}
 
-    diskFile.seekg(groupNumber * sizeof(Ext4GroupDesc), std::ios::beg);
-    diskFile.read(reinterpret_cast<char *>(&groupDesc), sizeof(groupDesc));
-    diskFile.close();
+bool BlockGroup::readGroupDescFromDisk(uint32_t groupNumber) {
+    this->groupNumber = groupNumber;
+    uint64_t offset = descTableStart + groupNumber * sizeof(Ext4GroupDesc);
+    bool ok = true;
+    if (!cache->read(offset, &groupDesc, sizeof(groupDesc))) {
+        std::cerr << "Error reading group descriptor " << groupNumber << std::endl;
+        ok = false;
+    }
+    if (ok && !verifyChecksum(groupDesc, groupNumber)) {
+        std::cerr << "Checksum mismatch in group descriptor " << groupNumber << std::endl;
+        ok = false;
+    }
+    freeBlocks.store(getFreeBlocksCount(groupDesc), std::memory_order_relaxed);
+    freeInodes.store(getFreeInodesCount(groupDesc), std::memory_order_relaxed);
+    return ok;
 }
 
 void BlockGroup::writeGroupDescToDisk(uint32_t groupNumber) {
-    std::ofstream diskFile(disk, std::ios::binary | std::ios::in);
-    if (!diskFile) {
-        std::cerr << "Error opening disk file" << std::endl;
-        return;
+    uint64_t offset = descTableStart + groupNumber * sizeof(Ext4GroupDesc);
+    setChecksum(groupDesc, groupNumber);
+    if (!cache->write(offset, &groupDesc, sizeof(Ext4GroupDesc))) {
+        std::cerr << "Error writing group descriptor " << groupNumber << std::endl;
     }
+}
+
+namespace {
+uint32_t descChecksum(const BlockGroup::Ext4GroupDesc &desc, uint32_t groupNumber) {
+    return Crc32c::extend(Crc32c::compute(&groupNumber, sizeof(groupNumber)), &desc,
+                          offsetof(BlockGroup::Ext4GroupDesc, bg_checksum));
+}
+}
+
+void BlockGroup::setChecksum(Ext4GroupDesc &desc, uint32_t groupNumber) {
+    desc.bg_checksum = descChecksum(desc, groupNumber);
+}
+
+bool BlockGroup::verifyChecksum(const Ext4GroupDesc &desc, uint32_t groupNumber) {
+    static const Ext4GroupDesc unused = {};
+    return desc.bg_checksum == descChecksum(desc, groupNumber) || std::memcmp(&desc, &unused, sizeof(desc)) == 0;
+}
 
-    diskFile.seekp(groupNumber * sizeof(Ext4GroupDesc), std::ios::beg);
-    diskFile.write(reinterpret_cast<const char *>(&groupDesc), sizeof(groupDesc));
-    diskFile.close();
+uint32_t BlockGroup::getFreeBlocksCount(const Ext4GroupDesc &desc) {
+    return desc.bg_free_blocks_count | static_cast<uint32_t>(desc.bg_free_blocks_count_hi) << 16;
+}
+
+uint32_t BlockGroup::getFreeInodesCount(const Ext4GroupDesc &desc) {
+    return desc.bg_free_inodes_count | static_cast<uint32_t>(desc.bg_free_inodes_count_hi) << 16;
+}
+
+void BlockGroup::setFreeCounts(Ext4GroupDesc &desc, uint32_t freeBlocks, uint32_t freeInodes) {
+    desc.bg_free_blocks_count = static_cast<uint16_t>(freeBlocks);
+    desc.bg_free_blocks_count_hi = static_cast<uint16_t>(freeBlocks >> 16);
+    desc.bg_free_inodes_count = static_cast<uint16_t>(freeInodes);
+    desc.bg_free_inodes_count_hi = static_cast<uint16_t>(freeInodes >> 16);
+}
+
+void BlockGroup::adjustFree(int64_t blocks, int64_t inodes) {
+    // Clamped, so that a group whose descriptor was never read cannot wrap around
+    int64_t newBlocks = std::max<int64_t>(0, static_cast<int64_t>(getFreeBlocksCount(groupDesc)) + blocks);
+    int64_t newInodes = std::max<int64_t>(0, static_cast<int64_t>(getFreeInodesCount(groupDesc)) + inodes);
+    if (totals) {
+        totals->blocks.fetch_add(static_cast<uint64_t>(newBlocks - getFreeBlocksCount(groupDesc)), std::memory_order_relaxed);
+        totals->inodes.fetch_add(static_cast<uint64_t>(newInodes - getFreeInodesCount(groupDesc)), std::memory_order_relaxed);
+    }
+    setFreeCounts(groupDesc, static_cast<uint32_t>(newBlocks), static_cast<uint32_t>(newInodes));
+    freeBlocks.store(static_cast<uint32_t>(newBlocks), std::memory_order_relaxed);
+    freeInodes.store(static_cast<uint32_t>(newInodes), std::memory_order_relaxed);
+    writeGroupDescToDisk(groupNumber);
+}
+
+void BlockGroup::recountFree() {
+    adjustFree(static_cast<int64_t>(blockBitmap.countZeros()) - getFreeBlocksCount(groupDesc),
+               static_cast<int64_t>(inodeBitmap.countZeros()) - getFreeInodesCount(groupDesc));
 }
 
 int BlockGroup::findFreeInode(const std::vector<bool> &inodeBitmap) const {
@@ -51,3 +119,292 @@ void BlockGroup::freeBlock(std::vector<bool> &blockBitmap, int blockIndex) {
         blockBitmap[blockIndex] = false;
     }
 }
+
+int BlockGroup::findFreeInode(const Bitmap &inodeBitmap) {
+    Stats::Scope scope(Stats::BITMAP_SEARCH);
+    size_t index = inodeBitmap.findNextZero(inodeHint);
+    if (index == Bitmap::npos) {
+        return -1; // No free inode
+    }
+    inodeHint = index + 1;
+    return static_cast<int>(index);
+}
+
+int BlockGroup::findFreeBlock(const Bitmap &blockBitmap) {
+    Stats::Scope scope(Stats::BITMAP_SEARCH);
+    size_t index = blockBitmap.findNextZero(blockHint);
+    if (index == Bitmap::npos) {
+        return -1; // No free block
+    }
+    blockHint = index + 1;
+    return static_cast<int>(index);
+}
+
+void BlockGroup::freeBlock(Bitmap &blockBitmap, int blockIndex) {
+    if (blockIndex >= 0 && blockIndex < static_cast<int>(blockBitmap.size())) {
+        blockBitmap.clear(blockIndex);
+    }
+}
+
+bool BlockGroup::readBitmapsFromDisk(uint32_t blocksCount, uint32_t inodesCount, uint32_t metadataBlocks) {
+    if (!readBitmap(groupDesc.bg_block_bitmap, blockBitmap, blocksCount) ||
+        !readBitmap(groupDesc.bg_inode_bitmap, inodeBitmap, inodesCount)) {
+        std::cerr << "Error reading bitmaps" << std::endl;
+        return false;
+    }
+    inodeHint = blockHint = 0;
+
+    // mkfs left the (zero) bitmaps of this group untouched; claim its metadata now
+    if (groupDesc.bg_flags & (BLOCK_UNINIT | INODE_UNINIT)) {
+        if (groupDesc.bg_flags & BLOCK_UNINIT) {
+            size_t reserved = std::min<size_t>(metadataBlocks, blockBitmap.size());
+            blockBitmap.setRange(0, reserved);
+            writeBitmapRange(groupDesc.bg_block_bitmap, blockBitmap, 0, reserved);
+        }
+        groupDesc.bg_flags &= static_cast<uint16_t>(~(BLOCK_UNINIT | INODE_UNINIT));
+        writeGroupDescToDisk(groupNumber);
+    }
+    return true;
+}
+
+bool BlockGroup::writeBitmapsToDisk() {
+    return writeBitmapRange(groupDesc.bg_block_bitmap, blockBitmap, 0, blockBitmap.size()) &&
+           writeBitmapRange(groupDesc.bg_inode_bitmap, inodeBitmap, 0, inodeBitmap.size());
+}
+
+bool BlockGroup::readBitmap(uint32_t bitmapBlock, Bitmap &bitmap, uint32_t bits) {
+    uint64_t offset = static_cast<uint64_t>(bitmapBlock) * cache->getDevice()->getBlockSize();
+    bitmap.resize(bits);
+    if (!cache->read(offset, bitmap.data(), bitmap.byteSize())) {
+        return false;
+    }
+    bitmap.padTail();
+    return true;
+}
+
+int BlockGroup::allocateInode() {
+    int index = findFreeInode(inodeBitmap);
+    if (index != -1) {
+        inodeBitmap.set(index);
+        writeBitmapWord(groupDesc.bg_inode_bitmap, inodeBitmap, index);
+        adjustFree(0, -1);
+    }
+    return index;
+}
+
+void BlockGroup::releaseInode(uint32_t inodeIndex) {
+    if (inodeIndex < inodeBitmap.size() && inodeBitmap.test(inodeIndex)) {
+        inodeBitmap.clear(inodeIndex);
+        writeBitmapWord(groupDesc.bg_inode_bitmap, inodeBitmap, inodeIndex);
+        adjustFree(0, 1);
+    }
+}
+
+uint32_t BlockGroup::allocateInodes(uint32_t count, std::vector<uint32_t> &inodeIndexes) {
+    size_t first = Bitmap::npos;
+    size_t last = 0;
+    uint32_t taken = 0;
+    for (; taken < count; ++taken) {
+        int index = findFreeInode(inodeBitmap);
+        if (index == -1) {
+            break;
+        }
+        inodeBitmap.set(index);
+        inodeIndexes.push_back(static_cast<uint32_t>(index));
+        first = std::min<size_t>(first, index);
+        last = std::max<size_t>(last, index);
+    }
+    if (taken > 0) {
+        writeBitmapRange(groupDesc.bg_inode_bitmap, inodeBitmap, first, last - first + 1);
+        adjustFree(0, -static_cast<int64_t>(taken));
+    }
+    return taken;
+}
+
+void BlockGroup::releaseInodes(const std::vector<uint32_t> &inodeIndexes) {
+    size_t first = Bitmap::npos;
+    size_t last = 0;
+    int64_t released = 0;
+    for (uint32_t index : inodeIndexes) {
+        if (index < inodeBitmap.size() && inodeBitmap.test(index)) {
+            inodeBitmap.clear(index);
+            first = std::min<size_t>(first, index);
+            last = std::max<size_t>(last, index);
+            ++released;
+        }
+    }
+    if (first != Bitmap::npos) {
+        writeBitmapRange(groupDesc.bg_inode_bitmap, inodeBitmap, first, last - first + 1);
+        adjustFree(0, released);
+    }
+}
+
+int BlockGroup::allocateBlock() {
+    int index = findFreeBlock(blockBitmap);
+    if (index != -1) {
+        blockBitmap.set(index);
+        writeBitmapWord(groupDesc.bg_block_bitmap, blockBitmap, index);
+        adjustFree(-1, 0);
+    }
+    return index;
+}
+
+void BlockGroup::releaseBlock(uint32_t blockIndex) {
+    if (blockIndex < blockBitmap.size() && blockBitmap.test(blockIndex)) {
+        freeBlock(blockBitmap, blockIndex);
+        writeBitmapWord(groupDesc.bg_block_bitmap, blockBitmap, blockIndex);
+        adjustFree(1, 0);
+    }
+}
+
+int BlockGroup::allocateBlocks(uint32_t count, uint32_t &allocated, int goal) {
+    allocated = 0;
+    if (count == 0) {
+        return -1;
+    }
+
+    size_t start;
+    size_t runLength;
+    {
+        Stats::Scope scope(Stats::BITMAP_SEARCH);
+        if (goal >= 0 && static_cast<size_t>(goal) < blockBitmap.size() && !blockBitmap.test(goal)) {
+            start = static_cast<size_t>(goal);
+            runLength = blockBitmap.findFirstOne(start) - start;
+        } else {
+            start = blockBitmap.findBestFitRun(count, runLength);
+        }
+    }
+    if (start == Bitmap::npos) {
+        return -1; // No free block
+    }
+
+    allocated = static_cast<uint32_t>(std::min<size_t>(runLength, count));
+    blockBitmap.setRange(start, allocated);
+    writeBitmapRange(groupDesc.bg_block_bitmap, blockBitmap, start, allocated);
+    adjustFree(-static_cast<int64_t>(allocated), 0);
+    blockHint = start + allocated;
+    return static_cast<int>(start);
+}
+
+void BlockGroup::releaseBlocks(uint32_t firstBlock, uint32_t count) {
+    if (firstBlock >= blockBitmap.size() || count == 0) {
+        return;
+    }
+    count = std::min<uint32_t>(count, static_cast<uint32_t>(blockBitmap.size() - firstBlock));
+    std::vector<uint32_t> shares;
+    if (!hasRefcountTable() || !readShares(firstBlock, count, shares) ||
+        std::all_of(shares.begin(), shares.end(), [](uint32_t s) { return s == 0; })) {
+        freeRange(firstBlock, count);
+        return;
+    }
+    // Shared blocks lose an owner and stay in use; the rest are freed a run at a time
+    for (uint32_t i = 0; i < count;) {
+        if (shares[i] > 0) {
+            --shares[i++];
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < count && shares[i + run] == 0) {
+            ++run;
+        }
+        freeRange(firstBlock + i, run);
+        i += run;
+    }
+    writeShares(firstBlock, shares);
+}
+
+void BlockGroup::freeRange(uint32_t firstBlock, uint32_t count) {
+    size_t used = blockBitmap.countOnes(firstBlock, count);
+    blockBitmap.clearRange(firstBlock, count);
+    writeBitmapRange(groupDesc.bg_block_bitmap, blockBitmap, firstBlock, count);
+    adjustFree(static_cast<int64_t>(used), 0);
+}
+
+uint32_t BlockGroup::refcountTableBlocks(uint32_t blocksPerGroup, uint32_t blockSize) {
+    return static_cast<uint32_t>((static_cast<uint64_t>(blocksPerGroup) * sizeof(uint32_t) + blockSize - 1) / blockSize);
+}
+
+void BlockGroup::setRefcountTable(uint32_t firstBlock) {
+    groupDesc.bg_refcount_table = firstBlock;
+    writeGroupDescToDisk(groupNumber);
+}
+
+bool BlockGroup::getRefcounts(uint32_t firstBlock, uint32_t count, std::vector<uint32_t> &refcounts) {
+    count = firstBlock < blockBitmap.size() ? std::min<uint32_t>(count, static_cast<uint32_t>(blockBitmap.size() - firstBlock)) : 0;
+    if (hasRefcountTable()) {
+        if (!readShares(firstBlock, count, refcounts)) {
+            return false;
+        }
+    } else {
+        refcounts.assign(count, 0);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        refcounts[i] = blockBitmap.test(firstBlock + i) ? refcounts[i] + 1 : 0;
+    }
+    return true;
+}
+
+bool BlockGroup::addReferences(uint32_t firstBlock, uint32_t count) {
+    std::vector<uint32_t> shares;
+    if (!hasRefcountTable() || firstBlock + count > blockBitmap.size() || !readShares(firstBlock, count, shares)) {
+        return false;
+    }
+    for (uint32_t &share : shares) {
+        if (share == UINT32_MAX) {
+            std::cerr << "Too many owners for a block of group " << groupNumber << std::endl;
+            return false;
+        }
+        ++share;
+    }
+    return writeShares(firstBlock, shares);
+}
+
+bool BlockGroup::readShares(uint32_t firstBlock, uint32_t count, std::vector<uint32_t> &shares) {
+    shares.resize(count);
+    uint64_t offset = static_cast<uint64_t>(groupDesc.bg_refcount_table) * cache->getDevice()->getBlockSize() +
+                      static_cast<uint64_t>(firstBlock) * sizeof(uint32_t);
+    if (count > 0 && !cache->read(offset, shares.data(), count * sizeof(uint32_t))) {
+        std::cerr << "Error reading the reference counts of group " << groupNumber << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A block of the table at a time, so no journal record outgrows the journal
+bool BlockGroup::writeShares(uint32_t firstBlock, const std::vector<uint32_t> &shares) {
+    uint32_t blockSize = cache->getDevice()->getBlockSize();
+    uint64_t offset = static_cast<uint64_t>(groupDesc.bg_refcount_table) * blockSize +
+                      static_cast<uint64_t>(firstBlock) * sizeof(uint32_t);
+    const char *data = reinterpret_cast<const char *>(shares.data());
+    size_t left = shares.size() * sizeof(uint32_t);
+    while (left > 0) {
+        size_t chunk = std::min<size_t>(left, blockSize - offset % blockSize);
+        if (!cache->write(offset, data, chunk)) {
+            std::cerr << "Error writing the reference counts of group " << groupNumber << std::endl;
+            return false;
+        }
+        offset += chunk;
+        data += chunk;
+        left -= chunk;
+    }
+    return true;
+}
+
+void BlockGroup::writeBitmapWord(uint32_t bitmapBlock, const Bitmap &bitmap, size_t bitIndex) {
+    writeBitmapRange(bitmapBlock, bitmap, bitIndex, 1);
+}
+
+bool BlockGroup::writeBitmapRange(uint32_t bitmapBlock, const Bitmap &bitmap, size_t firstBit, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    size_t firstWord = firstBit / 64;
+    size_t lastWord = (firstBit + count - 1) / 64;
+    uint64_t offset = static_cast<uint64_t>(bitmapBlock) * cache->getDevice()->getBlockSize() + firstWord * sizeof(uint64_t);
+    size_t length = (lastWord - firstWord + 1) * sizeof(uint64_t);
+    if (!cache->write(offset, bitmap.data() + firstWord, length)) {
+        std::cerr << "Error writing bitmap" << std::endl;
+        return false;
+    }
+    return true;
+}
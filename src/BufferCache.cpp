@@ -0,0 +1,291 @@
+#include "BufferCache.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+const size_t BufferCache::DEFAULT_CAPACITY;
+const size_t BufferCache::WRITEBACK_BATCH;
+
+BufferCache::BufferCache(std::shared_ptr<BlockDevice> device, size_t capacityBlocks)
+    : device(std::move(device)), capacity(std::max<size_t>(capacityBlocks, 1)), writeThrough(false),
+      journal(nullptr), dirtyCount(0), hits(0), misses(0), writebacks(0) {
+    blockSize = this->device->getBlockSize();
+}
+
+BufferCache::~BufferCache() {
+    flush();
+}
+
+bool BufferCache::read(uint64_t offset, void *buffer, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    char *out = static_cast<char *>(buffer);
+    while (length > 0) {
+        uint64_t blockNumber = offset / blockSize;
+        size_t inBlock = static_cast<size_t>(offset % blockSize);
+        size_t chunk = std::min<size_t>(length, blockSize - inBlock);
+
+        Buffer *buf = getBuffer(blockNumber, true);
+        if (!buf) {
+            return false;
+        }
+        std::memcpy(out, buf->data.data() + inBlock, chunk);
+
+        out += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+bool BufferCache::write(uint64_t offset, const void *buffer, size_t length, bool logged) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (logged) {
+        logRecord(Journal::METADATA_BLOCK, offset, buffer, length);
+    }
+    if (writeThrough && !device->write(offset, buffer, length)) {
+        return false;
+    }
+
+    const char *in = static_cast<const char *>(buffer);
+    while (length > 0) {
+        uint64_t blockNumber = offset / blockSize;
+        size_t inBlock = static_cast<size_t>(offset % blockSize);
+        size_t chunk = std::min<size_t>(length, blockSize - inBlock);
+
+        // A full-block overwrite does not need the old contents
+        Buffer *buf = getBuffer(blockNumber, chunk != blockSize);
+        if (!buf) {
+            return false;
+        }
+        std::memcpy(buf->data.data() + inBlock, in, chunk);
+        if (!writeThrough && !buf->dirty) {
+            buf->dirty = true;
+            ++dirtyCount;
+        }
+
+        in += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+void BufferCache::logWrite(uint64_t offset, const void *data, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    logRecord(Journal::METADATA_BLOCK, offset, data, length);
+}
+
+void BufferCache::pin(uint64_t blockNumber) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pinned.insert(blockNumber);
+}
+
+void BufferCache::unpin(uint64_t blockNumber) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pinned.erase(blockNumber);
+}
+
+void BufferCache::discard(uint64_t blockNumber) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Older images of the block must not be replayed over whatever reuses it
+    logRecord(Journal::REVOKE_BLOCK, blockNumber * blockSize, nullptr, 0);
+    loggedIn.erase(blockNumber);
+    auto it = buffers.find(blockNumber);
+    if (it == buffers.end()) {
+        return;
+    }
+    if (it->second.dirty) {
+        --dirtyCount;
+    }
+    lru.erase(it->second.lruPosition);
+    buffers.erase(it);
+}
+
+bool BufferCache::flush() {
+    // Commit what is logged so far, so that every dirty block may go home
+    bool committed = !journal || journal->flush();
+    std::lock_guard<std::mutex> lock(mutex);
+    return flushLocked() && committed;
+}
+
+// False when a dirty block had to stay behind: its records are not committed
+bool BufferCache::flushLocked() {
+    if (dirtyCount == 0) {
+        return true;
+    }
+    uint32_t committed;
+    bool writable = homeLimit(committed);
+    std::vector<uint64_t> dirty;
+    dirty.reserve(dirtyCount);
+    for (const auto &entry : buffers) {
+        if (entry.second.dirty && writable && isCommitted(entry.first, committed)) {
+            dirty.push_back(entry.first);
+        }
+    }
+    bool complete = dirty.size() == dirtyCount;
+    return writeBack(dirty) && complete;
+}
+
+bool BufferCache::sync() {
+    bool committed = !journal || journal->flush();
+    std::lock_guard<std::mutex> lock(mutex);
+    bool ok = flushLocked() && committed;
+    return device->sync() && ok;
+}
+
+void BufferCache::invalidate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers.clear();
+    lru.clear();
+    loggedIn.clear();
+    dirtyCount = 0;
+}
+
+BufferCache::Buffer *BufferCache::getBuffer(uint64_t blockNumber, bool loadFromDisk) {
+    auto it = buffers.find(blockNumber);
+    if (it != buffers.end()) {
+        ++hits;
+        lru.splice(lru.begin(), lru, it->second.lruPosition);
+        return &it->second;
+    }
+
+    ++misses;
+    makeRoom();
+
+    Buffer &buf = buffers[blockNumber];
+    buf.data.assign(blockSize, 0);
+    if (loadFromDisk && !device->readBlocks(blockNumber, buf.data.data(), 1)) {
+        buffers.erase(blockNumber);
+        return nullptr;
+    }
+    lru.push_front(blockNumber);
+    buf.lruPosition = lru.begin();
+    return &buf;
+}
+
+void BufferCache::makeRoom() {
+    uint32_t committed;
+    bool writable = homeLimit(committed);
+    std::unordered_set<uint64_t> unwritten; // write-back failed; they stay cached and dirty
+    auto evictable = [&](uint64_t blockNumber) {
+        return !pinned.count(blockNumber) && !unwritten.count(blockNumber) &&
+               (!buffers[blockNumber].dirty || (writable && isCommitted(blockNumber, committed)));
+    };
+    while (buffers.size() >= capacity) {
+        // Coldest block that may leave
+        auto victim = lru.rbegin();
+        while (victim != lru.rend() && !evictable(*victim)) {
+            ++victim;
+        }
+        if (victim == lru.rend()) {
+            return; // Nothing may leave; let the cache grow past capacity
+        }
+
+        uint64_t blockNumber = *victim;
+        if (buffers[blockNumber].dirty) {
+            // Write back the victim together with its cold dirty neighbours in the LRU
+            std::vector<uint64_t> batch;
+            for (auto it = victim; it != lru.rend() && batch.size() < WRITEBACK_BATCH; ++it) {
+                if (buffers[*it].dirty && evictable(*it)) {
+                    batch.push_back(*it);
+                }
+            }
+            if (!writeBack(batch)) {
+                std::cerr << "Error writing back cached block " << blockNumber << std::endl;
+            }
+            // The only copy of a block that did not reach the disk is the
+            // cached one: keep it, dirty, and look for another victim
+            for (uint64_t block : batch) {
+                if (buffers[block].dirty) {
+                    unwritten.insert(block);
+                }
+            }
+            if (buffers[blockNumber].dirty) {
+                continue;
+            }
+        }
+
+        lru.erase(std::next(victim).base());
+        buffers.erase(blockNumber);
+    }
+}
+
+// The newest transaction that is committed, and false when nothing may go
+// home at all because the journal failed
+bool BufferCache::homeLimit(uint32_t &committed) {
+    if (!journal) {
+        committed = UINT32_MAX;
+        return true;
+    }
+    committed = journal->getCommittedTransaction();
+    return journal->isOpen();
+}
+
+// Write-ahead: a block may go home once every record logged for it is durable
+bool BufferCache::isCommitted(uint64_t blockNumber, uint32_t committed) const {
+    auto it = loggedIn.find(blockNumber);
+    return it == loggedIn.end() || it->second <= committed;
+}
+
+bool BufferCache::writeBack(std::vector<uint64_t> &blockNumbers) {
+    std::sort(blockNumbers.begin(), blockNumbers.end());
+
+    // Coalesce each run of consecutive block numbers into one write, and have
+    // all the runs in flight together
+    std::vector<size_t> runStarts;
+    std::vector<std::vector<char>> staging;
+    std::vector<IoEngine::Request> requests;
+    size_t i = 0;
+    while (i < blockNumbers.size()) {
+        size_t j = i + 1;
+        while (j < blockNumbers.size() && blockNumbers[j] == blockNumbers[j - 1] + 1) {
+            ++j;
+        }
+        staging.emplace_back((j - i) * blockSize);
+        for (size_t k = i; k < j; ++k) {
+            std::memcpy(staging.back().data() + (k - i) * blockSize, buffers[blockNumbers[k]].data.data(), blockSize);
+        }
+        runStarts.push_back(i);
+        i = j;
+    }
+    for (auto &run : staging) {
+        requests.push_back({true, blockNumbers[runStarts[requests.size()]] * blockSize, run.data(), run.size(), false});
+    }
+    bool ok = device->io().submitAndWait(requests);
+
+    for (size_t r = 0; r < requests.size(); ++r) {
+        if (!requests[r].ok) {
+            continue;
+        }
+        size_t runLength = staging[r].size() / blockSize;
+        for (size_t k = runStarts[r]; k < runStarts[r] + runLength; ++k) {
+            buffers[blockNumbers[k]].dirty = false;
+            loggedIn.erase(blockNumbers[k]);
+        }
+        dirtyCount -= runLength;
+        writebacks += runLength;
+    }
+    return ok;
+}
+
+// Record data: the byte offset, then the new contents of the range (none for a
+// revoke, which covers the whole block at the offset)
+void BufferCache::logRecord(uint32_t type, uint64_t offset, const void *data, size_t length) {
+    if (!journal) {
+        return;
+    }
+    record.resize(sizeof(offset) + length);
+    std::memcpy(record.data(), &offset, sizeof(offset));
+    if (length > 0) {
+        std::memcpy(record.data() + sizeof(offset), data, length);
+    }
+    uint32_t transaction = journal->writeJournal({Journal::MAGIC_NUMBER, type, 0}, record.data(), record.size());
+    if (transaction == 0) {
+        std::cerr << "Error journaling metadata at offset " << offset << std::endl;
+        return;
+    }
+    for (uint64_t block = offset / blockSize; length > 0 && block <= (offset + length - 1) / blockSize; ++block) {
+        loggedIn[block] = transaction;
+    }
+}
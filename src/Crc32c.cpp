@@ -0,0 +1,194 @@
+#include "Crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+namespace {
+
+// Castagnoli polynomial, bit-reflected
+const uint32_t POLY = 0x82F63B78;
+
+// Internally the CRC register is kept without the initial and final inversion,
+// which extend() applies, so that lanes can be combined linearly.
+using Function = uint32_t (*)(uint32_t crc, const unsigned char *data, size_t length);
+
+struct Tables {
+    uint32_t table[8][256];
+
+    Tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (int k = 1; k < 8; ++k) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+const Tables &tables() {
+    static const Tables instance;
+    return instance;
+}
+
+// Slicing-by-8; loads are little-endian
+uint32_t extendTable(uint32_t crc, const unsigned char *data, size_t length) {
+    const uint32_t (*t)[256] = tables().table;
+    while (length >= 8) {
+        uint32_t low, high;
+        std::memcpy(&low, data, 4);
+        std::memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+
+// Product of two polynomials modulo POLY, bit-reflected (bit 31 is x^0)
+uint32_t multiplyModP(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^exponent modulo POLY, bit-reflected
+uint32_t xPowModP(uint64_t exponent) {
+    uint32_t result = 1u << 31; // x^0
+    uint32_t power = 1u << 30;  // x^1
+    for (; exponent != 0; exponent >>= 1) {
+        if (exponent & 1) {
+            result = multiplyModP(result, power);
+        }
+        power = multiplyModP(power, power);
+    }
+    return result;
+}
+
+// Three-lane rounds, longest first. Moving a lane's CRC past n more bytes
+// multiplies it by x^(8n); clmul(crc, x^(8n-33)) followed by a crc32 of the
+// 64-bit product does that, the crc32 adding the missing x^32 and reducing.
+struct Lane {
+    size_t bytes;
+    uint32_t shiftOne; // x^(8 * bytes - 33)
+    uint32_t shiftTwo; // x^(16 * bytes - 33)
+};
+
+struct Lanes {
+    Lane lanes[2];
+
+    Lanes() {
+        const size_t sizes[2] = {4096, 256};
+        for (int i = 0; i < 2; ++i) {
+            lanes[i] = {sizes[i], xPowModP(8 * sizes[i] - 33), xPowModP(16 * sizes[i] - 33)};
+        }
+    }
+};
+
+const Lanes &lanes() {
+    static const Lanes instance;
+    return instance;
+}
+
+__attribute__((target("sse4.2"))) uint32_t extendSse42(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul"))) uint32_t shift(uint64_t crc, uint32_t constant) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                                           _mm_cvtsi32_si128(static_cast<int>(constant)), 0);
+    return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product))));
+}
+
+__attribute__((target("sse4.2,pclmul"))) uint32_t extendPclmul(uint32_t crc, const unsigned char *data, size_t length) {
+    for (const Lane &lane : lanes().lanes) {
+        while (length >= 3 * lane.bytes) {
+            uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+            const unsigned char *end = data + lane.bytes;
+            for (; data < end; data += 8) {
+                uint64_t word0, word1, word2;
+                std::memcpy(&word0, data, 8);
+                std::memcpy(&word1, data + lane.bytes, 8);
+                std::memcpy(&word2, data + 2 * lane.bytes, 8);
+                crc0 = _mm_crc32_u64(crc0, word0);
+                crc1 = _mm_crc32_u64(crc1, word1);
+                crc2 = _mm_crc32_u64(crc2, word2);
+            }
+            crc = shift(crc0, lane.shiftTwo) ^ shift(crc1, lane.shiftOne) ^ static_cast<uint32_t>(crc2);
+            data += 2 * lane.bytes;
+            length -= 3 * lane.bytes;
+        }
+    }
+    return extendSse42(crc, data, length);
+}
+
+#endif // CRC32C_X86
+
+struct Implementation {
+    Function function;
+    const char *name;
+
+    Implementation() : function(extendTable), name("table") {
+#ifdef CRC32C_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+            function = extendPclmul;
+            name = "sse4.2+pclmul";
+        } else if (__builtin_cpu_supports("sse4.2")) {
+            function = extendSse42;
+            name = "sse4.2";
+        }
+#endif
+    }
+};
+
+const Implementation &selected() {
+    static const Implementation instance;
+    return instance;
+}
+
+} // namespace
+
+uint32_t Crc32c::extend(uint32_t crc, const void *data, size_t length) {
+    return ~selected().function(~crc, static_cast<const unsigned char *>(data), length);
+}
+
+uint32_t Crc32c::extendPortable(uint32_t crc, const void *data, size_t length) {
+    return ~extendTable(~crc, static_cast<const unsigned char *>(data), length);
+}
+
+const char *Crc32c::implementation() {
+    return selected().name;
+}
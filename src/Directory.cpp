@@ -0,0 +1,572 @@
+#include "Directory.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+const uint8_t Directory::FT_UNKNOWN;
+const uint8_t Directory::FT_REG_FILE;
+const uint8_t Directory::FT_DIR;
+const uint32_t Directory::INDEX_FL;
+const uint8_t Directory::HASH_FNV1A;
+const uint8_t Directory::MAX_INDIRECT_LEVELS;
+const size_t Directory::MAX_NAME_LENGTH;
+
+namespace {
+const size_t ENTRY_HEADER = sizeof(Directory::Ext4DirEntry);
+// "." and ".." at the start of block 0, then the root info and the index
+const size_t DOT_RECORD = 12;
+const size_t ROOT_ENTRIES_OFFSET = 2 * DOT_RECORD + sizeof(Directory::DxRootInfo);
+// An index node starts with one empty entry spanning the block
+const size_t NODE_ENTRIES_OFFSET = ENTRY_HEADER;
+
+// Space an entry with a name of 'nameLength' bytes needs
+size_t recordLength(size_t nameLength) {
+    return (ENTRY_HEADER + nameLength + 3) & ~size_t(3);
+}
+
+Directory::Ext4DirEntry *entryAt(std::vector<char> &data, size_t offset) {
+    return reinterpret_cast<Directory::Ext4DirEntry *>(data.data() + offset);
+}
+
+void putEntry(std::vector<char> &data, size_t offset, uint32_t inode, uint16_t recLen, const std::string &name,
+              uint8_t fileType) {
+    Directory::Ext4DirEntry *entry = entryAt(data, offset);
+    entry->inode = inode;
+    entry->rec_len = recLen;
+    entry->name_len = static_cast<uint8_t>(name.size());
+    entry->file_type = fileType;
+    std::memcpy(data.data() + offset + ENTRY_HEADER, name.data(), name.size());
+}
+
+// Walks the entries of a block; false if the block is corrupt
+template <typename Visitor>
+bool forEachEntry(std::vector<char> &data, Visitor visit) {
+    size_t offset = 0;
+    size_t previous = SIZE_MAX;
+    while (offset < data.size()) {
+        Directory::Ext4DirEntry *entry = entryAt(data, offset);
+        if (entry->rec_len < ENTRY_HEADER || entry->rec_len % 4 != 0 || offset + entry->rec_len > data.size() ||
+            ENTRY_HEADER + entry->name_len > entry->rec_len) {
+            std::cerr << "Corrupt directory entry at offset " << offset << std::endl;
+            return false;
+        }
+        if (visit(offset, previous)) {
+            return true;
+        }
+        previous = offset;
+        offset += entry->rec_len;
+    }
+    return true;
+}
+
+bool sameName(std::vector<char> &data, size_t offset, const std::string &name) {
+    const Directory::Ext4DirEntry *entry = entryAt(data, offset);
+    return entry->inode != 0 && entry->name_len == name.size() &&
+           std::memcmp(data.data() + offset + ENTRY_HEADER, name.data(), name.size()) == 0;
+}
+
+// Puts an entry in the first gap large enough for it
+bool insertIntoBlock(std::vector<char> &data, const std::string &name, uint32_t inodeNumber, uint8_t fileType) {
+    size_t needed = recordLength(name.size());
+    bool inserted = false;
+    bool ok = forEachEntry(data, [&](size_t offset, size_t) {
+        Directory::Ext4DirEntry *entry = entryAt(data, offset);
+        size_t used = entry->inode ? recordLength(entry->name_len) : 0;
+        if (entry->rec_len - used < needed) {
+            return false;
+        }
+        if (used == 0) {
+            putEntry(data, offset, inodeNumber, entry->rec_len, name, fileType);
+        } else {
+            uint16_t rest = static_cast<uint16_t>(entry->rec_len - used);
+            entry->rec_len = static_cast<uint16_t>(used);
+            putEntry(data, offset + used, inodeNumber, rest, name, fileType);
+        }
+        inserted = true;
+        return true;
+    });
+    return ok && inserted;
+}
+
+// Lays 'entries' out from the start of 'data'; the last one spans the rest
+void fillBlock(std::vector<char> &data, const std::vector<Directory::Entry> &entries) {
+    std::fill(data.begin(), data.end(), 0);
+    if (entries.empty()) {
+        putEntry(data, 0, 0, static_cast<uint16_t>(data.size()), "", Directory::FT_UNKNOWN);
+        return;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        size_t length = i + 1 == entries.size() ? data.size() - offset : recordLength(entries[i].name.size());
+        putEntry(data, offset, entries[i].inode, static_cast<uint16_t>(length), entries[i].name, entries[i].fileType);
+        offset += length;
+    }
+}
+
+bool collectEntries(std::vector<char> &data, std::vector<Directory::Entry> &entries) {
+    return forEachEntry(data, [&](size_t offset, size_t) {
+        const Directory::Ext4DirEntry *entry = entryAt(data, offset);
+        if (entry->inode != 0) {
+            entries.push_back({std::string(data.data() + offset + ENTRY_HEADER, entry->name_len), entry->inode,
+                               entry->file_type});
+        }
+        return false;
+    });
+}
+
+Directory::DxCountLimit *countLimit(std::vector<char> &data, size_t entriesOffset) {
+    return reinterpret_cast<Directory::DxCountLimit *>(data.data() + entriesOffset);
+}
+
+Directory::DxEntry *dxEntries(std::vector<char> &data, size_t entriesOffset) {
+    return reinterpret_cast<Directory::DxEntry *>(data.data() + entriesOffset);
+}
+
+Directory::DxRootInfo *rootInfo(std::vector<char> &data) {
+    return reinterpret_cast<Directory::DxRootInfo *>(data.data() + 2 * DOT_RECORD);
+}
+
+// Empty index node: one unused entry over the whole block, then the index
+void initIndexNode(std::vector<char> &data) {
+    std::fill(data.begin(), data.end(), 0);
+    putEntry(data, 0, 0, static_cast<uint16_t>(data.size()), "", Directory::FT_UNKNOWN);
+    countLimit(data, NODE_ENTRIES_OFFSET)->limit =
+        static_cast<uint16_t>((data.size() - NODE_ENTRIES_OFFSET) / sizeof(Directory::DxEntry));
+}
+}
+
+Directory::Directory(std::shared_ptr<BufferCache> cache, Inode::Ext4Inode &dir, BlockMapper mapBlock)
+    : cache(std::move(cache)), dir(dir), mapBlock(std::move(mapBlock)) {
+    blockSize = this->cache->getDevice()->getBlockSize();
+}
+
+// FNV-1a with bit 0 cleared; bit 0 of an index hash marks a continued run
+uint32_t Directory::hash(const std::string &name) {
+    uint32_t value = 2166136261u;
+    for (unsigned char c : name) {
+        value = (value ^ c) * 16777619u;
+    }
+    return value & ~1u;
+}
+
+bool Directory::init(uint32_t self, uint32_t parent) {
+    if (dir.i_size == 0 && appendBlock() < 0) {
+        return false;
+    }
+    std::vector<char> data(blockSize, 0);
+    putEntry(data, 0, self, DOT_RECORD, ".", FT_DIR);
+    putEntry(data, DOT_RECORD, parent, static_cast<uint16_t>(blockSize - DOT_RECORD), "..", FT_DIR);
+    dir.i_flags &= ~INDEX_FL;
+    return writeBlock(0, data);
+}
+
+bool Directory::lookup(const std::string &name, uint32_t &inodeNumber, uint8_t *fileType) {
+    std::vector<char> data;
+    auto find = [&]() {
+        bool found = false;
+        forEachEntry(data, [&](size_t offset, size_t) {
+            if (!sameName(data, offset, name)) {
+                return false;
+            }
+            inodeNumber = entryAt(data, offset)->inode;
+            if (fileType) {
+                *fileType = entryAt(data, offset)->file_type;
+            }
+            found = true;
+            return true;
+        });
+        return found;
+    };
+
+    if (!(dir.i_flags & INDEX_FL)) {
+        return dir.i_size > 0 && readBlock(0, data) && find();
+    }
+    if (name == "." || name == "..") {
+        return readBlock(0, data) && find();
+    }
+
+    uint32_t nameHash = hash(name);
+    std::vector<Frame> frames;
+    if (!probe(nameHash, frames)) {
+        return false;
+    }
+    uint32_t leaf = dxEntries(frames.back().data, frames.back().entriesOffset)[frames.back().position].block;
+    do {
+        if (!readBlock(leaf, data)) {
+            return false;
+        }
+        if (find()) {
+            return true;
+        }
+    } while (nextLeaf(frames, nameHash, leaf));
+    return false;
+}
+
+bool Directory::add(const std::string &name, uint32_t inodeNumber, uint8_t fileType) {
+    if (name.empty() || name.size() > MAX_NAME_LENGTH) {
+        std::cerr << "Invalid directory entry name" << std::endl;
+        return false;
+    }
+    std::vector<char> data;
+    if (!(dir.i_flags & INDEX_FL)) {
+        if (!readBlock(0, data)) {
+            return false;
+        }
+        if (insertIntoBlock(data, name, inodeNumber, fileType)) {
+            return writeBlock(0, data);
+        }
+        if (!convertToIndex()) {
+            return false;
+        }
+    }
+
+    // Each round either inserts the entry or makes room for it, by splitting
+    // the leaf it hashes to (and the index above it when that is full)
+    uint32_t nameHash = hash(name);
+    for (int attempt = 0; attempt < 4; ++attempt) {
+        std::vector<Frame> frames;
+        if (!probe(nameHash, frames)) {
+            return false;
+        }
+        Frame &bottom = frames.back();
+        uint32_t leaf = dxEntries(bottom.data, bottom.entriesOffset)[bottom.position].block;
+        if (!readBlock(leaf, data)) {
+            return false;
+        }
+        if (insertIntoBlock(data, name, inodeNumber, fileType)) {
+            return writeBlock(leaf, data);
+        }
+        DxCountLimit *bottomCount = countLimit(bottom.data, bottom.entriesOffset);
+        if (bottomCount->count == bottomCount->limit) {
+            if (!makeIndexRoom(frames)) {
+                return false;
+            }
+            continue;
+        }
+        if (!splitLeaf(frames)) {
+            return false;
+        }
+    }
+    std::cerr << "No room for directory entry " << name << std::endl;
+    return false;
+}
+
+bool Directory::remove(const std::string &name) {
+    std::vector<char> data;
+    auto erase = [&]() {
+        bool removed = false;
+        forEachEntry(data, [&](size_t offset, size_t previous) {
+            if (!sameName(data, offset, name)) {
+                return false;
+            }
+            // Merge into the previous entry, or mark the first entry unused
+            if (previous != SIZE_MAX) {
+                entryAt(data, previous)->rec_len += entryAt(data, offset)->rec_len;
+            } else {
+                entryAt(data, offset)->inode = 0;
+            }
+            removed = true;
+            return true;
+        });
+        return removed;
+    };
+
+    if (name == "." || name == ".." || dir.i_size == 0) {
+        return false;
+    }
+    if (!(dir.i_flags & INDEX_FL)) {
+        return readBlock(0, data) && erase() && writeBlock(0, data);
+    }
+
+    uint32_t nameHash = hash(name);
+    std::vector<Frame> frames;
+    if (!probe(nameHash, frames)) {
+        return false;
+    }
+    uint32_t leaf = dxEntries(frames.back().data, frames.back().entriesOffset)[frames.back().position].block;
+    do {
+        if (!readBlock(leaf, data)) {
+            return false;
+        }
+        if (erase()) {
+            return writeBlock(leaf, data);
+        }
+    } while (nextLeaf(frames, nameHash, leaf));
+    return false;
+}
+
+bool Directory::list(std::vector<Entry> &entries) {
+    std::vector<char> data;
+    for (uint32_t logical = 0; logical < dir.i_size / blockSize; ++logical) {
+        if (!readBlock(logical, data) || !collectEntries(data, entries)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Directory::isEmpty() {
+    std::vector<Entry> entries;
+    return list(entries) && entries.size() <= 2;
+}
+
+bool Directory::readBlock(uint32_t logical, std::vector<char> &data) {
+    int64_t physical = mapBlock(logical, false);
+    data.resize(blockSize);
+    if (physical < 0 || !cache->read(static_cast<uint64_t>(physical) * blockSize, data.data(), blockSize)) {
+        std::cerr << "Error reading directory block " << logical << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Directory::writeBlock(uint32_t logical, const std::vector<char> &data) {
+    int64_t physical = mapBlock(logical, false);
+    if (physical < 0 || !cache->write(static_cast<uint64_t>(physical) * blockSize, data.data(), blockSize)) {
+        std::cerr << "Error writing directory block " << logical << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Maps one more block at the end of the directory; returns its logical number.
+// The caller writes all of it.
+int64_t Directory::appendBlock() {
+    uint32_t logical = dir.i_size / blockSize;
+    if (mapBlock(logical, true) < 0) {
+        std::cerr << "No free blocks for directory" << std::endl;
+        return -1;
+    }
+    dir.i_size += blockSize;
+    return logical;
+}
+
+// Follows the index from the root down to the leaf covering 'nameHash'
+bool Directory::probe(uint32_t nameHash, std::vector<Frame> &frames) {
+    frames.clear();
+    frames.push_back({0, {}, ROOT_ENTRIES_OFFSET, 0});
+    if (!readBlock(0, frames.back().data)) {
+        return false;
+    }
+    const DxRootInfo *info = rootInfo(frames.back().data);
+    if (info->hash_version != HASH_FNV1A || info->indirect_levels > MAX_INDIRECT_LEVELS) {
+        std::cerr << "Unsupported directory index" << std::endl;
+        return false;
+    }
+    uint8_t levels = info->indirect_levels;
+
+    for (uint8_t level = 0;; ++level) {
+        Frame &frame = frames.back();
+        const DxEntry *entries = dxEntries(frame.data, frame.entriesOffset);
+        uint16_t count = countLimit(frame.data, frame.entriesOffset)->count;
+        // Last entry whose hash is <= nameHash; entry 0 covers everything below entry 1
+        size_t low = 1;
+        size_t high = count;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (entries[middle].hash > nameHash) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        frame.position = low - 1;
+        if (level == levels) {
+            return true;
+        }
+        uint32_t child = entries[frame.position].block;
+        frames.push_back({child, {}, NODE_ENTRIES_OFFSET, 0});
+        if (!readBlock(child, frames.back().data)) {
+            return false;
+        }
+    }
+}
+
+// Names with equal hashes may continue into the following leaf, whose index
+// entry then has bit 0 set; moves 'frames' there and returns it in 'leaf'
+bool Directory::nextLeaf(std::vector<Frame> &frames, uint32_t nameHash, uint32_t &leaf) {
+    for (size_t level = frames.size(); level-- > 0;) {
+        Frame &frame = frames[level];
+        if (frame.position + 1 >= countLimit(frame.data, frame.entriesOffset)->count) {
+            continue;
+        }
+        ++frame.position;
+        if ((dxEntries(frame.data, frame.entriesOffset)[frame.position].hash & ~1u) != nameHash) {
+            return false;
+        }
+        for (size_t below = level + 1; below < frames.size(); ++below) {
+            Frame &parent = frames[below - 1];
+            frames[below].block = dxEntries(parent.data, parent.entriesOffset)[parent.position].block;
+            frames[below].position = 0;
+            if (!readBlock(frames[below].block, frames[below].data)) {
+                return false;
+            }
+        }
+        leaf = dxEntries(frames.back().data, frames.back().entriesOffset)[frames.back().position].block;
+        return true;
+    }
+    return false;
+}
+
+// Moves the entries of a full single-block directory into a leaf and turns
+// block 0 into the index root pointing at it
+bool Directory::convertToIndex() {
+    std::vector<char> root;
+    std::vector<Entry> entries;
+    if (!readBlock(0, root) || !collectEntries(root, entries)) {
+        return false;
+    }
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [](const Entry &entry) { return entry.name == "." || entry.name == ".."; }),
+                  entries.end());
+
+    int64_t leaf = appendBlock();
+    if (leaf < 0) {
+        return false;
+    }
+    std::vector<char> data(blockSize);
+    fillBlock(data, entries);
+    if (!writeBlock(static_cast<uint32_t>(leaf), data)) {
+        return false;
+    }
+
+    // Keep "." and "..", the latter now spanning the index
+    Ext4DirEntry *dotDot = entryAt(root, DOT_RECORD);
+    std::string dotDotName = "..";
+    uint32_t parent = dotDot->inode;
+    uint32_t self = entryAt(root, 0)->inode;
+    std::fill(root.begin(), root.end(), 0);
+    putEntry(root, 0, self, DOT_RECORD, ".", FT_DIR);
+    putEntry(root, DOT_RECORD, parent, static_cast<uint16_t>(blockSize - DOT_RECORD), dotDotName, FT_DIR);
+    DxRootInfo *info = rootInfo(root);
+    info->hash_version = HASH_FNV1A;
+    info->info_length = sizeof(DxRootInfo);
+    info->indirect_levels = 0;
+    DxCountLimit *limits = countLimit(root, ROOT_ENTRIES_OFFSET);
+    limits->limit = static_cast<uint16_t>((blockSize - ROOT_ENTRIES_OFFSET) / sizeof(DxEntry));
+    limits->count = 1;
+    dxEntries(root, ROOT_ENTRIES_OFFSET)[0].block = static_cast<uint32_t>(leaf);
+    if (!writeBlock(0, root)) {
+        return false;
+    }
+    dir.i_flags |= INDEX_FL;
+    return true;
+}
+
+// The bottom index block is full. A full root with no index nodes below it
+// moves its entries into a new node, adding a level; a full node is split in
+// two, with the upper half referenced from the root.
+bool Directory::makeIndexRoom(std::vector<Frame> &frames) {
+    Frame &root = frames.front();
+    DxCountLimit *rootCount = countLimit(root.data, root.entriesOffset);
+    std::vector<char> node(blockSize);
+    initIndexNode(node);
+    DxCountLimit *nodeCount = countLimit(node, NODE_ENTRIES_OFFSET);
+
+    if (frames.size() == 1) {
+        if (rootInfo(root.data)->indirect_levels >= MAX_INDIRECT_LEVELS) {
+            std::cerr << "Directory index full" << std::endl;
+            return false;
+        }
+        int64_t block = appendBlock();
+        if (block < 0) {
+            return false;
+        }
+        uint16_t count = rootCount->count;
+        uint16_t limit = nodeCount->limit;
+        std::memcpy(dxEntries(node, NODE_ENTRIES_OFFSET), dxEntries(root.data, root.entriesOffset), count * sizeof(DxEntry));
+        nodeCount->limit = limit;
+        nodeCount->count = count;
+        rootCount->count = 1;
+        dxEntries(root.data, root.entriesOffset)[0].block = static_cast<uint32_t>(block);
+        rootInfo(root.data)->indirect_levels = 1;
+        return writeBlock(static_cast<uint32_t>(block), node) && writeBlock(0, root.data);
+    }
+
+    if (rootCount->count == rootCount->limit) {
+        std::cerr << "Directory index full" << std::endl;
+        return false;
+    }
+    Frame &full = frames.back();
+    DxCountLimit *fullCount = countLimit(full.data, full.entriesOffset);
+    int64_t block = appendBlock();
+    if (block < 0) {
+        return false;
+    }
+    uint16_t keep = fullCount->count / 2;
+    uint16_t moved = fullCount->count - keep;
+    const DxEntry *upper = dxEntries(full.data, full.entriesOffset) + keep;
+    uint32_t splitHash = upper[0].hash;
+    uint16_t limit = nodeCount->limit;
+    std::memcpy(dxEntries(node, NODE_ENTRIES_OFFSET), upper, moved * sizeof(DxEntry));
+    nodeCount->limit = limit;
+    nodeCount->count = moved;
+    fullCount->count = keep;
+    insertIndexEntry(root, splitHash, static_cast<uint32_t>(block));
+    return writeBlock(static_cast<uint32_t>(block), node) && writeBlock(full.block, full.data) &&
+           writeBlock(0, root.data);
+}
+
+// Moves the upper half (by hash) of the bottom frame's leaf into a new leaf
+bool Directory::splitLeaf(std::vector<Frame> &frames) {
+    Frame &bottom = frames.back();
+    uint32_t leaf = dxEntries(bottom.data, bottom.entriesOffset)[bottom.position].block;
+    std::vector<char> data;
+    std::vector<Entry> entries;
+    if (!readBlock(leaf, data) || !collectEntries(data, entries) || entries.size() < 2) {
+        return false;
+    }
+    std::vector<std::pair<uint32_t, Entry>> sorted;
+    for (auto &entry : entries) {
+        sorted.push_back({hash(entry.name), std::move(entry)});
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<uint32_t, Entry> &a, const std::pair<uint32_t, Entry> &b) { return a.first < b.first; });
+
+    // Split in the middle, moving the split point off a run of equal hashes if
+    // possible; otherwise the new leaf continues the run
+    size_t split = sorted.size() / 2;
+    size_t up = split;
+    while (up < sorted.size() && sorted[up].first == sorted[up - 1].first) {
+        ++up;
+    }
+    size_t down = split;
+    while (down > 1 && sorted[down].first == sorted[down - 1].first) {
+        --down;
+    }
+    if (up < sorted.size()) {
+        split = up;
+    } else if (sorted[down].first != sorted[down - 1].first) {
+        split = down;
+    }
+    uint32_t splitHash = sorted[split].first;
+    if (sorted[split].first == sorted[split - 1].first) {
+        splitHash |= 1;
+    }
+
+    int64_t block = appendBlock();
+    if (block < 0) {
+        return false;
+    }
+    std::vector<Entry> lower;
+    std::vector<Entry> upper;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        (i < split ? lower : upper).push_back(std::move(sorted[i].second));
+    }
+    std::vector<char> upperData(blockSize);
+    fillBlock(data, lower);
+    fillBlock(upperData, upper);
+    insertIndexEntry(bottom, splitHash, static_cast<uint32_t>(block));
+    return writeBlock(static_cast<uint32_t>(block), upperData) && writeBlock(leaf, data) &&
+           writeBlock(bottom.block, bottom.data);
+}
+
+// Inserts after the frame's current position; the caller checked for room
+void Directory::insertIndexEntry(Frame &frame, uint32_t entryHash, uint32_t block) {
+    DxCountLimit *limits = countLimit(frame.data, frame.entriesOffset);
+    DxEntry *entries = dxEntries(frame.data, frame.entriesOffset);
+    size_t at = frame.position + 1;
+    std::memmove(entries + at + 1, entries + at, (limits->count - at) * sizeof(DxEntry));
+    entries[at] = {entryHash, block};
+    ++limits->count;
+}
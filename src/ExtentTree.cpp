@@ -0,0 +1,270 @@
+#include "ExtentTree.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+const uint16_t ExtentTree::MAGIC;
+const uint16_t ExtentTree::MAX_EXTENT_LENGTH;
+const uint16_t ExtentTree::MAX_DEPTH;
+
+namespace {
+const uint16_t ROOT_CAPACITY = 4; // (60 - header) / entry in i_block
+
+ExtentTree::Ext4Extent packExtent(const ExtentTree::Extent &extent) {
+    ExtentTree::Ext4Extent packed = {};
+    packed.ee_block = extent.logical;
+    packed.ee_len = static_cast<uint16_t>(extent.length);
+    packed.ee_start_hi = static_cast<uint16_t>(extent.physical >> 32);
+    packed.ee_start_lo = static_cast<uint32_t>(extent.physical);
+    return packed;
+}
+
+ExtentTree::Extent unpackExtent(const ExtentTree::Ext4Extent &packed) {
+    return {packed.ee_block, (static_cast<uint64_t>(packed.ee_start_hi) << 32) | packed.ee_start_lo, packed.ee_len};
+}
+
+uint64_t childBlock(const ExtentTree::Ext4ExtentIdx &idx) {
+    return (static_cast<uint64_t>(idx.ei_leaf_hi) << 32) | idx.ei_leaf_lo;
+}
+
+const ExtentTree::Ext4ExtentHeader *header(const char *node) {
+    return reinterpret_cast<const ExtentTree::Ext4ExtentHeader *>(node);
+}
+
+// Writes one node (header plus entries) into 'node'
+template <typename Entry>
+void buildNode(char *node, uint16_t capacity, uint16_t depth, const Entry *entries, size_t count) {
+    ExtentTree::Ext4ExtentHeader hdr = {ExtentTree::MAGIC, static_cast<uint16_t>(count), capacity, depth, 0};
+    std::memcpy(node, &hdr, sizeof(hdr));
+    std::memcpy(node + sizeof(hdr), entries, count * sizeof(Entry));
+}
+}
+
+ExtentTree::ExtentTree(std::shared_ptr<BufferCache> cache) : cache(std::move(cache)) {
+    blockSize = this->cache->getDevice()->getBlockSize();
+}
+
+void ExtentTree::initRoot(uint32_t iBlock[15]) {
+    std::memset(iBlock, 0, 15 * sizeof(uint32_t));
+    Ext4ExtentHeader hdr = {MAGIC, 0, ROOT_CAPACITY, 0, 0};
+    std::memcpy(iBlock, &hdr, sizeof(hdr));
+}
+
+bool ExtentTree::hasRoot(const uint32_t iBlock[15]) {
+    return header(reinterpret_cast<const char *>(iBlock))->eh_magic == MAGIC;
+}
+
+uint16_t ExtentTree::nodeCapacity() const {
+    return static_cast<uint16_t>((blockSize - sizeof(Ext4ExtentHeader)) / sizeof(Ext4Extent));
+}
+
+bool ExtentTree::load(const uint32_t iBlock[15], std::vector<Extent> &extents) const {
+    extents.clear();
+    if (!hasRoot(iBlock)) {
+        return false;
+    }
+    const char *root = reinterpret_cast<const char *>(iBlock);
+    return loadNode(root, header(root)->eh_depth, extents, nullptr);
+}
+
+bool ExtentTree::collectNodeBlocks(const uint32_t iBlock[15], std::vector<uint64_t> &blocks) const {
+    if (!hasRoot(iBlock)) {
+        return false;
+    }
+    std::vector<Extent> ignored;
+    const char *root = reinterpret_cast<const char *>(iBlock);
+    return loadNode(root, header(root)->eh_depth, ignored, &blocks);
+}
+
+bool ExtentTree::loadNode(const char *node, uint16_t depth, std::vector<Extent> &extents,
+                          std::vector<uint64_t> *nodeBlocks) const {
+    const Ext4ExtentHeader *hdr = header(node);
+    if (hdr->eh_magic != MAGIC || hdr->eh_depth != depth || hdr->eh_entries > hdr->eh_max) {
+        std::cerr << "Corrupt extent node" << std::endl;
+        return false;
+    }
+
+    if (depth == 0) {
+        const Ext4Extent *entries = reinterpret_cast<const Ext4Extent *>(node + sizeof(Ext4ExtentHeader));
+        for (uint16_t i = 0; i < hdr->eh_entries; ++i) {
+            extents.push_back(unpackExtent(entries[i]));
+        }
+        return true;
+    }
+
+    const Ext4ExtentIdx *entries = reinterpret_cast<const Ext4ExtentIdx *>(node + sizeof(Ext4ExtentHeader));
+    std::vector<char> child(blockSize);
+    for (uint16_t i = 0; i < hdr->eh_entries; ++i) {
+        uint64_t block = childBlock(entries[i]);
+        if (nodeBlocks) {
+            nodeBlocks->push_back(block);
+        }
+        if (!cache->read(block * blockSize, child.data(), blockSize) ||
+            !loadNode(child.data(), depth - 1, extents, nodeBlocks)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ExtentTree::lookup(const uint32_t iBlock[15], uint32_t logical, Extent &found) const {
+    if (!hasRoot(iBlock)) {
+        return false;
+    }
+
+    std::vector<char> buffer(blockSize);
+    std::memcpy(buffer.data(), iBlock, 15 * sizeof(uint32_t));
+    for (;;) {
+        const Ext4ExtentHeader *hdr = header(buffer.data());
+        if (hdr->eh_magic != MAGIC || hdr->eh_entries == 0) {
+            return false;
+        }
+
+        if (hdr->eh_depth == 0) {
+            const Ext4Extent *entries = reinterpret_cast<const Ext4Extent *>(buffer.data() + sizeof(Ext4ExtentHeader));
+            const Ext4Extent *end = entries + hdr->eh_entries;
+            const Ext4Extent *it = std::upper_bound(entries, end, logical,
+                [](uint32_t value, const Ext4Extent &e) { return value < e.ee_block; });
+            if (it == entries) {
+                return false;
+            }
+            Extent extent = unpackExtent(*(it - 1));
+            if (logical >= extent.logical + extent.length) {
+                return false; // Hole
+            }
+            found = extent;
+            return true;
+        }
+
+        const Ext4ExtentIdx *entries = reinterpret_cast<const Ext4ExtentIdx *>(buffer.data() + sizeof(Ext4ExtentHeader));
+        const Ext4ExtentIdx *end = entries + hdr->eh_entries;
+        const Ext4ExtentIdx *it = std::upper_bound(entries, end, logical,
+            [](uint32_t value, const Ext4ExtentIdx &e) { return value < e.ei_block; });
+        if (it == entries) {
+            return false;
+        }
+        if (!cache->read(childBlock(*(it - 1)) * blockSize, buffer.data(), blockSize)) {
+            return false;
+        }
+    }
+}
+
+void ExtentTree::normalize(std::vector<Extent> &extents) {
+    std::sort(extents.begin(), extents.end(),
+              [](const Extent &a, const Extent &b) { return a.logical < b.logical; });
+
+    std::vector<Extent> merged;
+    for (const Extent &extent : extents) {
+        if (extent.length == 0) {
+            continue;
+        }
+        if (!merged.empty()) {
+            Extent &last = merged.back();
+            if (last.logical + last.length == extent.logical && last.physical + last.length == extent.physical) {
+                last.length += extent.length;
+                continue;
+            }
+        }
+        merged.push_back(extent);
+    }
+
+    // Split anything longer than one on-disk extent can describe
+    extents.clear();
+    for (Extent extent : merged) {
+        while (extent.length > MAX_EXTENT_LENGTH) {
+            extents.push_back({extent.logical, extent.physical, MAX_EXTENT_LENGTH});
+            extent.logical += MAX_EXTENT_LENGTH;
+            extent.physical += MAX_EXTENT_LENGTH;
+            extent.length -= MAX_EXTENT_LENGTH;
+        }
+        extents.push_back(extent);
+    }
+}
+
+bool ExtentTree::store(uint32_t iBlock[15], std::vector<Extent> extents,
+                       const NodeAllocator &allocateNode, const NodeReleaser &releaseNode) {
+    normalize(extents);
+
+    std::vector<uint64_t> oldNodes;
+    if (hasRoot(iBlock) && !collectNodeBlocks(iBlock, oldNodes)) {
+        return false;
+    }
+
+    // Count the nodes each level of the new tree needs before touching anything
+    const uint16_t capacity = nodeCapacity();
+    std::vector<size_t> levelNodes;
+    size_t entries = extents.size();
+    while (entries > ROOT_CAPACITY) {
+        entries = (entries + capacity - 1) / capacity;
+        levelNodes.push_back(entries);
+    }
+    if (levelNodes.size() > MAX_DEPTH) {
+        std::cerr << "Extent tree too deep" << std::endl;
+        return false;
+    }
+
+    size_t needed = 0;
+    for (size_t count : levelNodes) {
+        needed += count;
+    }
+    std::vector<uint64_t> nodes(oldNodes.begin(), oldNodes.begin() + std::min(needed, oldNodes.size()));
+    while (nodes.size() < needed) {
+        int64_t block = allocateNode();
+        if (block < 0) {
+            for (size_t i = std::min(needed, oldNodes.size()); i < nodes.size(); ++i) {
+                releaseNode(nodes[i]);
+            }
+            std::cerr << "No space for extent tree node" << std::endl;
+            return false;
+        }
+        nodes.push_back(static_cast<uint64_t>(block));
+    }
+
+    // Build bottom-up: leaves first, then index levels until the root fits inline
+    std::vector<char> node(blockSize);
+    size_t nextNode = 0;
+    std::vector<Ext4Extent> leafEntries;
+    for (const Extent &extent : extents) {
+        leafEntries.push_back(packExtent(extent));
+    }
+    std::vector<Ext4ExtentIdx> indexEntries;
+    uint16_t depth = 0;
+    for (size_t level = 0; level < levelNodes.size(); ++level) {
+        std::vector<Ext4ExtentIdx> parents;
+        size_t count = depth == 0 ? leafEntries.size() : indexEntries.size();
+        for (size_t first = 0; first < count; first += capacity) {
+            size_t n = std::min<size_t>(capacity, count - first);
+            std::fill(node.begin(), node.end(), 0);
+            uint32_t firstLogical;
+            if (depth == 0) {
+                buildNode(node.data(), capacity, depth, leafEntries.data() + first, n);
+                firstLogical = leafEntries[first].ee_block;
+            } else {
+                buildNode(node.data(), capacity, depth, indexEntries.data() + first, n);
+                firstLogical = indexEntries[first].ei_block;
+            }
+            uint64_t block = nodes[nextNode++];
+            if (!cache->write(block * blockSize, node.data(), blockSize)) {
+                return false;
+            }
+            Ext4ExtentIdx idx = {firstLogical, static_cast<uint32_t>(block), static_cast<uint16_t>(block >> 32), 0};
+            parents.push_back(idx);
+        }
+        indexEntries.swap(parents);
+        ++depth;
+    }
+
+    // Root
+    std::memset(iBlock, 0, 15 * sizeof(uint32_t));
+    char *root = reinterpret_cast<char *>(iBlock);
+    if (depth == 0) {
+        buildNode(root, ROOT_CAPACITY, 0, leafEntries.data(), leafEntries.size());
+    } else {
+        buildNode(root, ROOT_CAPACITY, depth, indexEntries.data(), indexEntries.size());
+    }
+
+    for (size_t i = needed; i < oldNodes.size(); ++i) {
+        releaseNode(oldNodes[i]);
+    }
+    return true;
+}
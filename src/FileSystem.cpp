@@ -1,121 +1,2266 @@
 #include "FileSystem.h"
-#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <sys/mman.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-FileSystem::FileSystem(const std::string &disk)
-    : blockGroup(disk), inode(disk, 0), journal(disk) {}
+const uint32_t FileSystem::ROOT_INODE;
 
-void FileSystem::initialize() {
-    // For simplicity, we'll initialize a dummy disk image with a simple layout
-    std::ofstream diskFile(blockGroup.getDisk(), std::ios::binary | std::ios::trunc);
-    if (!diskFile) {
+namespace {
+// Readahead window bounds, in blocks; the window doubles on every sequential read
+const uint32_t READAHEAD_MIN_BLOCKS = 4;
+const uint32_t READAHEAD_MAX_BLOCKS = 256;
+// Buffered data is written home in chunks of this many blocks
+const uint32_t FLUSH_CHUNK_BLOCKS = 256;
+
+bool isDirectory(const Inode::Ext4Inode &inode) {
+    return (inode.i_mode & Inode::TYPE_MASK) == Inode::DIRECTORY;
+}
+
+bool hasInlineData(const Inode::Ext4Inode &inode) {
+    return (inode.i_flags & Inode::INLINE_DATA_FL) != 0;
+}
+
+char *inlineData(Inode::Ext4Inode &inode) {
+    return reinterpret_cast<char *>(inode.i_block);
+}
+
+// Physically contiguous runs in a logically ordered block map
+uint32_t countRuns(const std::vector<ExtentTree::Extent> &extents) {
+    uint32_t runs = 0;
+    for (size_t i = 0; i < extents.size(); ++i) {
+        if (i == 0 || extents[i].physical != extents[i - 1].physical + extents[i - 1].length) {
+            ++runs;
+        }
+    }
+    return runs;
+}
+
+// Splits a block map into the pieces inside logical blocks [logical,
+// logical + count) and the pieces outside it
+void splitRange(const std::vector<ExtentTree::Extent> &extents, uint32_t logical, uint32_t count,
+                std::vector<ExtentTree::Extent> &outside, std::vector<ExtentTree::Extent> &inside) {
+    uint32_t end = logical + count;
+    for (const auto &extent : extents) {
+        uint32_t extentEnd = extent.logical + extent.length;
+        uint32_t from = std::max(extent.logical, logical);
+        uint32_t to = std::min(extentEnd, end);
+        if (from >= to) {
+            outside.push_back(extent);
+            continue;
+        }
+        if (extent.logical < from) {
+            outside.push_back({extent.logical, extent.physical, from - extent.logical});
+        }
+        inside.push_back({from, extent.physical + (from - extent.logical), to - from});
+        if (to < extentEnd) {
+            outside.push_back({to, extent.physical + (to - extent.logical), extentEnd - to});
+        }
+    }
+}
+
+// The block map with [logical, logical + count) moved to 'target'
+std::vector<ExtentTree::Extent> replaceRange(const std::vector<ExtentTree::Extent> &extents, uint32_t logical,
+                                             uint32_t count, uint64_t target,
+                                             std::vector<ExtentTree::Extent> &replaced) {
+    std::vector<ExtentTree::Extent> result;
+    splitRange(extents, logical, count, result, replaced);
+    result.push_back({logical, target, count});
+    std::sort(result.begin(), result.end(),
+              [](const ExtentTree::Extent &a, const ExtentTree::Extent &b) { return a.logical < b.logical; });
+    return result;
+}
+
+bool sameExtents(const std::vector<ExtentTree::Extent> &a, const std::vector<ExtentTree::Extent> &b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const ExtentTree::Extent &x, const ExtentTree::Extent &y) {
+        return x.logical == y.logical && x.physical == y.physical && x.length == y.length;
+    });
+}
+
+bool validName(const std::string &name) {
+    return !name.empty() && name.size() <= Directory::MAX_NAME_LENGTH && name != "." && name != ".." &&
+           name.find('/') == std::string::npos && name.find('\0') == std::string::npos;
+}
+}
+
+FileSystem::FileSystem(const std::string &disk, const FileSystemOptions &options)
+    : disk(disk),
+      options(options),
+      stats(options.collectStats ? std::make_unique<Stats>() : nullptr),
+      trace(options.traceFile.empty() ? nullptr : std::make_unique<TraceRecorder>(options.traceFile)),
+      device(std::make_shared<BlockDevice>(disk, BlockDevice::DEFAULT_BLOCK_SIZE, options.directIO)),
+      cache(std::make_shared<BufferCache>(device, options.cacheBlocks)),
+      superblock(std::make_unique<Superblock>(cache)),
+      extentTree(cache) {
+    mapImage();
+    mount();
+}
+
+FileSystem::~FileSystem() {
+    unmount();
+}
+
+bool FileSystem::initialize(const MkfsOptions &mkfsOptions) {
+    uint32_t blockSize = mkfsOptions.blockSize;
+    if (blockSize < 1024 || blockSize > 64 * 1024 || (blockSize & (blockSize - 1)) != 0) {
+        std::cerr << "Invalid block size " << blockSize << std::endl;
+        return false;
+    }
+    if (mkfsOptions.inodesPerGroup <= ROOT_INODE || mkfsOptions.inodesPerGroup > 8 * blockSize) {
+        std::cerr << "Invalid number of inodes per group " << mkfsOptions.inodesPerGroup << std::endl;
+        return false;
+    }
+    if (mkfsOptions.journalBlocks < 2 || mkfsOptions.imageSize / blockSize > UINT32_MAX) {
+        std::cerr << "Invalid journal or image size" << std::endl;
+        return false;
+    }
+
+    unmount();
+    openDevice(blockSize);
+    // Truncating to zero and back gives a zero-filled (sparse) image without
+    // writing it out; the bitmaps and inode tables of every group read as zeros
+    if (!device->isOpen() || !device->truncate(0) || !device->truncate(mkfsOptions.imageSize) ||
+        (mkfsOptions.preallocate && !device->allocate(0, mkfsOptions.imageSize))) {
         std::cerr << "Error opening disk file for initialization" << std::endl;
+        return false;
+    }
+    cache->invalidate();
+
+    Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    sb = {};
+    sb.s_magic = Superblock::MAGIC;
+    while ((1024u << sb.s_log_block_size) < blockSize) {
+        ++sb.s_log_block_size;
+    }
+    sb.s_inode_size = sizeof(Inode::Ext4Inode);
+    sb.s_blocks_count = static_cast<uint32_t>(mkfsOptions.imageSize / blockSize);
+    sb.s_blocks_per_group = 8 * blockSize; // one block of block bitmap per group
+    sb.s_inodes_per_group = mkfsOptions.inodesPerGroup;
+    sb.s_journal_blocks = mkfsOptions.journalBlocks;
+    sb.s_mkfs_time = static_cast<uint32_t>(time(nullptr));
+
+    // A last group too small for its own metadata is left out
+    uint32_t groupCount = superblock->getGroupCount();
+    if (groupCount > 1 && superblock->getBlocksInGroup(groupCount - 1) <= superblock->getMetadataBlocks(groupCount - 1)) {
+        sb.s_blocks_count = static_cast<uint32_t>(superblock->getGroupFirstBlock(--groupCount));
+    }
+    if (groupCount == 0 || superblock->getBlocksInGroup(0) <= superblock->getMetadataBlocks(0)) {
+        std::cerr << "Image too small for the file system metadata" << std::endl;
+        return false;
+    }
+    if (static_cast<uint64_t>(groupCount) * sb.s_inodes_per_group > INT32_MAX) {
+        std::cerr << "Too many inodes" << std::endl;
+        return false;
+    }
+    sb.s_inodes_count = groupCount * sb.s_inodes_per_group;
+    sb.s_journal_block = static_cast<uint32_t>(superblock->getInodeTableBlock(0) + superblock->getInodeTableBlocks());
+
+    // The superblock and descriptor table are all mkfs writes; each group
+    // initializes its bitmaps the first time it is loaded
+    std::vector<BlockGroup::Ext4GroupDesc> descs(groupCount);
+    for (uint32_t g = 0; g < groupCount; ++g) {
+        descs[g].bg_block_bitmap = static_cast<uint32_t>(superblock->getBlockBitmapBlock(g));
+        descs[g].bg_inode_bitmap = static_cast<uint32_t>(superblock->getInodeBitmapBlock(g));
+        descs[g].bg_inode_table = static_cast<uint32_t>(superblock->getInodeTableBlock(g));
+        descs[g].bg_flags = BlockGroup::INODE_UNINIT | BlockGroup::BLOCK_UNINIT | BlockGroup::INODE_ZEROED;
+        uint32_t freeBlocks = superblock->getBlocksInGroup(g) - superblock->getMetadataBlocks(g);
+        BlockGroup::setFreeCounts(descs[g], freeBlocks, sb.s_inodes_per_group);
+        BlockGroup::setChecksum(descs[g], g);
+        sb.s_free_blocks_count += freeBlocks;
+    }
+    sb.s_free_inodes_count = sb.s_inodes_count;
+    sb.s_feature_compat |= Superblock::COMPAT_FREE_COUNTS;
+    superblock->writeSuperblockToDisk();
+    if (!cache->write(static_cast<uint64_t>(Superblock::GROUP_DESC_BLOCK) * blockSize, descs.data(),
+                      descs.size() * sizeof(BlockGroup::Ext4GroupDesc)) ||
+        !cache->sync() || !mount()) {
+        std::cerr << "Error writing file system metadata" << std::endl;
+        return false;
+    }
+
+    // Reserve the inode numbers below the root, then create the root directory
+    {
+        std::unique_lock<std::mutex> lock;
+        Group *group = lockGroup(0, lock);
+        for (uint32_t i = 0; group && i < ROOT_INODE; ++i) {
+            group->blockGroup.allocateInode();
+        }
+    }
+    if (createInode(Inode::DIRECTORY | 0755, 0, 0) != static_cast<int>(ROOT_INODE) ||
+        !initDirectory(ROOT_INODE, ROOT_INODE)) {
+        std::cerr << "Error creating root directory" << std::endl;
+        return false;
+    }
+
+    std::cout << "File system initialized." << std::endl;
+    return true;
+}
+
+int FileSystem::createFile(uint16_t mode, uint32_t size) {
+    Stats::Scope scope(stats.get(), Stats::CREATE);
+    TraceRecorder::Event event(trace.get(), Trace::CREATE_FILE, 0, size, 0, mode);
+    checkpointIfNeeded();
+    int inodeNumber = createInode(mode, size, homeGroup());
+    event.setResult(inodeNumber);
+    return inodeNumber;
+}
+
+int FileSystem::createInode(uint16_t mode, uint32_t size, uint32_t firstGroup) {
+    if (groups.empty()) {
+        std::cerr << "File system not initialized" << std::endl;
+        return -1;
+    }
+    // The bitmap, descriptor and inode changes commit together
+    Journal::Handle transaction(*journal);
+
+    // Find and claim a free inode, starting in 'firstGroup'
+    uint32_t groupCount = getGroupCount();
+    Group *group = nullptr;
+    uint32_t groupNumber = 0;
+    int freeInodeIndex = -1;
+    for (uint32_t i = 0; i < groupCount && freeInodeIndex == -1; ++i) {
+        groupNumber = (firstGroup + i) % groupCount;
+        if (groups[groupNumber]->blockGroup.getFreeInodes() == 0) {
+            continue; // full; its bitmaps need not be loaded
+        }
+        std::unique_lock<std::mutex> lock;
+        group = lockGroup(groupNumber, lock);
+        freeInodeIndex = group ? group->blockGroup.allocateInode() : -1;
+        if (freeInodeIndex != -1 && (mode & Inode::TYPE_MASK) == Inode::DIRECTORY) {
+            ++group->blockGroup.getGroupDesc().bg_used_dirs_count;
+            group->blockGroup.writeGroupDescToDisk(groupNumber);
+        }
+    }
+    if (freeInodeIndex == -1) {
+        std::cerr << "No free inodes available" << std::endl;
+        return -1;
+    }
+
+    // Create the inode and give it storage for 'size' bytes, near the inode
+    int inodeNumber = static_cast<int>(groupNumber * getSuperblock().s_inodes_per_group + freeInodeIndex);
+    InodeCache::Handle inode = inodes->create(static_cast<uint32_t>(inodeNumber));
+    Inode::Ext4Inode &fileInode = *inode;
+    Inode::initInode(fileInode, mode, size);
+    if (storesInline(mode, size)) {
+        fileInode.i_flags |= Inode::INLINE_DATA_FL; // the zeroed i_block is its data
+    } else {
+        fileInode.i_flags |= Inode::EXTENTS_FL;
+        ExtentTree::initRoot(fileInode.i_block);
+        uint32_t blockSize = device->getBlockSize();
+        uint32_t blocks = static_cast<uint32_t>((static_cast<uint64_t>(size) + blockSize - 1) / blockSize);
+        if (blocks > 0 && !allocateFileBlocks(fileInode, 0, blocks, groupNumber)) {
+            std::cerr << "No free blocks available" << std::endl;
+            orphanInodes({inode});
+            return -1;
+        }
+    }
+    inode.markDirty();
+
+    std::cout << "File created with inode number: " << inodeNumber << std::endl;
+    return inodeNumber;
+}
+
+void FileSystem::deleteFile(uint32_t inodeNumber) {
+    Stats::Scope scope(stats.get(), Stats::DELETE);
+    TraceRecorder::Event event(trace.get(), Trace::DELETE_FILE, inodeNumber);
+    checkpointIfNeeded();
+    {
+        Journal::Handle transaction(*journal);
+        std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+        InodeCache::Handle inode;
+        if (!loadInode(inodeNumber, inode)) {
+            std::cerr << "Invalid inode number or inode not in use" << std::endl;
+            return;
+        }
+        orphanInodes({inode});
+    }
+    if (!options.deferReclaim) {
+        reclaim();
+    }
+    event.setResult(1);
+
+    std::cout << "File with inode number " << inodeNumber << " deleted." << std::endl;
+}
+
+bool FileSystem::createFiles(uint32_t count, uint16_t mode, uint32_t size, std::vector<uint32_t> &created) {
+    Stats::Scope scope(stats.get(), Stats::CREATE);
+    TraceRecorder::Event event(trace.get(), Trace::CREATE_FILES, 0, size, count, mode);
+    size_t first = created.size();
+    if (groups.empty()) {
+        std::cerr << "File system not initialized" << std::endl;
+        return false;
+    }
+    uint32_t blockSize = device->getBlockSize();
+    bool inlined = storesInline(mode, size);
+    uint32_t blocksPerFile =
+        inlined ? 0 : static_cast<uint32_t>((static_cast<uint64_t>(size) + blockSize - 1) / blockSize);
+    uint32_t firstGroup = homeGroup();
+    created.reserve(created.size() + count);
+
+    uint32_t done = 0;
+    while (done < count) {
+        checkpointIfNeeded();
+        Journal::Handle transaction(*journal);
+        std::vector<uint32_t> inodeNumbers;
+        allocateInodes(std::min(batchInodes(), count - done), (mode & Inode::TYPE_MASK) == Inode::DIRECTORY,
+                       firstGroup, inodeNumbers);
+        if (inodeNumbers.empty()) {
+            std::cerr << "No free inodes available" << std::endl;
+            return false;
+        }
+
+        // The files' storage is cut from as few runs as the free space allows
+        std::vector<InodeCache::Handle> handles;
+        handles.reserve(inodeNumbers.size());
+        uint64_t runStart = 0;
+        uint32_t runLeft = 0;
+        size_t i = 0;
+        for (; i < inodeNumbers.size(); ++i) {
+            uint32_t groupNumber = inodeNumbers[i] / getSuperblock().s_inodes_per_group;
+            std::vector<ExtentTree::Extent> extents;
+            uint32_t logical = 0;
+            while (logical < blocksPerFile) {
+                if (runLeft == 0) {
+                    uint64_t wanted = static_cast<uint64_t>(inodeNumbers.size() - i) * blocksPerFile - logical;
+                    int64_t start = allocateBlocks(static_cast<uint32_t>(std::min<uint64_t>(wanted, UINT32_MAX)), runLeft,
+                                                   runStart, groupNumber);
+                    if (start < 0) {
+                        break;
+                    }
+                    runStart = static_cast<uint64_t>(start);
+                }
+                uint32_t taken = std::min(runLeft, blocksPerFile - logical);
+                extents.push_back({logical, runStart, taken});
+                logical += taken;
+                runStart += taken;
+                runLeft -= taken;
+            }
+
+            InodeCache::Handle inode = inodes->create(inodeNumbers[i]);
+            Inode::initInode(*inode, mode, size);
+            if (inlined) {
+                inode->i_flags |= Inode::INLINE_DATA_FL;
+                handles.push_back(std::move(inode));
+                continue;
+            }
+            inode->i_flags |= Inode::EXTENTS_FL;
+            ExtentTree::initRoot(inode->i_block);
+            if (logical < blocksPerFile || !storeExtents(*inode, extents, groupNumber)) {
+                std::cerr << "No free blocks available" << std::endl;
+                releaseExtents(extents);
+                break;
+            }
+            handles.push_back(std::move(inode));
+        }
+        if (runLeft > 0) {
+            releaseBlocks(runStart, runLeft);
+        }
+        inodes->markDirty(handles);
+        created.insert(created.end(), inodeNumbers.begin(), inodeNumbers.begin() + i);
+        done += static_cast<uint32_t>(i);
+
+        if (i < inodeNumbers.size()) {
+            std::vector<std::pair<uint32_t, bool>> unused;
+            for (size_t k = i; k < inodeNumbers.size(); ++k) {
+                unused.push_back({inodeNumbers[k], (mode & Inode::TYPE_MASK) == Inode::DIRECTORY});
+            }
+            releaseInodeNumbers(unused);
+            event.setInodes(std::vector<uint32_t>(created.begin() + first, created.end()));
+            return false;
+        }
+    }
+    event.setInodes(std::vector<uint32_t>(created.begin() + first, created.end()));
+    event.setResult(1);
+    return true;
+}
+
+bool FileSystem::deleteFiles(const std::vector<uint32_t> &inodeNumbers) {
+    Stats::Scope scope(stats.get(), Stats::DELETE);
+    TraceRecorder::Event event(trace.get(), Trace::DELETE_FILES);
+    event.setInodes(inodeNumbers);
+    std::vector<uint32_t> pending(inodeNumbers);
+    std::sort(pending.begin(), pending.end());
+    pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+    bool ok = true;
+    size_t next = 0;
+    while (next < pending.size()) {
+        checkpointIfNeeded();
+        Journal::Handle transaction(*journal);
+        size_t end = std::min<size_t>(next + batchInodes(), pending.size());
+
+        // Take the chunk's inode locks in stripe order, which cannot deadlock
+        // with other holders of one or two of them
+        std::array<bool, INODE_LOCKS> needed = {};
+        for (size_t i = next; i < end; ++i) {
+            needed[pending[i] % INODE_LOCKS] = true;
+        }
+        std::vector<std::unique_lock<std::shared_mutex>> guards;
+        for (size_t stripe = 0; stripe < INODE_LOCKS; ++stripe) {
+            if (needed[stripe]) {
+                guards.emplace_back(inodeLocks[stripe]);
+            }
+        }
+
+        std::vector<InodeCache::Handle> handles;
+        for (size_t i = next; i < end; ++i) {
+            InodeCache::Handle inode;
+            if (!loadInode(pending[i], inode)) {
+                std::cerr << "Invalid inode number or inode not in use: " << pending[i] << std::endl;
+                ok = false;
+                continue;
+            }
+            handles.push_back(std::move(inode));
+        }
+        orphanInodes(handles);
+        next = end;
+    }
+    if (!options.deferReclaim) {
+        reclaim();
+    }
+    event.setResult(ok ? 1 : -1);
+    return ok;
+}
+
+int FileSystem::clone(uint32_t sourceInode) {
+    Stats::Scope scope(stats.get(), Stats::CLONE);
+    TraceRecorder::Event event(trace.get(), Trace::CLONE, sourceInode);
+    if (groups.empty()) {
+        std::cerr << "File system not initialized" << std::endl;
+        return -1;
+    }
+    checkpointIfNeeded();
+    Journal::Handle transaction(*journal);
+    std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(sourceInode));
+    InodeCache::Handle source;
+    if (!loadInode(sourceInode, source)) {
+        std::cerr << "Invalid inode number or inode not in use" << std::endl;
+        return -1;
+    }
+    if (isDirectory(*source)) {
+        std::cerr << "Is a directory: " << sourceInode << std::endl;
+        return -1;
+    }
+    // Buffered data needs its blocks before they can be shared
+    if (!flushFile(sourceInode, *source)) {
+        return -1;
+    }
+    source.markDirty();
+
+    std::vector<ExtentTree::Extent> extents;
+    if (!hasInlineData(*source) && !extentTree.load(source->i_block, extents)) {
+        return -1;
+    }
+    // The owners are added before the clone is written: should a crash come in
+    // between, the counts are too high, which only keeps the blocks until fsck
+    if (!addReferences(extents)) {
+        return -1;
+    }
+    uint32_t groupNumber = sourceInode / getSuperblock().s_inodes_per_group;
+    int cloneNumber = createInode(source->i_mode, 0, groupNumber);
+    InodeCache::Handle copy;
+    if (cloneNumber < 0 || !loadInode(static_cast<uint32_t>(cloneNumber), copy)) {
+        releaseExtents(extents); // drops the owners added above
+        return -1;
+    }
+    // Nobody else knows the new inode number yet, so it needs no lock
+    uint16_t links = copy->i_links_count;
+    *copy = *source;
+    copy->i_links_count = links;
+    if (!extents.empty()) {
+        ExtentTree::initRoot(copy->i_block);
+        if (!storeExtents(*copy, extents, groupNumber)) {
+            ExtentTree::initRoot(copy->i_block);
+            copy->i_blocks = 0;
+            orphanInodes({copy});
+            releaseExtents(extents);
+            return -1;
+        }
+        copy->i_flags |= Inode::SHARED_FL;
+        source->i_flags |= Inode::SHARED_FL;
+    }
+    copy.markDirty();
+    source.markDirty();
+    event.setResult(cloneNumber);
+    return cloneNumber;
+}
+
+int FileSystem::lookup(uint32_t parent, const std::string &name) {
+    TraceRecorder::Event event(trace.get(), Trace::LOOKUP, parent);
+    event.setName(name);
+    int inodeNumber = lookupEntry(parent, name);
+    event.setResult(inodeNumber);
+    return inodeNumber;
+}
+
+int FileSystem::lookupEntry(uint32_t parent, const std::string &name) {
+    std::shared_lock<std::shared_mutex> parentGuard(inodeLock(parent));
+    InodeCache::Handle parentInode;
+    if (!loadInode(parent, parentInode) || !isDirectory(*parentInode)) {
+        std::cerr << "Not a directory: " << parent << std::endl;
+        return -1;
+    }
+    uint32_t inodeNumber;
+    if (!openDirectory(*parentInode).lookup(name, inodeNumber)) {
+        return -1;
+    }
+    return static_cast<int>(inodeNumber);
+}
+
+int FileSystem::create(uint32_t parent, const std::string &name, uint16_t mode) {
+    Stats::Scope scope(stats.get(), Stats::CREATE);
+    TraceRecorder::Event event(trace.get(), Trace::CREATE, parent, 0, 0, mode);
+    event.setName(name);
+    if (!validName(name)) {
+        std::cerr << "Invalid file name: " << name << std::endl;
+        return -1;
+    }
+    bool makeDirectory = (mode & Inode::TYPE_MASK) == Inode::DIRECTORY;
+    if ((mode & Inode::TYPE_MASK) == 0) {
+        mode |= Inode::REGULAR_FILE;
+    }
+
+    checkpointIfNeeded();
+    // The inode, its directory block and the entry commit together. The new
+    // inode is not reachable until its entry is added, so it needs no lock.
+    Journal::Handle transaction(*journal);
+    std::unique_lock<std::shared_mutex> parentGuard(inodeLock(parent));
+    InodeCache::Handle parentInode;
+    if (!loadInode(parent, parentInode) || !isDirectory(*parentInode)) {
+        std::cerr << "Not a directory: " << parent << std::endl;
+        return -1;
+    }
+    Directory directory = openDirectory(*parentInode);
+    uint32_t existing;
+    if (directory.lookup(name, existing)) {
+        std::cerr << "File exists: " << name << std::endl;
+        return -1;
+    }
+
+    int created = createInode(mode, 0, homeGroup());
+    if (created < 0) {
+        return -1;
+    }
+    uint32_t child = static_cast<uint32_t>(created);
+    if ((makeDirectory && !initDirectory(child, parent)) ||
+        !directory.add(name, child, makeDirectory ? Directory::FT_DIR : Directory::FT_REG_FILE)) {
+        InodeCache::Handle childInode;
+        if (loadInode(child, childInode)) {
+            orphanInodes({childInode});
+        }
+        return -1;
+    }
+
+    if (makeDirectory) {
+        ++parentInode->i_links_count; // the child's ".."
+    }
+    parentInode->i_mtime = static_cast<uint32_t>(time(nullptr));
+    parentInode.markDirty();
+    event.setResult(created);
+    return created;
+}
+
+bool FileSystem::unlink(uint32_t parent, const std::string &name) {
+    Stats::Scope scope(stats.get(), Stats::DELETE);
+    TraceRecorder::Event event(trace.get(), Trace::UNLINK, parent);
+    event.setName(name);
+    if (!validName(name)) {
+        std::cerr << "Invalid file name: " << name << std::endl;
+        return false;
+    }
+    for (;;) {
+        int found = lookupEntry(parent, name);
+        if (found < 0) {
+            std::cerr << "No such file: " << name << std::endl;
+            return false;
+        }
+        uint32_t child = static_cast<uint32_t>(found);
+        checkpointIfNeeded();
+        // The entry's removal, the parent's update and the orphaning commit
+        // together
+        Journal::Handle transaction(*journal);
+
+        // Both inodes are locked together, so take the locks at once and then
+        // check that the name still refers to the same inode
+        std::unique_lock<std::shared_mutex> parentGuard(inodeLock(parent), std::defer_lock);
+        std::unique_lock<std::shared_mutex> childGuard;
+        if (&inodeLock(child) == &inodeLock(parent)) {
+            parentGuard.lock();
+        } else {
+            childGuard = std::unique_lock<std::shared_mutex>(inodeLock(child), std::defer_lock);
+            std::lock(parentGuard, childGuard);
+        }
+
+        InodeCache::Handle parentInode;
+        if (!loadInode(parent, parentInode) || !isDirectory(*parentInode)) {
+            return false;
+        }
+        Directory directory = openDirectory(*parentInode);
+        uint32_t current;
+        if (!directory.lookup(name, current)) {
+            std::cerr << "No such file: " << name << std::endl;
+            return false;
+        }
+        if (current != child) {
+            continue; // replaced in the meantime
+        }
+
+        InodeCache::Handle childInode;
+        if (!loadInode(child, childInode)) {
+            return false;
+        }
+        bool removingDirectory = isDirectory(*childInode);
+        if (removingDirectory && !openDirectory(*childInode).isEmpty()) {
+            std::cerr << "Directory not empty: " << name << std::endl;
+            return false;
+        }
+        if (!directory.remove(name)) {
+            return false;
+        }
+        if (removingDirectory) {
+            --parentInode->i_links_count;
+        }
+        parentInode->i_mtime = static_cast<uint32_t>(time(nullptr));
+        parentInode.markDirty();
+        orphanInodes({childInode});
+        break;
+    }
+    if (!options.deferReclaim) {
+        reclaim();
+    }
+    event.setResult(1);
+    return true;
+}
+
+bool FileSystem::listDirectory(uint32_t directory, std::vector<Directory::Entry> &entries) {
+    TraceRecorder::Event event(trace.get(), Trace::LIST_DIRECTORY, directory);
+    std::shared_lock<std::shared_mutex> guard(inodeLock(directory));
+    InodeCache::Handle dirInode;
+    if (!loadInode(directory, dirInode) || !isDirectory(*dirInode)) {
+        std::cerr << "Not a directory: " << directory << std::endl;
+        return false;
+    }
+    bool ok = openDirectory(*dirInode).list(entries);
+    event.setResult(ok ? static_cast<int64_t>(entries.size()) : -1);
+    return ok;
+}
+
+int64_t FileSystem::read(uint32_t inodeNumber, uint64_t offset, char *buffer, size_t length) {
+    Stats::Scope scope(stats.get(), Stats::READ);
+    TraceRecorder::Event event(trace.get(), Trace::READ, inodeNumber, offset, length);
+    std::shared_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+    InodeCache::Handle inode;
+    if (!loadInode(inodeNumber, inode)) {
+        std::cerr << "Invalid inode number or inode not in use" << std::endl;
+        return -1;
+    }
+    const Inode::Ext4Inode &fileInode = *inode;
+    const DirtyFile *file = findDirty(inodeNumber);
+    uint64_t size = file ? std::max<uint64_t>(fileInode.i_size, file->size) : fileInode.i_size;
+    if (offset >= size) {
+        event.setResult(0);
+        return 0;
+    }
+    length = static_cast<size_t>(std::min<uint64_t>(length, size - offset));
+
+    bool inlined = hasInlineData(fileInode);
+    if (inlined) {
+        size_t stored = offset < Inode::INLINE_DATA_SIZE
+                            ? static_cast<size_t>(std::min<uint64_t>(length, Inode::INLINE_DATA_SIZE - offset))
+                            : 0;
+        std::memcpy(buffer, reinterpret_cast<const char *>(fileInode.i_block) + offset, stored);
+        std::memset(buffer + stored, 0, length - stored);
+    } else if (!transferData(fileInode, offset, buffer, length, false)) {
+        return -1;
+    }
+    if (file) {
+        // Buffered pages lie past the allocated blocks, which read as zeros above
+        uint32_t blockSize = device->getBlockSize();
+        auto page = file->pages.lower_bound(static_cast<uint32_t>(offset / blockSize));
+        for (; page != file->pages.end() && static_cast<uint64_t>(page->first) * blockSize < offset + length; ++page) {
+            uint64_t pageStart = static_cast<uint64_t>(page->first) * blockSize;
+            uint64_t from = std::max(pageStart, offset);
+            uint64_t to = std::min<uint64_t>(pageStart + blockSize, offset + length);
+            std::memcpy(buffer + (from - offset), page->second.data() + (from - pageStart), to - from);
+        }
+    }
+    if (!inlined) {
+        updateReadahead(fileInode, inodeNumber, offset, length);
+    }
+    event.setResult(static_cast<int64_t>(length));
+    return static_cast<int64_t>(length);
+}
+
+int64_t FileSystem::write(uint32_t inodeNumber, uint64_t offset, const char *buffer, size_t length) {
+    Stats::Scope scope(stats.get(), Stats::WRITE);
+    TraceRecorder::Event event(trace.get(), Trace::WRITE, inodeNumber, offset, length);
+    checkpointIfNeeded();
+    Journal::Handle transaction(*journal);
+    std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+    InodeCache::Handle inode;
+    if (!loadInode(inodeNumber, inode)) {
+        std::cerr << "Invalid inode number or inode not in use" << std::endl;
+        return -1;
+    }
+    Inode::Ext4Inode &fileInode = *inode;
+    if (isDirectory(fileInode)) {
+        std::cerr << "Is a directory: " << inodeNumber << std::endl;
+        return -1;
+    }
+    if (defragInode.load(std::memory_order_relaxed) == inodeNumber) {
+        defragRaced.store(true, std::memory_order_relaxed); // the copy in progress is stale
+    }
+    if (offset + length > UINT32_MAX) {
+        std::cerr << "Write past the maximum file size" << std::endl;
+        return -1;
+    }
+
+    // An inline file takes writes that still fit into its inode. Once it
+    // outgrows it, its bytes join the buffered pages and it stays inline on disk
+    // until the flush that gives it blocks.
+    if (hasInlineData(fileInode) && !findDirty(inodeNumber)) {
+        if (offset + length <= Inode::INLINE_DATA_SIZE) {
+            std::memcpy(inlineData(fileInode) + offset, buffer, length);
+            fileInode.i_size = std::max<uint32_t>(fileInode.i_size, static_cast<uint32_t>(offset + length));
+            fileInode.i_mtime = static_cast<uint32_t>(time(nullptr));
+            inode.markDirty();
+            event.setResult(static_cast<int64_t>(length));
+            return static_cast<int64_t>(length);
+        }
+        if (fileInode.i_size > 0 && !bufferData(inodeNumber, 0, 0, inlineData(fileInode), fileInode.i_size)) {
+            return -1;
+        }
+    }
+
+    // Allocated blocks are overwritten in place; the rest of the range is
+    // buffered until the file is flushed
+    uint32_t blockSize = device->getBlockSize();
+    uint32_t mappedBlocks = this->mappedBlocks(fileInode);
+    uint64_t mappedBytes = static_cast<uint64_t>(mappedBlocks) * blockSize;
+    size_t inPlace = offset < mappedBytes ? static_cast<size_t>(std::min<uint64_t>(length, mappedBytes - offset)) : 0;
+    if (inPlace > 0) {
+        if ((fileInode.i_flags & Inode::SHARED_FL) && !unshareBlocks(inodeNumber, fileInode, offset, inPlace)) {
+            return -1;
+        }
+        if (!transferData(fileInode, offset, const_cast<char *>(buffer), inPlace, true)) {
+            return -1;
+        }
+        fileInode.i_size = std::max<uint32_t>(fileInode.i_size, static_cast<uint32_t>(offset + inPlace));
+    }
+    if (inPlace < length && !bufferData(inodeNumber, mappedBlocks, offset + inPlace, buffer + inPlace, length - inPlace)) {
+        return -1;
+    }
+    fileInode.i_mtime = static_cast<uint32_t>(time(nullptr));
+
+    // Over the limit, the writer pays for flushing its own file and the
+    // writeback thread takes care of the others
+    bool overLimit;
+    {
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        overLimit = dirtyBytes > options.dirtyLimit;
+    }
+    if (overLimit) {
+        if (!flushFile(inodeNumber, fileInode)) {
+            std::cerr << "Error flushing file " << inodeNumber << std::endl;
+        }
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        if (dirtyBytes > options.dirtyLimit) {
+            writebackRequested = true;
+            writebackWanted.notify_one();
+        }
+    }
+    inode.markDirty();
+    event.setResult(static_cast<int64_t>(length));
+    return static_cast<int64_t>(length);
+}
+
+bool FileSystem::fsync(uint32_t inodeNumber) {
+    TraceRecorder::Event event(trace.get(), Trace::FSYNC, inodeNumber);
+    {
+        Journal::Handle transaction(*journal);
+        std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+        InodeCache::Handle inode;
+        if (!loadInode(inodeNumber, inode)) {
+            std::cerr << "Invalid inode number or inode not in use" << std::endl;
+            return false;
+        }
+        if (!flushFile(inodeNumber, *inode)) {
+            return false;
+        }
+        inode.markDirty();
+    }
+    // The commit's fdatasync covers the data written above; do one anyway
+    // for overwrites, which commit nothing
+    bool ok = journal->flush() && device->sync();
+    event.setResult(ok ? 1 : -1);
+    return ok;
+}
+
+void FileSystem::sync() {
+    TraceRecorder::Event event(trace.get(), Trace::SYNC);
+    if (journal && (!flushAll() || !reclaim() || !checkpoint())) {
+        std::cerr << "Error syncing disk file" << std::endl;
         return;
     }
+    event.setResult(1);
+}
 
-    // Initialize with zeroed-out data
-    char zero = 0;
-    for (int i = 0; i < 1024 * 1024; ++i) { // 1MB of disk space
-        diskFile.write(&zero, sizeof(zero));
+bool FileSystem::reclaim() {
+    if (!journal) {
+        return false;
     }
+    bool ok = true;
+    while (reclaimBatch(ok) > 0) {
+    }
+    return ok;
+}
+
+size_t FileSystem::getOrphanCount() const {
+    std::lock_guard<std::mutex> lock(orphanMutex);
+    return orphans.size();
+}
+
+bool FileSystem::statfs(StatFs &result) const {
+    if (!isMounted()) {
+        return false;
+    }
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    result.blockSize = superblock->getBlockSize();
+    result.blocks = sb.s_blocks_count;
+    result.freeBlocks = freeTotals.blocks.load(std::memory_order_relaxed);
+    result.inodes = sb.s_inodes_count;
+    result.freeInodes = freeTotals.inodes.load(std::memory_order_relaxed);
+    return true;
+}
 
-    // Initialize a block group descriptor
-    BlockGroup::Ext4GroupDesc bgDesc = {};
-    bgDesc.bg_block_bitmap = 1; // Let's assume block bitmap starts at block 1
-    bgDesc.bg_inode_bitmap = 2; // Inode bitmap starts at block 2
-    bgDesc.bg_inode_table = 3; // Inode table starts at block 3
+bool FileSystem::stat(uint32_t inodeNumber, Inode::Ext4Inode &result) {
+    TraceRecorder::Event event(trace.get(), Trace::STAT, inodeNumber);
+    bool ok = statInode(inodeNumber, result);
+    event.setResult(ok ? 1 : -1);
+    return ok;
+}
 
-    blockGroup.getGroupDesc() = bgDesc;
-    blockGroup.writeGroupDescToDisk(0);
+bool FileSystem::statInode(uint32_t inodeNumber, Inode::Ext4Inode &result) {
+    std::shared_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+    InodeCache::Handle inode;
+    if (!loadInode(inodeNumber, inode)) {
+        return false;
+    }
+    result = *inode;
+    if (const DirtyFile *file = findDirty(inodeNumber)) {
+        result.i_size = static_cast<uint32_t>(std::max<uint64_t>(result.i_size, file->size));
+    }
+    return true;
+}
 
-    // Initialize the bitmaps
-    std::vector<bool> blockBitmap(1024, false); // Assuming 1024 blocks
-    std::vector<bool> inodeBitmap(256, false); // Assuming 256 inodes
+bool FileSystem::getExtents(uint32_t inodeNumber, std::vector<ExtentTree::Extent> &extents) {
+    Inode::Ext4Inode fileInode;
+    if (!statInode(inodeNumber, fileInode)) {
+        return false;
+    }
+    if (hasInlineData(fileInode)) {
+        extents.clear();
+        return true;
+    }
+    return extentTree.load(fileInode.i_block, extents);
+}
 
-    std::ofstream blockBitmapFile(blockGroup.getDisk(), std::ios::binary | std::ios::in | std::ios::out);
-    if (blockBitmapFile) {
-        blockBitmapFile.seekp(1024, std::ios::beg); // Block 1
-        for (auto bit : blockBitmap) {
-            blockBitmapFile.write(reinterpret_cast<char*>(&bit), sizeof(bit));
+bool FileSystem::getFragmentation(uint32_t inodeNumber, Fragmentation &result) {
+    std::vector<ExtentTree::Extent> extents;
+    if (!loadFileExtents(inodeNumber, extents)) {
+        return false;
+    }
+    result = fragmentation(extents);
+    return true;
+}
+
+bool FileSystem::defragment(const DefragOptions &defragOptions, DefragReport &report) {
+    if (groups.empty()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(defragMutex);
+    CopyPacer pacer;
+    uint32_t inodesPerGroup = getSuperblock().s_inodes_per_group;
+    bool ok = true;
+    for (uint32_t g = 0; g < getGroupCount(); ++g) {
+        if (groups[g]->blockGroup.getFreeInodes() == inodesPerGroup) {
+            continue; // nothing in it; its bitmaps need not be loaded
+        }
+        std::vector<uint32_t> inUse;
+        {
+            std::unique_lock<std::mutex> groupLock;
+            Group *group = lockGroup(g, groupLock);
+            for (uint32_t i = 0; group && i < inodesPerGroup; ++i) {
+                if (group->blockGroup.getInodeBitmap().test(i) && g * inodesPerGroup + i >= ROOT_INODE) {
+                    inUse.push_back(g * inodesPerGroup + i);
+                }
+            }
         }
+        for (uint32_t inodeNumber : inUse) {
+            ok = defragmentInode(inodeNumber, defragOptions, report, pacer) && ok;
+        }
+    }
+    return ok;
+}
 
-        blockBitmapFile.seekp(2048, std::ios::beg); // Block 2
-        for (auto bit : inodeBitmap) {
-            blockBitmapFile.write(reinterpret_cast<char*>(&bit), sizeof(bit));
+bool FileSystem::defragmentFile(uint32_t inodeNumber, const DefragOptions &defragOptions, DefragReport &report) {
+    std::lock_guard<std::mutex> lock(defragMutex);
+    CopyPacer pacer;
+    return defragmentInode(inodeNumber, defragOptions, report, pacer);
+}
+
+void FileSystem::CopyPacer::pace(size_t copied, uint64_t bytesPerSecond) {
+    bytes += copied;
+    if (bytesPerSecond > 0) {
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                  std::chrono::duration<double>(static_cast<double>(bytes) / bytesPerSecond)));
+    }
+}
+
+// A regular file's block map (and its flags), read under its lock
+bool FileSystem::loadFileExtents(uint32_t inodeNumber, std::vector<ExtentTree::Extent> &extents, uint32_t *flags) {
+    std::shared_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+    InodeCache::Handle inode;
+    if (!loadInode(inodeNumber, inode) || isDirectory(*inode) || !(inode->i_flags & Inode::EXTENTS_FL)) {
+        return false;
+    }
+    if (flags) {
+        *flags = inode->i_flags;
+    }
+    extents.clear();
+    return extentTree.load(inode->i_block, extents);
+}
+
+Fragmentation FileSystem::fragmentation(const std::vector<ExtentTree::Extent> &extents) const {
+    Fragmentation result;
+    for (const auto &extent : extents) {
+        result.blocks += extent.length;
+    }
+    result.fragments = countRuns(extents);
+    // Group 0 has the most metadata, so its free stretch is the shortest
+    uint32_t longestRun = getSuperblock().s_blocks_per_group - superblock->getMetadataBlocks(0);
+    result.ideal = (result.blocks + longestRun - 1) / longestRun;
+    return result;
+}
+
+// Moves a fragmented file into fewer runs, one segment at a time. Each segment
+// takes the longest run the allocator gives for the rest of the file, after
+// the previous segment's run when that is free. A segment that would not
+// reduce the file's runs is left in place.
+bool FileSystem::defragmentInode(uint32_t inodeNumber, const DefragOptions &defragOptions, DefragReport &report,
+                                 CopyPacer &pacer) {
+    std::vector<ExtentTree::Extent> extents;
+    uint32_t flags = 0;
+    if (!loadFileExtents(inodeNumber, extents, &flags)) {
+        return true; // not a file with blocks
+    }
+    ++report.filesScanned;
+    Fragmentation before = fragmentation(extents);
+    if (before.fragments <= before.ideal) {
+        return true;
+    }
+    ++report.filesFragmented;
+    report.fragmentsBefore += before.fragments;
+    // Holes would be filled by the copy, and shared blocks unshared
+    bool skip = flags & Inode::SHARED_FL;
+    for (size_t i = 0; !skip && i < extents.size(); ++i) {
+        skip = extents[i].logical != (i == 0 ? 0 : extents[i - 1].logical + extents[i - 1].length);
+    }
+    if (skip) {
+        ++report.filesSkipped;
+        report.fragmentsAfter += before.fragments;
+        return true;
+    }
+
+    uint32_t preferredGroup = inodeNumber / getSuperblock().s_inodes_per_group;
+    uint32_t end = extents.back().logical + extents.back().length;
+    uint64_t goal = 0;
+    bool improved = false;
+    bool abandoned = false;
+    for (uint32_t logical = 0; logical < end;) {
+        uint32_t allocated = 0;
+        int64_t start;
+        {
+            Journal::Handle transaction(*journal);
+            start = allocateBlocks(end - logical, allocated, goal, preferredGroup);
+            if (start >= 0) {
+                setDefragRun(static_cast<uint64_t>(start), allocated);
+            }
+        }
+        if (start < 0) {
+            break; // no free space left
+        }
+        std::vector<ExtentTree::Extent> replaced;
+        if (countRuns(replaceRange(extents, logical, allocated, static_cast<uint64_t>(start), replaced)) >=
+            countRuns(extents)) {
+            {
+                Journal::Handle transaction(*journal);
+                releaseBlocks(static_cast<uint64_t>(start), allocated);
+                setDefragRun(0, 0);
+            }
+            // Keep the extent at 'logical' where it is
+            for (const auto &extent : extents) {
+                if (extent.logical + extent.length > logical) {
+                    logical = extent.logical + extent.length;
+                    break;
+                }
+            }
+            goal = 0;
+            continue;
+        }
+        if (!moveSegment(inodeNumber, extents, logical, allocated, static_cast<uint64_t>(start), defragOptions,
+                         pacer)) {
+            abandoned = true;
+            break;
+        }
+        improved = true;
+        report.blocksMoved += allocated;
+        logical += allocated;
+        goal = static_cast<uint64_t>(start) + allocated;
+        if (!loadFileExtents(inodeNumber, extents)) {
+            abandoned = true;
+            break;
         }
     }
 
-    std::cout << "File system initialized." << std::endl;
+    report.filesImproved += improved ? 1 : 0;
+    report.filesSkipped += abandoned ? 1 : 0;
+    std::vector<ExtentTree::Extent> after;
+    report.fragmentsAfter += loadFileExtents(inodeNumber, after) ? countRuns(after) : 0;
+    return true;
 }
 
-void FileSystem::createFile(uint16_t mode, uint32_t size) {
-    // Find a free inode
-    std::vector<bool> inodeBitmap(256, false); // Assuming 256 inodes
-    blockGroup.readGroupDescFromDisk(0);
-    
-    std::ifstream inodeBitmapFile(blockGroup.getDisk(), std::ios::binary);
-    if (inodeBitmapFile) {
-        inodeBitmapFile.seekg(2048, std::ios::beg); // Block 2
-        for (auto &bit : inodeBitmap) {
-            inodeBitmapFile.read(reinterpret_cast<char*>(&bit), sizeof(bit));
+// Copies logical blocks [logical, logical + count) to the run at 'target',
+// which setDefragRun() recorded, and switches the block map to the copy in
+// one transaction that frees the old blocks. The copy takes the file's lock
+// shared, one chunk at a time, so readers go on and a writer waits for one
+// chunk at most. A write to the file in between, or a change to the range's
+// mapping, abandons the copy and frees the run.
+bool FileSystem::moveSegment(uint32_t inodeNumber, const std::vector<ExtentTree::Extent> &extents, uint32_t logical,
+                             uint32_t count, uint64_t target, const DefragOptions &defragOptions, CopyPacer &pacer) {
+    uint32_t blockSize = device->getBlockSize();
+    uint32_t chunkBlocks = static_cast<uint32_t>(std::max<size_t>(defragOptions.chunkBytes / blockSize, 1));
+    std::vector<char> buffer(static_cast<size_t>(std::min(count, chunkBlocks)) * blockSize);
+    defragRaced.store(false, std::memory_order_relaxed);
+    defragInode.store(inodeNumber, std::memory_order_relaxed);
+    bool copied = true;
+    for (uint32_t done = 0; copied && done < count;) {
+        uint32_t blocks = std::min(chunkBlocks, count - done);
+        size_t bytes = static_cast<size_t>(blocks) * blockSize;
+        {
+            std::shared_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+            InodeCache::Handle inode;
+            std::vector<IoEngine::Request> write = {{true, (target + done) * blockSize, buffer.data(), bytes, false}};
+            copied = !defragRaced.load(std::memory_order_relaxed) && loadInode(inodeNumber, inode) &&
+                     transferData(*inode, static_cast<uint64_t>(logical + done) * blockSize, buffer.data(), bytes, false) &&
+                     device->io().submitAndWait(write);
         }
+        done += blocks;
+        pacer.pace(bytes, defragOptions.bytesPerSecond);
     }
 
-    int freeInodeIndex = blockGroup.findFreeInode(inodeBitmap);
-    if (freeInodeIndex == -1) {
-        std::cerr << "No free inodes available" << std::endl;
+    bool moved = false;
+    {
+        checkpointIfNeeded();
+        Journal::Handle transaction(*journal);
+        std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+        InodeCache::Handle inode;
+        std::vector<ExtentTree::Extent> current;
+        std::vector<ExtentTree::Extent> outside, inside, expected;
+        splitRange(extents, logical, count, outside, expected);
+        outside.clear();
+        if (copied && !defragRaced.load(std::memory_order_relaxed) && loadInode(inodeNumber, inode) &&
+            extentTree.load(inode->i_block, current)) {
+            splitRange(current, logical, count, outside, inside);
+            std::vector<ExtentTree::Extent> replaced;
+            std::vector<ExtentTree::Extent> updated = replaceRange(current, logical, count, target, replaced);
+            if (sameExtents(inside, expected) &&
+                storeExtents(*inode, updated, inodeNumber / getSuperblock().s_inodes_per_group)) {
+                inode.markDirty();
+                releaseExtents(replaced);
+                moved = true;
+            }
+        }
+        if (!moved) {
+            releaseBlocks(target, count);
+        }
+        setDefragRun(0, 0);
+    }
+    defragInode.store(0, std::memory_order_relaxed);
+    return moved;
+}
+
+// Records the run being filled by a defragmentation, or clears it; the caller
+// holds a transaction
+void FileSystem::setDefragRun(uint64_t firstBlock, uint32_t count) {
+    std::lock_guard<std::mutex> lock(orphanMutex);
+    Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    sb.s_defrag_block = static_cast<uint32_t>(firstBlock);
+    sb.s_defrag_blocks = count;
+    superblock->writeSuperblockToDisk();
+}
+
+// Moves a byte range between the caller's buffer and the file's blocks. Each
+// extent covered by the range becomes one request, so a contiguous file is
+// transferred with a single large I/O and a fragmented one with all of its
+// extents in flight at once. Reads of unmapped blocks return zeros.
+bool FileSystem::transferData(const Inode::Ext4Inode &fileInode, uint64_t offset, char *buffer, size_t length, bool isWrite) {
+    uint32_t blockSize = device->getBlockSize();
+    std::vector<IoEngine::Request> requests;
+    while (length > 0) {
+        uint32_t logical = static_cast<uint32_t>(offset / blockSize);
+        uint32_t inBlock = static_cast<uint32_t>(offset % blockSize);
+
+        ExtentTree::Extent extent;
+        if (!extentTree.lookup(fileInode.i_block, logical, extent)) {
+            if (isWrite) {
+                std::cerr << "Write to unmapped block " << logical << std::endl;
+                return false;
+            }
+            size_t chunk = std::min<size_t>(length, blockSize - inBlock);
+            std::memset(buffer, 0, chunk);
+            buffer += chunk;
+            offset += chunk;
+            length -= chunk;
+            continue;
+        }
+
+        uint64_t extentEnd = static_cast<uint64_t>(extent.logical + extent.length) * blockSize;
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(length, extentEnd - offset));
+        uint64_t diskOffset = (extent.physical + (logical - extent.logical)) * blockSize + inBlock;
+        requests.push_back({isWrite, diskOffset, buffer, chunk, false});
+        buffer += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return requests.empty() || device->io().submitAndWait(requests);
+}
+
+// A read that starts where the previous one ended is sequential: double the
+// window and ask the kernel to prefetch the blocks beyond it. Any other read
+// resets the window.
+void FileSystem::updateReadahead(const Inode::Ext4Inode &fileInode, uint32_t inodeNumber, uint64_t offset, size_t length) {
+    std::lock_guard<std::mutex> lock(readaheadMutex);
+    ReadaheadState &state = readahead[inodeNumber];
+    uint64_t end = offset + length;
+    bool sequential = offset == state.nextOffset && offset != 0;
+    state.nextOffset = end;
+    if (!sequential) {
+        state.window = READAHEAD_MIN_BLOCKS;
+        state.prefetchedTo = end;
         return;
     }
+    state.window = std::min(state.window * 2, READAHEAD_MAX_BLOCKS);
 
-    inodeBitmap[freeInodeIndex] = true;
-    std::ofstream inodeBitmapOutFile(blockGroup.getDisk(), std::ios::binary | std::ios::in | std::ios::out);
-    if (inodeBitmapOutFile) {
-        inodeBitmapOutFile.seekp(2048, std::ios::beg); // Block 2
-        for (auto bit : inodeBitmap) {
-            inodeBitmapOutFile.write(reinterpret_cast<char*>(&bit), sizeof(bit));
+    uint32_t blockSize = device->getBlockSize();
+    uint64_t target = std::min<uint64_t>(end + static_cast<uint64_t>(state.window) * blockSize, fileInode.i_size);
+    uint64_t from = std::max(state.prefetchedTo, end);
+    while (from < target) {
+        uint32_t logical = static_cast<uint32_t>(from / blockSize);
+        ExtentTree::Extent extent;
+        if (!extentTree.lookup(fileInode.i_block, logical, extent)) {
+            break;
         }
+        uint64_t extentEnd = std::min<uint64_t>(static_cast<uint64_t>(extent.logical + extent.length) * blockSize, target);
+        uint64_t diskOffset = (extent.physical + (logical - extent.logical)) * blockSize;
+        uint64_t alignedFrom = static_cast<uint64_t>(logical) * blockSize;
+        device->readahead(diskOffset, extentEnd - alignedFrom);
+        from = extentEnd;
     }
+    state.prefetchedTo = std::max(state.prefetchedTo, from);
+}
 
-    // Create the inode
-    inode.createInode(mode, size);
-    inode.writeInodeToDisk(freeInodeIndex);
+bool FileSystem::storesInline(uint16_t mode, uint32_t size) const {
+    return options.inlineData && (mode & Inode::TYPE_MASK) != Inode::DIRECTORY && size <= Inode::INLINE_DATA_SIZE;
+}
 
-    std::cout << "File created with inode number: " << freeInodeIndex << std::endl;
+// Blocks mapped from the start of the file, past which writes are buffered
+uint32_t FileSystem::mappedBlocks(const Inode::Ext4Inode &fileInode) {
+    if (hasInlineData(fileInode)) {
+        return 0;
+    }
+    std::vector<ExtentTree::Extent> extents;
+    extentTree.load(fileInode.i_block, extents);
+    return extents.empty() ? 0 : extents.back().logical + extents.back().length;
 }
 
-void FileSystem::deleteFile(uint32_t inodeNumber) {
-    // Read the inode bitmap
-    std::vector<bool> inodeBitmap(256, false); // Assuming 256 inodes
+// Copies a write that lies past the file's 'mappedBlocks' allocated blocks into
+// its dirty pages. The blocks the flush will need are reserved now, so running
+// out of space is reported here rather than lost at flush time.
+bool FileSystem::bufferData(uint32_t inodeNumber, uint32_t mappedBlocks, uint64_t offset, const char *buffer,
+                            size_t length) {
+    uint32_t blockSize = device->getBlockSize();
+    uint32_t firstPage = static_cast<uint32_t>(offset / blockSize);
+    uint32_t lastPage = static_cast<uint32_t>((offset + length - 1) / blockSize);
+    DirtyFile *file;
+    {
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        file = &dirty[inodeNumber];
+        uint32_t blocks = std::max(file->blocks, lastPage + 1 - mappedBlocks);
+        uint64_t reserving = blocks - file->blocks;
+        if (reserving > 0 && freeTotals.blocks.load(std::memory_order_relaxed) < reservedBlocks + reserving) {
+            if (file->pages.empty()) {
+                dirty.erase(inodeNumber);
+            }
+            std::cerr << "No free blocks available" << std::endl;
+            return false;
+        }
+        reservedBlocks += reserving;
+        file->blocks = blocks;
+        file->size = std::max(file->size, offset + length);
+        for (uint32_t page = firstPage; page <= lastPage; ++page) {
+            dirtyBytes += file->pages.count(page) ? 0 : blockSize;
+        }
+    }
 
-    std::ifstream inodeBitmapFile(blockGroup.getDisk(), std::ios::binary);
-    if (inodeBitmapFile) {
-        inodeBitmapFile.seekg(2048, std::ios::beg); // Block 2
-        for (auto &bit : inodeBitmap) {
-            inodeBitmapFile.read(reinterpret_cast<char*>(&bit), sizeof(bit));
+    for (uint32_t page = firstPage; page <= lastPage; ++page) {
+        std::vector<char> &data = file->pages[page];
+        if (data.empty()) {
+            data.assign(blockSize, 0);
         }
+        uint64_t pageStart = static_cast<uint64_t>(page) * blockSize;
+        uint64_t from = std::max(pageStart, offset);
+        uint64_t to = std::min<uint64_t>(pageStart + blockSize, offset + length);
+        std::memcpy(data.data() + (from - pageStart), buffer + (from - offset), to - from);
     }
+    return true;
+}
 
-    if (inodeNumber >= inodeBitmap.size() || !inodeBitmap[inodeNumber]) {
-        std::cerr << "Invalid inode number or inode not in use" << std::endl;
+// The pointer stays valid while the caller holds the inode's lock
+const FileSystem::DirtyFile *FileSystem::findDirty(uint32_t inodeNumber) {
+    std::lock_guard<std::mutex> lock(dirtyMutex);
+    auto it = dirty.find(inodeNumber);
+    return it == dirty.end() ? nullptr : &it->second;
+}
+
+// Allocates the blocks for a file's buffered data, all at once so that they
+// come as one run next to its last extent, and writes them home in large
+// chunks. Blocks between the pages that no write touched are zeroed. The size
+// only grows once the data is home; until then the pages stay buffered. The
+// caller holds the inode's lock exclusively and marks the inode dirty.
+bool FileSystem::flushFile(uint32_t inodeNumber, Inode::Ext4Inode &fileInode) {
+    DirtyFile file;
+    {
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        auto it = dirty.find(inodeNumber);
+        if (it == dirty.end()) {
+            return true;
+        }
+        file = std::move(it->second);
+        dirty.erase(it);
+    }
+    uint32_t blockSize = device->getBlockSize();
+    uint32_t mappedBlocks = this->mappedBlocks(fileInode);
+    uint32_t endBlock = file.pages.empty() ? mappedBlocks : file.pages.rbegin()->first + 1;
+
+    // An inline file's bytes are already in its first page; the inode becomes
+    // block-backed in the same transaction that maps its blocks
+    bool wasInline = hasInlineData(fileInode);
+    Inode::Ext4Inode inlined = fileInode;
+    if (wasInline) {
+        fileInode.i_flags = (fileInode.i_flags & ~Inode::INLINE_DATA_FL) | Inode::EXTENTS_FL;
+        ExtentTree::initRoot(fileInode.i_block);
+    }
+    if (endBlock > mappedBlocks &&
+        !allocateFileBlocks(fileInode, mappedBlocks, endBlock - mappedBlocks,
+                            inodeNumber / getSuperblock().s_inodes_per_group)) {
+        std::cerr << "No free blocks available" << std::endl;
+        if (wasInline) {
+            fileInode = inlined;
+        }
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        dirty[inodeNumber] = std::move(file); // kept for the next attempt
+        return false;
+    }
+    bool written = true;
+    std::vector<char> chunk;
+    for (uint32_t first = mappedBlocks; written && first < endBlock; first += FLUSH_CHUNK_BLOCKS) {
+        uint32_t count = std::min(FLUSH_CHUNK_BLOCKS, endBlock - first);
+        chunk.assign(static_cast<size_t>(count) * blockSize, 0);
+        for (auto page = file.pages.lower_bound(first); page != file.pages.end() && page->first < first + count; ++page) {
+            std::memcpy(chunk.data() + static_cast<size_t>(page->first - first) * blockSize, page->second.data(), blockSize);
+        }
+        written = transferData(fileInode, static_cast<uint64_t>(first) * blockSize, chunk.data(), chunk.size(), true);
+    }
+    if (!written) {
+        // The data is not home: unmap the new blocks and keep the pages for
+        // the next attempt, as when there was no space
+        std::vector<ExtentTree::Extent> extents;
+        std::vector<ExtentTree::Extent> kept;
+        std::vector<ExtentTree::Extent> added;
+        extentTree.load(fileInode.i_block, extents);
+        for (const auto &extent : extents) {
+            uint32_t below = extent.logical < mappedBlocks ? std::min(extent.length, mappedBlocks - extent.logical) : 0;
+            if (below > 0) {
+                kept.push_back({extent.logical, extent.physical, below});
+            }
+            if (below < extent.length) {
+                added.push_back({extent.logical + below, extent.physical + below, extent.length - below});
+            }
+        }
+        if (wasInline) {
+            std::vector<ExtentTree::Extent> unused;
+            releaseFileBlocks(fileInode, unused);
+            fileInode = inlined;
+        } else {
+            storeExtents(fileInode, kept, inodeNumber / getSuperblock().s_inodes_per_group);
+        }
+        releaseExtents(added);
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        dirty[inodeNumber] = std::move(file);
+        return false;
+    }
+
+    fileInode.i_size = std::max<uint32_t>(fileInode.i_size, static_cast<uint32_t>(file.size));
+    std::lock_guard<std::mutex> lock(dirtyMutex);
+    dirtyBytes -= file.pages.size() * blockSize;
+    reservedBlocks -= file.blocks;
+    return true;
+}
+
+// Flushes every file with buffered data, one inode lock at a time
+bool FileSystem::flushAll() {
+    std::vector<uint32_t> inodeNumbers;
+    {
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        for (const auto &file : dirty) {
+            inodeNumbers.push_back(file.first);
+        }
+    }
+    std::sort(inodeNumbers.begin(), inodeNumbers.end());
+    bool ok = true;
+    for (uint32_t inodeNumber : inodeNumbers) {
+        checkpointIfNeeded();
+        Journal::Handle transaction(*journal);
+        std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+        InodeCache::Handle inode;
+        if (!loadInode(inodeNumber, inode)) {
+            discardDirty(inodeNumber);
+            continue;
+        }
+        ok = flushFile(inodeNumber, *inode) && ok;
+        inode.markDirty();
+    }
+    return ok;
+}
+
+// Drops a file's buffered data; the caller holds the inode's lock
+void FileSystem::discardDirty(uint32_t inodeNumber) {
+    std::lock_guard<std::mutex> lock(dirtyMutex);
+    auto it = dirty.find(inodeNumber);
+    if (it != dirty.end()) {
+        dirtyBytes -= it->second.pages.size() * device->getBlockSize();
+        reservedBlocks -= it->second.blocks;
+        dirty.erase(it);
+    }
+}
+
+// Flushes all buffered data every writebackIntervalMs, or sooner when a
+// writer finds the buffered data over the limit
+void FileSystem::writebackLoop() {
+    std::unique_lock<std::mutex> lock(dirtyMutex);
+    while (!stopWriteback) {
+        writebackWanted.wait_for(lock, std::chrono::milliseconds(options.writebackIntervalMs),
+                                 [this]() { return stopWriteback || writebackRequested; });
+        if (stopWriteback) {
+            break;
+        }
+        writebackRequested = false;
+        if (dirty.empty()) {
+            continue;
+        }
+        lock.unlock();
+        if (!flushAll()) {
+            std::cerr << "Error writing back buffered data" << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+// Frees the oldest orphans, as many as one journal chunk holds, in one
+// transaction: their extent tree nodes, data blocks and inode numbers, and the
+// end of the orphan list. A crash before it commits leaves them all orphans.
+// Returns how many were taken off the list.
+size_t FileSystem::reclaimBatch(bool &ok) {
+    Stats::Scope scope(stats.get(), Stats::RECLAIM);
+    std::lock_guard<std::mutex> batchLock(reclaimMutex);
+    std::vector<uint32_t> batch;
+    {
+        std::lock_guard<std::mutex> lock(orphanMutex);
+        batch.assign(orphans.begin(), orphans.begin() + std::min<size_t>(orphans.size(), batchInodes()));
+    }
+    if (batch.empty()) {
+        return 0;
+    }
+    checkpointIfNeeded();
+    Journal::Handle transaction(*journal);
+    uint32_t now = static_cast<uint32_t>(time(nullptr));
+    std::vector<InodeCache::Handle> handles;
+    std::vector<ExtentTree::Extent> freed;
+    std::vector<ExtentTree::Extent> data;
+    std::vector<std::pair<uint32_t, bool>> released;
+    for (uint32_t inodeNumber : batch) {
+        // Nothing else uses an orphan; the lock waits out the delete that made it
+        std::unique_lock<std::shared_mutex> inodeGuard(inodeLock(inodeNumber));
+        InodeCache::Handle inode = inodes->get(inodeNumber);
+        if (!inode) {
+            std::cerr << "Error reading orphan " << inodeNumber << "; its blocks are lost" << std::endl;
+            ok = false;
+            continue;
+        }
+        size_t first = freed.size();
+        releaseFileBlocks(*inode, freed);
+        if (!isDirectory(*inode)) {
+            data.insert(data.end(), freed.begin() + first, freed.end());
+        }
+        inode->i_dtime = now;
+        released.push_back({inodeNumber, isDirectory(*inode)});
+        handles.push_back(std::move(inode));
+    }
+    inodes->markDirty(handles);
+    // While the orphans still own the blocks: once freed they may be reused at
+    // once. Blocks shared with other files are not freed, so they stay.
+    std::vector<ExtentTree::Extent> unshared;
+    for (const auto &extent : data) {
+        if (!selectRuns(extent, false, unshared)) {
+            unshared.clear();
+            break;
+        }
+    }
+    punchExtents(unshared);
+    releaseExtents(freed);
+    releaseInodeNumbers(released);
+
+    std::lock_guard<std::mutex> lock(orphanMutex);
+    orphans.erase(orphans.begin(), orphans.begin() + batch.size());
+    if (orphans.empty()) {
+        superblock->getSuperblock().s_last_orphan = 0;
+        superblock->writeSuperblockToDisk();
+    } else if (InodeCache::Handle last = inodes->get(orphans.front())) {
+        last->i_dtime = 0; // pointed into the batch; now it ends the list
+        last.markDirty();
+    }
+    return batch.size();
+}
+
+// Frees orphans whenever there are some, so deletes never wait for it
+void FileSystem::reclaimLoop() {
+    std::unique_lock<std::mutex> lock(orphanMutex);
+    while (!stopReclaim) {
+        reclaimWanted.wait(lock, [this]() { return stopReclaim || !orphans.empty(); });
+        if (stopReclaim) {
+            break;
+        }
+        lock.unlock();
+        bool ok = true;
+        reclaimBatch(ok);
+        if (!ok) {
+            std::cerr << "Error reclaiming deleted files" << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+// Returns freed data to the host file system, a merged run at a time. Only
+// whole pages are deallocated; the rest of a run is just zeroed.
+void FileSystem::punchExtents(std::vector<ExtentTree::Extent> &extents) {
+    std::sort(extents.begin(), extents.end(),
+              [](const ExtentTree::Extent &a, const ExtentTree::Extent &b) { return a.physical < b.physical; });
+    uint64_t blockSize = device->getBlockSize();
+    size_t i = 0;
+    while (i < extents.size()) {
+        uint64_t first = extents[i].physical;
+        uint64_t end = first + extents[i].length;
+        size_t j = i + 1;
+        while (j < extents.size() && extents[j].physical == end) {
+            end += extents[j++].length;
+        }
+        if (!device->punchHole(first * blockSize, (end - first) * blockSize)) {
+            return; // not supported here; the space stays allocated
+        }
+        i = j;
+    }
+}
+
+// Maps logical blocks [firstLogical, firstLogical + count) to freshly allocated
+// runs. Each run continues right after the previous one when possible, so a
+// file normally ends up with one extent per contiguous free region it used.
+// A new file starts in 'preferredGroup'; extents hold absolute block numbers.
+bool FileSystem::allocateFileBlocks(Inode::Ext4Inode &fileInode, uint32_t firstLogical, uint32_t count, uint32_t preferredGroup) {
+    std::vector<ExtentTree::Extent> extents;
+    if (!extentTree.load(fileInode.i_block, extents)) {
+        return false;
+    }
+
+    uint64_t goal = 0;
+    if (!extents.empty()) {
+        goal = extents.back().physical + extents.back().length;
+    }
+
+    std::vector<ExtentTree::Extent> added;
+    uint32_t logical = firstLogical;
+    uint32_t remaining = count;
+    while (remaining > 0) {
+        uint32_t allocated = 0;
+        int64_t start = allocateBlocks(remaining, allocated, goal, preferredGroup);
+        if (start < 0) {
+            break;
+        }
+        added.push_back({logical, static_cast<uint64_t>(start), allocated});
+        logical += allocated;
+        remaining -= allocated;
+        goal = static_cast<uint64_t>(start) + allocated;
+    }
+
+    extents.insert(extents.end(), added.begin(), added.end());
+    if (remaining > 0 || !storeExtents(fileInode, extents, preferredGroup)) {
+        for (const auto &extent : added) {
+            releaseBlocks(extent.physical, extent.length);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Writes the file's whole mapping; tree nodes come from 'preferredGroup'
+bool FileSystem::storeExtents(Inode::Ext4Inode &fileInode, const std::vector<ExtentTree::Extent> &extents,
+                              uint32_t preferredGroup) {
+    if (!extentTree.store(fileInode.i_block, extents,
+                          [this, preferredGroup]() -> int64_t {
+                              uint32_t allocated = 0;
+                              return allocateBlocks(1, allocated, 0, preferredGroup);
+                          },
+                          [this](uint64_t block) {
+                              cache->discard(block);
+                              releaseBlocks(block, 1);
+                          })) {
+        return false;
+    }
+    updateBlockCount(fileInode);
+    return true;
+}
+
+// Takes a run from the group holding 'goal' (continuing at 'goal' when it is
+// free), or, without a goal, from 'preferredGroup'; the following groups are
+// tried in turn when that one is full. Returns an absolute block number. Only
+// one group lock is held at a time.
+int64_t FileSystem::allocateBlocks(uint32_t count, uint32_t &allocated, uint64_t goal, uint32_t preferredGroup) {
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    uint32_t groupCount = getGroupCount();
+    bool hasGoal = goal > sb.s_first_data_block && goal < sb.s_blocks_count;
+    uint32_t firstGroup = hasGoal ? static_cast<uint32_t>((goal - sb.s_first_data_block) / sb.s_blocks_per_group)
+                                  : preferredGroup % std::max<uint32_t>(groupCount, 1);
+    Journal::Handle transaction(*journal);
+    for (uint32_t i = 0; i < groupCount; ++i) {
+        uint32_t groupNumber = (firstGroup + i) % groupCount;
+        if (groups[groupNumber]->blockGroup.getFreeBlocks() == 0) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock;
+        Group *group = lockGroup(groupNumber, lock);
+        if (!group) {
+            continue;
+        }
+        uint64_t groupStart = superblock->getGroupFirstBlock(groupNumber);
+        int localGoal = hasGoal && i == 0 ? static_cast<int>(goal - groupStart) : -1;
+        int start = group->blockGroup.allocateBlocks(count, allocated, localGoal);
+        if (start >= 0) {
+            return static_cast<int64_t>(groupStart + start);
+        }
+    }
+    return -1;
+}
+
+// Frees an absolute block range, which may span several groups
+void FileSystem::releaseBlocks(uint64_t firstBlock, uint32_t count) {
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    Journal::Handle transaction(*journal);
+    while (count > 0 && firstBlock >= sb.s_first_data_block && firstBlock < sb.s_blocks_count) {
+        uint32_t groupNumber = static_cast<uint32_t>((firstBlock - sb.s_first_data_block) / sb.s_blocks_per_group);
+        uint64_t groupStart = superblock->getGroupFirstBlock(groupNumber);
+        uint32_t inGroup = static_cast<uint32_t>(std::min<uint64_t>(count, groupStart + sb.s_blocks_per_group - firstBlock));
+        std::unique_lock<std::mutex> lock;
+        if (Group *group = lockGroup(groupNumber, lock)) {
+            group->blockGroup.releaseBlocks(static_cast<uint32_t>(firstBlock - groupStart), inGroup);
+        }
+        firstBlock += inGroup;
+        count -= inGroup;
+    }
+}
+
+// Frees extents gathered from many files: sorted and merged first, so
+// neighbouring files cost one bitmap update between them
+void FileSystem::releaseExtents(std::vector<ExtentTree::Extent> &extents) {
+    std::sort(extents.begin(), extents.end(),
+              [](const ExtentTree::Extent &a, const ExtentTree::Extent &b) { return a.physical < b.physical; });
+    size_t i = 0;
+    while (i < extents.size()) {
+        uint64_t first = extents[i].physical;
+        uint64_t end = first + extents[i].length;
+        size_t j = i + 1;
+        while (j < extents.size() && extents[j].physical == end && end - first + extents[j].length <= UINT32_MAX) {
+            end += extents[j++].length;
+        }
+        releaseBlocks(first, static_cast<uint32_t>(end - first));
+        i = j;
+    }
+}
+
+// Gives a group its reference count table: a zeroed run from the group, or
+// from the ones after it when it is full
+bool FileSystem::ensureRefcountTable(uint32_t groupNumber) {
+    {
+        std::unique_lock<std::mutex> lock;
+        Group *group = lockGroup(groupNumber, lock);
+        if (!group) {
+            return false;
+        }
+        if (group->blockGroup.hasRefcountTable()) {
+            return true;
+        }
+    }
+    uint32_t blockSize = device->getBlockSize();
+    uint32_t tableBlocks = BlockGroup::refcountTableBlocks(getSuperblock().s_blocks_per_group, blockSize);
+    uint32_t allocated = 0;
+    int64_t start = allocateBlocks(tableBlocks, allocated, 0, groupNumber);
+    if (start < 0 || allocated < tableBlocks) {
+        if (start >= 0) {
+            releaseBlocks(static_cast<uint64_t>(start), allocated);
+        }
+        std::cerr << "No free run for the reference counts of group " << groupNumber << std::endl;
+        return false;
+    }
+    // Zeroed on disk rather than through the journal; the commit that records
+    // the table syncs the image first
+    for (uint32_t i = 0; i < tableBlocks; ++i) {
+        cache->discard(static_cast<uint64_t>(start) + i);
+    }
+    std::vector<char> zeros(static_cast<size_t>(tableBlocks) * blockSize);
+    std::vector<IoEngine::Request> write = {
+        {true, static_cast<uint64_t>(start) * blockSize, zeros.data(), zeros.size(), false}};
+    bool ok = device->io().submitAndWait(write);
+
+    std::unique_lock<std::mutex> lock;
+    Group *group = lockGroup(groupNumber, lock);
+    if (ok && group && !group->blockGroup.hasRefcountTable()) {
+        group->blockGroup.setRefcountTable(static_cast<uint32_t>(start));
+        return true;
+    }
+    lock.unlock();
+    releaseBlocks(static_cast<uint64_t>(start), tableBlocks); // failed, or another clone was first
+    return ok && group;
+}
+
+// Adds an owner to every block of 'extents'; on failure the ones added are dropped again
+bool FileSystem::addReferences(const std::vector<ExtentTree::Extent> &extents) {
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    Journal::Handle transaction(*journal);
+    std::vector<ExtentTree::Extent> added;
+    bool ok = true;
+    for (const auto &extent : extents) {
+        uint64_t firstBlock = extent.physical;
+        uint32_t count = extent.length;
+        while (ok && count > 0) {
+            if (firstBlock < sb.s_first_data_block || firstBlock >= sb.s_blocks_count) {
+                ok = false;
+                break;
+            }
+            uint32_t groupNumber = static_cast<uint32_t>((firstBlock - sb.s_first_data_block) / sb.s_blocks_per_group);
+            uint64_t groupStart = superblock->getGroupFirstBlock(groupNumber);
+            uint32_t inGroup = static_cast<uint32_t>(std::min<uint64_t>(count, groupStart + sb.s_blocks_per_group - firstBlock));
+            ok = ensureRefcountTable(groupNumber);
+            if (ok) {
+                std::unique_lock<std::mutex> lock;
+                Group *group = lockGroup(groupNumber, lock);
+                ok = group && group->blockGroup.addReferences(static_cast<uint32_t>(firstBlock - groupStart), inGroup);
+            }
+            if (ok) {
+                added.push_back({0, firstBlock, inGroup});
+            }
+            firstBlock += inGroup;
+            count -= inGroup;
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error sharing blocks" << std::endl;
+        releaseExtents(added);
+    }
+    return ok;
+}
+
+bool FileSystem::selectRuns(const ExtentTree::Extent &extent, bool shared, std::vector<ExtentTree::Extent> &runs) {
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    uint32_t logical = extent.logical;
+    uint64_t firstBlock = extent.physical;
+    uint32_t count = extent.length;
+    std::vector<uint32_t> refcounts;
+    while (count > 0 && firstBlock >= sb.s_first_data_block && firstBlock < sb.s_blocks_count) {
+        uint32_t groupNumber = static_cast<uint32_t>((firstBlock - sb.s_first_data_block) / sb.s_blocks_per_group);
+        uint64_t groupStart = superblock->getGroupFirstBlock(groupNumber);
+        uint32_t inGroup = static_cast<uint32_t>(std::min<uint64_t>(count, groupStart + sb.s_blocks_per_group - firstBlock));
+        {
+            std::unique_lock<std::mutex> lock;
+            Group *group = lockGroup(groupNumber, lock);
+            if (!group) {
+                return false;
+            }
+            if (!group->blockGroup.hasRefcountTable()) {
+                refcounts.assign(inGroup, 1); // nothing in this group is shared
+            } else if (!group->blockGroup.getRefcounts(static_cast<uint32_t>(firstBlock - groupStart), inGroup, refcounts)) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < refcounts.size();) {
+            uint32_t run = 1;
+            while (i + run < refcounts.size() && (refcounts[i + run] > 1) == (refcounts[i] > 1)) {
+                ++run;
+            }
+            if ((refcounts[i] > 1) == shared) {
+                runs.push_back({logical + i, firstBlock + i, run});
+            }
+            i += run;
+        }
+        logical += inGroup;
+        firstBlock += inGroup;
+        count -= inGroup;
+    }
+    return true;
+}
+
+// Copy-on-write: before a write to [offset, offset + length), moves the file
+// off any shared block in the range. New blocks take the shared ones' place in
+// the block map, and the shared blocks lose the file as an owner. Only blocks
+// the write covers partly need their old contents copied.
+bool FileSystem::unshareBlocks(uint32_t inodeNumber, Inode::Ext4Inode &fileInode, uint64_t offset, size_t length) {
+    uint32_t blockSize = device->getBlockSize();
+    uint32_t first = static_cast<uint32_t>(offset / blockSize);
+    uint32_t end = static_cast<uint32_t>((offset + length + blockSize - 1) / blockSize);
+    std::vector<ExtentTree::Extent> extents;
+    std::vector<ExtentTree::Extent> outside, inside, shared;
+    if (!extentTree.load(fileInode.i_block, extents)) {
+        return false;
+    }
+    splitRange(extents, first, end - first, outside, inside);
+    for (const auto &piece : inside) {
+        if (!selectRuns(piece, true, shared)) {
+            return false;
+        }
+    }
+    if (shared.empty()) {
+        return true;
+    }
+
+    // The first and last blocks of the write, unless it covers them whole
+    std::vector<uint32_t> partial;
+    if (offset % blockSize != 0) {
+        partial.push_back(first);
+    }
+    if ((offset + length) % blockSize != 0 && (partial.empty() || end - 1 != first)) {
+        partial.push_back(end - 1);
+    }
+
+    Journal::Handle transaction(*journal);
+    uint32_t groupNumber = inodeNumber / getSuperblock().s_inodes_per_group;
+    std::vector<ExtentTree::Extent> copies;
+    std::vector<ExtentTree::Extent> replaced;
+    std::vector<char> block(blockSize);
+    uint64_t goal = 0;
+    bool ok = true;
+    for (const auto &run : shared) {
+        for (uint32_t done = 0; ok && done < run.length;) {
+            uint32_t allocated = 0;
+            int64_t start = allocateBlocks(run.length - done, allocated, goal, groupNumber);
+            if (start < 0) {
+                std::cerr << "No free blocks available" << std::endl;
+                ok = false;
+                break;
+            }
+            uint32_t logical = run.logical + done;
+            copies.push_back({logical, static_cast<uint64_t>(start), allocated});
+            for (uint32_t target : partial) {
+                if (target >= logical && target < logical + allocated) {
+                    uint64_t from = run.physical + (target - run.logical);
+                    uint64_t to = static_cast<uint64_t>(start) + (target - logical);
+                    std::vector<IoEngine::Request> read = {{false, from * blockSize, block.data(), blockSize, false}};
+                    std::vector<IoEngine::Request> write = {{true, to * blockSize, block.data(), blockSize, false}};
+                    ok = ok && device->io().submitAndWait(read) && device->io().submitAndWait(write);
+                }
+            }
+            extents = replaceRange(extents, logical, allocated, static_cast<uint64_t>(start), replaced);
+            done += allocated;
+            goal = static_cast<uint64_t>(start) + allocated;
+        }
+    }
+    if (!ok || !storeExtents(fileInode, extents, groupNumber)) {
+        releaseExtents(copies);
+        return false;
+    }
+    releaseExtents(replaced);
+    return true;
+}
+
+void FileSystem::releaseFileBlocks(Inode::Ext4Inode &fileInode, std::vector<ExtentTree::Extent> &freed) {
+    if (!(fileInode.i_flags & Inode::EXTENTS_FL)) {
         return;
     }
+    std::vector<ExtentTree::Extent> extents;
+    std::vector<uint64_t> nodes;
+    extentTree.load(fileInode.i_block, extents);
+    extentTree.collectNodeBlocks(fileInode.i_block, nodes);
+
+    for (const auto &extent : extents) {
+        // Directory blocks are metadata: drop them from the cache and the journal
+        for (uint32_t i = 0; isDirectory(fileInode) && i < extent.length; ++i) {
+            cache->discard(extent.physical + i);
+        }
+        freed.push_back(extent);
+    }
+    for (uint64_t node : nodes) {
+        cache->discard(node);
+        releaseBlocks(node, 1);
+    }
+    ExtentTree::initRoot(fileInode.i_block);
+    fileInode.i_blocks = 0;
+}
+
+// i_blocks counts 512-byte sectors for data and extent tree nodes, as in ext4
+void FileSystem::updateBlockCount(Inode::Ext4Inode &fileInode) {
+    std::vector<ExtentTree::Extent> extents;
+    std::vector<uint64_t> nodes;
+    extentTree.load(fileInode.i_block, extents);
+    extentTree.collectNodeBlocks(fileInode.i_block, nodes);
+
+    uint64_t blocks = nodes.size();
+    for (const auto &extent : extents) {
+        blocks += extent.length;
+    }
+    fileInode.i_blocks = static_cast<uint32_t>(blocks * (device->getBlockSize() / 512));
+}
 
-    // Mark the inode as free
-    inodeBitmap[inodeNumber] = false;
+void FileSystem::mapImage() {
+    if (options.mmapImage && !device->map()) {
+        std::cerr << "Could not map disk image, using pread/pwrite" << std::endl;
+    }
+}
 
-    std::ofstream inodeBitmapOutFile(blockGroup.getDisk(), std::ios::binary | std::ios::in | std::ios::out);
-    if (inodeBitmapOutFile) {
-        inodeBitmapOutFile.seekp(2048, std::ios::beg); // Block 2
-        for (auto bit : inodeBitmap) {
-            inodeBitmapOutFile.write(reinterpret_cast<char*>(&bit), sizeof(bit));
+// The block size is only known once the superblock has been read, so the
+// device and everything layered on it are reopened when it differs
+void FileSystem::openDevice(uint32_t blockSize) {
+    device = std::make_shared<BlockDevice>(disk, blockSize, options.directIO);
+    cache = std::make_shared<BufferCache>(device, options.cacheBlocks);
+    superblock = std::make_unique<Superblock>(cache);
+    extentTree = ExtentTree(cache);
+    mapImage();
+}
+
+// Reads the superblock and group descriptors and replays the journal. Group
+// bitmaps are loaded on first use, so mounting costs the same for any size.
+bool FileSystem::mount() {
+    if (!device->isOpen() || !superblock->readSuperblockFromDisk()) {
+        return false; // Not formatted yet; initialize() sets it up
+    }
+    if (superblock->getBlockSize() != device->getBlockSize()) {
+        openDevice(superblock->getBlockSize());
+        if (!superblock->readSuperblockFromDisk()) {
+            return false;
         }
     }
 
-    // Read and delete the inode
-    inode.readInodeFromDisk(inodeNumber);
-    inode.deleteInode();
-    inode.writeInodeToDisk(inodeNumber);
+    uint64_t blockSize = device->getBlockSize();
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    journal = std::make_unique<Journal>(device, sb.s_journal_block * blockSize, sb.s_journal_blocks * blockSize,
+                                        options.journal);
+    recover();
+    cache->invalidate();
+    superblock->readSuperblockFromDisk();
 
-    std::cout << "File with inode number " << inodeNumber << " deleted." << std::endl;
+    // Superblock and descriptor table are touched by every operation; keep them resident
+    cache->pin(0);
+    for (uint32_t b = 0; b < superblock->getGroupDescBlocks(); ++b) {
+        cache->pin(Superblock::GROUP_DESC_BLOCK + b);
+    }
+    uint32_t groupCount = superblock->getGroupCount();
+    groups.reserve(groupCount);
+    freeTotals.blocks = 0;
+    freeTotals.inodes = 0;
+    for (uint32_t g = 0; g < groupCount; ++g) {
+        groups.push_back(std::make_unique<Group>(cache, Superblock::GROUP_DESC_BLOCK * blockSize,
+                                                 superblock->getInodeTableBlock(g) * blockSize));
+        BlockGroup &blockGroup = groups.back()->blockGroup;
+        if (!blockGroup.readGroupDescFromDisk(g)) {
+            // Its bitmap and inode table locations cannot be trusted
+            std::cerr << "Not mounting: group descriptor " << g << " is damaged" << std::endl;
+            groups.clear();
+            journal.reset();
+            return false;
+        }
+        blockGroup.setTotals(&freeTotals);
+        freeTotals.blocks += blockGroup.getFreeBlocks();
+        freeTotals.inodes += blockGroup.getFreeInodes();
+    }
+    inodes = std::make_unique<InodeCache>(
+        cache,
+        [this](uint32_t inodeNumber) {
+            return inodeTableStart(inodeNumber) + static_cast<uint64_t>(inodeIndex(inodeNumber)) * sizeof(Inode::Ext4Inode);
+        },
+        options.cachedInodes);
+    cache->setJournal(journal.get());
+    if (!(sb.s_feature_compat & Superblock::COMPAT_FREE_COUNTS)) {
+        recountFreeSpace();
+    }
+    loadOrphans();
+    if (trace) {
+        trace->setGeometry(static_cast<uint64_t>(sb.s_blocks_count) * blockSize, static_cast<uint32_t>(blockSize),
+                           sb.s_inodes_per_group, sb.s_journal_blocks);
+    }
+    if (sb.s_defrag_blocks > 0) {
+        // A crash during a defragmentation: the copy never made it into the
+        // block map
+        Journal::Handle transaction(*journal);
+        releaseBlocks(sb.s_defrag_block, sb.s_defrag_blocks);
+        setDefragRun(0, 0);
+    }
+
+    if (device->isMapped()) {
+        // Group 0's metadata is touched on every operation; fault it in up front
+        device->advise(0, superblock->getMetadataBlocks(0) * blockSize, MADV_WILLNEED);
+    }
+    if (options.writebackIntervalMs > 0) {
+        stopWriteback = false;
+        writeback = std::thread(&FileSystem::writebackLoop, this);
+    }
+    if (options.deferReclaim) {
+        stopReclaim = false;
+        reclaimer = std::thread(&FileSystem::reclaimLoop, this);
+    } else {
+        reclaim();
+    }
+    return true;
+}
+
+void FileSystem::unmount() {
+    if (!journal) {
+        return;
+    }
+    if (writeback.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(dirtyMutex);
+            stopWriteback = true;
+        }
+        writebackWanted.notify_one();
+        writeback.join();
+    }
+    if (reclaimer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(orphanMutex);
+            stopReclaim = true;
+        }
+        reclaimWanted.notify_one();
+        reclaimer.join();
+    }
+    if (!flushAll() || !reclaim() || !checkpoint()) {
+        std::cerr << "Error syncing disk file" << std::endl;
+    }
+    dirty.clear();
+    orphans.clear();
+    dirtyBytes = 0;
+    reservedBlocks = 0;
+    inodes.reset();
+    cache->setJournal(nullptr);
+    journal.reset();
+    groups.clear();
+    readahead.clear();
+}
+
+// Locks a group, reading its bitmaps (and, right after mkfs, setting them up)
+// the first time. They stay in memory until unmount.
+FileSystem::Group *FileSystem::lockGroup(uint32_t groupNumber, std::unique_lock<std::mutex> &lock) {
+    if (groupNumber >= groups.size()) {
+        return nullptr;
+    }
+    Group *group = groups[groupNumber].get();
+    lock = std::unique_lock<std::mutex>(group->lock);
+    if (!group->loaded) {
+        BlockGroup &blockGroup = group->blockGroup;
+        if (!blockGroup.readBitmapsFromDisk(superblock->getBlocksInGroup(groupNumber), getSuperblock().s_inodes_per_group,
+                                            superblock->getMetadataBlocks(groupNumber))) {
+            return nullptr;
+        }
+        cache->pin(blockGroup.getGroupDesc().bg_block_bitmap);
+        cache->pin(blockGroup.getGroupDesc().bg_inode_bitmap);
+        group->loaded = true;
+    }
+    return group;
+}
+
+// Each thread gets a home group, round robin in order of first use, where its
+// inode searches start; new files take their blocks from their inode's group
+uint32_t FileSystem::homeGroup() const {
+    static std::atomic<uint32_t> threads(0);
+    thread_local uint32_t threadIndex = threads++;
+    return threadIndex % getGroupCount();
+}
+
+uint64_t FileSystem::inodeTableStart(uint32_t inodeNumber) const {
+    uint32_t groupNumber = groups.empty() ? 0 : inodeNumber / getSuperblock().s_inodes_per_group;
+    return groupNumber < groups.size() ? groups[groupNumber]->inodeTableStart : 0;
+}
+
+// Gets a handle to an in-use inode from the inode cache. Changes made through
+// it are kept with markDirty() and written home in batches at checkpoints.
+bool FileSystem::loadInode(uint32_t inodeNumber, InodeCache::Handle &inode) {
+    if (groups.empty()) {
+        return false;
+    }
+    uint32_t index = inodeIndex(inodeNumber);
+    {
+        std::unique_lock<std::mutex> lock;
+        Group *group = lockGroup(inodeNumber / getSuperblock().s_inodes_per_group, lock);
+        if (!group || !group->blockGroup.getInodeBitmap().test(index)) {
+            return false;
+        }
+    }
+    inode = inodes->get(inodeNumber);
+    if (inode && inode->i_links_count == 0) {
+        inode = InodeCache::Handle(); // deleted; waiting for the reclaimer
+    }
+    return static_cast<bool>(inode);
+}
+
+// An orphan keeps its number and blocks, so nothing can reuse them before the
+// reclaimer frees them. It goes to the front of the on-disk list, as in ext4:
+// s_last_orphan names it and its i_dtime the orphan before it.
+void FileSystem::orphanInodes(const std::vector<InodeCache::Handle> &handles) {
+    {
+        std::lock_guard<std::mutex> lock(readaheadMutex);
+        for (const InodeCache::Handle &inode : handles) {
+            readahead.erase(inode.number());
+        }
+    }
+    for (const InodeCache::Handle &inode : handles) {
+        discardDirty(inode.number());
+    }
+    Journal::Handle transaction(*journal);
+    {
+        std::lock_guard<std::mutex> lock(orphanMutex);
+        Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+        for (const InodeCache::Handle &inode : handles) {
+            inode->i_links_count = 0;
+            inode->i_dtime = sb.s_last_orphan;
+            sb.s_last_orphan = inode.number();
+            orphans.push_back(inode.number());
+        }
+        inodes->markDirty(handles);
+        superblock->writeSuperblockToDisk();
+    }
+    reclaimWanted.notify_one();
+}
+
+// Reads the list left by the last mount, which a crash may have left
+// non-empty; its orphans are reclaimed like new ones
+void FileSystem::loadOrphans() {
+    const Superblock::Ext4Superblock &sb = getSuperblock();
+    std::vector<uint32_t> chain;
+    for (uint32_t next = sb.s_last_orphan; next != 0 && chain.size() < sb.s_inodes_count;) {
+        InodeCache::Handle inode;
+        if (next < ROOT_INODE || next >= sb.s_inodes_count || !(inode = inodes->get(next)) ||
+            inode->i_mode == 0 || inode->i_links_count != 0) {
+            std::cerr << "Orphan list ends at inode " << next << ", which is not an orphan" << std::endl;
+            break;
+        }
+        chain.push_back(next);
+        next = inode->i_dtime;
+    }
+    std::lock_guard<std::mutex> lock(orphanMutex);
+    orphans.assign(chain.rbegin(), chain.rend());
+}
+
+// Inodes per chunk of a batch operation: a chunk's records take at most a
+// quarter of the journal, so each chunk can commit as one transaction
+uint32_t FileSystem::batchInodes() const {
+    uint64_t journalBytes = static_cast<uint64_t>(getSuperblock().s_journal_blocks) * device->getBlockSize();
+    return static_cast<uint32_t>(std::max<uint64_t>(journalBytes / 4 / sizeof(Inode::Ext4Inode), 1));
+}
+
+// Claims up to 'count' inode numbers, starting in 'firstGroup', with one bitmap
+// pass and one descriptor update per group
+void FileSystem::allocateInodes(uint32_t count, bool directories, uint32_t firstGroup, std::vector<uint32_t> &inodeNumbers) {
+    uint32_t groupCount = getGroupCount();
+    for (uint32_t i = 0; i < groupCount && inodeNumbers.size() < count; ++i) {
+        uint32_t groupNumber = (firstGroup + i) % groupCount;
+        if (groups[groupNumber]->blockGroup.getFreeInodes() == 0) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock;
+        Group *group = lockGroup(groupNumber, lock);
+        if (!group) {
+            continue;
+        }
+        std::vector<uint32_t> indexes;
+        uint32_t taken = group->blockGroup.allocateInodes(count - static_cast<uint32_t>(inodeNumbers.size()), indexes);
+        for (uint32_t index : indexes) {
+            inodeNumbers.push_back(groupNumber * getSuperblock().s_inodes_per_group + index);
+        }
+        if (taken > 0 && directories) {
+            group->blockGroup.getGroupDesc().bg_used_dirs_count += taken;
+            group->blockGroup.writeGroupDescToDisk(groupNumber);
+        }
+    }
+}
+
+// Returns inode numbers to their groups' bitmaps, one update per group
+void FileSystem::releaseInodeNumbers(const std::vector<std::pair<uint32_t, bool>> &released) {
+    uint32_t inodesPerGroup = getSuperblock().s_inodes_per_group;
+    std::unordered_map<uint32_t, std::pair<std::vector<uint32_t>, uint32_t>> byGroup; // indexes, directories
+    for (const auto &inode : released) {
+        auto &entry = byGroup[inode.first / inodesPerGroup];
+        entry.first.push_back(inode.first % inodesPerGroup);
+        entry.second += inode.second ? 1 : 0;
+    }
+    for (const auto &entry : byGroup) {
+        std::unique_lock<std::mutex> lock;
+        Group *group = lockGroup(entry.first, lock);
+        if (!group) {
+            continue;
+        }
+        group->blockGroup.releaseInodes(entry.second.first);
+        if (entry.second.second > 0) {
+            group->blockGroup.getGroupDesc().bg_used_dirs_count -= entry.second.second;
+            group->blockGroup.writeGroupDescToDisk(entry.first);
+        }
+    }
+}
+
+// Directory blocks are allocated like file blocks, near the directory's last block
+Directory FileSystem::openDirectory(Inode::Ext4Inode &dir) {
+    return Directory(cache, dir, [this, &dir](uint32_t logical, bool allocate) -> int64_t {
+        ExtentTree::Extent extent;
+        if (!extentTree.lookup(dir.i_block, logical, extent)) {
+            if (!allocate || !allocateFileBlocks(dir, logical, 1, homeGroup()) ||
+                !extentTree.lookup(dir.i_block, logical, extent)) {
+                return -1;
+            }
+        }
+        return static_cast<int64_t>(extent.physical + (logical - extent.logical));
+    });
+}
+
+bool FileSystem::initDirectory(uint32_t inodeNumber, uint32_t parent) {
+    InodeCache::Handle dirInode;
+    if (!loadInode(inodeNumber, dirInode)) {
+        return false;
+    }
+    dirInode->i_links_count = 2; // "." and the parent's entry
+    if (!openDirectory(*dirInode).init(inodeNumber, parent)) {
+        return false;
+    }
+    dirInode.markDirty();
+    return true;
+}
+
+// Redoes the metadata changes committed after the last checkpoint, in log
+// order. A first pass collects revokes so that an image of a block that was
+// later freed (and may since hold file data) is not written back over it.
+void FileSystem::recover() {
+    uint32_t blockSize = device->getBlockSize();
+    std::unordered_map<uint64_t, uint64_t> revoked; // block -> index of its last revoke
+    Journal::Ext4JournalHeader header;
+    const char *data;
+    uint32_t dataSize;
+    uint64_t index = 0;
+    {
+        Journal::Cursor cursor(*journal);
+        for (; cursor.next(header, data, dataSize); ++index) {
+            uint64_t offset;
+            if (header.j_blocktype == Journal::REVOKE_BLOCK && dataSize >= sizeof(offset)) {
+                std::memcpy(&offset, data, sizeof(offset));
+                revoked[offset / blockSize] = index;
+            }
+        }
+    }
+    if (index == 0) {
+        return;
+    }
+
+    uint64_t applied = 0;
+    {
+        Journal::Cursor cursor(*journal);
+        for (index = 0; cursor.next(header, data, dataSize); ++index) {
+            uint64_t offset;
+            if (header.j_blocktype != Journal::METADATA_BLOCK || dataSize < sizeof(offset)) {
+                continue;
+            }
+            std::memcpy(&offset, data, sizeof(offset));
+            uint32_t length = dataSize - sizeof(offset);
+            bool skip = false;
+            for (uint64_t block = offset / blockSize; length > 0 && block <= (offset + length - 1) / blockSize; ++block) {
+                auto it = revoked.find(block);
+                skip = skip || (it != revoked.end() && it->second > index);
+            }
+            if (!skip && !device->write(offset, data + sizeof(offset), length)) {
+                std::cerr << "Error replaying journal" << std::endl;
+                return;
+            }
+            applied += skip ? 0 : 1;
+        }
+    }
+
+    // The replayed changes are home now; the log can be reclaimed
+    if (!device->sync() || !journal->checkpoint(journal->getCommittedTransaction())) {
+        std::cerr << "Error checkpointing journal after recovery" << std::endl;
+        return;
+    }
+    std::cout << "Recovered " << applied << " metadata changes from the journal." << std::endl;
+}
+
+// Metadata reaches its home location only after the journal records for it
+// are durable (see BufferCache), so once the inode cache is flushed
+// and the buffer cache synced every committed transaction can be reclaimed.
+// Updates are held off throughout: a change logged after the flush would be
+// written home before its transaction commits.
+bool FileSystem::checkpoint() {
+    Stats::Scope scope(stats.get(), Stats::CHECKPOINT);
+    std::lock_guard<std::mutex> lock(checkpointMutex);
+    journal->lockUpdates();
+    {
+        std::lock_guard<std::mutex> orphanLock(orphanMutex); // also writes the superblock
+        Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+        sb.s_free_blocks_count = static_cast<uint32_t>(freeTotals.blocks.load(std::memory_order_relaxed));
+        sb.s_free_inodes_count = static_cast<uint32_t>(freeTotals.inodes.load(std::memory_order_relaxed));
+        superblock->writeSuperblockToDisk();
+    }
+    bool ok = journal->flush();
+    if (ok) {
+        uint32_t committed = journal->getCommittedTransaction();
+        ok = inodes->flush() && cache->sync() && journal->checkpoint(committed);
+    }
+    journal->unlockUpdates();
+    return ok;
+}
+
+// Images made before the free counts were maintained have zeros there. Count
+// every group's bitmaps once and mark the counts valid.
+void FileSystem::recountFreeSpace() {
+    for (uint32_t g = 0; g < getGroupCount(); ++g) {
+        std::unique_lock<std::mutex> lock;
+        if (Group *group = lockGroup(g, lock)) {
+            group->blockGroup.recountFree();
+        }
+    }
+    superblock->getSuperblock().s_feature_compat |= Superblock::COMPAT_FREE_COUNTS;
+    checkpoint();
+}
+
+// Checkpointing at half full keeps commits from finding the ring full, which
+// would stop the journal
+void FileSystem::checkpointIfNeeded() {
+    if (journal && journal->needsCheckpoint() && !checkpoint()) {
+        std::cerr << "Error checkpointing journal" << std::endl;
+    }
 }
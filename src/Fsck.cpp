@@ -0,0 +1,691 @@
+#include "Fsck.h"
+#include "Directory.h"
+#include "ExtentTree.h"
+#include "FileSystem.h"
+#include "Journal.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+bool isDirectory(const Inode::Ext4Inode &inode) {
+    return (inode.i_mode & Inode::TYPE_MASK) == Inode::DIRECTORY;
+}
+
+std::string describeRun(const char *what, uint64_t first, uint64_t count) {
+    std::ostringstream out;
+    out << what << " " << first;
+    if (count > 1) {
+        out << "-" << first + count - 1;
+    }
+    return out.str();
+}
+
+} // namespace
+
+Fsck::Fsck(const std::string &disk, const FsckOptions &options)
+    : disk(disk), options(options), orphanListBroken(false), orphanListEnd(0), report(nullptr), repairs(0) {}
+
+Fsck::~Fsck() = default;
+
+bool Fsck::run(FsckReport &result) {
+    result = FsckReport();
+    report = &result;
+    repairs = 0;
+    groups.clear();
+    dangling.clear();
+    linkFixes.clear();
+    blockCountFixes.clear();
+
+    if (!openImage()) {
+        std::cerr << "No file system on " << disk << std::endl;
+        return false;
+    }
+    if (!replayJournal(result) || !loadGroups()) {
+        return false;
+    }
+    loadOrphans();
+
+    const Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    claimed = std::vector<std::atomic<uint64_t>>((static_cast<uint64_t>(sb.s_blocks_count) + 63) / 64);
+    references = std::vector<std::atomic<uint32_t>>(sb.s_inodes_count);
+    for (uint32_t g = 0; g < groups.size(); ++g) {
+        uint64_t first = superblock->getGroupFirstBlock(g);
+        for (uint64_t block = first; block < first + superblock->getMetadataBlocks(g); ++block) {
+            claimed[block / 64].fetch_or(uint64_t(1) << (block % 64), std::memory_order_relaxed);
+        }
+        if (!groups[g].shares.empty()) {
+            uint64_t table = groups[g].desc.bg_refcount_table;
+            uint32_t tableBlocks = BlockGroup::refcountTableBlocks(sb.s_blocks_per_group, superblock->getBlockSize());
+            for (uint64_t block = table; block < table + tableBlocks; ++block) {
+                claimed[block / 64].fetch_or(uint64_t(1) << (block % 64), std::memory_order_relaxed);
+            }
+        }
+    }
+    // The run a defragmentation was filling; the next mount frees it
+    for (uint64_t block = sb.s_defrag_block;
+         block < static_cast<uint64_t>(sb.s_defrag_block) + sb.s_defrag_blocks && block < sb.s_blocks_count; ++block) {
+        claimed[block / 64].fetch_or(uint64_t(1) << (block % 64), std::memory_order_relaxed);
+    }
+
+    forEachGroup([this](uint32_t group, std::shared_ptr<BufferCache> &cache) { scanInodes(group, cache); });
+    forEachGroup([this](uint32_t group, std::shared_ptr<BufferCache> &cache) { walkDirectories(group, cache); });
+    forEachGroup([this](uint32_t group, std::shared_ptr<BufferCache> &) { compareGroup(group); });
+
+    if (options.repair && repairs > 0) {
+        if (!applyRepairs()) {
+            std::cerr << "Error writing repairs to " << disk << std::endl;
+            return false;
+        }
+        result.repaired += repairs;
+    }
+    report = nullptr;
+    return true;
+}
+
+bool Fsck::openImage() {
+    device = std::make_shared<BlockDevice>(disk);
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        imageCache = std::make_shared<BufferCache>(device);
+        imageCache->setWriteThrough(true);
+        superblock = std::make_unique<Superblock>(imageCache);
+        if (!device->isOpen() || !superblock->readSuperblockFromDisk()) {
+            return false;
+        }
+        if (superblock->getBlockSize() == device->getBlockSize()) {
+            return true;
+        }
+        device = std::make_shared<BlockDevice>(disk, superblock->getBlockSize());
+    }
+    return false;
+}
+
+// Transactions that were committed but never checkpointed would make the
+// check report damage that replaying them fixes. Mounting replays them, and
+// formats a journal whose superblock is damaged. The journal is only read
+// here, so a check without repairs leaves the image as it was.
+bool Fsck::replayJournal(FsckReport &result) {
+    const Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    uint64_t blockSize = superblock->getBlockSize();
+    // mkfs puts the journal right after group 0's inode table
+    uint64_t journalStart = superblock->getInodeTableBlock(0) + superblock->getInodeTableBlocks();
+    if (sb.s_journal_block != journalStart || sb.s_journal_blocks < 2 ||
+        journalStart + sb.s_journal_blocks > superblock->getGroupFirstBlock(0) + superblock->getBlocksInGroup(0)) {
+        problem("superblock: journal region (block " + std::to_string(sb.s_journal_block) + ", " +
+                    std::to_string(sb.s_journal_blocks) + " blocks) does not fit group 0's layout",
+                false);
+        return true;
+    }
+
+    JournalOptions journalOptions;
+    journalOptions.readOnly = true;
+    bool loaded;
+    uint64_t records = 0;
+    {
+        Journal journal(device, sb.s_journal_block * blockSize, sb.s_journal_blocks * blockSize, journalOptions);
+        loaded = journal.isOpen();
+        if (loaded) {
+            Journal::Cursor cursor(journal);
+            Journal::Ext4JournalHeader header;
+            const char *data;
+            uint32_t dataSize;
+            while (cursor.next(header, data, dataSize)) {
+                ++records;
+            }
+        }
+    }
+    if (!loaded) {
+        problem("journal superblock is damaged");
+        if (!options.repair) {
+            return true;
+        }
+    } else if (records == 0) {
+        return true;
+    } else if (!options.repair) {
+        problem("journal holds " + std::to_string(records) + " records that were never checkpointed", false);
+        return true;
+    }
+    {
+        FileSystem fs(disk); // mounting replays and checkpoints the journal
+    }
+    result.journalReplayed = records > 0;
+    return openImage();
+}
+
+bool Fsck::loadGroups() {
+    uint32_t groupCount = superblock->getGroupCount();
+    uint64_t blockSize = superblock->getBlockSize();
+    std::vector<BlockGroup::Ext4GroupDesc> descs(groupCount);
+    if (!device->read(Superblock::GROUP_DESC_BLOCK * blockSize, descs.data(), descs.size() * sizeof(descs[0]))) {
+        std::cerr << "Error reading the group descriptors" << std::endl;
+        return false;
+    }
+    groups.resize(groupCount);
+    for (uint32_t g = 0; g < groupCount; ++g) {
+        GroupState &state = groups[g];
+        state.desc = descs[g];
+        if (!BlockGroup::verifyChecksum(state.desc, g)) {
+            problem("group " + std::to_string(g) + ": descriptor checksum mismatch");
+            state.descDamaged = true;
+        }
+        // The layout is fixed by the geometry; a descriptor disagreeing with it is damaged
+        if (state.desc.bg_block_bitmap != superblock->getBlockBitmapBlock(g) ||
+            state.desc.bg_inode_bitmap != superblock->getInodeBitmapBlock(g) ||
+            state.desc.bg_inode_table != superblock->getInodeTableBlock(g)) {
+            problem("group " + std::to_string(g) + ": descriptor points away from the group's bitmaps and inode table");
+            state.descDamaged = true;
+            state.desc.bg_block_bitmap = static_cast<uint32_t>(superblock->getBlockBitmapBlock(g));
+            state.desc.bg_inode_bitmap = static_cast<uint32_t>(superblock->getInodeBitmapBlock(g));
+            state.desc.bg_inode_table = static_cast<uint32_t>(superblock->getInodeTableBlock(g));
+        }
+        if (state.desc.bg_refcount_table != 0) {
+            uint32_t blocksInGroup = superblock->getBlocksInGroup(g);
+            uint32_t tableBlocks = BlockGroup::refcountTableBlocks(superblock->getSuperblock().s_blocks_per_group,
+                                                                   static_cast<uint32_t>(blockSize));
+            if (state.desc.bg_refcount_table < superblock->getSuperblock().s_first_data_block ||
+                static_cast<uint64_t>(state.desc.bg_refcount_table) + tableBlocks > superblock->getSuperblock().s_blocks_count) {
+                problem("group " + std::to_string(g) + ": reference count table lies outside the image", false);
+                continue;
+            }
+            state.shares.resize(blocksInGroup);
+            if (!device->read(state.desc.bg_refcount_table * blockSize, state.shares.data(),
+                              state.shares.size() * sizeof(uint32_t))) {
+                std::cerr << "Error reading the reference counts of group " << g << std::endl;
+                return false;
+            }
+            state.owners.reset(new std::atomic<uint32_t>[blocksInGroup]());
+        }
+    }
+    return true;
+}
+
+// Follows the list from the superblock through each orphan's i_dtime. An
+// entry that is not an orphan (free, linked or unreadable) ends it.
+void Fsck::loadOrphans() {
+    const Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    orphans.clear();
+    orphanListBroken = false;
+    orphanListEnd = 0;
+    for (uint32_t next = sb.s_last_orphan; next != 0;) {
+        uint64_t offset = 0;
+        Inode::Ext4Inode inode = {};
+        bool valid = next >= FileSystem::ROOT_INODE && next < sb.s_inodes_count && !orphans.count(next);
+        if (valid) {
+            offset = static_cast<uint64_t>(groups[next / sb.s_inodes_per_group].desc.bg_inode_table) *
+                         superblock->getBlockSize() +
+                     static_cast<uint64_t>(next % sb.s_inodes_per_group) * sizeof(inode);
+            valid = device->read(offset, &inode, sizeof(inode)) && Inode::verifyChecksum(inode, offset) &&
+                    inode.i_mode != 0 && inode.i_links_count == 0;
+        }
+        if (!valid) {
+            problem("orphan list: inode " + std::to_string(next) + " is not an orphan");
+            orphanListBroken = true;
+            return;
+        }
+        orphans.insert(next);
+        orphanListEnd = next;
+        next = inode.i_dtime;
+    }
+}
+
+bool Fsck::readBitmap(uint64_t block, Bitmap &bitmap, uint32_t bits) {
+    bitmap.resize(bits);
+    if (!device->read(block * superblock->getBlockSize(), bitmap.data(), bitmap.byteSize())) {
+        return false;
+    }
+    bitmap.padTail();
+    return true;
+}
+
+void Fsck::forEachGroup(const std::function<void(uint32_t group, std::shared_ptr<BufferCache> &cache)> &work) {
+    uint32_t groupCount = static_cast<uint32_t>(groups.size());
+    unsigned workers = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min<unsigned>(workers, std::max<uint32_t>(groupCount, 1));
+    std::atomic<uint32_t> next{0};
+    auto worker = [&]() {
+        auto cache = std::make_shared<BufferCache>(device);
+        for (uint32_t group = next++; group < groupCount; group = next++) {
+            work(group, cache);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < workers; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+// Pass 1: the group's inode table against its inode bitmap
+void Fsck::scanInodes(uint32_t group, std::shared_ptr<BufferCache> &cache) {
+    GroupState &state = groups[group];
+    const Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    uint32_t inodesPerGroup = sb.s_inodes_per_group;
+    std::string where = "group " + std::to_string(group) + ": ";
+
+    // An uninitialized group's bitmaps were never written; they are implied
+    state.liveInodes.resize(inodesPerGroup);
+    if (state.desc.bg_flags & BlockGroup::INODE_UNINIT) {
+        state.inodeBitmap.resize(inodesPerGroup);
+    } else if (!readBitmap(state.desc.bg_inode_bitmap, state.inodeBitmap, inodesPerGroup)) {
+        problem(where + "error reading the inode bitmap", false);
+        state.inodeBitmap.resize(inodesPerGroup);
+    }
+    uint32_t blocksInGroup = superblock->getBlocksInGroup(group);
+    if (state.desc.bg_flags & BlockGroup::BLOCK_UNINIT) {
+        state.blockBitmap.resize(blocksInGroup);
+        state.blockBitmap.setRange(0, std::min(superblock->getMetadataBlocks(group), blocksInGroup));
+    } else if (!readBitmap(state.desc.bg_block_bitmap, state.blockBitmap, blocksInGroup)) {
+        problem(where + "error reading the block bitmap", false);
+        state.blockBitmap.resize(blocksInGroup);
+    }
+
+    // Inode numbers below the root are reserved: in use, with no inode behind them
+    uint32_t firstInode = 0;
+    if (group == 0) {
+        for (; firstInode < FileSystem::ROOT_INODE; ++firstInode) {
+            if (!state.inodeBitmap.test(firstInode)) {
+                problem("inode " + std::to_string(firstInode) + " is reserved but marked free");
+            }
+            state.liveInodes.set(firstInode);
+        }
+    }
+    if (state.desc.bg_flags & BlockGroup::INODE_UNINIT) {
+        return; // the table was never used
+    }
+
+    uint64_t tableOffset = static_cast<uint64_t>(state.desc.bg_inode_table) * superblock->getBlockSize();
+    InodeScanner scanner(device, tableOffset, firstInode, inodesPerGroup - firstInode, options.scanBytes);
+    uint32_t index;
+    const Inode::Ext4Inode *inode;
+    while (scanner.next(index, inode)) {
+        uint32_t number = group * inodesPerGroup + index;
+        std::string name = "inode " + std::to_string(number);
+        bool marked = state.inodeBitmap.test(index);
+        if (!Inode::verifyChecksum(*inode, tableOffset + static_cast<uint64_t>(index) * sizeof(Inode::Ext4Inode))) {
+            problem(name + ": checksum mismatch");
+            state.damaged.push_back(number);
+            continue;
+        }
+        // A deleted inode keeps its contents but has i_dtime set; an orphan
+        // uses i_dtime for the list and is in use until it is reclaimed
+        bool orphan = orphans.count(number) != 0;
+        bool live = inode->i_mode != 0 && ((inode->i_dtime == 0 && inode->i_links_count > 0) || orphan);
+        if (!live) {
+            if (marked) {
+                problem(name + " is marked in use but is free");
+            }
+            continue;
+        }
+        if (!claimBlocks(number, *inode, cache)) {
+            state.damaged.push_back(number);
+            continue;
+        }
+        if (!marked) {
+            problem(name + " is in use but marked free");
+        }
+        state.liveInodes.set(index);
+        if (isDirectory(*inode)) {
+            ++state.usedDirs; // until the reclaimer frees it
+        }
+        if (orphan) {
+            ++state.orphans;
+            continue;
+        }
+        state.live.push_back({number, inode->i_links_count, isDirectory(*inode)});
+        if (isDirectory(*inode)) {
+            state.directories.push_back({number, *inode});
+        }
+    }
+    if (scanner.failed()) {
+        problem(where + "error reading the inode table", false);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    report->inodeTableReads += scanner.getReads();
+}
+
+// Claims the blocks of an inode in use. False when its block map is unusable,
+// in which case the inode is treated as damaged.
+bool Fsck::claimBlocks(uint32_t inodeNumber, const Inode::Ext4Inode &inode, std::shared_ptr<BufferCache> &cache) {
+    const Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    std::string name = "inode " + std::to_string(inodeNumber);
+    if (inode.i_flags & Inode::INLINE_DATA_FL) {
+        if (isDirectory(inode) || inode.i_size > Inode::INLINE_DATA_SIZE) {
+            problem(name + ": bad inline data");
+            return false;
+        }
+        if (inode.i_blocks != 0) {
+            problem(name + ": i_blocks is " + std::to_string(inode.i_blocks) + ", should be 0");
+            std::lock_guard<std::mutex> lock(mutex);
+            blockCountFixes.push_back({inodeNumber, 0});
+        }
+        return true;
+    }
+    if (!(inode.i_flags & Inode::EXTENTS_FL)) {
+        problem(name + ": neither an extent tree nor inline data");
+        return false;
+    }
+
+    ExtentTree tree(cache);
+    std::vector<ExtentTree::Extent> extents;
+    std::vector<uint64_t> nodes;
+    if (!tree.load(inode.i_block, extents) || !tree.collectNodeBlocks(inode.i_block, nodes)) {
+        problem(name + ": damaged extent tree");
+        return false;
+    }
+    for (uint64_t node : nodes) {
+        extents.push_back({0, node, 1});
+    }
+    uint64_t blocks = 0;
+    for (const auto &extent : extents) {
+        if (extent.length == 0 || extent.physical < sb.s_first_data_block ||
+            extent.physical + extent.length > sb.s_blocks_count) {
+            problem(name + ": " + describeRun("blocks", extent.physical, extent.length) + " lie outside the image");
+            return false;
+        }
+        blocks += extent.length;
+    }
+
+    for (const auto &extent : extents) {
+        uint64_t shared = claimRun(extent.physical, extent.length);
+        if (shared > 0) {
+            problem(name + ": " + std::to_string(shared) + " of " +
+                        describeRun("blocks", extent.physical, extent.length) + " are claimed more than once",
+                    false);
+        }
+    }
+
+    uint32_t expected = static_cast<uint32_t>(blocks * (superblock->getBlockSize() / 512));
+    if (inode.i_blocks != expected) {
+        problem(name + ": i_blocks is " + std::to_string(inode.i_blocks) + ", should be " + std::to_string(expected));
+        std::lock_guard<std::mutex> lock(mutex);
+        blockCountFixes.push_back({inodeNumber, expected});
+    }
+    return true;
+}
+
+uint64_t Fsck::claimRun(uint64_t first, uint64_t count) {
+    const Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    uint64_t shared = 0;
+    for (uint64_t block = first; block < first + count;) {
+        uint32_t group = static_cast<uint32_t>((block - sb.s_first_data_block) / sb.s_blocks_per_group);
+        uint64_t groupStart = superblock->getGroupFirstBlock(group);
+        uint64_t groupEnd = std::min<uint64_t>(first + count, groupStart + sb.s_blocks_per_group);
+        GroupState &state = groups[group];
+        if (!state.shares.empty()) {
+            // A block at a time, counting the owners; blocks the table says
+            // are shared may be claimed again
+            for (; block < groupEnd; ++block) {
+                state.owners[block - groupStart].fetch_add(1, std::memory_order_relaxed);
+                uint64_t mask = uint64_t(1) << (block % 64);
+                uint64_t before = claimed[block / 64].fetch_or(mask, std::memory_order_relaxed);
+                shared += (before & mask) && state.shares[block - groupStart] == 0;
+            }
+            continue;
+        }
+        // A word at a time; bits that were already set belong to someone else
+        while (block < groupEnd) {
+            uint64_t bit = block % 64;
+            uint64_t length = std::min<uint64_t>(64 - bit, groupEnd - block);
+            uint64_t mask = (length == 64 ? ~uint64_t(0) : ((uint64_t(1) << length) - 1)) << bit;
+            uint64_t before = claimed[block / 64].fetch_or(mask, std::memory_order_relaxed);
+            shared += static_cast<uint64_t>(__builtin_popcountll(before & mask));
+            block += length;
+        }
+    }
+    return shared;
+}
+
+bool Fsck::isLive(uint32_t inodeNumber) const {
+    uint32_t inodesPerGroup = superblock->getSuperblock().s_inodes_per_group;
+    uint32_t group = inodeNumber / inodesPerGroup;
+    return inodeNumber >= FileSystem::ROOT_INODE && group < groups.size() &&
+           groups[group].liveInodes.test(inodeNumber % inodesPerGroup);
+}
+
+// Pass 2: every entry of the group's directories names an inode in use
+void Fsck::walkDirectories(uint32_t group, std::shared_ptr<BufferCache> &cache) {
+    ExtentTree tree(cache);
+    for (auto &directory : groups[group].directories) {
+        Inode::Ext4Inode &dir = directory.second;
+        Directory listing(cache, dir, [&tree, &dir](uint32_t logical, bool) -> int64_t {
+            ExtentTree::Extent extent;
+            if (!tree.lookup(dir.i_block, logical, extent)) {
+                return -1;
+            }
+            return static_cast<int64_t>(extent.physical + (logical - extent.logical));
+        });
+        std::vector<Directory::Entry> entries;
+        std::string name = "directory " + std::to_string(directory.first);
+        if (!listing.list(entries)) {
+            problem(name + ": cannot be listed", false);
+            continue;
+        }
+        for (const auto &entry : entries) {
+            if (!isLive(entry.inode) || orphans.count(entry.inode)) {
+                problem(name + ": entry '" + entry.name + "' names inode " + std::to_string(entry.inode) +
+                        ", which is not in use");
+                std::lock_guard<std::mutex> lock(mutex);
+                dangling.push_back({directory.first, entry.name});
+                continue;
+            }
+            references[entry.inode].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Pass 3: link counts, block bitmap and descriptor counters
+void Fsck::compareGroup(uint32_t group) {
+    GroupState &state = groups[group];
+    std::string where = "group " + std::to_string(group) + ": ";
+    uint64_t unattached = 0;
+    for (const LiveInode &inode : state.live) {
+        uint32_t links = references[inode.number].load(std::memory_order_relaxed);
+        if (links == 0) {
+            ++unattached; // reachable by number only
+            continue;
+        }
+        if (links != inode.links) {
+            problem("inode " + std::to_string(inode.number) + ": link count is " + std::to_string(inode.links) +
+                    ", should be " + std::to_string(links));
+            std::lock_guard<std::mutex> lock(mutex);
+            linkFixes.push_back({inode.number, links});
+        }
+    }
+
+    // The block bitmap, in runs of blocks that are wrong the same way
+    uint64_t first = superblock->getGroupFirstBlock(group);
+    uint32_t blocksInGroup = superblock->getBlocksInGroup(group);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < blocksInGroup;) {
+        uint64_t block = first + i;
+        bool inUse = (claimed[block / 64].load(std::memory_order_relaxed) >> (block % 64)) & 1;
+        used += inUse;
+        if (inUse == state.blockBitmap.test(i)) {
+            ++i;
+            continue;
+        }
+        uint32_t run = 1;
+        for (; i + run < blocksInGroup; ++run) {
+            uint64_t next = block + run;
+            bool nextInUse = (claimed[next / 64].load(std::memory_order_relaxed) >> (next % 64)) & 1;
+            if (nextInUse != inUse || nextInUse == state.blockBitmap.test(i + run)) {
+                break;
+            }
+            used += nextInUse;
+        }
+        problem(describeRun("blocks", block, run) + (inUse ? " are in use but marked free" : " are marked in use but unused"));
+        state.blockBitmapWrong = true;
+        i += run;
+    }
+
+    // Each block's extra owners, against the table
+    uint64_t sharedBlocks = 0;
+    uint32_t wrongShares = 0;
+    for (uint32_t i = 0; i < state.shares.size(); ++i) {
+        uint32_t owners = state.owners[i].load(std::memory_order_relaxed);
+        uint32_t expected = owners > 1 ? owners - 1 : 0;
+        sharedBlocks += owners > 1;
+        if (state.shares[i] != expected) {
+            state.shares[i] = expected;
+            ++wrongShares;
+        }
+    }
+    if (wrongShares > 0) {
+        problem(where + std::to_string(wrongShares) + " reference counts are wrong");
+        state.sharesWrong = true;
+    }
+
+    uint32_t inodesPerGroup = superblock->getSuperblock().s_inodes_per_group;
+    uint32_t usedInodes = static_cast<uint32_t>(state.liveInodes.countOnes(0, inodesPerGroup));
+    for (size_t word = 0; !state.inodeBitmapWrong && word < state.liveInodes.wordCount(); ++word) {
+        state.inodeBitmapWrong = state.liveInodes.data()[word] != state.inodeBitmap.data()[word];
+    }
+    state.freeBlocks = blocksInGroup - used;
+    state.freeInodes = inodesPerGroup - usedInodes;
+    if (BlockGroup::getFreeBlocksCount(state.desc) != state.freeBlocks) {
+        problem(where + "free blocks count is " + std::to_string(BlockGroup::getFreeBlocksCount(state.desc)) +
+                ", should be " + std::to_string(state.freeBlocks));
+        state.descDamaged = true;
+    }
+    if (BlockGroup::getFreeInodesCount(state.desc) != state.freeInodes) {
+        problem(where + "free inodes count is " + std::to_string(BlockGroup::getFreeInodesCount(state.desc)) +
+                ", should be " + std::to_string(state.freeInodes));
+        state.descDamaged = true;
+    }
+    if (state.desc.bg_used_dirs_count != state.usedDirs) {
+        problem(where + "directory count is " + std::to_string(state.desc.bg_used_dirs_count) + ", should be " +
+                std::to_string(state.usedDirs));
+        state.descDamaged = true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    report->inodesInUse += state.live.size();
+    report->directories += state.usedDirs;
+    report->blocksInUse += used;
+    report->unattached += unattached;
+    report->orphans += state.orphans;
+    report->sharedBlocks += sharedBlocks;
+}
+
+// Writes every fix, one thread, after all passes are done
+bool Fsck::applyRepairs() {
+    uint64_t blockSize = superblock->getBlockSize();
+    uint32_t inodesPerGroup = superblock->getSuperblock().s_inodes_per_group;
+    auto inodeOffset = [&](uint32_t number) {
+        return static_cast<uint64_t>(groups[number / inodesPerGroup].desc.bg_inode_table) * blockSize +
+               static_cast<uint64_t>(number % inodesPerGroup) * sizeof(Inode::Ext4Inode);
+    };
+    bool ok = true;
+
+    // Entries naming inodes that are not in use
+    ExtentTree tree(imageCache);
+    for (const DanglingEntry &entry : dangling) {
+        for (auto &directory : groups[entry.directory / inodesPerGroup].directories) {
+            if (directory.first != entry.directory) {
+                continue;
+            }
+            Inode::Ext4Inode &dir = directory.second;
+            Directory listing(imageCache, dir, [&tree, &dir](uint32_t logical, bool) -> int64_t {
+                ExtentTree::Extent extent;
+                if (!tree.lookup(dir.i_block, logical, extent)) {
+                    return -1;
+                }
+                return static_cast<int64_t>(extent.physical + (logical - extent.logical));
+            });
+            ok = listing.remove(entry.name) && ok;
+        }
+    }
+
+    // Inodes: damaged ones are cleared, counts are rewritten
+    static const Inode::Ext4Inode cleared = {};
+    for (const GroupState &state : groups) {
+        for (uint32_t number : state.damaged) {
+            ok = device->write(inodeOffset(number), &cleared, sizeof(cleared)) && ok;
+        }
+    }
+    auto rewrite = [&](uint32_t number, const std::function<void(Inode::Ext4Inode &)> &change) {
+        Inode::Ext4Inode inode;
+        uint64_t offset = inodeOffset(number);
+        if (!device->read(offset, &inode, sizeof(inode))) {
+            return false;
+        }
+        change(inode);
+        Inode::setChecksum(inode, offset);
+        return device->write(offset, &inode, sizeof(inode));
+    };
+    for (const auto &fix : linkFixes) {
+        ok = rewrite(fix.first, [&fix](Inode::Ext4Inode &inode) { inode.i_links_count = static_cast<uint16_t>(fix.second); }) && ok;
+    }
+    for (const auto &fix : blockCountFixes) {
+        ok = rewrite(fix.first, [&fix](Inode::Ext4Inode &inode) { inode.i_blocks = fix.second; }) && ok;
+    }
+
+    for (const GroupState &state : groups) {
+        if (state.sharesWrong) {
+            ok = device->write(state.desc.bg_refcount_table * blockSize, state.shares.data(),
+                               state.shares.size() * sizeof(uint32_t)) &&
+                 ok;
+        }
+    }
+
+    // Bitmaps and descriptors. Writing a bitmap initializes the group.
+    Superblock::Ext4Superblock &sb = superblock->getSuperblock();
+    sb.s_free_blocks_count = 0;
+    sb.s_free_inodes_count = 0;
+    std::vector<BlockGroup::Ext4GroupDesc> descs(groups.size());
+    for (uint32_t g = 0; g < groups.size(); ++g) {
+        GroupState &state = groups[g];
+        if (state.inodeBitmapWrong || state.blockBitmapWrong) {
+            Bitmap blocks(superblock->getBlocksInGroup(g));
+            uint64_t first = superblock->getGroupFirstBlock(g);
+            for (uint32_t i = 0; i < blocks.size(); ++i) {
+                if ((claimed[(first + i) / 64].load(std::memory_order_relaxed) >> ((first + i) % 64)) & 1) {
+                    blocks.set(i);
+                }
+            }
+            blocks.padTail();
+            state.liveInodes.padTail();
+            ok = device->write(state.desc.bg_block_bitmap * blockSize, blocks.data(), blocks.byteSize()) &&
+                 device->write(state.desc.bg_inode_bitmap * blockSize, state.liveInodes.data(),
+                               state.liveInodes.byteSize()) &&
+                 ok;
+            state.desc.bg_flags &= static_cast<uint16_t>(~(BlockGroup::BLOCK_UNINIT | BlockGroup::INODE_UNINIT));
+            state.descDamaged = true;
+        }
+        if (state.descDamaged) {
+            BlockGroup::setFreeCounts(state.desc, state.freeBlocks, state.freeInodes);
+            state.desc.bg_used_dirs_count = static_cast<uint16_t>(state.usedDirs);
+            BlockGroup::setChecksum(state.desc, g);
+        }
+        descs[g] = state.desc;
+        sb.s_free_blocks_count += state.freeBlocks;
+        sb.s_free_inodes_count += state.freeInodes;
+    }
+    ok = device->write(Superblock::GROUP_DESC_BLOCK * blockSize, descs.data(), descs.size() * sizeof(descs[0])) && ok;
+    if (orphanListBroken) {
+        if (orphanListEnd == 0) {
+            sb.s_last_orphan = 0;
+        } else {
+            ok = rewrite(orphanListEnd, [](Inode::Ext4Inode &inode) { inode.i_dtime = 0; }) && ok;
+        }
+    }
+    superblock->writeSuperblockToDisk();
+    return imageCache->sync() && ok;
+}
+
+void Fsck::problem(const std::string &description, bool repairable) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++report->errors;
+    if (repairable && options.repair) {
+        ++repairs;
+    }
+    if (report->problems.size() < options.maxProblems) {
+        report->problems.push_back(description);
+    }
+}
@@ -1,37 +1,58 @@
 #include "Inode.h"
-#include <fstream>
+#include "Crc32c.h"
+#include "Stats.h"
+#include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <ctime>
 
-Inode::Inode(const std::string &disk, uint32_t inodeTableStart) : disk(disk), inodeTableStart(inodeTableStart) {}
+const uint32_t Inode::EXTENTS_FL;
+const uint32_t Inode::INLINE_DATA_FL;
+const uint32_t Inode::SHARED_FL;
+const uint32_t Inode::INLINE_DATA_SIZE;
+const uint16_t Inode::TYPE_MASK;
+const uint16_t Inode::DIRECTORY;
+const uint16_t Inode::REGULAR_FILE;
 
-void Inode::readInodeFromDisk(uint32_t inodeNumber) {
-    std::ifstream diskFile(disk, std::ios::binary);
-    if (!diskFile) {
-        std::cerr << "Error opening disk file" << std::endl;
-        return;
-    }
+Inode::Inode(const std::string &disk, uint64_t inodeTableStart)
+    : cache(std::make_shared<BufferCache>(std::make_shared<BlockDevice>(disk))), inodeTableStart(inodeTableStart), inode() {
+    // A standalone inode has nobody to flush it, so keep the disk current
+    cache->setWriteThrough(true);
+}
+
+Inode::Inode(std::shared_ptr<BufferCache> cache, uint64_t inodeTableStart)
+    : cache(std::move(cache)), inodeTableStart(inodeTableStart), inode() {}
 
-    uint32_t inodeOffset = inodeTableStart + inodeNumber * sizeof(Ext4Inode);
-    diskFile.seekg(inodeOffset, std::ios::beg);
-    diskFile.read(reinterpret_cast<char *>(&inode), sizeof(inode));
-    diskFile.close();
+uint64_t Inode::inodeOffset(uint32_t inodeNumber) const {
+    return inodeTableStart + static_cast<uint64_t>(inodeNumber) * sizeof(Ext4Inode);
 }
 
-void Inode::writeInodeToDisk(uint32_t inodeNumber) {
-    std::ofstream diskFile(disk, std::ios::binary | std::ios::in);
-    if (!diskFile) {
-        std::cerr << "Error opening disk file" << std::endl;
-        return;
+bool Inode::readInodeFromDisk(uint32_t inodeNumber) {
+    Stats::Scope scope(Stats::INODE_READ);
+    if (!cache->read(inodeOffset(inodeNumber), &inode, sizeof(inode))) {
+        std::cerr << "Error reading inode " << inodeNumber << std::endl;
+        return false;
+    }
+    if (!verifyChecksum(inode, inodeOffset(inodeNumber))) {
+        std::cerr << "Checksum mismatch in inode " << inodeNumber << std::endl;
+        return false;
     }
+    return true;
+}
 
-    uint32_t inodeOffset = inodeTableStart + inodeNumber * sizeof(Ext4Inode);
-    diskFile.seekp(inodeOffset, std::ios::beg);
-    diskFile.write(reinterpret_cast<const char *>(&inode), sizeof(inode));
-    diskFile.close();
+void Inode::writeInodeToDisk(uint32_t inodeNumber) {
+    Stats::Scope scope(Stats::INODE_WRITE);
+    setChecksum(inode, inodeOffset(inodeNumber));
+    if (!cache->write(inodeOffset(inodeNumber), &inode, sizeof(inode))) {
+        std::cerr << "Error writing inode " << inodeNumber << std::endl;
+    }
 }
 
 void Inode::createInode(uint16_t mode, uint32_t size) {
+    initInode(inode, mode, size);
+}
+
+void Inode::initInode(Ext4Inode &inode, uint16_t mode, uint32_t size) {
     inode.i_mode = mode;
     inode.i_uid = 0;
     inode.i_size = size;
@@ -44,6 +65,22 @@ void Inode::createInode(uint16_t mode, uint32_t size) {
     for (int i = 0; i < 15; ++i) {
         inode.i_block[i] = 0;
     }
+    inode.i_checksum = 0;
+}
+
+namespace {
+uint32_t inodeChecksum(const Inode::Ext4Inode &inode, uint64_t offset) {
+    return Crc32c::extend(Crc32c::compute(&offset, sizeof(offset)), &inode, offsetof(Inode::Ext4Inode, i_checksum));
+}
+}
+
+void Inode::setChecksum(Ext4Inode &inode, uint64_t offset) {
+    inode.i_checksum = inodeChecksum(inode, offset);
+}
+
+bool Inode::verifyChecksum(const Ext4Inode &inode, uint64_t offset) {
+    static const Ext4Inode unused = {};
+    return inode.i_checksum == inodeChecksum(inode, offset) || std::memcmp(&inode, &unused, sizeof(inode)) == 0;
 }
 
 void Inode::deleteInode() {
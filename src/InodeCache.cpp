@@ -0,0 +1,279 @@
+#include "InodeCache.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+const size_t InodeCache::DEFAULT_CAPACITY;
+const size_t InodeCache::SLAB_INODES;
+
+InodeCache::Handle::Handle(const Handle &other) : owner(other.owner), slot(other.slot) {
+    if (slot) {
+        std::lock_guard<std::mutex> lock(owner->mutex);
+        ++slot->refs;
+    }
+}
+
+InodeCache::Handle::Handle(Handle &&other) noexcept : owner(other.owner), slot(other.slot) {
+    other.owner = nullptr;
+    other.slot = nullptr;
+}
+
+InodeCache::Handle &InodeCache::Handle::operator=(Handle other) noexcept {
+    std::swap(owner, other.owner);
+    std::swap(slot, other.slot);
+    return *this;
+}
+
+InodeCache::Handle::~Handle() {
+    if (slot) {
+        owner->release(slot);
+    }
+}
+
+Inode::Ext4Inode &InodeCache::Handle::operator*() const {
+    return slot->inode;
+}
+
+uint32_t InodeCache::Handle::number() const {
+    return slot->number;
+}
+
+void InodeCache::Handle::markDirty() {
+    owner->markDirty(slot);
+}
+
+InodeCache::InodeCache(std::shared_ptr<BufferCache> cache, Locator locate, size_t capacity)
+    : cache(std::move(cache)), locate(std::move(locate)), capacity(std::max<size_t>(capacity, 1)),
+      lruHead(nullptr), lruTail(nullptr), cached(0), dirtyCount(0), hits(0), misses(0), blockWrites(0) {
+    blockSize = this->cache->getDevice()->getBlockSize();
+    size_t bucketCount = 1;
+    while (bucketCount < this->capacity) {
+        bucketCount <<= 1;
+    }
+    buckets.assign(bucketCount, nullptr);
+}
+
+InodeCache::~InodeCache() {
+    flush();
+}
+
+InodeCache::Handle InodeCache::get(uint32_t inodeNumber) {
+    return acquire(inodeNumber, true);
+}
+
+InodeCache::Handle InodeCache::create(uint32_t inodeNumber) {
+    return acquire(inodeNumber, false);
+}
+
+bool InodeCache::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return flushLocked();
+}
+
+InodeCache::Handle InodeCache::acquire(uint32_t inodeNumber, bool read) {
+    Stats::Scope scope(Stats::INODE_READ);
+    std::lock_guard<std::mutex> lock(mutex);
+    Slot *slot = find(inodeNumber);
+    if (slot) {
+        ++hits;
+        unlinkLru(slot);
+        pushLru(slot);
+    } else {
+        ++misses;
+        slot = allocateSlot();
+        slot->number = inodeNumber;
+        slot->dirty = false;
+        if (read) {
+            uint64_t offset = locate(inodeNumber);
+            if (!cache->read(offset, &slot->inode, sizeof(slot->inode))) {
+                std::cerr << "Error reading inode " << inodeNumber << std::endl;
+                freeSlots.push_back(slot);
+                return Handle();
+            }
+            if (!Inode::verifyChecksum(slot->inode, offset)) {
+                std::cerr << "Checksum mismatch in inode " << inodeNumber << std::endl;
+                freeSlots.push_back(slot);
+                return Handle();
+            }
+        }
+        Slot *&bucket = buckets[inodeNumber & (buckets.size() - 1)];
+        slot->hashNext = bucket;
+        bucket = slot;
+        pushLru(slot);
+        ++cached;
+    }
+    if (!read) {
+        std::memset(&slot->inode, 0, sizeof(slot->inode));
+    }
+    ++slot->refs;
+    return Handle(this, slot);
+}
+
+InodeCache::Slot *InodeCache::find(uint32_t inodeNumber) const {
+    Slot *slot = buckets[inodeNumber & (buckets.size() - 1)];
+    while (slot && slot->number != inodeNumber) {
+        slot = slot->hashNext;
+    }
+    return slot;
+}
+
+// A free slot, the least recently used unreferenced one, or a new slab when
+// every cached inode is referenced
+InodeCache::Slot *InodeCache::allocateSlot() {
+    if (freeSlots.empty() && cached >= capacity) {
+        Slot *victim = lruTail;
+        while (victim && victim->refs > 0) {
+            victim = victim->lruPrev;
+        }
+        if (victim) {
+            if (victim->dirty && !flushLocked()) {
+                std::cerr << "Error writing back inodes" << std::endl;
+            }
+            unlinkHash(victim);
+            unlinkLru(victim);
+            --cached;
+            freeSlots.push_back(victim);
+        }
+    }
+    if (freeSlots.empty()) {
+        slabs.emplace_back(new Slot[SLAB_INODES]);
+        for (size_t i = SLAB_INODES; i-- > 0;) {
+            freeSlots.push_back(&slabs.back()[i]);
+        }
+    }
+    Slot *slot = freeSlots.back();
+    freeSlots.pop_back();
+    slot->refs = 0;
+    return slot;
+}
+
+void InodeCache::unlinkHash(Slot *slot) {
+    Slot **link = &buckets[slot->number & (buckets.size() - 1)];
+    while (*link != slot) {
+        link = &(*link)->hashNext;
+    }
+    *link = slot->hashNext;
+}
+
+void InodeCache::unlinkLru(Slot *slot) {
+    (slot->lruPrev ? slot->lruPrev->lruNext : lruHead) = slot->lruNext;
+    (slot->lruNext ? slot->lruNext->lruPrev : lruTail) = slot->lruPrev;
+}
+
+void InodeCache::pushLru(Slot *slot) {
+    slot->lruPrev = nullptr;
+    slot->lruNext = lruHead;
+    (lruHead ? lruHead->lruPrev : lruTail) = slot;
+    lruHead = slot;
+}
+
+void InodeCache::release(Slot *slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    --slot->refs;
+}
+
+// Logging and queueing under the cache's mutex keeps every journaled inode
+// change visible to the next flush(), which a checkpoint relies on. The
+// checksum goes into the journaled copy, so a replayed inode verifies; it is
+// computed once per markDirty, on that copy only.
+void InodeCache::markDirty(Slot *slot) {
+    Stats::Scope scope(Stats::INODE_WRITE);
+    uint64_t offset = locate(slot->number);
+    std::lock_guard<std::mutex> lock(mutex);
+    slot->pending = slot->inode;
+    Inode::setChecksum(slot->pending, offset);
+    cache->logWrite(offset, &slot->pending, sizeof(slot->pending));
+    if (!slot->dirty) {
+        slot->dirty = true;
+        ++dirtyCount;
+    }
+}
+
+void InodeCache::markDirty(const std::vector<Handle> &handles) {
+    Stats::Scope scope(Stats::INODE_WRITE);
+    std::vector<std::pair<uint64_t, Slot *>> slots;
+    slots.reserve(handles.size());
+    for (const Handle &handle : handles) {
+        if (handle) {
+            slots.push_back({locate(handle.slot->number), handle.slot});
+        }
+    }
+    std::sort(slots.begin(), slots.end(),
+              [](const std::pair<uint64_t, Slot *> &a, const std::pair<uint64_t, Slot *> &b) { return a.first < b.first; });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<char> run;
+    size_t i = 0;
+    while (i < slots.size()) {
+        size_t j = i + 1;
+        while (j < slots.size() && slots[j].first == slots[j - 1].first + sizeof(Inode::Ext4Inode)) {
+            ++j;
+        }
+        run.resize((j - i) * sizeof(Inode::Ext4Inode));
+        for (size_t k = i; k < j; ++k) {
+            Slot *slot = slots[k].second;
+            slot->pending = slot->inode;
+            Inode::setChecksum(slot->pending, slots[k].first);
+            std::memcpy(run.data() + (k - i) * sizeof(Inode::Ext4Inode), &slot->pending, sizeof(Inode::Ext4Inode));
+            if (!slot->dirty) {
+                slot->dirty = true;
+                ++dirtyCount;
+            }
+        }
+        cache->logWrite(slots[i].first, run.data(), run.size());
+        i = j;
+    }
+}
+
+bool InodeCache::flushLocked() {
+    if (dirtyCount == 0) {
+        return true;
+    }
+    std::vector<std::pair<uint64_t, Slot *>> dirty;
+    dirty.reserve(dirtyCount);
+    for (Slot *slot = lruHead; slot; slot = slot->lruNext) {
+        if (slot->dirty) {
+            dirty.push_back({locate(slot->number), slot});
+        }
+    }
+    std::sort(dirty.begin(), dirty.end(),
+              [](const std::pair<uint64_t, Slot *> &a, const std::pair<uint64_t, Slot *> &b) { return a.first < b.first; });
+
+    bool ok = true;
+    std::vector<char> run;
+    size_t i = 0;
+    while (i < dirty.size()) {
+        // Inodes whose blocks are the same or adjacent form one run
+        uint64_t firstBlock = dirty[i].first / blockSize;
+        uint64_t lastBlock = (dirty[i].first + sizeof(Inode::Ext4Inode) - 1) / blockSize;
+        size_t j = i + 1;
+        while (j < dirty.size() && dirty[j].first / blockSize <= lastBlock + 1) {
+            lastBlock = std::max(lastBlock, (dirty[j].first + sizeof(Inode::Ext4Inode) - 1) / blockSize);
+            ++j;
+        }
+
+        uint64_t runStart = firstBlock * blockSize;
+        run.resize((lastBlock - firstBlock + 1) * blockSize);
+        if (!cache->read(runStart, run.data(), run.size())) {
+            ok = false;
+            i = j;
+            continue;
+        }
+        for (size_t k = i; k < j; ++k) {
+            std::memcpy(run.data() + (dirty[k].first - runStart), &dirty[k].second->pending, sizeof(Inode::Ext4Inode));
+        }
+        // Already journaled by markDirty()
+        if (cache->write(runStart, run.data(), run.size(), false)) {
+            for (size_t k = i; k < j; ++k) {
+                dirty[k].second->dirty = false;
+            }
+            dirtyCount -= j - i;
+            blockWrites += lastBlock - firstBlock + 1;
+        } else {
+            ok = false;
+        }
+        i = j;
+    }
+    return ok;
+}
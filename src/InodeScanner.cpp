@@ -0,0 +1,63 @@
+#include "InodeScanner.h"
+#include "IoEngine.h"
+#include <algorithm>
+
+const size_t InodeScanner::DEFAULT_CHUNK_BYTES;
+
+InodeScanner::InodeScanner(std::shared_ptr<BlockDevice> device, uint64_t tableOffset, uint32_t firstInode,
+                           uint32_t count, size_t chunkBytes)
+    : device(std::move(device)),
+      tableOffset(tableOffset),
+      end(firstInode + count),
+      chunkInodes(static_cast<uint32_t>(std::max<size_t>(chunkBytes / sizeof(Inode::Ext4Inode), 1))),
+      position(firstInode),
+      chunkStart(firstInode),
+      chunkLength(0),
+      pendingStart(firstInode),
+      pendingLength(0),
+      reads(0),
+      error(false) {
+    prefetch();
+}
+
+InodeScanner::~InodeScanner() {
+    if (inFlight.valid()) {
+        inFlight.wait();
+    }
+}
+
+// Starts reading the chunk after the current one
+void InodeScanner::prefetch() {
+    uint32_t start = chunkStart + chunkLength;
+    pendingStart = start;
+    pendingLength = std::min(chunkInodes, end - start);
+    if (pendingLength == 0) {
+        return;
+    }
+    pending.resize(pendingLength);
+    inFlight = device->io().read(tableOffset + static_cast<uint64_t>(start) * sizeof(Inode::Ext4Inode), pending.data(),
+                                 static_cast<size_t>(pendingLength) * sizeof(Inode::Ext4Inode));
+    ++reads;
+}
+
+bool InodeScanner::next(uint32_t &index, const Inode::Ext4Inode *&inode) {
+    if (error || position >= end) {
+        return false;
+    }
+    if (position >= chunkStart + chunkLength) {
+        // Take the chunk that was read ahead and start on the one after it
+        if (pendingLength == 0 || !inFlight.get()) {
+            error = true;
+            return false;
+        }
+        current.swap(pending);
+        chunkStart = pendingStart;
+        chunkLength = pendingLength;
+        pendingLength = 0;
+        prefetch();
+    }
+    index = position;
+    inode = &current[position - chunkStart];
+    ++position;
+    return true;
+}
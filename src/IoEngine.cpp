@@ -0,0 +1,378 @@
+#include "IoEngine.h"
+#include "BlockDevice.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define IOENGINE_HAVE_URING 1
+#endif
+#endif
+#endif
+
+const unsigned IoEngine::DEFAULT_QUEUE_DEPTH;
+const unsigned IoEngine::MAX_POOL_THREADS;
+
+namespace {
+// An SQE carries a 32-bit length; longer requests go in pieces
+const size_t MAX_SUBMISSION = size_t(1) << 30;
+
+#ifdef IOENGINE_HAVE_URING
+int enter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+}
+#endif
+}
+
+IoEngine::IoEngine(BlockDevice &device, unsigned queueDepth, Backend backend)
+    : device(device), queueDepth(std::max(queueDepth, 1u)), inFlight(0), peakInFlight(0), submitted(0),
+      stopping(false), ringFd(-1), sqRing(nullptr), sqRingSize(0), cqRing(nullptr), cqRingSize(0), sqes(nullptr),
+      sqesSize(0), sqHead(nullptr), sqTail(nullptr), sqMask(nullptr), sqArray(nullptr), cqHead(nullptr),
+      cqTail(nullptr), cqMask(nullptr), cqes(nullptr), inRing(0), ringFailed(false) {
+    if (backend != Backend::ThreadPool && setupUring()) {
+        reaper = std::thread(&IoEngine::reapLoop, this);
+        return;
+    }
+    if (backend == Backend::Uring) {
+        std::cerr << "io_uring not available, using a thread pool" << std::endl;
+    }
+    fallBackToPool();
+}
+
+IoEngine::~IoEngine() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this]() { return inFlight == 0; });
+        stopping = true;
+#ifdef IOENGINE_HAVE_URING
+        if (ringFd >= 0 && !ringFailed) {
+            // A no-op with no operation attached tells the reaper to exit
+            unsigned tail = *sqTail;
+            unsigned index = tail & *sqMask;
+            io_uring_sqe *sqe = static_cast<io_uring_sqe *>(sqes) + index;
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            ++inRing;
+            while (enter(ringFd, 1, 0, 0) < 0 && errno == EINTR) {
+            }
+        }
+#endif
+    }
+    work.notify_all();
+    if (reaper.joinable()) {
+        reaper.join();
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    teardownUring();
+}
+
+void IoEngine::submit(bool isWrite, uint64_t offset, void *buffer, size_t length, Callback done) {
+    // What the kernel cannot do for us directly goes through the device now
+    bool direct = device.isOpen() && !device.isMapped() && length > 0 &&
+                  (!device.isDirectIO() || device.isAligned(offset, buffer, length));
+    if (!direct) {
+        done(isWrite ? device.write(offset, buffer, length) : device.read(offset, buffer, length));
+        return;
+    }
+
+    // The transfer happens on another thread (or in the kernel); charge it to
+    // the submitter as the one syscall it normally takes
+    Stats::countIo(length);
+    Operation *operation = new Operation{isWrite, offset, static_cast<char *>(buffer), length, 0, std::move(done)};
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [this]() { return inFlight < queueDepth; });
+    peakInFlight = std::max(peakInFlight, ++inFlight);
+    ++submitted;
+    if (ringFd >= 0 && !ringFailed) {
+        if (!queueUring(operation)) {
+            lock.unlock();
+            finishBlocking(operation);
+        }
+    } else {
+        pending.push_back(operation);
+        work.notify_one();
+    }
+}
+
+std::future<bool> IoEngine::read(uint64_t offset, void *buffer, size_t length) {
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+    submit(false, offset, buffer, length, [promise](bool ok) { promise->set_value(ok); });
+    return result;
+}
+
+std::future<bool> IoEngine::write(uint64_t offset, const void *buffer, size_t length) {
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+    submit(true, offset, const_cast<void *>(buffer), length, [promise](bool ok) { promise->set_value(ok); });
+    return result;
+}
+
+bool IoEngine::submitAndWait(std::vector<Request> &requests) {
+    if (requests.size() == 1) {
+        // Nothing to overlap with: skip the round trip through the queue
+        Request &request = requests[0];
+        request.ok = request.isWrite ? device.write(request.offset, request.buffer, request.length)
+                                     : device.read(request.offset, request.buffer, request.length);
+        return request.ok;
+    }
+    std::mutex doneMutex;
+    std::condition_variable allDone;
+    size_t remaining = requests.size();
+    for (Request &request : requests) {
+        submit(request.isWrite, request.offset, request.buffer, request.length, [&](bool ok) {
+            request.ok = ok;
+            // Notify under the lock: the waiter's stack frame goes away right after
+            std::lock_guard<std::mutex> lock(doneMutex);
+            if (--remaining == 0) {
+                allDone.notify_all();
+            }
+        });
+    }
+    std::unique_lock<std::mutex> lock(doneMutex);
+    allDone.wait(lock, [&]() { return remaining == 0; });
+    return std::all_of(requests.begin(), requests.end(), [](const Request &request) { return request.ok; });
+}
+
+// The thread pool, at startup or when the ring stops working; the caller holds
+// 'mutex' unless the engine is being constructed
+void IoEngine::fallBackToPool() {
+    ringFailed = ringFd >= 0;
+    unsigned threads = std::min(queueDepth, MAX_POOL_THREADS);
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(&IoEngine::workerLoop, this);
+    }
+}
+
+void IoEngine::finishBlocking(Operation *operation) {
+    size_t done = operation->done;
+    bool ok = operation->isWrite
+                  ? device.write(operation->offset + done, operation->buffer + done, operation->length - done)
+                  : device.read(operation->offset + done, operation->buffer + done, operation->length - done);
+    complete(operation, ok);
+}
+
+// Runs the callback, then frees the operation's queue slot
+void IoEngine::complete(Operation *operation, bool ok) {
+    operation->callback(ok);
+    delete operation;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--inFlight == 0) {
+        drained.notify_all();
+    }
+    space.notify_one();
+}
+
+void IoEngine::workerLoop() {
+    for (;;) {
+        Operation *operation;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            operation = pending.front();
+            pending.pop_front();
+        }
+        finishBlocking(operation);
+    }
+}
+
+#ifdef IOENGINE_HAVE_URING
+
+bool IoEngine::setupUring() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(::syscall(__NR_io_uring_setup, queueDepth, &params));
+    if (fd < 0) {
+        return false;
+    }
+    ringFd = fd;
+    queueDepth = params.sq_entries; // rounded up to a power of two
+
+    // The completion ring is twice the submission ring, so it cannot overflow
+    // while at most queueDepth requests are in flight
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+    sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = singleMap ? sqRing
+                       : ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        sqRing = sqRing == MAP_FAILED ? nullptr : sqRing;
+        cqRing = cqRing == MAP_FAILED ? nullptr : cqRing;
+        sqes = sqes == MAP_FAILED ? nullptr : sqes;
+        teardownUring();
+        return false;
+    }
+
+    char *sq = static_cast<char *>(sqRing);
+    char *cq = static_cast<char *>(cqRing);
+    sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+void IoEngine::teardownUring() {
+    if (sqes) {
+        ::munmap(sqes, sqesSize);
+    }
+    if (cqRing && cqRing != sqRing) {
+        ::munmap(cqRing, cqRingSize);
+    }
+    if (sqRing) {
+        ::munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+        ::close(ringFd);
+    }
+    sqes = sqRing = cqRing = nullptr;
+    ringFd = -1;
+}
+
+// Queues the rest of an operation; the caller holds 'mutex' and the operation
+// already owns one of the queueDepth slots, so the ring has room for it
+bool IoEngine::queueUring(Operation *operation) {
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(sqes) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = operation->isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = device.getFd();
+    sqe->addr = reinterpret_cast<uint64_t>(operation->buffer + operation->done);
+    sqe->len = static_cast<uint32_t>(std::min(operation->length - operation->done, MAX_SUBMISSION));
+    sqe->off = operation->offset + operation->done;
+    sqe->user_data = reinterpret_cast<uint64_t>(operation);
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int result;
+    while ((result = enter(ringFd, 1, 0, 0)) < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+    }
+    if (result < 0) {
+        // The kernel took nothing; take the entry back out of the ring
+        std::cerr << "Error submitting I/O: " << std::strerror(errno) << std::endl;
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+    ++inRing;
+    return true;
+}
+
+void IoEngine::resubmit(Operation *operation) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ringFailed) {
+            pending.push_back(operation);
+            work.notify_one();
+            return;
+        }
+        if (queueUring(operation)) {
+            return;
+        }
+    }
+    finishBlocking(operation);
+}
+
+void IoEngine::reapLoop() {
+    // Once waiting on the ring fails, new requests go to the thread pool and
+    // the completions of the ones the kernel still holds are polled for
+    bool polling = false;
+    for (;;) {
+        if (polling) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        } else if (enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN &&
+                   errno != EBUSY) {
+            std::cerr << "Error waiting for I/O: " << std::strerror(errno) << "; using a thread pool" << std::endl;
+            std::lock_guard<std::mutex> lock(mutex);
+            fallBackToPool();
+            polling = true;
+        }
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        {
+            // Operations are queued under 'mutex'; taking it here orders their
+            // setup before our reads even though the hand-off went through the kernel
+            std::lock_guard<std::mutex> lock(mutex);
+            inRing -= tail - head;
+            if (polling && inRing == 0 && head == tail) {
+                return;
+            }
+        }
+        for (; head != tail; ++head) {
+            const io_uring_cqe *cqe = static_cast<const io_uring_cqe *>(cqes) + (head & *cqMask);
+            Operation *operation = reinterpret_cast<Operation *>(cqe->user_data);
+            int result = cqe->res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            if (!operation) {
+                return; // shutdown
+            }
+
+            if (result == -EINTR || result == -EAGAIN) {
+                resubmit(operation);
+            } else if (result == -EINVAL || result == -EOPNOTSUPP) {
+                // Kernel without IORING_OP_READ/WRITE: do it the blocking way
+                finishBlocking(operation);
+            } else if (result < 0) {
+                complete(operation, false);
+            } else if (result == 0) {
+                // End of file: the rest of a read is a hole past the image
+                if (!operation->isWrite) {
+                    std::memset(operation->buffer + operation->done, 0, operation->length - operation->done);
+                }
+                complete(operation, !operation->isWrite);
+            } else if ((operation->done += static_cast<size_t>(result)) < operation->length) {
+                resubmit(operation);
+            } else {
+                complete(operation, true);
+            }
+        }
+    }
+}
+
+#else
+
+bool IoEngine::setupUring() {
+    return false;
+}
+
+void IoEngine::teardownUring() {}
+
+bool IoEngine::queueUring(Operation *) {
+    return false;
+}
+
+void IoEngine::resubmit(Operation *operation) {
+    finishBlocking(operation);
+}
+
+void IoEngine::reapLoop() {}
+
+#endif
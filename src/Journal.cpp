@@ -1,39 +1,171 @@
 #include "Journal.h"
-#include <fstream>
+#include "Crc32c.h"
+#include "Stats.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
 
-Journal::Journal(const std::string &disk) : disk(disk) {}
+const uint32_t Journal::MAGIC_NUMBER;
+const uint32_t Journal::DESCRIPTOR_BLOCK;
+const uint32_t Journal::COMMIT_BLOCK;
+const uint32_t Journal::SUPERBLOCK;
+const uint32_t Journal::REVOKE_BLOCK;
+const uint32_t Journal::METADATA_BLOCK;
+const uint64_t Journal::DEFAULT_REGION_SIZE;
 
-void Journal::writeJournal(const JournalEntry &entry) {
-    std::ofstream diskFile(disk, std::ios::binary | std::ios::app);
-    if (!diskFile) {
-        std::cerr << "Error opening disk file" << std::endl;
-        return;
+namespace {
+// Seeded with the transaction number, so a stale transaction from an earlier
+// lap of the ring never validates
+uint32_t commitChecksum(const char *records, size_t length, uint32_t transaction) {
+    return Crc32c::extend(Crc32c::compute(&transaction, sizeof(transaction)), records, length);
+}
+
+uint32_t descriptorChecksum(const Journal::TransactionHeader &header) {
+    return Crc32c::compute(&header, offsetof(Journal::TransactionHeader, t_checksum));
+}
+
+// Record prefix: header, data size, checksum
+const size_t RECORD_PREFIX = sizeof(Journal::Ext4JournalHeader) + 2 * sizeof(uint32_t);
+
+uint32_t recordChecksum(const Journal::Ext4JournalHeader &header, uint32_t dataSize, const void *data) {
+    uint32_t crc = Crc32c::compute(&header, sizeof(header));
+    crc = Crc32c::extend(crc, &dataSize, sizeof(dataSize));
+    return Crc32c::extend(crc, data, dataSize);
+}
+
+// The journals this thread holds Handles on, once per Handle
+thread_local std::vector<const Journal *> heldHandles;
+
+bool holdsHandle(const Journal *journal) {
+    return std::find(heldHandles.begin(), heldHandles.end(), journal) != heldHandles.end();
+}
+}
+
+Journal::Journal(const std::string &disk) : Journal(std::make_shared<BlockDevice>(disk)) {}
+
+Journal::Journal(std::shared_ptr<BlockDevice> device, uint64_t regionStart, uint64_t regionLength,
+                 const JournalOptions &options)
+    : device(std::move(device)), regionStart(regionStart), regionLength(static_cast<uint32_t>(regionLength)),
+      options(options), superblock(), head(0), used(0), committingBytes(0), runningRecords(0), runningTransaction(1),
+      committedTransaction(0), openHandles(0), commitLocked(false), updatesLocked(false), stopping(false), failed(false), commits(0), records(0) {
+    blockSize = this->device->getBlockSize();
+    ringSize = this->regionLength > blockSize ? this->regionLength - blockSize : 0;
+    if (ringSize < blockSize) {
+        std::cerr << "Journal region too small" << std::endl;
+        failed = true;
+    } else if (!load()) {
+        if (options.readOnly) {
+            failed = true; // the caller reports it
+        } else if (!format()) {
+            std::cerr << "Error formatting journal" << std::endl;
+            failed = true;
+        }
+    }
+    start();
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
     }
+    commitWanted.notify_all();
+    committer.join();
+}
 
-    diskFile.write(reinterpret_cast<const char *>(&entry.header), sizeof(entry.header));
-    uint32_t dataSize = entry.data.size();
-    diskFile.write(reinterpret_cast<const char *>(&dataSize), sizeof(dataSize));
-    diskFile.write(entry.data.data(), dataSize);
-    diskFile.close();
+uint32_t Journal::writeJournal(const JournalEntry &entry) {
+    return writeJournal(entry.header, entry.data.data(), static_cast<uint32_t>(entry.data.size()));
 }
 
-void Journal::readJournal(std::vector<JournalEntry> &journalEntries) {
-    std::ifstream diskFile(disk, std::ios::binary);
-    if (!diskFile) {
-        std::cerr << "Error opening disk file" << std::endl;
-        return;
+uint32_t Journal::writeJournal(const Ext4JournalHeader &header, const void *data, uint32_t dataSize) {
+    Stats::Scope scope(Stats::JOURNAL_WRITE);
+    size_t recordSize = RECORD_PREFIX + dataSize;
+    if (transactionSize(recordSize) > ringSize) {
+        std::cerr << "Journal entry larger than the journal" << std::endl;
+        return 0;
     }
+    if (header.j_magic != MAGIC_NUMBER) {
+        std::cerr << "Journal entry without the journal magic number" << std::endl;
+        return 0;
+    }
+    if (options.readOnly) {
+        std::cerr << "Journal is read-only" << std::endl;
+        return 0;
+    }
+    // Computed before taking the lock, so writers checksum in parallel
+    uint32_t checksum = recordChecksum(header, dataSize, data);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    // Commit the running transaction first if this record would not fit with
+    // it. That commit would wait for the open Handles, which may be waiting
+    // for the caller, so with any open the update is too large to log: abort.
+    while (!failed && runningRecords > 0 && transactionSize(running.size() + recordSize) > ringSize) {
+        if (openHandles > 0) {
+            std::cerr << "Journal transaction outgrew the journal; aborting it" << std::endl;
+            failed = true;
+            break;
+        }
+        commitLocked = true;
+        commitWanted.notify_one();
+        commitDone.wait(lock);
+    }
+    if (failed) {
+        return 0;
+    }
+
+    size_t offset = running.size();
+    running.resize(offset + recordSize);
+    std::memcpy(running.data() + offset, &header, sizeof(header));
+    std::memcpy(running.data() + offset + sizeof(header), &dataSize, sizeof(dataSize));
+    std::memcpy(running.data() + offset + sizeof(header) + sizeof(dataSize), &checksum, sizeof(checksum));
+    if (dataSize > 0) {
+        std::memcpy(running.data() + offset + RECORD_PREFIX, data, dataSize);
+    }
+    if (++runningRecords == 1 || running.size() >= options.maxBatchBytes) {
+        commitWanted.notify_one();
+    }
+    return runningTransaction;
+}
 
+bool Journal::waitForCommit(uint32_t transaction) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (transaction == 0 || transaction > runningTransaction ||
+        (transaction == runningTransaction && runningRecords == 0)) {
+        return !failed && transaction != 0;
+    }
+    commitDone.wait(lock, [&]() { return committedTransaction >= transaction; });
+    return !failed;
+}
+
+bool Journal::flush() {
+    Stats::Scope scope(Stats::JOURNAL_FLUSH);
+    if (holdsHandle(this)) {
+        std::cerr << "Journal flushed inside a transaction handle" << std::endl;
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    uint32_t target = runningTransaction - 1;
+    if (runningRecords > 0) {
+        target = runningTransaction;
+        commitLocked = true;
+        commitWanted.notify_one();
+    }
+    commitDone.wait(lock, [&]() { return committedTransaction >= target; });
+    return !failed;
+}
+
+void Journal::readJournal(std::vector<JournalEntry> &journalEntries) {
+    flush();
+    Cursor cursor(*this);
     JournalEntry entry;
-    while (diskFile.read(reinterpret_cast<char *>(&entry.header), sizeof(entry.header))) {
-        uint32_t dataSize;
-        diskFile.read(reinterpret_cast<char *>(&dataSize), sizeof(dataSize));
-        entry.data.resize(dataSize);
-        diskFile.read(entry.data.data(), dataSize);
+    const char *data;
+    uint32_t dataSize;
+    while (cursor.next(entry.header, data, dataSize)) {
+        entry.data.assign(data, data + dataSize);
         journalEntries.push_back(entry);
     }
-    diskFile.close();
 }
 
 void Journal::manageJournal(std::vector<JournalEntry> &journalEntries, size_t maxEntries) {
@@ -41,3 +173,310 @@ void Journal::manageJournal(std::vector<JournalEntry> &journalEntries, size_t ma
         journalEntries.erase(journalEntries.begin(), journalEntries.begin() + (journalEntries.size() - maxEntries));
     }
 }
+
+bool Journal::format() {
+    if (options.readOnly) {
+        return false;
+    }
+    flush();
+    std::lock_guard<std::mutex> lock(ringMutex);
+
+    // Zero the ring so nothing from an earlier journal can pass for a transaction
+    std::vector<char> zeros(std::min<uint32_t>(ringSize, 64 * 1024), 0);
+    for (uint32_t position = 0; position < ringSize; position += zeros.size()) {
+        if (!writeRing(position, zeros.data(), std::min<size_t>(zeros.size(), ringSize - position))) {
+            return false;
+        }
+    }
+
+    superblock = {};
+    superblock.s_header = {MAGIC_NUMBER, SUPERBLOCK, 0};
+    superblock.s_blocksize = blockSize;
+    superblock.s_maxlen = regionLength;
+    superblock.s_first = blockSize;
+    {
+        // Keep numbering transactions where we were, so waiters stay consistent
+        std::lock_guard<std::mutex> runningLock(mutex);
+        superblock.s_sequence = runningTransaction;
+    }
+    superblock.s_start = 0;
+    head = 0;
+    used = 0;
+    live.clear();
+    return writeSuperblock() && device->flush();
+}
+
+bool Journal::checkpoint(uint32_t transaction) {
+    if (options.readOnly) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(ringMutex);
+    bool moved = false;
+    while (!live.empty() && superblock.s_sequence <= transaction) {
+        superblock.s_start = (superblock.s_start + live.front()) % ringSize;
+        ++superblock.s_sequence;
+        used -= live.front();
+        live.pop_front();
+        moved = true;
+    }
+    return !moved || (writeSuperblock() && device->flush());
+}
+
+bool Journal::needsCheckpoint() {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t queued = runningRecords > 0 ? transactionSize(running.size()) : 0;
+    return used + committingBytes + queued > ringSize / 2;
+}
+
+uint32_t Journal::getCommittedTransaction() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return committedTransaction;
+}
+
+bool Journal::isOpen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !failed;
+}
+
+Journal::Handle::Handle(Journal &journal) : journal(journal) {
+    bool nested = holdsHandle(&journal);
+    std::unique_lock<std::mutex> lock(journal.mutex);
+    if (!nested) {
+        // A transaction past a quarter of the ring commits before another
+        // update joins it, so one update always fits with what it joins
+        if (!journal.failed && journal.runningRecords > 0 &&
+            journal.transactionSize(journal.running.size()) > journal.ringSize / 4) {
+            journal.commitLocked = true;
+            journal.commitWanted.notify_one();
+        }
+        std::thread::id self = std::this_thread::get_id();
+        journal.handlesAllowed.wait(lock, [&]() {
+            return !journal.commitLocked && (!journal.updatesLocked || journal.updatesOwner == self);
+        });
+    }
+    ++journal.openHandles;
+    heldHandles.push_back(&journal);
+}
+
+Journal::Handle::~Handle() {
+    heldHandles.erase(std::find(heldHandles.rbegin(), heldHandles.rend(), &journal).base() - 1);
+    std::lock_guard<std::mutex> lock(journal.mutex);
+    if (--journal.openHandles == 0) {
+        journal.commitWanted.notify_one();
+        journal.handlesClosed.notify_all();
+    }
+}
+
+void Journal::lockUpdates() {
+    std::unique_lock<std::mutex> lock(mutex);
+    handlesAllowed.wait(lock, [this]() { return !updatesLocked; });
+    updatesLocked = true;
+    updatesOwner = std::this_thread::get_id();
+    handlesClosed.wait(lock, [this]() { return openHandles == 0; });
+}
+
+void Journal::unlockUpdates() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        updatesLocked = false;
+    }
+    handlesAllowed.notify_all();
+}
+
+Journal::Cursor::Cursor(Journal &journal)
+    : journal(journal), lock(journal.ringMutex), position(journal.superblock.s_start),
+      nextTransaction(journal.superblock.s_sequence), remaining(journal.live.size()), current(0), offset(0) {}
+
+bool Journal::Cursor::next(Ext4JournalHeader &header, const char *&data, uint32_t &dataSize) {
+    for (;;) {
+        if (offset + RECORD_PREFIX <= payload.size()) {
+            uint32_t checksum;
+            std::memcpy(&header, payload.data() + offset, sizeof(header));
+            std::memcpy(&dataSize, payload.data() + offset + sizeof(header), sizeof(dataSize));
+            std::memcpy(&checksum, payload.data() + offset + sizeof(header) + sizeof(dataSize), sizeof(checksum));
+            offset += RECORD_PREFIX;
+            if (header.j_magic != MAGIC_NUMBER || dataSize > payload.size() - offset ||
+                checksum != recordChecksum(header, dataSize, payload.data() + offset)) {
+                break;
+            }
+            data = payload.data() + offset;
+            offset += dataSize;
+            return true;
+        }
+        if (remaining == 0) {
+            return false;
+        }
+
+        uint32_t size;
+        if (!journal.readTransaction(position, nextTransaction, payload, size)) {
+            break;
+        }
+        position = (position + size) % journal.ringSize;
+        current = nextTransaction++;
+        --remaining;
+        offset = 0;
+    }
+    std::cerr << "Corrupt journal transaction " << nextTransaction << std::endl;
+    remaining = 0;
+    payload.clear();
+    return false;
+}
+
+void Journal::start() {
+    committer = std::thread(&Journal::committerLoop, this);
+}
+
+// Finds the live transactions: everything from s_start that carries the next
+// sequence number and a valid commit record
+bool Journal::load() {
+    if (!device->read(regionStart, &superblock, sizeof(superblock)) ||
+        superblock.s_header.j_magic != MAGIC_NUMBER || superblock.s_header.j_blocktype != SUPERBLOCK ||
+        superblock.s_blocksize != blockSize || superblock.s_maxlen != regionLength ||
+        superblock.s_first != blockSize || superblock.s_start >= ringSize || superblock.s_sequence == 0) {
+        return false;
+    }
+
+    head = superblock.s_start;
+    used = 0;
+    live.clear();
+    uint32_t transaction = superblock.s_sequence;
+    std::vector<char> payload;
+    uint32_t size;
+    while (readTransaction(head, transaction, payload, size) && used + size <= ringSize) {
+        live.push_back(size);
+        used += size;
+        head = (head + size) % ringSize;
+        ++transaction;
+    }
+    runningTransaction = transaction;
+    committedTransaction = transaction - 1;
+    return true;
+}
+
+void Journal::committerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        commitWanted.wait(lock, [this]() { return stopping || runningRecords > 0; });
+        if (runningRecords == 0) {
+            return;
+        }
+        // Leave the transaction open for one interval so other writers can join
+        // it. Then close it to new Handles and wait for the open ones, so no
+        // multi-step update commits half done.
+        commitWanted.wait_for(lock, std::chrono::milliseconds(options.commitIntervalMs), [this]() {
+            return stopping || commitLocked || running.size() >= options.maxBatchBytes;
+        });
+        commitLocked = true;
+        commitWanted.wait(lock, [this]() { return stopping || openHandles == 0; });
+
+        std::vector<char> payload;
+        payload.swap(running);
+        uint32_t recordCount = runningRecords;
+        uint32_t transaction = runningTransaction++;
+        runningRecords = 0;
+        commitLocked = false;
+        committingBytes = transactionSize(payload.size());
+        lock.unlock();
+        handlesAllowed.notify_all();
+
+        bool ok = !failed && commitTransaction(transaction, payload, recordCount);
+
+        lock.lock();
+        if (ok) {
+            ++commits;
+            records += recordCount;
+        } else {
+            failed = true;
+        }
+        committedTransaction = transaction;
+        committingBytes = 0;
+        commitDone.notify_all();
+    }
+}
+
+bool Journal::commitTransaction(uint32_t transaction, const std::vector<char> &payload, uint32_t recordCount) {
+    std::lock_guard<std::mutex> lock(ringMutex);
+    uint32_t size = transactionSize(payload.size());
+
+    // Out of room: the owner did not checkpoint in time. The live
+    // transactions describe changes that may not be home yet, so they are
+    // never overwritten; the commit fails instead.
+    if (ringSize - used < size) {
+        std::cerr << "Journal full; transaction " << transaction << " not committed" << std::endl;
+        return false;
+    }
+
+    // Descriptor, records and commit record go out in one write and one flush;
+    // the checksum tells a torn transaction from a committed one
+    std::vector<char> block(size, 0);
+    TransactionHeader header = {{MAGIC_NUMBER, DESCRIPTOR_BLOCK, transaction}, recordCount,
+                                static_cast<uint32_t>(payload.size()), 0};
+    header.t_checksum = descriptorChecksum(header);
+    CommitRecord commit = {{MAGIC_NUMBER, COMMIT_BLOCK, transaction},
+                           commitChecksum(payload.data(), payload.size(), transaction)};
+    std::memcpy(block.data(), &header, sizeof(header));
+    std::memcpy(block.data() + sizeof(header), payload.data(), payload.size());
+    std::memcpy(block.data() + sizeof(header) + payload.size(), &commit, sizeof(commit));
+    if (!writeRing(head, block.data(), size) || !device->flush()) {
+        std::cerr << "Error writing journal transaction " << transaction << std::endl;
+        return false;
+    }
+
+    live.push_back(size);
+    used += size;
+    head = (head + size) % ringSize;
+    return true;
+}
+
+bool Journal::writeSuperblock() {
+    return device->write(regionStart, &superblock, sizeof(superblock));
+}
+
+bool Journal::readTransaction(uint32_t position, uint32_t transaction, std::vector<char> &payload, uint32_t &size) {
+    TransactionHeader header;
+    if (!readRing(position, &header, sizeof(header)) || header.t_header.j_magic != MAGIC_NUMBER ||
+        header.t_header.j_blocktype != DESCRIPTOR_BLOCK || header.t_header.j_sequence != transaction ||
+        header.t_checksum != descriptorChecksum(header) || header.t_length > ringSize) {
+        return false;
+    }
+    size = transactionSize(header.t_length);
+    if (size > ringSize) {
+        return false;
+    }
+
+    CommitRecord commit;
+    payload.resize(header.t_length);
+    if (!readRing((position + sizeof(header)) % ringSize, payload.data(), payload.size()) ||
+        !readRing((position + sizeof(header) + header.t_length) % ringSize, &commit, sizeof(commit))) {
+        return false;
+    }
+    return commit.c_header.j_magic == MAGIC_NUMBER && commit.c_header.j_blocktype == COMMIT_BLOCK &&
+           commit.c_header.j_sequence == transaction &&
+           commit.c_checksum == commitChecksum(payload.data(), payload.size(), transaction);
+}
+
+// Ring I/O: a range running past the end of the ring continues at its start
+bool Journal::readRing(uint32_t position, void *buffer, size_t length) {
+    uint64_t ring = regionStart + blockSize;
+    size_t first = std::min<size_t>(length, ringSize - position);
+    return device->read(ring + position, buffer, first) &&
+           (first == length || device->read(ring, static_cast<char *>(buffer) + first, length - first));
+}
+
+bool Journal::writeRing(uint32_t position, const void *buffer, size_t length) {
+    uint64_t ring = regionStart + blockSize;
+    size_t first = std::min<size_t>(length, ringSize - position);
+    if (first == length) {
+        return device->write(ring + position, buffer, length);
+    }
+    // Wrapping around: both pieces go out together
+    char *data = static_cast<char *>(const_cast<void *>(buffer));
+    std::vector<IoEngine::Request> requests = {{true, ring + position, data, first, false},
+                                               {true, ring, data + first, length - first, false}};
+    return device->io().submitAndWait(requests);
+}
+
+uint32_t Journal::transactionSize(size_t payloadLength) const {
+    size_t bytes = sizeof(TransactionHeader) + payloadLength + sizeof(CommitRecord);
+    return static_cast<uint32_t>((bytes + blockSize - 1) / blockSize * blockSize);
+}
@@ -0,0 +1,166 @@
+#include "Stats.h"
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+const size_t Stats::HISTOGRAM_BUCKETS;
+
+namespace {
+
+std::atomic<uint64_t> nextStatsId{1};
+
+// Innermost open scope on this thread
+thread_local Stats::Scope *innermost = nullptr;
+
+// (Stats id, counters) for every Stats this thread has recorded into. Ids are
+// never reused, so an entry left behind by a destroyed Stats is never matched.
+thread_local std::vector<std::pair<uint64_t, void *>> threadCounters;
+
+// Only this thread writes 'counter'
+inline void bump(std::atomic<uint64_t> &counter, uint64_t amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+} // namespace
+
+uint64_t Stats::OperationStats::percentile(double quantile) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(count));
+    rank = std::min(std::max<uint64_t>(rank, 1), count);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+        seen += histogram[bucket];
+        if (seen >= rank) {
+            return std::min(bucketLimit(bucket), maxNanos);
+        }
+    }
+    return maxNanos;
+}
+
+Stats::Scope::Scope(Stats *stats, Operation operation) : stats(nullptr), operation(operation) {
+    open(stats);
+}
+
+Stats::Scope::Scope(Operation operation) : stats(nullptr), operation(operation) {
+    open(innermost ? innermost->stats : nullptr);
+}
+
+void Stats::Scope::open(Stats *owner) {
+    if (!owner) {
+        return;
+    }
+    stats = owner;
+    parent = innermost;
+    bytes = 0;
+    syscalls = 0;
+    innermost = this;
+    start = std::chrono::steady_clock::now();
+}
+
+Stats::Scope::~Scope() {
+    if (!stats) {
+        return;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    innermost = parent;
+    stats->record(operation, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+                  bytes, syscalls);
+}
+
+Stats::Stats() : id(nextStatsId.fetch_add(1)) {}
+
+Stats::~Stats() = default;
+
+void Stats::countIo(uint64_t bytes) {
+    for (Scope *scope = innermost; scope; scope = scope->parent) {
+        scope->bytes += bytes;
+        ++scope->syscalls;
+    }
+}
+
+Stats::ThreadCounters &Stats::localCounters() {
+    for (const auto &entry : threadCounters) {
+        if (entry.first == id) {
+            return *static_cast<ThreadCounters *>(entry.second);
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.emplace_back(new ThreadCounters());
+    threadCounters.push_back({id, threads.back().get()});
+    return *threads.back();
+}
+
+void Stats::record(Operation operation, uint64_t nanos, uint64_t bytes, uint64_t syscalls) {
+    Counters &counters = localCounters().operations[operation];
+    bump(counters.count, 1);
+    bump(counters.totalNanos, nanos);
+    if (nanos > counters.maxNanos.load(std::memory_order_relaxed)) {
+        counters.maxNanos.store(nanos, std::memory_order_relaxed);
+    }
+    bump(counters.bytes, bytes);
+    bump(counters.syscalls, syscalls);
+    bump(counters.histogram[bucketOf(nanos)], 1);
+}
+
+Stats::Snapshot Stats::snapshot() const {
+    Snapshot result;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &thread : threads) {
+        for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+            const Counters &counters = thread->operations[op];
+            OperationStats &total = result[op];
+            total.count += counters.count.load(std::memory_order_relaxed);
+            total.totalNanos += counters.totalNanos.load(std::memory_order_relaxed);
+            total.maxNanos = std::max(total.maxNanos, counters.maxNanos.load(std::memory_order_relaxed));
+            total.bytes += counters.bytes.load(std::memory_order_relaxed);
+            total.syscalls += counters.syscalls.load(std::memory_order_relaxed);
+            for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+                total.histogram[bucket] += counters.histogram[bucket].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return result;
+}
+
+std::string Stats::toJson() const {
+    Snapshot stats = snapshot();
+    std::ostringstream out;
+    out << "{";
+    for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+        const OperationStats &s = stats[op];
+        out << (op ? ", " : "") << "\"" << operationName(static_cast<Operation>(op)) << "\": {"
+            << "\"count\": " << s.count << ", \"total_ns\": " << s.totalNanos
+            << ", \"mean_ns\": " << (s.count ? s.totalNanos / s.count : 0) << ", \"max_ns\": " << s.maxNanos
+            << ", \"p50_ns\": " << s.percentile(0.5) << ", \"p99_ns\": " << s.percentile(0.99)
+            << ", \"p999_ns\": " << s.percentile(0.999) << ", \"bytes\": " << s.bytes
+            << ", \"syscalls\": " << s.syscalls << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+const char *Stats::operationName(Operation operation) {
+    static const char *const names[OPERATION_COUNT] = {"create",        "delete",      "read",          "write",
+                                                       "inode_read",    "inode_write", "bitmap_search", "journal_write",
+                                                       "journal_flush", "checkpoint",  "reclaim",       "clone"};
+    return operation < OPERATION_COUNT ? names[operation] : "unknown";
+}
+
+size_t Stats::bucketOf(uint64_t nanos) {
+    if (nanos < 4) {
+        return static_cast<size_t>(nanos);
+    }
+    unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(nanos));
+    return 4 * (exponent - 1) + ((nanos >> (exponent - 2)) & 3);
+}
+
+uint64_t Stats::bucketLimit(size_t bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    unsigned exponent = static_cast<unsigned>(bucket / 4 + 1);
+    uint64_t width = uint64_t(1) << (exponent - 2);
+    return (4 + bucket % 4) * width + (width - 1);
+}
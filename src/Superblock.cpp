@@ -0,0 +1,64 @@
+#include "Superblock.h"
+#include "BlockGroup.h"
+#include "Inode.h"
+#include <algorithm>
+#include <iostream>
+
+const uint16_t Superblock::MAGIC;
+const uint32_t Superblock::GROUP_DESC_BLOCK;
+const uint32_t Superblock::COMPAT_FREE_COUNTS;
+
+Superblock::Superblock(std::shared_ptr<BufferCache> cache) : cache(std::move(cache)), superblock() {}
+
+bool Superblock::readSuperblockFromDisk() {
+    if (!cache->read(0, &superblock, sizeof(superblock))) {
+        std::cerr << "Error reading superblock" << std::endl;
+        return false;
+    }
+    return superblock.s_magic == MAGIC && superblock.s_log_block_size <= 6 &&
+           superblock.s_blocks_per_group > 0 && superblock.s_inodes_per_group > 0 &&
+           superblock.s_inode_size == sizeof(Inode::Ext4Inode);
+}
+
+void Superblock::writeSuperblockToDisk() {
+    if (!cache->write(0, &superblock, sizeof(superblock))) {
+        std::cerr << "Error writing superblock" << std::endl;
+    }
+}
+
+uint32_t Superblock::getGroupCount() const {
+    uint32_t blocks = superblock.s_blocks_count - superblock.s_first_data_block;
+    return (blocks + superblock.s_blocks_per_group - 1) / superblock.s_blocks_per_group;
+}
+
+uint64_t Superblock::getGroupFirstBlock(uint32_t group) const {
+    return superblock.s_first_data_block + static_cast<uint64_t>(group) * superblock.s_blocks_per_group;
+}
+
+uint32_t Superblock::getBlocksInGroup(uint32_t group) const {
+    uint64_t first = getGroupFirstBlock(group);
+    return static_cast<uint32_t>(std::min<uint64_t>(superblock.s_blocks_per_group, superblock.s_blocks_count - first));
+}
+
+uint32_t Superblock::getInodeTableBlocks() const {
+    uint64_t bytes = static_cast<uint64_t>(superblock.s_inodes_per_group) * superblock.s_inode_size;
+    return static_cast<uint32_t>((bytes + getBlockSize() - 1) / getBlockSize());
+}
+
+uint32_t Superblock::getGroupDescBlocks() const {
+    uint64_t bytes = static_cast<uint64_t>(getGroupCount()) * sizeof(BlockGroup::Ext4GroupDesc);
+    return static_cast<uint32_t>((bytes + getBlockSize() - 1) / getBlockSize());
+}
+
+uint64_t Superblock::getBlockBitmapBlock(uint32_t group) const {
+    uint64_t first = getGroupFirstBlock(group);
+    return group == 0 ? first + GROUP_DESC_BLOCK + getGroupDescBlocks() : first;
+}
+
+uint32_t Superblock::getMetadataBlocks(uint32_t group) const {
+    uint64_t end = getInodeTableBlock(group) + getInodeTableBlocks();
+    if (group == 0) {
+        end += superblock.s_journal_blocks;
+    }
+    return static_cast<uint32_t>(end - getGroupFirstBlock(group));
+}
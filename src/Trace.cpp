@@ -0,0 +1,267 @@
+#include "Trace.h"
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+void putVarint(std::vector<char> &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Names longer than this or more inode numbers than this mark a damaged record
+const uint64_t MAX_NAME = 4096;
+const uint64_t MAX_INODES = 1 << 24;
+
+} // namespace
+
+const uint32_t Trace::MAGIC;
+const uint32_t Trace::VERSION;
+const size_t TraceRecorder::BUFFER_BYTES;
+
+const char *Trace::operationName(Operation operation) {
+    switch (operation) {
+    case CREATE_FILE:
+        return "createFile";
+    case DELETE_FILE:
+        return "deleteFile";
+    case CREATE_FILES:
+        return "createFiles";
+    case DELETE_FILES:
+        return "deleteFiles";
+    case CREATE:
+        return "create";
+    case LOOKUP:
+        return "lookup";
+    case UNLINK:
+        return "unlink";
+    case LIST_DIRECTORY:
+        return "listDirectory";
+    case READ:
+        return "read";
+    case WRITE:
+        return "write";
+    case FSYNC:
+        return "fsync";
+    case SYNC:
+        return "sync";
+    case STAT:
+        return "stat";
+    case CLONE:
+        return "clone";
+    default:
+        return "unknown";
+    }
+}
+
+TraceRecorder::TraceRecorder(const std::string &path)
+    : out(path, std::ios::binary | std::ios::trunc), header(), started(std::chrono::steady_clock::now()),
+      records(0), failed(false) {
+    header.magic = Trace::MAGIC;
+    header.version = Trace::VERSION;
+    if (!out.write(reinterpret_cast<const char *>(&header), sizeof(header))) {
+        std::cerr << "Failed to create trace " << path << std::endl;
+        failed = true;
+    }
+    buffer.reserve(BUFFER_BYTES + 256);
+}
+
+TraceRecorder::~TraceRecorder() {
+    flush();
+}
+
+void TraceRecorder::setGeometry(uint64_t imageSize, uint32_t blockSize, uint32_t inodesPerGroup,
+                                uint32_t journalBlocks) {
+    std::lock_guard<std::mutex> lock(mutex);
+    header.imageSize = imageSize;
+    header.blockSize = blockSize;
+    header.inodesPerGroup = inodesPerGroup;
+    header.journalBlocks = journalBlocks;
+    if (failed) {
+        return;
+    }
+    // Records are appended after the header, so write out the buffer first
+    // and come back to the end afterwards
+    writeOut();
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.seekp(0, std::ios::end);
+    if (!out) {
+        std::cerr << "Failed to write the trace header" << std::endl;
+        failed = true;
+    }
+}
+
+uint64_t TraceRecorder::now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+void TraceRecorder::record(Trace::Record &record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto thread = threads.emplace(std::this_thread::get_id(), static_cast<uint32_t>(threads.size())).first;
+    record.thread = thread->second;
+
+    buffer.push_back(static_cast<char>(record.operation));
+    putVarint(buffer, record.thread);
+    putVarint(buffer, record.start);
+    putVarint(buffer, record.duration);
+    putVarint(buffer, record.inode);
+    putVarint(buffer, record.mode);
+    putVarint(buffer, record.offset);
+    putVarint(buffer, record.length);
+    putVarint(buffer, zigzag(record.result));
+    putVarint(buffer, record.name.size());
+    buffer.insert(buffer.end(), record.name.begin(), record.name.end());
+    putVarint(buffer, record.inodes.size());
+    for (uint32_t inode : record.inodes) {
+        putVarint(buffer, inode);
+    }
+    ++records;
+    if (buffer.size() >= BUFFER_BYTES) {
+        writeOut();
+    }
+}
+
+bool TraceRecorder::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!writeOut()) {
+        return false;
+    }
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+uint64_t TraceRecorder::getRecordCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return records;
+}
+
+bool TraceRecorder::writeOut() {
+    if (failed) {
+        buffer.clear();
+        return false;
+    }
+    if (!buffer.empty() && !out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()))) {
+        std::cerr << "Failed to write the trace; recording stopped" << std::endl;
+        failed = true;
+    }
+    buffer.clear();
+    return !failed;
+}
+
+TraceRecorder::Event::Event(TraceRecorder *recorder, Trace::Operation operation, uint32_t inode, uint64_t offset,
+                            uint64_t length, uint32_t mode)
+    : recorder(recorder) {
+    if (!recorder) {
+        return;
+    }
+    record.operation = operation;
+    record.inode = inode;
+    record.offset = offset;
+    record.length = length;
+    record.mode = mode;
+    record.result = -1;
+    record.start = recorder->now();
+}
+
+TraceRecorder::Event::~Event() {
+    if (!recorder) {
+        return;
+    }
+    record.duration = recorder->now() - record.start;
+    recorder->record(record);
+}
+
+void TraceRecorder::Event::setName(const std::string &name) {
+    if (recorder) {
+        record.name = name;
+    }
+}
+
+void TraceRecorder::Event::setInodes(const std::vector<uint32_t> &inodes) {
+    if (recorder) {
+        record.inodes = inodes;
+    }
+}
+
+TraceReader::TraceReader(const std::string &path) : in(path, std::ios::binary), header(), opened(false), error(false) {
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        std::cerr << "Failed to read trace " << path << std::endl;
+        return;
+    }
+    if (header.magic != Trace::MAGIC || header.version != Trace::VERSION) {
+        std::cerr << path << " is not a trace" << std::endl;
+        return;
+    }
+    opened = true;
+}
+
+bool TraceReader::readVarint(uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == std::char_traits<char>::eof()) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TraceReader::next(Trace::Record &record) {
+    if (!opened || error) {
+        return false;
+    }
+    int operation = in.get();
+    if (operation == std::char_traits<char>::eof()) {
+        return false;
+    }
+    // From here on, running out of input means the record was cut short
+    error = true;
+    if (operation >= Trace::OPERATION_COUNT) {
+        return false;
+    }
+    record.operation = static_cast<Trace::Operation>(operation);
+
+    uint64_t thread, inode, mode, result, nameLength, inodeCount;
+    if (!readVarint(thread) || !readVarint(record.start) || !readVarint(record.duration) || !readVarint(inode) ||
+        !readVarint(mode) || !readVarint(record.offset) || !readVarint(record.length) || !readVarint(result) ||
+        !readVarint(nameLength) || nameLength > MAX_NAME) {
+        return false;
+    }
+    record.thread = static_cast<uint32_t>(thread);
+    record.inode = static_cast<uint32_t>(inode);
+    record.mode = static_cast<uint32_t>(mode);
+    record.result = unzigzag(result);
+    record.name.resize(nameLength);
+    if (nameLength > 0 && !in.read(&record.name[0], static_cast<std::streamsize>(nameLength))) {
+        return false;
+    }
+    if (!readVarint(inodeCount) || inodeCount > MAX_INODES) {
+        return false;
+    }
+    record.inodes.resize(inodeCount);
+    for (uint64_t i = 0; i < inodeCount; ++i) {
+        uint64_t number;
+        if (!readVarint(number)) {
+            return false;
+        }
+        record.inodes[i] = static_cast<uint32_t>(number);
+    }
+    error = false;
+    return true;
+}
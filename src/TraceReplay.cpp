@@ -0,0 +1,274 @@
+#include "TraceReplay.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+// Operations whose Record::inode is an inode number to map
+bool takesInode(Trace::Operation operation) {
+    switch (operation) {
+    case Trace::CREATE_FILE:
+    case Trace::CREATE_FILES:
+    case Trace::DELETE_FILES:
+    case Trace::SYNC:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Records the inode number a call returned, or 0 if it failed
+void produce(std::vector<uint32_t> &made, int64_t result) {
+    made.assign(1, result > 0 ? static_cast<uint32_t>(result) : 0);
+}
+
+} // namespace
+
+const size_t TraceReplay::NO_SOURCE;
+
+TraceReplay::TraceReplay(const std::string &trace, const std::string &image, const ReplayOptions &options)
+    : tracePath(trace), image(image), options(options), header() {
+    this->options.threads = std::max(1u, options.threads);
+}
+
+bool TraceReplay::load() {
+    TraceReader reader(tracePath);
+    if (!reader.isOpen()) {
+        return false;
+    }
+    header = reader.getHeader();
+    if (header.blockSize == 0) {
+        std::cerr << tracePath << " was not recorded on a mounted file system" << std::endl;
+        return false;
+    }
+    records.clear();
+    Trace::Record record;
+    while (reader.next(record)) {
+        records.push_back(record);
+    }
+    if (reader.failed()) {
+        std::cerr << "Damaged record " << records.size() << " in " << tracePath << "; replaying the ones before it"
+                  << std::endl;
+    }
+
+    // Each inode argument comes from the latest record before it that returned it
+    std::unordered_map<uint32_t, Source> producers;
+    auto sourceOf = [&producers](uint32_t number) {
+        auto it = producers.find(number);
+        return it == producers.end() ? Source{NO_SOURCE, 0} : it->second;
+    };
+    sources.assign(records.size(), {});
+    for (size_t i = 0; i < records.size(); ++i) {
+        const Trace::Record &r = records[i];
+        if (takesInode(r.operation)) {
+            sources[i].push_back(sourceOf(r.inode));
+        }
+        if (r.operation == Trace::DELETE_FILES) {
+            for (uint32_t number : r.inodes) {
+                sources[i].push_back(sourceOf(number));
+            }
+        }
+        switch (r.operation) {
+        case Trace::CREATE_FILE:
+        case Trace::CREATE:
+        case Trace::LOOKUP:
+        case Trace::CLONE:
+            if (r.result > 0) {
+                producers[static_cast<uint32_t>(r.result)] = Source{i, 0};
+            }
+            break;
+        case Trace::CREATE_FILES:
+            for (uint32_t k = 0; k < r.inodes.size(); ++k) {
+                producers[r.inodes[k]] = Source{i, k};
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+bool TraceReplay::run(ReplayReport &report) {
+    if (!load()) {
+        return false;
+    }
+    MkfsOptions mkfs;
+    mkfs.imageSize = header.imageSize;
+    mkfs.blockSize = header.blockSize;
+    mkfs.inodesPerGroup = header.inodesPerGroup;
+    mkfs.journalBlocks = header.journalBlocks;
+    FileSystem fs(image, options.fileSystem);
+    if (!fs.initialize(mkfs)) {
+        return false;
+    }
+
+    produced.assign(records.size(), {});
+    done.reset(new std::atomic<bool>[records.size()]());
+    std::vector<OperationStats> stats(options.threads);
+    std::vector<uint64_t> mismatches(options.threads, 0);
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < options.threads; ++w) {
+        workers.emplace_back(&TraceReplay::replay, this, w, std::ref(fs), begin, std::ref(stats[w]),
+                             std::ref(mismatches[w]));
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    report.operations = records.size();
+    report.mismatches = 0;
+    report.perOperation = {};
+    for (unsigned w = 0; w < options.threads; ++w) {
+        report.mismatches += mismatches[w];
+        for (size_t op = 0; op < Trace::OPERATION_COUNT; ++op) {
+            Stats::OperationStats &total = report.perOperation[op];
+            const Stats::OperationStats &part = stats[w][op];
+            total.count += part.count;
+            total.totalNanos += part.totalNanos;
+            total.maxNanos = std::max(total.maxNanos, part.maxNanos);
+            total.bytes += part.bytes;
+            for (size_t b = 0; b < Stats::HISTOGRAM_BUCKETS; ++b) {
+                total.histogram[b] += part.histogram[b];
+            }
+        }
+    }
+    return true;
+}
+
+void TraceReplay::replay(unsigned worker, FileSystem &fs, std::chrono::steady_clock::time_point begin,
+                         OperationStats &stats, uint64_t &mismatches) {
+    std::vector<char> data;
+    std::vector<char> pattern;
+    std::vector<uint32_t> arguments;
+    for (size_t i = 0; i < records.size(); ++i) {
+        const Trace::Record &r = records[i];
+        if (r.thread % options.threads != worker) {
+            continue;
+        }
+        if (options.realTime) {
+            std::this_thread::sleep_until(begin + std::chrono::nanoseconds(r.start));
+        }
+        // Waiting for other workers' records is not part of the call's latency
+        arguments.clear();
+        for (size_t a = 0; a < sources[i].size(); ++a) {
+            arguments.push_back(translate(i, a));
+        }
+
+        std::vector<uint32_t> made;
+        auto start = std::chrono::steady_clock::now();
+        int64_t result = execute(r, arguments, fs, data, pattern, made);
+        uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                             .count();
+
+        Stats::OperationStats &op = stats[r.operation];
+        ++op.count;
+        op.totalNanos += nanos;
+        op.maxNanos = std::max(op.maxNanos, nanos);
+        ++op.histogram[Stats::bucketOf(nanos)];
+        if ((r.operation == Trace::READ || r.operation == Trace::WRITE) && result > 0) {
+            op.bytes += static_cast<uint64_t>(result);
+        }
+        if ((result >= 0) != (r.result >= 0)) {
+            ++mismatches;
+        }
+        finish(i, std::move(made));
+    }
+}
+
+int64_t TraceReplay::execute(const Trace::Record &r, const std::vector<uint32_t> &arguments, FileSystem &fs,
+                             std::vector<char> &data, std::vector<char> &pattern, std::vector<uint32_t> &made) {
+    uint16_t mode = static_cast<uint16_t>(r.mode);
+    uint32_t inode = arguments.empty() ? 0 : arguments[0];
+    int64_t result = -1;
+    switch (r.operation) {
+    case Trace::CREATE_FILE:
+        result = fs.createFile(mode, static_cast<uint32_t>(r.offset));
+        produce(made, result);
+        break;
+    case Trace::DELETE_FILE:
+        // deleteFile reports no failure; take the recorded outcome
+        fs.deleteFile(inode);
+        result = r.result;
+        break;
+    case Trace::CREATE_FILES:
+        result = fs.createFiles(static_cast<uint32_t>(r.length), mode, static_cast<uint32_t>(r.offset), made) ? 1 : -1;
+        break;
+    case Trace::DELETE_FILES:
+        result = fs.deleteFiles(arguments) ? 1 : -1;
+        break;
+    case Trace::CREATE:
+        result = fs.create(inode, r.name, mode);
+        produce(made, result);
+        break;
+    case Trace::LOOKUP:
+        result = fs.lookup(inode, r.name);
+        produce(made, result);
+        break;
+    case Trace::UNLINK:
+        result = fs.unlink(inode, r.name) ? 1 : -1;
+        break;
+    case Trace::LIST_DIRECTORY: {
+        std::vector<Directory::Entry> entries;
+        result = fs.listDirectory(inode, entries) ? static_cast<int64_t>(entries.size()) : -1;
+        break;
+    }
+    case Trace::READ:
+        data.resize(std::max<size_t>(data.size(), r.length));
+        result = fs.read(inode, r.offset, data.data(), r.length);
+        break;
+    case Trace::WRITE:
+        for (size_t b = pattern.size(); b < r.length; ++b) {
+            pattern.push_back(static_cast<char>('a' + b % 26));
+        }
+        result = fs.write(inode, r.offset, pattern.data(), r.length);
+        break;
+    case Trace::FSYNC:
+        result = fs.fsync(inode) ? 1 : -1;
+        break;
+    case Trace::SYNC:
+        fs.sync();
+        result = 1;
+        break;
+    case Trace::STAT: {
+        Inode::Ext4Inode info;
+        result = fs.stat(inode, info) ? 1 : -1;
+        break;
+    }
+    case Trace::CLONE:
+        result = fs.clone(inode);
+        produce(made, result);
+        break;
+    default:
+        break;
+    }
+    return result;
+}
+
+uint32_t TraceReplay::translate(size_t index, size_t argument) {
+    const Trace::Record &r = records[index];
+    uint32_t recorded = r.operation == Trace::DELETE_FILES ? r.inodes[argument] : r.inode;
+    const Source &source = sources[index][argument];
+    if (source.record == NO_SOURCE) {
+        return recorded;
+    }
+    if (!done[source.record].load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return done[source.record].load(std::memory_order_acquire); });
+    }
+    const std::vector<uint32_t> &numbers = produced[source.record];
+    return source.position < numbers.size() ? numbers[source.position] : 0;
+}
+
+void TraceReplay::finish(size_t index, std::vector<uint32_t> made) {
+    produced[index] = std::move(made);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[index].store(true, std::memory_order_release);
+    }
+    finished.notify_all();
+}
@@ -1,8 +1,34 @@
+#include "Bitmap.h"
+#include "BlockDevice.h"
 #include "BlockGroup.h"
+#include "BufferCache.h"
+#include "Crc32c.h"
+#include "Directory.h"
+#include "ExtentTree.h"
+#include "FileSystem.h"
+#include "Fsck.h"
 #include "Inode.h"
+#include "InodeCache.h"
+#include "IoEngine.h"
 #include "Journal.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "TraceReplay.h"
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <fstream>
+#include <functional>
+#include <sstream>
+#include <set>
+#include <thread>
 
 // Helper function to initialize a disk image with zeros
 void initializeDisk(const std::string& disk) {
@@ -18,6 +44,352 @@ void initializeDisk(const std::string& disk) {
     diskFile.close();
 }
 
+// Test case for block-aligned positional I/O on the shared device
+TEST(BlockDeviceTest, ReadWriteBlocks) {
+    initializeDisk("disk.img");
+    BlockDevice device("disk.img");
+    ASSERT_TRUE(device.isOpen());
+    EXPECT_EQ(device.size(), 1024u * 1024u);
+
+    std::vector<char> out(2 * device.getBlockSize(), 'A');
+    out[device.getBlockSize()] = 'B';
+    ASSERT_TRUE(device.writeBlocks(5, out.data(), 2));
+
+    std::vector<char> in(2 * device.getBlockSize(), 0);
+    ASSERT_TRUE(device.readBlocks(5, in.data(), 2));
+    EXPECT_EQ(in, out);
+
+    // Reads past the end of the image come back zero-filled
+    char tail[16];
+    ASSERT_TRUE(device.read(device.size(), tail, sizeof(tail)));
+    EXPECT_EQ(tail[0], 0);
+    EXPECT_TRUE(device.sync());
+}
+
+// Test case for components sharing one open device through the cache
+TEST(BlockDeviceTest, SharedDevice) {
+    initializeDisk("disk.img");
+    auto cache = std::make_shared<BufferCache>(std::make_shared<BlockDevice>("disk.img"));
+    Inode writer(cache, 3072);
+    writer.createInode(0x1A4, 42);
+    writer.writeInodeToDisk(7);
+
+    Inode reader(cache, 3072);
+    reader.readInodeFromDisk(7);
+    EXPECT_EQ(reader.getInode().i_mode, 0x1A4);
+    EXPECT_EQ(reader.getInode().i_size, 42u);
+}
+
+// Test case for a memory-mapped device: I/O goes through the mapping, which
+// follows the image as it grows
+TEST(BlockDeviceTest, MappedReadWrite) {
+    initializeDisk("disk.img");
+    BlockDevice device("disk.img");
+    ASSERT_TRUE(device.map());
+    ASSERT_TRUE(device.isMapped());
+
+    uint32_t word = 0xCAFEF00D;
+    ASSERT_TRUE(device.write(4096, &word, sizeof(word)));
+    uint32_t readBack = 0;
+    ASSERT_TRUE(device.read(4096, &readBack, sizeof(readBack)));
+    EXPECT_EQ(readBack, 0xCAFEF00Du);
+
+    // Writing past the end grows the image; what was there stays
+    uint64_t oldSize = device.size();
+    const char tail[] = "tail";
+    ASSERT_TRUE(device.write(oldSize + 100, tail, sizeof(tail)));
+    EXPECT_EQ(device.size(), oldSize + 100 + sizeof(tail));
+    char tailBack[sizeof(tail)] = {};
+    ASSERT_TRUE(device.read(oldSize + 100, tailBack, sizeof(tailBack)));
+    EXPECT_EQ(std::memcmp(tailBack, tail, sizeof(tail)), 0);
+    readBack = 0;
+    ASSERT_TRUE(device.read(4096, &readBack, sizeof(readBack)));
+    EXPECT_EQ(readBack, 0xCAFEF00Du);
+    ASSERT_TRUE(device.sync());
+
+    // Writers growing the image at once never shrink it under each other
+    uint64_t base = device.size();
+    std::vector<std::thread> writers;
+    for (uint32_t t = 0; t < 4; ++t) {
+        writers.emplace_back([&device, base, t]() {
+            for (uint32_t i = 0; i < 50; ++i) {
+                uint32_t value = t * 1000 + i;
+                EXPECT_TRUE(device.write(base + (i * 4 + t) * 4096, &value, sizeof(value)));
+            }
+            EXPECT_TRUE(device.flush());
+        });
+    }
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    EXPECT_EQ(device.size(), base + 199 * 4096 + sizeof(uint32_t));
+    for (uint32_t t = 0; t < 4; ++t) {
+        for (uint32_t i = 0; i < 50; ++i) {
+            ASSERT_TRUE(device.read(base + (i * 4 + t) * 4096, &readBack, sizeof(readBack)));
+            EXPECT_EQ(readBack, t * 1000 + i);
+        }
+    }
+
+    // Visible through ordinary pread
+    BlockDevice plain("disk.img");
+    ASSERT_TRUE(plain.read(4096, &readBack, sizeof(readBack)));
+    EXPECT_EQ(readBack, 0xCAFEF00Du);
+    ASSERT_TRUE(plain.read(base + 199 * 4096, &readBack, sizeof(readBack)));
+    EXPECT_EQ(readBack, 3049u);
+}
+
+// Test case for asynchronous I/O with both engine backends
+TEST(IoEngineTest, UringAndThreadPool) {
+    for (IoEngine::Backend backend : {IoEngine::Backend::Uring, IoEngine::Backend::ThreadPool}) {
+        initializeDisk("disk.img");
+        BlockDevice device("disk.img");
+        IoEngine engine(device, 16, backend);
+        if (backend == IoEngine::Backend::ThreadPool) {
+            EXPECT_FALSE(engine.usesUring());
+        }
+
+        // 64 writes with at most 16 in flight
+        std::vector<std::vector<char>> blocks(64);
+        std::vector<IoEngine::Request> requests;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            blocks[i].assign(4096, static_cast<char>('A' + i % 26));
+            requests.push_back({true, i * 8192, blocks[i].data(), blocks[i].size(), false});
+        }
+        ASSERT_TRUE(engine.submitAndWait(requests));
+        EXPECT_EQ(engine.getSubmitted(), 64u);
+        EXPECT_LE(engine.getPeakInFlight(), engine.getQueueDepth());
+        EXPECT_GT(engine.getPeakInFlight(), 1u);
+
+        std::vector<char> readBack(4096);
+        for (size_t i = 0; i < blocks.size(); i += 9) {
+            ASSERT_TRUE(engine.read(i * 8192, readBack.data(), readBack.size()).get());
+            EXPECT_EQ(readBack, blocks[i]);
+        }
+
+        // A read running past the end of the image comes back zero-filled
+        std::vector<char> tail(8192, 'x');
+        ASSERT_TRUE(engine.write(device.size() - 4096, blocks[1].data(), 4096).get());
+        ASSERT_TRUE(engine.read(device.size() - 4096, tail.data(), tail.size()).get());
+        EXPECT_EQ(std::vector<char>(tail.begin(), tail.begin() + 4096), blocks[1]);
+        EXPECT_EQ(std::vector<char>(tail.begin() + 4096, tail.end()), std::vector<char>(4096, 0));
+    }
+}
+
+// Test case for cache hits, misses and write-back on flush
+TEST(BufferCacheTest, HitMissAndFlush) {
+    initializeDisk("disk.img");
+    auto device = std::make_shared<BlockDevice>("disk.img");
+    BufferCache cache(device, 8);
+
+    uint32_t value = 0xDEADBEEF;
+    ASSERT_TRUE(cache.write(2048 + 16, &value, sizeof(value)));
+    EXPECT_EQ(cache.getMisses(), 1u);
+    EXPECT_EQ(cache.getDirtyCount(), 1u);
+
+    uint32_t readBack = 0;
+    ASSERT_TRUE(cache.read(2048 + 16, &readBack, sizeof(readBack)));
+    EXPECT_EQ(readBack, value);
+    EXPECT_EQ(cache.getHits(), 1u);
+
+    // Nothing reaches the device until the cache is flushed
+    uint32_t onDisk = 0;
+    device->read(2048 + 16, &onDisk, sizeof(onDisk));
+    EXPECT_EQ(onDisk, 0u);
+
+    ASSERT_TRUE(cache.flush());
+    EXPECT_EQ(cache.getDirtyCount(), 0u);
+    device->read(2048 + 16, &onDisk, sizeof(onDisk));
+    EXPECT_EQ(onDisk, value);
+}
+
+// Test case for LRU eviction of dirty blocks and pinning
+TEST(BufferCacheTest, EvictionWritesBackAndRespectsPins) {
+    initializeDisk("disk.img");
+    auto device = std::make_shared<BlockDevice>("disk.img");
+    BufferCache cache(device, 4);
+    cache.pin(1);
+
+    char marker = 'P';
+    cache.write(1 * 1024, &marker, 1);
+    for (uint64_t block = 10; block < 20; ++block) {
+        char c = static_cast<char>('a' + block);
+        cache.write(block * 1024, &c, 1);
+    }
+    EXPECT_LE(cache.getCachedCount(), 4u);
+    EXPECT_GT(cache.getWritebacks(), 0u);
+
+    // Evicted blocks were written home, the pinned block is still cached and dirty
+    char onDisk = 0;
+    device->read(10 * 1024, &onDisk, 1);
+    EXPECT_EQ(onDisk, static_cast<char>('a' + 10));
+    device->read(1 * 1024, &onDisk, 1);
+    EXPECT_EQ(onDisk, 0);
+
+    uint64_t misses = cache.getMisses();
+    cache.read(1 * 1024, &onDisk, 1);
+    EXPECT_EQ(onDisk, 'P');
+    EXPECT_EQ(cache.getMisses(), misses);
+}
+
+// Test case for eviction when a dirty block cannot be written home: it stays
+// cached and dirty
+TEST(BufferCacheTest, KeepsBlockWhenWriteBackFails) {
+    initializeDisk("disk.img");
+    auto device = std::make_shared<BlockDevice>("disk.img");
+    BufferCache cache(device, 2);
+    char marker = 'K';
+    ASSERT_TRUE(cache.write(2000 * 1024, &marker, 1)); // past the 1 MiB image
+
+    // Writes past RLIMIT_FSIZE fail with EFBIG, so the image cannot grow
+    struct rlimit saved;
+    ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &saved), 0);
+    struct rlimit limited = saved;
+    limited.rlim_cur = 1024 * 1024;
+    auto previous = std::signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limited), 0);
+    char c;
+    for (uint64_t block = 1; block <= 3; ++block) {
+        cache.read(block * 1024, &c, 1);
+    }
+    setrlimit(RLIMIT_FSIZE, &saved);
+    std::signal(SIGXFSZ, previous);
+
+    EXPECT_EQ(cache.getDirtyCount(), 1u);
+    uint64_t misses = cache.getMisses();
+    ASSERT_TRUE(cache.read(2000 * 1024, &c, 1));
+    EXPECT_EQ(c, 'K');
+    EXPECT_EQ(cache.getMisses(), misses);
+
+    // Once the disk takes it, the block goes home
+    ASSERT_TRUE(cache.flush());
+    ASSERT_TRUE(device->read(2000 * 1024, &c, 1));
+    EXPECT_EQ(c, 'K');
+}
+
+// Test case for inode cache handles, batched writeback and slab growth
+TEST(InodeCacheTest, BatchedWriteback) {
+    initializeDisk("disk.img");
+    auto device = std::make_shared<BlockDevice>("disk.img");
+    auto cache = std::make_shared<BufferCache>(device, 64);
+    const uint64_t tableStart = 4 * 1024;
+    InodeCache inodes(cache, [tableStart](uint32_t n) { return tableStart + n * sizeof(Inode::Ext4Inode); }, 128);
+
+    // Each inode is changed twice but written once; 100 inodes span 10 blocks
+    for (uint32_t n = 0; n < 100; ++n) {
+        InodeCache::Handle inode = inodes.create(n);
+        Inode::initInode(*inode, Inode::REGULAR_FILE | 0644, n);
+        inode.markDirty();
+        inode->i_size += 1000;
+        inode.markDirty();
+    }
+    EXPECT_EQ(inodes.getDirtyCount(), 100u);
+    EXPECT_EQ(cache->getDirtyCount(), 0u);
+    ASSERT_TRUE(inodes.flush());
+    EXPECT_EQ(inodes.getDirtyCount(), 0u);
+    EXPECT_EQ(inodes.getBlockWrites(), 10u);
+    EXPECT_EQ(cache->getDirtyCount(), 10u);
+
+    uint64_t blockWrites = inodes.getBlockWrites();
+    for (uint32_t n = 84; n < 100; ++n) {
+        InodeCache::Handle inode = inodes.get(n);
+        inode->i_mtime = 42;
+        inode.markDirty();
+    }
+    ASSERT_TRUE(inodes.flush());
+    EXPECT_EQ(inodes.getBlockWrites() - blockWrites, 2u); // bytes 8400..9999 of the table
+    EXPECT_EQ(inodes.getHits(), 16u);
+
+    ASSERT_TRUE(cache->flush());
+    Inode reader(cache, tableStart);
+    reader.readInodeFromDisk(57);
+    EXPECT_EQ(reader.getInode().i_size, 1057u);
+    reader.readInodeFromDisk(90);
+    EXPECT_EQ(reader.getInode().i_mtime, 42u);
+
+    // Referenced inodes are never evicted; the cache grows by another slab instead
+    std::vector<InodeCache::Handle> held;
+    for (uint32_t n = 0; n < InodeCache::SLAB_INODES + 1; ++n) {
+        held.push_back(inodes.get(n));
+    }
+    EXPECT_EQ(inodes.getCachedCount(), InodeCache::SLAB_INODES + 1);
+    EXPECT_EQ(held[99]->i_size, 1099u);
+    InodeCache::Handle copy = held[7];
+    held.clear();
+    EXPECT_EQ(copy.number(), 7u);
+}
+
+// Test case for histogram percentiles and per-thread counters summed on read
+TEST(StatsTest, HistogramsAndThreads) {
+    // Buckets are a quarter of a power of two wide
+    EXPECT_EQ(Stats::bucketOf(3), 3u);
+    EXPECT_EQ(Stats::bucketLimit(Stats::bucketOf(1000)), 1023u);
+    EXPECT_EQ(Stats::bucketLimit(Stats::bucketOf(1100)), 1279u);
+    EXPECT_EQ(Stats::bucketOf(UINT64_MAX), Stats::HISTOGRAM_BUCKETS - 1);
+
+    Stats stats;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&stats]() {
+            for (int i = 0; i < 1000; ++i) {
+                // 99% at ~1 us, 1% at ~1 ms
+                stats.record(Stats::CREATE, i % 100 == 0 ? 1000000 : 1000, 512, 2);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    Stats::Snapshot snapshot = stats.snapshot();
+    const Stats::OperationStats &create = snapshot[Stats::CREATE];
+    EXPECT_EQ(create.count, 4000u);
+    EXPECT_EQ(create.bytes, 4000u * 512u);
+    EXPECT_EQ(create.syscalls, 8000u);
+    EXPECT_EQ(create.maxNanos, 1000000u);
+    EXPECT_EQ(create.percentile(0.5), 1023u);
+    EXPECT_EQ(create.percentile(0.99), 1023u);
+    EXPECT_EQ(create.percentile(0.999), 1000000u);
+    EXPECT_EQ(snapshot[Stats::DELETE].count, 0u);
+
+    // Scopes without an enclosing Stats record nothing; nested ones charge I/O to both
+    {
+        Stats::Scope orphan(Stats::INODE_READ);
+        Stats::countIo(100);
+    }
+    {
+        Stats::Scope outer(&stats, Stats::WRITE);
+        Stats::Scope inner(Stats::JOURNAL_WRITE);
+        Stats::countIo(4096);
+    }
+    snapshot = stats.snapshot();
+    EXPECT_EQ(snapshot[Stats::INODE_READ].count, 0u);
+    EXPECT_EQ(snapshot[Stats::WRITE].count, 1u);
+    EXPECT_EQ(snapshot[Stats::WRITE].bytes, 4096u);
+    EXPECT_EQ(snapshot[Stats::JOURNAL_WRITE].syscalls, 1u);
+    EXPECT_NE(stats.toJson().find("\"create\": {\"count\": 4000"), std::string::npos);
+}
+
+// Test case for CRC32C: the accelerated version matches the table-driven one
+// on every length and alignment, including the three-lane sizes
+TEST(Crc32cTest, KnownValuesAndImplementations) {
+    EXPECT_EQ(Crc32c::compute("123456789", 9), 0xE3069283u);
+    EXPECT_EQ(Crc32c::extendPortable(0, "123456789", 9), 0xE3069283u);
+    EXPECT_EQ(Crc32c::compute("", 0), 0u);
+
+    std::vector<unsigned char> data(40000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<unsigned char>((i * 2654435761u) >> 13);
+    }
+    for (size_t length : {1, 7, 8, 96, 767, 768, 769, 12287, 12288, 12289, 39990}) {
+        for (size_t offset = 0; offset < 8; ++offset) {
+            uint32_t expected = Crc32c::extendPortable(0, &data[offset], length);
+            EXPECT_EQ(Crc32c::compute(&data[offset], length), expected) << length << " at " << offset;
+            size_t split = length / 3;
+            EXPECT_EQ(Crc32c::extend(Crc32c::compute(&data[offset], split), &data[offset + split], length - split), expected);
+        }
+    }
+    EXPECT_NE(std::string(Crc32c::implementation()), "");
+}
+
 // Test case for finding a free inode in the bitmap
 TEST(BlockGroupTest, FindFreeInode) {
     std::vector<bool> inodeBitmap = {false, true, true, false};
@@ -48,11 +420,1360 @@ TEST(BlockGroupTest, FreeBlock) {
     EXPECT_FALSE(blockBitmap[1]);
 }
 
+// Test case for the packed bitmap's word-at-a-time search
+TEST(BitmapTest, FindFirstZero) {
+    Bitmap bitmap(200);
+    EXPECT_EQ(bitmap.byteSize(), 32u); // 200 bits pack into four 64-bit words
+    EXPECT_EQ(bitmap.countZeros(), 200u);
+    EXPECT_EQ(bitmap.findFirstZero(), 0u);
+
+    for (size_t i = 0; i < 130; ++i) {
+        bitmap.set(i);
+    }
+    EXPECT_EQ(bitmap.findFirstZero(), 130u);
+    EXPECT_EQ(bitmap.findFirstZero(150), 150u);
+    bitmap.clear(5);
+    EXPECT_EQ(bitmap.findFirstZero(), 5u);
+    EXPECT_EQ(bitmap.findFirstZero(6), 130u);
+
+    // Tail bits past size() are never reported as free
+    for (size_t i = 130; i < 200; ++i) {
+        bitmap.set(i);
+    }
+    EXPECT_EQ(bitmap.findFirstZero(6), Bitmap::npos);
+    EXPECT_EQ(bitmap.countZeros(), 1u);
+}
+
+// Test case for the vectorised scan over a large, nearly full bitmap
+TEST(BitmapTest, LargeBitmapSearch) {
+    Bitmap bitmap(1 << 16);
+    for (size_t i = 0; i < bitmap.size(); ++i) {
+        bitmap.set(i);
+    }
+    EXPECT_EQ(bitmap.findFirstZero(), Bitmap::npos);
+
+    bitmap.clear(60001);
+    bitmap.clear(777);
+    EXPECT_EQ(bitmap.findFirstZero(), 777u);
+    EXPECT_EQ(bitmap.findFirstZero(778), 60001u);
+    EXPECT_EQ(bitmap.findNextZero(60002), 777u); // wraps around
+}
+
+// Test case for next-fit allocation from the group's own bitmaps
+TEST(BlockGroupTest, NextFitAllocation) {
+    initializeDisk("disk.img");
+    BlockGroup bg("disk.img");
+    bg.getGroupDesc().bg_block_bitmap = 1;
+    bg.getGroupDesc().bg_inode_bitmap = 2;
+    ASSERT_TRUE(bg.readBitmapsFromDisk(1024, 256));
+
+    EXPECT_EQ(bg.allocateInode(), 0);
+    EXPECT_EQ(bg.allocateInode(), 1);
+    EXPECT_EQ(bg.allocateInode(), 2);
+    bg.releaseInode(0);
+    // The cursor keeps moving forward instead of rescanning from index 0
+    EXPECT_EQ(bg.allocateInode(), 3);
+
+    // The packed bitmap is persisted: inodes 1..3 are in use
+    BlockGroup bg2("disk.img");
+    bg2.getGroupDesc() = bg.getGroupDesc();
+    ASSERT_TRUE(bg2.readBitmapsFromDisk(1024, 256));
+    EXPECT_FALSE(bg2.getInodeBitmap().test(0));
+    EXPECT_TRUE(bg2.getInodeBitmap().test(1));
+    EXPECT_TRUE(bg2.getInodeBitmap().test(3));
+    EXPECT_EQ(bg2.getInodeBitmap().countZeros(), 253u);
+}
+
+// Test case for best-fit contiguous allocation
+TEST(BlockGroupTest, AllocateContiguousRun) {
+    initializeDisk("disk.img");
+    BlockGroup bg("disk.img");
+    bg.getGroupDesc().bg_block_bitmap = 1;
+    bg.getGroupDesc().bg_inode_bitmap = 2;
+    ASSERT_TRUE(bg.readBitmapsFromDisk(1024, 256));
+
+    // Leave free gaps of 3 blocks at 10..12 and 8 blocks at 20..27, nothing after 100
+    Bitmap &bitmap = bg.getBlockBitmap();
+    bitmap.setRange(0, 1024);
+    bitmap.clearRange(10, 3);
+    bitmap.clearRange(20, 8);
+    bitmap.clearRange(100, 50);
+
+    uint32_t allocated = 0;
+    EXPECT_EQ(bg.allocateBlocks(8, allocated), 20); // exact fit beats the larger run
+    EXPECT_EQ(allocated, 8u);
+    EXPECT_EQ(bg.allocateBlocks(2, allocated), 10); // smallest run that fits
+    EXPECT_EQ(allocated, 2u);
+    EXPECT_EQ(bg.allocateBlocks(80, allocated), 100); // longest run when nothing fits
+    EXPECT_EQ(allocated, 50u);
+
+    bg.releaseBlocks(100, 50);
+    EXPECT_EQ(bg.allocateBlocks(4, allocated, 120), 120); // goal block is free
+    EXPECT_EQ(allocated, 4u);
+}
+
+// Test case for inline extents and the extent tree
+TEST(ExtentTreeTest, InlineAndTree) {
+    initializeDisk("disk.img");
+    auto cache = std::make_shared<BufferCache>(std::make_shared<BlockDevice>("disk.img"));
+    ExtentTree tree(cache);
+    uint32_t iBlock[15];
+    ExtentTree::initRoot(iBlock);
+
+    uint64_t nextNode = 500;
+    std::vector<uint64_t> released;
+    auto allocate = [&]() -> int64_t { return static_cast<int64_t>(nextNode++); };
+    auto release = [&](uint64_t block) { released.push_back(block); };
+
+    // Adjacent extents merge and stay inline
+    std::vector<ExtentTree::Extent> extents = {{0, 100, 4}, {4, 104, 4}, {8, 300, 2}};
+    ASSERT_TRUE(tree.store(iBlock, extents, allocate, release));
+    std::vector<uint64_t> nodes;
+    ASSERT_TRUE(tree.collectNodeBlocks(iBlock, nodes));
+    EXPECT_TRUE(nodes.empty());
+    std::vector<ExtentTree::Extent> loaded;
+    ASSERT_TRUE(tree.load(iBlock, loaded));
+    ASSERT_EQ(loaded.size(), 2u);
+    EXPECT_EQ(loaded[0].length, 8u);
+
+    // 200 discontiguous extents need leaf blocks
+    extents.clear();
+    for (uint32_t i = 0; i < 200; ++i) {
+        extents.push_back({i, 1000 + 2 * i, 1});
+    }
+    ASSERT_TRUE(tree.store(iBlock, extents, allocate, release));
+    ASSERT_TRUE(tree.collectNodeBlocks(iBlock, nodes));
+    EXPECT_EQ(nodes.size(), 3u); // 84 extents per 1 KiB leaf
+    ASSERT_TRUE(tree.load(iBlock, loaded));
+    ASSERT_EQ(loaded.size(), 200u);
+    EXPECT_EQ(loaded[150].physical, 1300u);
+
+    ExtentTree::Extent found;
+    ASSERT_TRUE(tree.lookup(iBlock, 123, found));
+    EXPECT_EQ(found.physical, 1246u);
+    EXPECT_FALSE(tree.lookup(iBlock, 200, found));
+
+    // Shrinking back inline releases the leaves
+    ASSERT_TRUE(tree.store(iBlock, {{0, 100, 8}}, allocate, release));
+    EXPECT_EQ(released.size(), 3u);
+}
+
+// Test case for a directory growing from one block into a two-level hash tree
+TEST(DirectoryTest, HashTreeLookup) {
+    initializeDisk("disk.img");
+    auto cache = std::make_shared<BufferCache>(std::make_shared<BlockDevice>("disk.img"), 1024);
+    Inode::Ext4Inode dirInode = {};
+    // Logical block n of the directory lives at physical block 10 + n
+    Directory directory(cache, dirInode, [](uint32_t logical, bool) -> int64_t { return 10 + logical; });
+    ASSERT_TRUE(directory.init(2, 2));
+
+    const uint32_t count = 6000;
+    for (uint32_t i = 0; i < count; ++i) {
+        ASSERT_TRUE(directory.add("entry-" + std::to_string(i), 100 + i, Directory::FT_REG_FILE));
+    }
+    EXPECT_TRUE(dirInode.i_flags & Directory::INDEX_FL);
+    Directory::DxRootInfo info;
+    ASSERT_TRUE(cache->read(10 * 1024 + 24, &info, sizeof(info)));
+    EXPECT_EQ(info.indirect_levels, 1); // more leaves than the root can index
+
+    // Every lookup reads the root, one index node and one leaf
+    for (uint32_t i = 0; i < count; i += 7) {
+        uint64_t before = cache->getHits() + cache->getMisses();
+        uint32_t found = 0;
+        ASSERT_TRUE(directory.lookup("entry-" + std::to_string(i), found));
+        EXPECT_EQ(found, 100 + i);
+        EXPECT_LE(cache->getHits() + cache->getMisses() - before, 3u);
+    }
+    uint32_t found = 0;
+    EXPECT_FALSE(directory.lookup("missing", found));
+    ASSERT_TRUE(directory.lookup("..", found));
+    EXPECT_EQ(found, 2u);
+
+    // Removed names are gone, the rest are still found
+    for (uint32_t i = 0; i < count; i += 3) {
+        ASSERT_TRUE(directory.remove("entry-" + std::to_string(i)));
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        EXPECT_EQ(directory.lookup("entry-" + std::to_string(i), found), i % 3 != 0);
+    }
+    std::vector<Directory::Entry> entries;
+    ASSERT_TRUE(directory.list(entries));
+    EXPECT_EQ(entries.size(), count - count / 3 + 2);
+    EXPECT_FALSE(directory.isEmpty());
+}
+
+// Test case for creating a file backed by contiguous extents
+TEST(FileSystemTest, CreateFileAllocatesExtents) {
+    FileSystem fs("fs_disk.img");
+    fs.initialize();
+
+    int first = fs.createFile(0x1FF, 100 * 1024);
+    ASSERT_GE(first, 0);
+    std::vector<ExtentTree::Extent> extents;
+    ASSERT_TRUE(fs.getExtents(first, extents));
+    ASSERT_EQ(extents.size(), 1u);
+    EXPECT_EQ(extents[0].length, 100u);
+
+    Inode::Ext4Inode fileInode;
+    ASSERT_TRUE(fs.stat(first, fileInode));
+    EXPECT_EQ(fileInode.i_size, 100u * 1024u);
+    EXPECT_EQ(fileInode.i_blocks, 200u); // 512-byte sectors
+
+    // Deleting the file returns its blocks once it is reclaimed; a new file of
+    // the same size reuses them
+    uint64_t start = extents[0].physical;
+    fs.deleteFile(first);
+    ASSERT_TRUE(fs.reclaim());
+    int second = fs.createFile(0x1FF, 100 * 1024);
+    ASSERT_TRUE(fs.getExtents(second, extents));
+    ASSERT_EQ(extents.size(), 1u);
+    EXPECT_EQ(extents[0].physical, start);
+}
+
+// Test case for offset-based binary I/O that grows a file
+TEST(FileSystemTest, ReadWriteBinaryData) {
+    FileSystem fs("fs_disk.img");
+    fs.initialize();
+    int file = fs.createFile(0x1FF, 0);
+    ASSERT_GE(file, 0);
+
+    // Binary content with embedded NULs, larger than any single block
+    std::vector<char> data(300 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>((i * 131) % 251);
+    }
+    ASSERT_EQ(fs.write(file, 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+    ASSERT_TRUE(fs.fsync(file));
+
+    std::vector<ExtentTree::Extent> extents;
+    ASSERT_TRUE(fs.getExtents(file, extents));
+    EXPECT_EQ(extents.size(), 1u); // grown as one contiguous run
+
+    // Sequential reads in uneven chunks reassemble the content
+    std::vector<char> readBack(data.size());
+    size_t offset = 0;
+    while (offset < readBack.size()) {
+        int64_t n = fs.read(file, offset, readBack.data() + offset, 7000);
+        ASSERT_GT(n, 0);
+        offset += static_cast<size_t>(n);
+    }
+    EXPECT_EQ(readBack, data);
+
+    // Overwrite in the middle, then read across the boundary
+    const char patch[] = {'\0', 'X', '\0', 'Y'};
+    ASSERT_EQ(fs.write(file, 1023, patch, sizeof(patch)), 4);
+    char window[6];
+    ASSERT_EQ(fs.read(file, 1022, window, sizeof(window)), 6);
+    EXPECT_EQ(window[0], data[1022]);
+    EXPECT_EQ(std::memcmp(window + 1, patch, sizeof(patch)), 0);
+    EXPECT_EQ(window[5], data[1027]);
+
+    // Reads stop at the end of the file
+    char tail[16];
+    EXPECT_EQ(fs.read(file, data.size() - 4, tail, sizeof(tail)), 4);
+    EXPECT_EQ(fs.read(file, data.size(), tail, sizeof(tail)), 0);
+}
+
+// Test case for crash recovery: committed metadata that never reached its home
+// location is replayed from the journal at mount
+TEST(FileSystemTest, RecoverFromJournal) {
+    std::vector<char> data(8 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 13 + 5);
+    }
+    int file;
+    {
+        FileSystem fs("fs_disk.img");
+        fs.initialize();
+        // Appends flushed one at a time and interleaved with other allocations
+        // give a fragmented file whose mapping needs a tree node block
+        int fragmented = fs.createFile(0x1A4, 0);
+        ASSERT_GE(fragmented, 0);
+        for (int i = 0; i < 6; ++i) {
+            ASSERT_EQ(fs.write(fragmented, i * 1024, data.data(), 1024), 1024);
+            ASSERT_TRUE(fs.fsync(fragmented));
+            ASSERT_GE(fs.createFile(0x1A4, 1024), 0);
+        }
+        std::vector<ExtentTree::Extent> extents;
+        ASSERT_TRUE(fs.getExtents(fragmented, extents));
+        EXPECT_GT(extents.size(), 4u);
+        // Freeing it revokes the node block, which the next file may reuse for data
+        fs.deleteFile(fragmented);
+        ASSERT_TRUE(fs.reclaim());
+
+        // Block-sized appends, flushed one at a time, fill the single-block holes first
+        file = fs.createFile(0x1FF, 0);
+        ASSERT_GE(file, 0);
+        for (size_t offset = 0; offset < data.size(); offset += 1024) {
+            ASSERT_EQ(fs.write(file, offset, data.data() + offset, 1024), 1024);
+            ASSERT_TRUE(fs.fsync(file));
+        }
+
+        // Crash: copy the image while the metadata is only in the cache and the journal
+        std::ifstream in("fs_disk.img", std::ios::binary);
+        std::ofstream out("fs_crash.img", std::ios::binary | std::ios::trunc);
+        out << in.rdbuf();
+    }
+
+    // The last write's inode update is not home before recovery
+    auto crashCache = std::make_shared<BufferCache>(std::make_shared<BlockDevice>("fs_crash.img"));
+    BlockGroup group(crashCache, Superblock::GROUP_DESC_BLOCK * 1024);
+    group.readGroupDescFromDisk(0);
+    Inode raw(crashCache, group.getGroupDesc().bg_inode_table * 1024ull);
+    raw.readInodeFromDisk(file);
+    EXPECT_NE(raw.getInode().i_size, data.size());
+
+    FileSystem recovered("fs_crash.img");
+    Inode::Ext4Inode info;
+    ASSERT_TRUE(recovered.stat(file, info));
+    EXPECT_EQ(info.i_size, data.size());
+    std::vector<char> readBack(data.size());
+    ASSERT_EQ(recovered.read(file, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+    EXPECT_EQ(readBack, data);
+}
+
+// Test case for the mmap backend: metadata staged over the mapping is read back by pread
+TEST(FileSystemTest, MmapBackend) {
+    FileSystemOptions options;
+    options.mmapImage = true;
+    std::vector<char> data(40 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 7);
+    }
+
+    int first;
+    int second;
+    {
+        FileSystem fs("fs_disk.img", options);
+        fs.initialize();
+        EXPECT_TRUE(fs.getCache().getDevice()->isMapped());
+        first = fs.createFile(0x1FF, 0);
+        second = fs.createFile(0x1A4, 2048);
+        ASSERT_GE(first, 0);
+        ASSERT_GE(second, 0);
+        ASSERT_EQ(fs.write(first, 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+        // Interleaving inodes must not leak one inode's fields into the other
+        ASSERT_EQ(fs.write(second, 0, "abc", 3), 3);
+
+        Inode::Ext4Inode info;
+        ASSERT_TRUE(fs.stat(first, info));
+        EXPECT_EQ(info.i_size, data.size());
+        ASSERT_TRUE(fs.stat(second, info));
+        EXPECT_EQ(info.i_size, 2048u);
+        fs.sync();
+    }
+
+    FileSystem reopened("fs_disk.img");
+    EXPECT_FALSE(reopened.getCache().getDevice()->isMapped());
+    Inode::Ext4Inode info;
+    ASSERT_TRUE(reopened.stat(first, info));
+    EXPECT_EQ(info.i_size, data.size());
+    EXPECT_EQ(info.i_mode, 0x1FF);
+    std::vector<char> readBack(data.size());
+    ASSERT_EQ(reopened.read(first, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+    EXPECT_EQ(readBack, data);
+
+    // The allocator state written through the mapping is intact
+    int third = reopened.createFile(0x1A4, 0);
+    EXPECT_NE(third, first);
+    EXPECT_NE(third, second);
+}
+
+// Test case for mkfs with many block groups: inodes and data spill into later groups
+TEST(FileSystemTest, MkfsManyGroups) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 64 * 1024 * 1024;
+    mkfs.inodesPerGroup = 16;
+    std::vector<char> data(10 * 1024 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 31 + 7);
+    }
+
+    int large;
+    std::vector<int> files;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize(mkfs));
+        EXPECT_EQ(fs.getGroupCount(), 8u); // 8192 blocks of 1 KiB per group
+        EXPECT_EQ(fs.getSuperblock().s_inodes_count, 8u * 16u);
+
+        for (int i = 0; i < 20; ++i) {
+            files.push_back(fs.createFile(0x1A4, 1024));
+            ASSERT_GE(files.back(), 0);
+        }
+        EXPECT_GE(files.back(), 16); // the 17th inode comes from group 1
+
+        // A file larger than a group is mapped across several of them
+        large = fs.createFile(0x1A4, 0);
+        ASSERT_GE(large, 0);
+        ASSERT_EQ(fs.write(large, 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+        std::vector<ExtentTree::Extent> extents;
+        ASSERT_TRUE(fs.getExtents(large, extents));
+        EXPECT_GT(extents.size(), 1u);
+    }
+
+    FileSystem fs("fs_disk.img");
+    ASSERT_TRUE(fs.isMounted());
+    EXPECT_EQ(fs.getGroupCount(), 8u);
+    std::vector<char> readBack(data.size());
+    ASSERT_EQ(fs.read(large, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+    EXPECT_EQ(readBack, data);
+    Inode::Ext4Inode info;
+    for (int file : files) {
+        ASSERT_TRUE(fs.stat(file, info));
+        EXPECT_EQ(info.i_size, 1024u);
+    }
+}
+
+// Test case for named files and directories, kept across a remount
+TEST(FileSystemTest, NamedFilesAndDirectories) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 16 * 1024 * 1024;
+    mkfs.inodesPerGroup = 4096;
+    const uint32_t root = FileSystem::ROOT_INODE;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize(mkfs));
+        int file = fs.create(root, "hello.txt", 0644);
+        ASSERT_GE(file, 0);
+        EXPECT_EQ(fs.lookup(root, "hello.txt"), file);
+        EXPECT_EQ(fs.create(root, "hello.txt", 0644), -1);
+        ASSERT_EQ(fs.write(file, 0, "hello", 5), 5);
+
+        int docs = fs.create(root, "docs", Inode::DIRECTORY | 0755);
+        ASSERT_GE(docs, 0);
+        EXPECT_EQ(fs.lookup(docs, ".."), static_cast<int>(root));
+        EXPECT_EQ(fs.write(docs, 0, "x", 1), -1);
+
+        // Enough entries for the directory to be indexed
+        for (int i = 0; i < 3000; ++i) {
+            ASSERT_GE(fs.create(docs, "note-" + std::to_string(i), 0644), 0);
+        }
+        Inode::Ext4Inode info;
+        ASSERT_TRUE(fs.stat(docs, info));
+        EXPECT_TRUE(info.i_flags & Directory::INDEX_FL);
+        EXPECT_FALSE(fs.unlink(root, "docs")); // not empty
+        for (int i = 0; i < 3000; ++i) {
+            ASSERT_TRUE(fs.unlink(docs, "note-" + std::to_string(i)));
+        }
+        EXPECT_EQ(fs.lookup(docs, "note-5"), -1);
+
+        ASSERT_GE(fs.create(root, "empty", Inode::DIRECTORY | 0755), 0);
+        EXPECT_TRUE(fs.unlink(root, "docs"));
+        EXPECT_EQ(fs.lookup(root, "docs"), -1);
+    }
+
+    // The root and "empty" are the directories left
+    auto cache = std::make_shared<BufferCache>(std::make_shared<BlockDevice>("fs_disk.img"));
+    BlockGroup group(cache, Superblock::GROUP_DESC_BLOCK * 1024);
+    group.readGroupDescFromDisk(0);
+    EXPECT_EQ(group.getGroupDesc().bg_used_dirs_count, 2u);
+
+    FileSystem fs("fs_disk.img");
+    int file = fs.lookup(root, "hello.txt");
+    ASSERT_GE(file, 0);
+    char buffer[5];
+    ASSERT_EQ(fs.read(file, 0, buffer, sizeof(buffer)), 5);
+    EXPECT_EQ(std::string(buffer, 5), "hello");
+    std::vector<Directory::Entry> entries;
+    ASSERT_TRUE(fs.listDirectory(root, entries));
+    EXPECT_EQ(entries.size(), 4u); // ".", "..", hello.txt, empty
+}
+
+// Test case for creates, writes and deletes from many threads at once
+TEST(FileSystemTest, ConcurrentCreateDelete) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 64 * 1024 * 1024;
+    FileSystem fs("fs_disk.img");
+    ASSERT_TRUE(fs.initialize(mkfs));
+
+    const int threadCount = 8;
+    const int filesPerThread = 64;
+    std::vector<std::vector<int>> kept(threadCount);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t]() {
+            std::vector<char> data(3000, static_cast<char>('a' + t));
+            for (int i = 0; i < filesPerThread; ++i) {
+                int file = fs.createFile(0x1A4, 0);
+                if (file < 0 || fs.write(file, 0, data.data(), data.size()) != static_cast<int64_t>(data.size())) {
+                    ++failures;
+                    continue;
+                }
+                if (i % 2) {
+                    fs.deleteFile(file);
+                } else {
+                    kept[t].push_back(file);
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(failures, 0);
+
+    // Every file kept has its own inode, its own blocks and its own contents
+    std::set<int> inodes;
+    std::set<uint32_t> usedGroups;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (int t = 0; t < threadCount; ++t) {
+        for (int file : kept[t]) {
+            EXPECT_TRUE(inodes.insert(file).second);
+            usedGroups.insert(file / mkfs.inodesPerGroup);
+            std::vector<char> readBack(3000);
+            ASSERT_EQ(fs.read(file, 0, readBack.data(), readBack.size()), 3000);
+            EXPECT_EQ(readBack, std::vector<char>(3000, static_cast<char>('a' + t)));
+            std::vector<ExtentTree::Extent> extents;
+            ASSERT_TRUE(fs.getExtents(file, extents));
+            for (const auto &extent : extents) {
+                ranges.push_back({extent.physical, extent.physical + extent.length});
+            }
+        }
+    }
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        EXPECT_GE(ranges[i].first, ranges[i - 1].second);
+    }
+    // Threads start in different home groups
+    EXPECT_GT(usedGroups.size(), 1u);
+}
+
+// Test case for mkfs of a large image: only the superblock and descriptors are written
+TEST(FileSystemTest, MkfsLargeSparseImage) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = uint64_t(4) << 30;
+    mkfs.blockSize = 4096;
+    mkfs.inodesPerGroup = 32768;
+    {
+        FileSystem fs("fs_large.img");
+        ASSERT_TRUE(fs.initialize(mkfs));
+        EXPECT_EQ(fs.getGroupCount(), 32u);
+        EXPECT_EQ(fs.getSuperblock().s_inodes_count, 32u * 32768u);
+        ASSERT_GE(fs.createFile(0x1A4, 64 * 1024), 0);
+    }
+    struct stat st;
+    ASSERT_EQ(::stat("fs_large.img", &st), 0);
+    EXPECT_EQ(static_cast<uint64_t>(st.st_size), mkfs.imageSize);
+    EXPECT_LT(static_cast<uint64_t>(st.st_blocks) * 512, uint64_t(8) << 20); // still sparse
+
+    // The block size is picked up from the superblock at mount
+    FileSystem fs("fs_large.img");
+    ASSERT_TRUE(fs.isMounted());
+    EXPECT_EQ(fs.getSuperblock().s_log_block_size, 2u);
+    EXPECT_EQ(fs.getCache().getDevice()->getBlockSize(), 4096u);
+    std::remove("fs_large.img");
+}
+
+// Test case for batch create and delete against the per-file calls
+TEST(FileSystemTest, BatchCreateDelete) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 16 * 1024 * 1024;
+    mkfs.inodesPerGroup = 2048;
+    std::vector<uint32_t> created;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize(mkfs));
+
+        // The same 300 files one at a time, for the record count
+        uint64_t records = fs.getJournal().getRecordCount();
+        std::vector<uint32_t> single;
+        for (int i = 0; i < 300; ++i) {
+            single.push_back(static_cast<uint32_t>(fs.createFile(0x81A4, 1500)));
+        }
+        fs.sync();
+        uint64_t singleRecords = fs.getJournal().getRecordCount() - records;
+        for (uint32_t file : single) {
+            fs.deleteFile(file);
+        }
+        fs.sync();
+
+        records = fs.getJournal().getRecordCount();
+        ASSERT_TRUE(fs.createFiles(300, 0x81A4, 1500, created));
+        fs.sync();
+        ASSERT_EQ(created.size(), 300u);
+        EXPECT_LT((fs.getJournal().getRecordCount() - records) * 10, singleRecords);
+
+        // Each file got two blocks, cut from one run in inode order
+        std::set<uint32_t> distinct(created.begin(), created.end());
+        EXPECT_EQ(distinct.size(), created.size());
+        std::vector<ExtentTree::Extent> first, last;
+        ASSERT_TRUE(fs.getExtents(created.front(), first));
+        ASSERT_TRUE(fs.getExtents(created.back(), last));
+        ASSERT_EQ(first.size(), 1u);
+        ASSERT_EQ(last.size(), 1u);
+        EXPECT_EQ(first[0].length, 2u);
+        EXPECT_EQ(last[0].physical, first[0].physical + 2 * 299);
+
+        // Deleting the odd ones frees them; a bad inode number is reported
+        std::vector<uint32_t> odd;
+        for (size_t i = 1; i < created.size(); i += 2) {
+            odd.push_back(created[i]);
+        }
+        EXPECT_TRUE(fs.deleteFiles(odd));
+        EXPECT_FALSE(fs.deleteFiles({created[1]}));
+        Inode::Ext4Inode inode;
+        EXPECT_FALSE(fs.stat(created[1], inode));
+        ASSERT_TRUE(fs.stat(created[2], inode));
+        EXPECT_EQ(inode.i_size, 1500u);
+    }
+
+    // The batches survive a remount
+    FileSystem fs("fs_disk.img");
+    Inode::Ext4Inode inode;
+    EXPECT_FALSE(fs.stat(created[1], inode));
+    ASSERT_TRUE(fs.stat(created[0], inode));
+    EXPECT_EQ(inode.i_size, 1500u);
+}
+
+// Test case for the statistics a FileSystem collects about its own operations
+TEST(FileSystemTest, OperationStats) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 4 * 1024 * 1024;
+    FileSystemOptions options;
+    options.dirtyLimit = 0; // write through, so the write's I/O is its own
+    FileSystem fs("fs_disk.img", options);
+    ASSERT_TRUE(fs.initialize(mkfs));
+    ASSERT_NE(fs.getStats(), nullptr);
+
+    std::vector<char> data(64 * 1024, 's');
+    std::vector<int> files;
+    for (int i = 0; i < 10; ++i) {
+        files.push_back(fs.createFile(0x81A4, 0));
+        ASSERT_GE(files.back(), 0);
+    }
+    ASSERT_EQ(fs.write(files[0], 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+    ASSERT_EQ(fs.read(files[0], 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+    for (int i = 0; i < 5; ++i) {
+        fs.deleteFile(files[i]);
+    }
+    fs.sync();
+
+    Stats::Snapshot stats = fs.getStats()->snapshot();
+    EXPECT_EQ(stats[Stats::CREATE].count, 10u);
+    EXPECT_EQ(stats[Stats::DELETE].count, 5u);
+    EXPECT_EQ(stats[Stats::WRITE].count, 1u);
+    EXPECT_GE(stats[Stats::WRITE].bytes, data.size());
+    EXPECT_GE(stats[Stats::READ].bytes, data.size());
+    EXPECT_GE(stats[Stats::READ].syscalls, 1u);
+    EXPECT_GE(stats[Stats::BITMAP_SEARCH].count, 11u); // an inode for each file, blocks for the write
+    EXPECT_GE(stats[Stats::INODE_READ].count, 17u);
+    EXPECT_GE(stats[Stats::INODE_WRITE].count, 16u);
+    EXPECT_GT(stats[Stats::JOURNAL_WRITE].count, 0u);
+    EXPECT_GE(stats[Stats::CHECKPOINT].count, 1u); // mkfs checkpoints as well
+    EXPECT_GE(stats[Stats::CHECKPOINT].syscalls, 1u); // at least the fsync
+    for (const Stats::OperationStats &operation : stats) {
+        EXPECT_LE(operation.percentile(0.5), operation.percentile(0.99));
+        EXPECT_LE(operation.percentile(0.99), operation.percentile(0.999));
+        EXPECT_LE(operation.percentile(0.999), operation.maxNanos);
+    }
+
+    FileSystemOptions quiet;
+    quiet.collectStats = false;
+    FileSystem other("disk.img", quiet);
+    EXPECT_EQ(other.getStats(), nullptr);
+}
+
+// Test case for the free block and inode counts behind statfs
+TEST(FileSystemTest, FreeSpaceCounters) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 64 * 1024 * 1024;
+    mkfs.inodesPerGroup = 16;
+    StatFs before;
+    std::vector<int> files;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize(mkfs));
+        StatFs fresh;
+        ASSERT_TRUE(fs.statfs(fresh));
+        EXPECT_EQ(fresh.inodes, 8u * 16u);
+        EXPECT_EQ(fresh.freeInodes, fresh.inodes - 3); // two reserved inodes and the root
+        EXPECT_LT(fresh.freeBlocks, fresh.blocks);
+
+        // A 10 KiB file takes 10 blocks of 1 KiB and one inode
+        int file = fs.createFile(0x81A4, 10 * 1024);
+        ASSERT_GE(file, 0);
+        ASSERT_TRUE(fs.statfs(before));
+        EXPECT_EQ(before.freeBlocks, fresh.freeBlocks - 10);
+        EXPECT_EQ(before.freeInodes, fresh.freeInodes - 1);
+        fs.deleteFile(file);
+        ASSERT_TRUE(fs.reclaim());
+        ASSERT_TRUE(fs.statfs(before));
+        EXPECT_EQ(before.freeBlocks, fresh.freeBlocks);
+        EXPECT_EQ(before.freeInodes, fresh.freeInodes);
+
+        // Use up every inode
+        for (int i = 0; i < 8 * 16 - 3; ++i) {
+            files.push_back(fs.createFile(0x81A4, 0));
+            ASSERT_GE(files.back(), 0);
+        }
+        ASSERT_TRUE(fs.statfs(before));
+        EXPECT_EQ(before.freeInodes, 0u);
+        EXPECT_EQ(fs.createFile(0x81A4, 0), -1);
+
+        // The counts agree with the group descriptors
+        fs.sync();
+        uint64_t freeBlocks = 0;
+        for (uint32_t g = 0; g < fs.getGroupCount(); ++g) {
+            BlockGroup group(std::make_shared<BufferCache>(std::make_shared<BlockDevice>("fs_disk.img")),
+                             Superblock::GROUP_DESC_BLOCK * 1024);
+            group.readGroupDescFromDisk(g);
+            freeBlocks += group.getFreeBlocks();
+            EXPECT_EQ(group.getFreeInodes(), 0u);
+        }
+        EXPECT_EQ(freeBlocks, before.freeBlocks);
+    }
+
+    // After a remount only the last group has a free inode; creating a file
+    // goes straight there without loading the full groups' bitmaps
+    FileSystem fs("fs_disk.img");
+    StatFs after;
+    ASSERT_TRUE(fs.statfs(after));
+    EXPECT_EQ(after.freeBlocks, before.freeBlocks);
+    EXPECT_EQ(after.freeInodes, 0u);
+    EXPECT_EQ(fs.getSuperblock().s_free_blocks_count, before.freeBlocks);
+    fs.deleteFile(files.back());
+    ASSERT_TRUE(fs.reclaim());
+    uint64_t misses = fs.getCache().getMisses();
+    EXPECT_EQ(fs.createFile(0x81A4, 0), files.back());
+    EXPECT_EQ(fs.getCache().getMisses(), misses);
+}
+
+// Test case for delayed allocation: small appends are buffered and get one
+// contiguous run of blocks per file when they are flushed
+TEST(FileSystemTest, DelayedAllocation) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 4 * 1024 * 1024;
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0; // flushed only when asked to
+    std::string expected[2];
+    int files[2];
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize(mkfs));
+        StatFs before;
+        ASSERT_TRUE(fs.statfs(before));
+        for (int &file : files) {
+            file = fs.createFile(0x81A4, 0);
+            ASSERT_GE(file, 0);
+        }
+
+        // Two logs appended to in turn, 100 bytes at a time
+        for (int i = 0; i < 1000; ++i) {
+            for (int f = 0; f < 2; ++f) {
+                std::string record(100, static_cast<char>('a' + (i + f) % 26));
+                ASSERT_EQ(fs.write(files[f], expected[f].size(), record.data(), record.size()), 100);
+                expected[f] += record;
+            }
+        }
+
+        // Nothing is allocated yet, but the data is visible
+        StatFs buffered;
+        ASSERT_TRUE(fs.statfs(buffered));
+        EXPECT_EQ(buffered.freeBlocks, before.freeBlocks);
+        std::vector<ExtentTree::Extent> extents;
+        ASSERT_TRUE(fs.getExtents(files[0], extents));
+        EXPECT_TRUE(extents.empty());
+        Inode::Ext4Inode info;
+        ASSERT_TRUE(fs.stat(files[0], info));
+        EXPECT_EQ(info.i_size, 100000u);
+        std::string readBack(expected[0].size(), '\0');
+        ASSERT_EQ(fs.read(files[0], 0, &readBack[0], readBack.size()), 100000);
+        EXPECT_EQ(readBack, expected[0]);
+
+        // Flushed, each file is one run of 98 blocks
+        for (int f = 0; f < 2; ++f) {
+            ASSERT_TRUE(fs.fsync(files[f]));
+            ASSERT_TRUE(fs.getExtents(files[f], extents));
+            ASSERT_EQ(extents.size(), 1u);
+            EXPECT_EQ(extents[0].length, 98u);
+        }
+        StatFs flushed;
+        ASSERT_TRUE(fs.statfs(flushed));
+        EXPECT_EQ(flushed.freeBlocks, before.freeBlocks - 2 * 98);
+
+        // Appends that start in the last, partly used block; left for unmount
+        std::string tail(5000, 'z');
+        ASSERT_EQ(fs.write(files[0], expected[0].size(), tail.data(), tail.size()), 5000);
+        expected[0] += tail;
+        ASSERT_EQ(fs.read(files[0], 0, &readBack[0], readBack.size()), 100000);
+        EXPECT_EQ(readBack, expected[0].substr(0, 100000));
+    }
+
+    std::vector<ExtentTree::Extent> extents;
+    {
+        FileSystem fs("fs_disk.img", options);
+        for (int f = 0; f < 2; ++f) {
+            std::string readBack(expected[f].size(), '\0');
+            ASSERT_EQ(fs.read(files[f], 0, &readBack[0], readBack.size()), static_cast<int64_t>(expected[f].size()));
+            EXPECT_EQ(readBack, expected[f]);
+        }
+        ASSERT_TRUE(fs.getExtents(files[0], extents));
+        EXPECT_EQ(extents.size(), 2u); // the tail got one run of its own, past the other file
+    }
+
+    // Over the dirty limit writers flush their own file
+    FileSystemOptions small = options;
+    small.dirtyLimit = 4096;
+    FileSystem limited("fs_disk.img", small);
+    int file = limited.createFile(0x81A4, 0);
+    ASSERT_GE(file, 0);
+    std::string record(100, 'q');
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(limited.write(file, i * 100, record.data(), record.size()), 100);
+    }
+    ASSERT_TRUE(limited.getExtents(file, extents));
+    EXPECT_FALSE(extents.empty());
+}
+
+// Test case for metadata checksums: a damaged inode or group descriptor is
+// refused instead of being used
+TEST(FileSystemTest, MetadataChecksums) {
+    int file;
+    uint64_t inodeOffset;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize());
+        file = fs.createFile(0x81A4, 4096);
+        ASSERT_GE(file, 0);
+        fs.sync();
+        BlockGroup group(std::make_shared<BufferCache>(std::make_shared<BlockDevice>("fs_disk.img")),
+                         Superblock::GROUP_DESC_BLOCK * 1024);
+        ASSERT_TRUE(group.readGroupDescFromDisk(0));
+        inodeOffset = group.getGroupDesc().bg_inode_table * 1024ull + file * sizeof(Inode::Ext4Inode);
+    }
+    auto flipByte = [](uint64_t offset) {
+        std::fstream image("fs_disk.img", std::ios::binary | std::ios::in | std::ios::out);
+        image.seekg(static_cast<std::streamoff>(offset));
+        char byte = static_cast<char>(image.get() ^ 0x10);
+        image.seekp(static_cast<std::streamoff>(offset));
+        image.put(byte);
+    };
+
+    flipByte(inodeOffset + offsetof(Inode::Ext4Inode, i_size));
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.isMounted());
+        Inode::Ext4Inode info;
+        EXPECT_FALSE(fs.stat(file, info));
+        char buffer[16];
+        EXPECT_EQ(fs.read(file, 0, buffer, sizeof(buffer)), -1);
+        std::vector<Directory::Entry> entries;
+        EXPECT_TRUE(fs.listDirectory(FileSystem::ROOT_INODE, entries)); // other inodes are fine
+    }
+    flipByte(inodeOffset + offsetof(Inode::Ext4Inode, i_size));
+
+    flipByte(Superblock::GROUP_DESC_BLOCK * 1024 + offsetof(BlockGroup::Ext4GroupDesc, bg_inode_table));
+    FileSystem damaged("fs_disk.img");
+    EXPECT_FALSE(damaged.isMounted());
+}
+
+// Test case for small files stored in the inode and moved to blocks as they grow
+TEST(FileSystemTest, InlineData) {
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0;
+    std::string message = "Hello, this is a test file!";
+    int small;
+    StatFs before;
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize());
+        ASSERT_TRUE(fs.statfs(before));
+        small = fs.create(FileSystem::ROOT_INODE, "test.txt", 0x1A4);
+        ASSERT_GE(small, 0);
+        ASSERT_EQ(fs.write(small, 0, message.data(), message.size()), static_cast<int64_t>(message.size()));
+        std::string padding(Inode::INLINE_DATA_SIZE - message.size(), '.');
+        ASSERT_EQ(fs.write(small, message.size(), padding.data(), padding.size()), static_cast<int64_t>(padding.size()));
+        message += padding;
+
+        std::vector<uint32_t> created;
+        ASSERT_TRUE(fs.createFiles(10, 0x81A4, 40, created));
+        ASSERT_TRUE(fs.fsync(small));
+        std::vector<ExtentTree::Extent> extents;
+        ASSERT_TRUE(fs.getExtents(created.back(), extents));
+        EXPECT_TRUE(extents.empty());
+    }
+
+    std::vector<ExtentTree::Extent> extents;
+    {
+        // The bytes live in the inode: no block was used and they survive a remount
+        FileSystem fs("fs_disk.img", options);
+        StatFs after;
+        ASSERT_TRUE(fs.statfs(after));
+        EXPECT_EQ(after.freeBlocks, before.freeBlocks);
+        Inode::Ext4Inode info;
+        ASSERT_TRUE(fs.stat(small, info));
+        EXPECT_TRUE(info.i_flags & Inode::INLINE_DATA_FL);
+        EXPECT_EQ(info.i_size, Inode::INLINE_DATA_SIZE);
+        EXPECT_EQ(info.i_blocks, 0u);
+        std::string readBack(100, '\0');
+        ASSERT_EQ(fs.read(small, 0, &readBack[0], readBack.size()), static_cast<int64_t>(Inode::INLINE_DATA_SIZE));
+        EXPECT_EQ(readBack.substr(0, Inode::INLINE_DATA_SIZE), message);
+
+        // Growing past i_block buffers the file; the flush moves it to one block
+        std::string more(100, 'x');
+        ASSERT_EQ(fs.write(small, message.size(), more.data(), more.size()), 100);
+        message += more;
+        ASSERT_TRUE(fs.stat(small, info));
+        EXPECT_TRUE(info.i_flags & Inode::INLINE_DATA_FL);
+        readBack.assign(message.size(), '\0');
+        ASSERT_EQ(fs.read(small, 0, &readBack[0], readBack.size()), static_cast<int64_t>(message.size()));
+        EXPECT_EQ(readBack, message);
+
+        ASSERT_TRUE(fs.fsync(small));
+        ASSERT_TRUE(fs.stat(small, info));
+        EXPECT_FALSE(info.i_flags & Inode::INLINE_DATA_FL);
+        EXPECT_TRUE(info.i_flags & Inode::EXTENTS_FL);
+        ASSERT_TRUE(fs.getExtents(small, extents));
+        ASSERT_EQ(extents.size(), 1u);
+        EXPECT_EQ(extents[0].length, 1u);
+        ASSERT_TRUE(fs.statfs(after));
+        EXPECT_EQ(after.freeBlocks, before.freeBlocks - 1);
+        ASSERT_EQ(fs.read(small, 0, &readBack[0], readBack.size()), static_cast<int64_t>(message.size()));
+        EXPECT_EQ(readBack, message);
+    }
+
+    // With inline data turned off even a small file gets a block
+    FileSystemOptions blockBacked = options;
+    blockBacked.inlineData = false;
+    FileSystem plain("fs_disk.img", blockBacked);
+    ASSERT_TRUE(plain.initialize());
+    int file = plain.createFile(0x81A4, 0);
+    ASSERT_GE(file, 0);
+    ASSERT_EQ(plain.write(file, 0, message.data(), 10), 10);
+    ASSERT_TRUE(plain.fsync(file));
+    ASSERT_TRUE(plain.getExtents(file, extents));
+    EXPECT_EQ(extents.size(), 1u);
+}
+
+// Test case for deleted files whose blocks are freed in the background
+TEST(FileSystemTest, DeferredReclaim) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 16 * 1024 * 1024;
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0;
+    auto allocatedBytes = []() {
+        struct stat st;
+        return ::stat("fs_disk.img", &st) == 0 ? static_cast<uint64_t>(st.st_blocks) * 512 : 0;
+    };
+    int doomed;
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize(mkfs));
+        int big = fs.create(FileSystem::ROOT_INODE, "big", 0644);
+        ASSERT_GE(big, 0);
+        std::vector<char> chunk(1024 * 1024, 'x');
+        for (uint64_t offset = 0; offset < 4 * chunk.size(); offset += chunk.size()) {
+            ASSERT_EQ(fs.write(big, offset, chunk.data(), chunk.size()), static_cast<int64_t>(chunk.size()));
+        }
+        fs.sync();
+        StatFs before;
+        ASSERT_TRUE(fs.statfs(before));
+        uint64_t allocated = allocatedBytes();
+
+        // The file is gone at once; its blocks follow when the orphan is reclaimed
+        ASSERT_TRUE(fs.unlink(FileSystem::ROOT_INODE, "big"));
+        Inode::Ext4Inode info;
+        EXPECT_FALSE(fs.stat(big, info));
+        EXPECT_LT(fs.lookup(FileSystem::ROOT_INODE, "big"), 0);
+        EXPECT_TRUE(fs.reclaim());
+        EXPECT_EQ(fs.getOrphanCount(), 0u);
+        EXPECT_EQ(fs.getSuperblock().s_last_orphan, 0u);
+        StatFs after;
+        ASSERT_TRUE(fs.statfs(after));
+        EXPECT_GE(after.freeBlocks, before.freeBlocks + 4096);
+        EXPECT_EQ(after.freeInodes, before.freeInodes + 1);
+        // Punched out of the image, but for the partial pages at its ends and
+        // what the reclaim wrote
+        EXPECT_LE(allocatedBytes() + 4 * chunk.size() - 64 * 1024, allocated);
+
+        // Many files at once, freed by the reclaimer thread
+        std::vector<uint32_t> created;
+        ASSERT_TRUE(fs.createFiles(50, 0x81A4, 10000, created));
+        ASSERT_TRUE(fs.deleteFiles(created));
+        for (int i = 0; i < 5000 && fs.getOrphanCount() > 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(fs.getOrphanCount(), 0u);
+        StatFs churned;
+        ASSERT_TRUE(fs.statfs(churned));
+        EXPECT_EQ(churned.freeBlocks, after.freeBlocks);
+        EXPECT_EQ(churned.freeInodes, after.freeInodes);
+        EXPECT_GE(fs.getStats()->snapshot()[Stats::RECLAIM].count, 2u);
+
+        doomed = fs.createFile(0x81A4, 5000);
+        ASSERT_GE(doomed, 0);
+    }
+
+    // A crash left 'doomed' on the orphan list: fsck accepts it and the next
+    // mount reclaims it
+    {
+        auto device = std::make_shared<BlockDevice>("fs_disk.img");
+        Superblock superblock(std::make_shared<BufferCache>(device));
+        ASSERT_TRUE(superblock.readSuperblockFromDisk());
+        uint64_t offset = superblock.getInodeTableBlock(0) * 1024 + static_cast<uint64_t>(doomed) * sizeof(Inode::Ext4Inode);
+        Inode::Ext4Inode inode;
+        ASSERT_TRUE(device->read(offset, &inode, sizeof(inode)));
+        inode.i_links_count = 0;
+        inode.i_dtime = 0;
+        Inode::setChecksum(inode, offset);
+        ASSERT_TRUE(device->write(offset, &inode, sizeof(inode)));
+        uint32_t head = static_cast<uint32_t>(doomed);
+        ASSERT_TRUE(device->write(offsetof(Superblock::Ext4Superblock, s_last_orphan), &head, sizeof(head)));
+    }
+    FsckReport report;
+    ASSERT_TRUE(Fsck("fs_disk.img").run(report));
+    EXPECT_TRUE(report.clean());
+    EXPECT_EQ(report.orphans, 1u);
+    {
+        FileSystem fs("fs_disk.img", options);
+        EXPECT_TRUE(fs.reclaim());
+        Inode::Ext4Inode info;
+        EXPECT_FALSE(fs.stat(static_cast<uint32_t>(doomed), info));
+    }
+    ASSERT_TRUE(Fsck("fs_disk.img").run(report));
+    EXPECT_TRUE(report.clean());
+    EXPECT_EQ(report.orphans, 0u);
+}
+
+// Test case for the online defragmenter: fragmented files are moved into one
+// run, paced to the requested rate, and a file written during the copy keeps
+// the last write
+TEST(FileSystemTest, OnlineDefragment) {
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0;
+    std::vector<char> data(128 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 7 + 3);
+    }
+    std::vector<int> files;
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize());
+        // Appends flushed one at a time between other files' blocks; the
+        // spacers are deleted afterwards, leaving gaps
+        std::vector<uint32_t> spacers;
+        for (int f = 0; f < 3; ++f) {
+            files.push_back(fs.createFile(0x81A4, 0));
+            ASSERT_GE(files.back(), 0);
+        }
+        for (size_t offset = 0; offset < data.size(); offset += 4096) {
+            for (int file : files) {
+                ASSERT_EQ(fs.write(file, offset, data.data() + offset, 4096), 4096);
+                ASSERT_TRUE(fs.fsync(file));
+            }
+            int spacer = fs.createFile(0x81A4, 4096);
+            ASSERT_GE(spacer, 0);
+            spacers.push_back(static_cast<uint32_t>(spacer));
+        }
+        ASSERT_TRUE(fs.deleteFiles(spacers));
+        ASSERT_TRUE(fs.reclaim());
+        Fragmentation before;
+        ASSERT_TRUE(fs.getFragmentation(files[0], before));
+        EXPECT_EQ(before.blocks, data.size() / 1024);
+        EXPECT_GT(before.fragments, 16u);
+        EXPECT_EQ(before.ideal, 1u);
+        StatFs freeBefore;
+        ASSERT_TRUE(fs.statfs(freeBefore));
+
+        DefragOptions unpaced;
+        unpaced.bytesPerSecond = 0;
+        DefragReport report;
+        ASSERT_TRUE(fs.defragmentFile(files[0], unpaced, report));
+        EXPECT_EQ(report.filesScanned, 1u);
+        EXPECT_EQ(report.filesImproved, 1u);
+        EXPECT_EQ(report.fragmentsBefore, before.fragments);
+        EXPECT_EQ(report.fragmentsAfter, 1u);
+        EXPECT_EQ(report.blocksMoved, before.blocks);
+        Fragmentation after;
+        ASSERT_TRUE(fs.getFragmentation(files[0], after));
+        EXPECT_EQ(after.fragments, 1u);
+        std::vector<char> readBack(data.size());
+        ASSERT_EQ(fs.read(files[0], 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, data);
+        StatFs freeAfter;
+        ASSERT_TRUE(fs.statfs(freeAfter));
+        EXPECT_GE(freeAfter.freeBlocks, freeBefore.freeBlocks);
+        // Nothing left to do for it
+        DefragReport again;
+        ASSERT_TRUE(fs.defragmentFile(files[0], unpaced, again));
+        EXPECT_EQ(again.filesFragmented, 0u);
+
+        // 128 KiB at 256 KiB/s takes half a second
+        DefragOptions paced;
+        paced.bytesPerSecond = 256 * 1024;
+        paced.chunkBytes = 16 * 1024;
+        auto start = std::chrono::steady_clock::now();
+        report = DefragReport();
+        ASSERT_TRUE(fs.defragmentFile(files[1], paced, report));
+        EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(400));
+        EXPECT_EQ(report.fragmentsAfter, 1u);
+
+        // A writer during the copy: either the move is abandoned or it
+        // finishes before the write; the file holds the last write either way
+        std::vector<char> last(data.size());
+        std::thread writer([&]() {
+            for (int round = 1; round <= 20; ++round) {
+                std::fill(last.begin(), last.end(), static_cast<char>(round));
+                fs.write(files[2], 0, last.data(), last.size());
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        });
+        report = DefragReport();
+        ASSERT_TRUE(fs.defragment(paced, report));
+        writer.join();
+        EXPECT_GE(report.filesScanned, 3u);
+        EXPECT_LE(report.fragmentsAfter, report.fragmentsBefore);
+        ASSERT_EQ(fs.read(files[2], 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, last);
+        ASSERT_EQ(fs.read(files[1], 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, data);
+    }
+
+    {
+        FileSystem reopened("fs_disk.img", options);
+        EXPECT_EQ(reopened.getSuperblock().s_defrag_blocks, 0u);
+        std::vector<char> readBack(data.size());
+        ASSERT_EQ(reopened.read(files[0], 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, data);
+    }
+    FsckReport check;
+    ASSERT_TRUE(Fsck("fs_disk.img").run(check));
+    EXPECT_TRUE(check.clean());
+}
+
+// Test case for reflink clones: a clone shares the source's blocks, the first
+// write to a shared block copies it, and deleting either file only drops its
+// references
+TEST(FileSystemTest, ReflinkClone) {
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0;
+    std::vector<char> data(256 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 11 + 1);
+    }
+    std::vector<char> patched(data);
+    std::memcpy(patched.data() + 5000, "patched", 7);
+    std::vector<char> readBack(data.size());
+    auto physical = [](const std::vector<ExtentTree::Extent> &extents) {
+        std::vector<uint64_t> blocks;
+        for (const auto &extent : extents) {
+            for (uint32_t i = 0; i < extent.length; ++i) {
+                blocks.push_back(extent.physical + i);
+            }
+        }
+        return blocks;
+    };
+    StatFs initial;
+    int copy;
+    int second;
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize());
+        int source = fs.create(FileSystem::ROOT_INODE, "model", 0644);
+        ASSERT_GE(source, 0);
+        ASSERT_TRUE(fs.statfs(initial));
+        ASSERT_EQ(fs.write(source, 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+        ASSERT_TRUE(fs.fsync(source));
+        StatFs before;
+        ASSERT_TRUE(fs.statfs(before));
+
+        // No data is copied: the group only gets its reference count table
+        copy = fs.clone(source);
+        ASSERT_GE(copy, 0);
+        uint32_t tableBlocks = BlockGroup::refcountTableBlocks(fs.getSuperblock().s_blocks_per_group, 1024);
+        StatFs cloned;
+        ASSERT_TRUE(fs.statfs(cloned));
+        EXPECT_EQ(before.freeBlocks - cloned.freeBlocks, tableBlocks);
+        std::vector<ExtentTree::Extent> sourceExtents, copyExtents;
+        ASSERT_TRUE(fs.getExtents(source, sourceExtents));
+        ASSERT_TRUE(fs.getExtents(copy, copyExtents));
+        EXPECT_EQ(physical(copyExtents), physical(sourceExtents));
+        ASSERT_EQ(fs.read(copy, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, data);
+
+        // Copy-on-write: one block moves, the source keeps its data
+        ASSERT_EQ(fs.write(copy, 5000, "patched", 7), 7);
+        ASSERT_EQ(fs.read(copy, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, patched);
+        ASSERT_EQ(fs.read(source, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, data);
+        ASSERT_TRUE(fs.getExtents(copy, copyExtents));
+        std::vector<uint64_t> a = physical(sourceExtents), b = physical(copyExtents);
+        ASSERT_EQ(a.size(), b.size());
+        for (size_t i = 0; i < a.size(); ++i) {
+            EXPECT_EQ(a[i] != b[i], i == 4) << "block " << i;
+        }
+        StatFs written;
+        ASSERT_TRUE(fs.statfs(written));
+        EXPECT_EQ(cloned.freeBlocks - written.freeBlocks, 1u);
+
+        // A clone of the clone; then the source goes, freeing only its own block
+        second = fs.clone(copy);
+        ASSERT_GE(second, 0);
+        ASSERT_TRUE(fs.unlink(FileSystem::ROOT_INODE, "model"));
+        ASSERT_TRUE(fs.reclaim());
+        StatFs deleted;
+        ASSERT_TRUE(fs.statfs(deleted));
+        EXPECT_EQ(deleted.freeBlocks, written.freeBlocks + 1);
+        ASSERT_EQ(fs.read(second, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+        EXPECT_EQ(readBack, patched);
+
+        // Directories cannot be cloned; inline files are copied with their inode
+        EXPECT_LT(fs.clone(FileSystem::ROOT_INODE), 0);
+        int small = fs.createFile(0x81A4, 0);
+        ASSERT_EQ(fs.write(small, 0, "tiny", 4), 4);
+        int smallCopy = fs.clone(small);
+        ASSERT_GE(smallCopy, 0);
+        char tiny[4];
+        ASSERT_EQ(fs.read(smallCopy, 0, tiny, 4), 4);
+        EXPECT_EQ(std::string(tiny, 4), "tiny");
+        fs.deleteFile(small);
+        fs.deleteFile(smallCopy);
+    }
+
+    // The counts survive a remount, and fsck agrees with them
+    FsckReport report;
+    ASSERT_TRUE(Fsck("fs_disk.img").run(report));
+    EXPECT_TRUE(report.clean());
+    EXPECT_EQ(report.sharedBlocks, data.size() / 1024);
+    {
+        FileSystem fs("fs_disk.img", options);
+        fs.deleteFile(copy);
+        ASSERT_TRUE(fs.reclaim());
+        // The last owner writes in place
+        StatFs before;
+        ASSERT_TRUE(fs.statfs(before));
+        ASSERT_EQ(fs.write(second, 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+        StatFs after;
+        ASSERT_TRUE(fs.statfs(after));
+        EXPECT_EQ(after.freeBlocks, before.freeBlocks);
+        fs.deleteFile(second);
+        ASSERT_TRUE(fs.reclaim());
+        ASSERT_TRUE(fs.statfs(after));
+        uint32_t tableBlocks = BlockGroup::refcountTableBlocks(fs.getSuperblock().s_blocks_per_group, 1024);
+        EXPECT_EQ(after.freeBlocks + tableBlocks, initial.freeBlocks);
+    }
+    ASSERT_TRUE(Fsck("fs_disk.img").run(report));
+    EXPECT_TRUE(report.clean());
+    EXPECT_EQ(report.sharedBlocks, 0u);
+}
+
+// Test case for recording a workload trace and replaying it on a fresh image
+TEST(FileSystemTest, TraceReplay) {
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0;
+    options.traceFile = "fs_trace.bin";
+    MkfsOptions mkfs;
+    mkfs.imageSize = 4 * 1024 * 1024;
+    mkfs.inodesPerGroup = 128;
+    std::vector<char> data(3000, 'x');
+    uint32_t blocksCount;
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize(mkfs));
+        blocksCount = fs.getSuperblock().s_blocks_count;
+        int docs = fs.create(FileSystem::ROOT_INODE, "docs", Inode::DIRECTORY | 0755);
+        ASSERT_GE(docs, 0);
+        // Two threads work in the directory the main thread made
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 2; ++t) {
+            threads.emplace_back([&fs, &data, docs, t] {
+                std::vector<char> readBack(data.size());
+                for (int k = 0; k < 5; ++k) {
+                    std::string name = "t" + std::to_string(t) + "-" + std::to_string(k);
+                    int file = fs.create(docs, name, 0644);
+                    EXPECT_EQ(fs.write(file, 0, data.data(), data.size()), static_cast<int64_t>(data.size()));
+                    EXPECT_EQ(fs.read(file, 0, readBack.data(), readBack.size()), static_cast<int64_t>(data.size()));
+                    EXPECT_EQ(fs.lookup(docs, name), file);
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        std::vector<uint32_t> created;
+        ASSERT_TRUE(fs.createFiles(10, 0x81A4, 2048, created));
+        ASSERT_TRUE(fs.deleteFiles(std::vector<uint32_t>(created.begin(), created.begin() + 5)));
+        int copy = fs.clone(created[7]);
+        ASSERT_GE(copy, 0);
+        Inode::Ext4Inode info;
+        EXPECT_TRUE(fs.stat(copy, info));
+        EXPECT_LT(fs.lookup(docs, "missing"), 0);
+        std::vector<Directory::Entry> entries;
+        EXPECT_TRUE(fs.listDirectory(docs, entries));
+        EXPECT_TRUE(fs.fsync(created[9]));
+        EXPECT_FALSE(fs.unlink(FileSystem::ROOT_INODE, "docs")); // not empty
+        fs.deleteFile(copy);
+        fs.sync();
+    }
+
+    // The trace holds every call with its arguments and outcome
+    TraceReader reader("fs_trace.bin");
+    ASSERT_TRUE(reader.isOpen());
+    EXPECT_EQ(reader.getHeader().inodesPerGroup, 128u);
+    EXPECT_EQ(reader.getHeader().imageSize, static_cast<uint64_t>(blocksCount) * reader.getHeader().blockSize);
+    std::array<uint64_t, Trace::OPERATION_COUNT> counts{};
+    Trace::Record record;
+    uint64_t records = 0;
+    uint64_t lastStart = 0;
+    std::set<uint32_t> threadsSeen;
+    while (reader.next(record)) {
+        ++records;
+        ++counts[record.operation];
+        threadsSeen.insert(record.thread);
+        lastStart = std::max(lastStart, record.start);
+        if (record.operation == Trace::WRITE) {
+            EXPECT_EQ(record.length, data.size());
+            EXPECT_EQ(record.result, static_cast<int64_t>(data.size()));
+        } else if (record.operation == Trace::LOOKUP && record.name == "missing") {
+            EXPECT_EQ(record.result, -1);
+        } else if (record.operation == Trace::CREATE_FILES) {
+            EXPECT_EQ(record.inodes.size(), 10u);
+        } else if (record.operation == Trace::DELETE_FILES) {
+            EXPECT_EQ(record.inodes.size(), 5u);
+        }
+    }
+    EXPECT_FALSE(reader.failed());
+    EXPECT_EQ(threadsSeen.size(), 3u);
+    EXPECT_EQ(counts[Trace::CREATE], 11u);
+    EXPECT_EQ(counts[Trace::WRITE], 10u);
+    EXPECT_EQ(counts[Trace::READ], 10u);
+    EXPECT_EQ(counts[Trace::LOOKUP], 11u);
+    EXPECT_EQ(counts[Trace::UNLINK], 1u);
+    EXPECT_EQ(counts[Trace::SYNC], 1u);
+
+    // Replayed on a fresh image, every call turns out as recorded
+    for (unsigned threads : {1u, 2u}) {
+        ReplayOptions replayOptions;
+        replayOptions.threads = threads;
+        replayOptions.realTime = threads == 1;
+        replayOptions.fileSystem.writebackIntervalMs = 0;
+        TraceReplay replay("fs_trace.bin", "fs_crash.img", replayOptions);
+        ReplayReport report;
+        ASSERT_TRUE(replay.run(report));
+        EXPECT_EQ(report.operations, records);
+        EXPECT_EQ(report.mismatches, 0u) << threads << " threads";
+        EXPECT_EQ(report.perOperation[Trace::WRITE].count, 10u);
+        EXPECT_EQ(report.perOperation[Trace::WRITE].bytes, 10 * data.size());
+        EXPECT_EQ(report.perOperation[Trace::READ].bytes, 10 * data.size());
+        if (replayOptions.realTime) {
+            EXPECT_GE(report.seconds * 1e9, static_cast<double>(lastStart));
+        }
+        FsckReport fsckReport;
+        ASSERT_TRUE(Fsck("fs_crash.img").run(fsckReport));
+        EXPECT_TRUE(fsckReport.clean());
+        EXPECT_EQ(fsckReport.directories, 2u);
+    }
+    std::remove("fs_trace.bin");
+}
+
 // Test case for reading and writing group descriptor to disk
 TEST(BlockGroupTest, ReadWriteGroupDesc) {
     initializeDisk("disk.img");
     BlockGroup bg("disk.img");
-    BlockGroup::Ext4GroupDesc desc = {1, 2, 3, 4, 5, 6, 7, {0, 0, 0}};
+    BlockGroup::Ext4GroupDesc desc = {1, 2, 3, 4, 5, 6, 7, 0, 0, 0, 0};
     bg.getGroupDesc() = desc;
     bg.writeGroupDescToDisk(0);
 
@@ -117,6 +1838,7 @@ TEST(InodeTest, DeleteInode) {
 // Test case for writing and reading a journal entry
 TEST(JournalTest, WriteReadJournal) {
     std::string disk = "journal_disk.img";
+    initializeDisk(disk);
     Journal journal(disk);
 
     // Write to the journal
@@ -154,6 +1876,425 @@ TEST(JournalTest, ManageJournal) {
     EXPECT_EQ(journalEntries[1].header.j_sequence, 3);
 }
 
+// Test case for group commit: concurrent writers share transactions
+TEST(JournalTest, GroupCommit) {
+    initializeDisk("journal_disk.img");
+    JournalOptions options;
+    options.commitIntervalMs = 20;
+    auto device = std::make_shared<BlockDevice>("journal_disk.img");
+    const int threads = 8;
+    const int perThread = 25;
+    {
+        Journal journal(device, 4096, 256 * 1024, options);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&journal, t]() {
+                for (int i = 0; i < perThread; ++i) {
+                    Journal::JournalEntry entry = {{Journal::MAGIC_NUMBER, 1, static_cast<uint32_t>(t * perThread + i)},
+                                                   {static_cast<char>(t), static_cast<char>(i)}};
+                    uint32_t transaction = journal.writeJournal(entry);
+                    ASSERT_NE(transaction, 0u);
+                    EXPECT_TRUE(journal.waitForCommit(transaction));
+                }
+            });
+        }
+        for (auto &writer : writers) {
+            writer.join();
+        }
+        EXPECT_EQ(journal.getRecordCount(), static_cast<uint64_t>(threads * perThread));
+        EXPECT_LT(journal.getCommitCount(), journal.getRecordCount());
+    }
+
+    // Everything committed is found again when the journal is reopened
+    Journal reopened(device, 4096, 256 * 1024, options);
+    std::vector<Journal::JournalEntry> entries;
+    reopened.readJournal(entries);
+    EXPECT_EQ(entries.size(), static_cast<size_t>(threads * perThread));
+    EXPECT_EQ(device->size(), 1024u * 1024u); // the image never grows
+}
+
+// Test case for handles: a forced commit waits for the open handles, and new
+// handles wait for the commit
+TEST(JournalTest, HandleHoldsForcedCommit) {
+    initializeDisk("journal_disk.img");
+    JournalOptions options;
+    options.commitIntervalMs = 1;
+    auto device = std::make_shared<BlockDevice>("journal_disk.img");
+    Journal journal(device, 0, 32 * 1024, options);
+    std::atomic<bool> flushed(false);
+    std::atomic<bool> started(false);
+    std::thread flusher, latecomer;
+    uint32_t first, second;
+    {
+        Journal::Handle handle(journal);
+        first = journal.writeJournal({{Journal::MAGIC_NUMBER, 1, 1}, {'a'}});
+        ASSERT_NE(first, 0u);
+        EXPECT_FALSE(journal.flush()); // would wait for this very handle
+        flusher = std::thread([&]() {
+            EXPECT_TRUE(journal.flush());
+            flushed = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        latecomer = std::thread([&]() {
+            Journal::Handle late(journal);
+            started = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_FALSE(flushed);
+        EXPECT_FALSE(started);
+        EXPECT_LT(journal.getCommittedTransaction(), first);
+
+        // The rest of the update still joins the transaction
+        Journal::Handle nested(journal);
+        second = journal.writeJournal({{Journal::MAGIC_NUMBER, 1, 2}, {'b'}});
+    }
+    flusher.join();
+    latecomer.join();
+    EXPECT_TRUE(flushed);
+    EXPECT_TRUE(started);
+    EXPECT_EQ(second, first);
+    EXPECT_GE(journal.getCommittedTransaction(), first);
+}
+
+// Test case for the ring: checkpointed space is reused, and live transactions
+// are never overwritten
+TEST(JournalTest, RingWrapsAndReloads) {
+    initializeDisk("journal_disk.img");
+    auto device = std::make_shared<BlockDevice>("journal_disk.img");
+    std::vector<char> payload(1500, 'j');
+    uint32_t last = 0;
+    {
+        Journal journal(device, 0, 16 * 1024);
+        for (uint32_t i = 1; i <= 40; ++i) {
+            payload[0] = static_cast<char>(i);
+            last = journal.writeJournal({{Journal::MAGIC_NUMBER, 1, i}, payload});
+            ASSERT_TRUE(journal.waitForCommit(last));
+            if (journal.needsCheckpoint()) {
+                ASSERT_TRUE(journal.checkpoint(last - 1));
+            }
+        }
+    }
+
+    std::vector<Journal::JournalEntry> entries;
+    {
+        Journal reopened(device, 0, 16 * 1024);
+        reopened.readJournal(entries);
+        ASSERT_FALSE(entries.empty());
+        EXPECT_LT(entries.size(), 40u);
+        EXPECT_EQ(entries.back().header.j_sequence, 40u);
+        for (size_t i = 1; i < entries.size(); ++i) {
+            EXPECT_EQ(entries[i].header.j_sequence, entries[i - 1].header.j_sequence + 1);
+        }
+
+        // New transactions continue the numbering after the reload. Without
+        // checkpoints the ring fills, and the commit that does not fit fails.
+        uint32_t next = reopened.writeJournal({{Journal::MAGIC_NUMBER, 1, 41}, payload});
+        EXPECT_GT(next, last);
+        EXPECT_TRUE(reopened.flush());
+        bool committed = true;
+        for (uint32_t i = 42; committed && i < 60; ++i) {
+            uint32_t transaction = reopened.writeJournal({{Journal::MAGIC_NUMBER, 1, i}, payload});
+            committed = transaction != 0 && reopened.waitForCommit(transaction);
+        }
+        EXPECT_FALSE(committed);
+        EXPECT_FALSE(reopened.isOpen());
+    }
+
+    // Everything live before the ring filled is still there
+    Journal full(device, 0, 16 * 1024);
+    std::vector<Journal::JournalEntry> kept;
+    full.readJournal(kept);
+    ASSERT_GT(kept.size(), entries.size());
+    EXPECT_EQ(kept.front().header.j_sequence, entries.front().header.j_sequence);
+    for (size_t i = 1; i < kept.size(); ++i) {
+        EXPECT_EQ(kept[i].header.j_sequence, kept[i - 1].header.j_sequence + 1);
+    }
+}
+
+// Test case for checkpointing: reclaimed transactions are not replayed
+TEST(JournalTest, CheckpointAndCursor) {
+    initializeDisk("journal_disk.img");
+    auto device = std::make_shared<BlockDevice>("journal_disk.img");
+    uint32_t checkpointed;
+    {
+        Journal journal(device, 0, 32 * 1024);
+        checkpointed = journal.writeJournal({{Journal::MAGIC_NUMBER, 1, 1}, {'o', 'l', 'd'}});
+        ASSERT_TRUE(journal.flush());
+        ASSERT_TRUE(journal.checkpoint(checkpointed));
+        journal.writeJournal({{Journal::MAGIC_NUMBER, 1, 2}, {'n', 'e', 'w'}});
+        journal.writeJournal({{Journal::MAGIC_NUMBER, 1, 3}, {'!'}});
+        ASSERT_TRUE(journal.flush());
+    }
+
+    Journal reopened(device, 0, 32 * 1024);
+    Journal::Cursor cursor(reopened);
+    Journal::Ext4JournalHeader header;
+    const char *data;
+    uint32_t dataSize;
+    ASSERT_TRUE(cursor.next(header, data, dataSize));
+    EXPECT_EQ(header.j_sequence, 2u);
+    EXPECT_EQ(std::string(data, dataSize), "new");
+    EXPECT_GT(cursor.transaction(), checkpointed);
+    ASSERT_TRUE(cursor.next(header, data, dataSize));
+    EXPECT_EQ(header.j_sequence, 3u);
+    EXPECT_FALSE(cursor.next(header, data, dataSize));
+}
+
+// Test case for torn writes: loading stops at the first transaction that does
+// not verify, and garbage lengths are never followed
+TEST(JournalTest, TornTransaction) {
+    initializeDisk("journal_disk.img");
+    auto device = std::make_shared<BlockDevice>("journal_disk.img");
+    {
+        Journal journal(device, 0, 32 * 1024);
+        EXPECT_EQ(journal.writeJournal({{0x12345678, 1, 0}, {'x'}}), 0u); // not a journal record
+        for (uint32_t i = 1; i <= 3; ++i) {
+            ASSERT_NE(journal.writeJournal({{Journal::MAGIC_NUMBER, 1, i}, std::vector<char>(100, 'r')}), 0u);
+            ASSERT_TRUE(journal.flush());
+        }
+    }
+
+    // Each transaction takes one block of the ring, which follows the superblock
+    auto transactionOffset = [](uint32_t transaction) { return 1024u * transaction; };
+    char byte = 0;
+    ASSERT_TRUE(device->write(transactionOffset(3) + 60, &byte, 1)); // inside the third record
+    {
+        Journal journal(device, 0, 32 * 1024);
+        std::vector<Journal::JournalEntry> entries;
+        journal.readJournal(entries);
+        ASSERT_EQ(entries.size(), 2u);
+        EXPECT_EQ(entries.back().header.j_sequence, 2u);
+        EXPECT_EQ(entries.back().data, std::vector<char>(100, 'r'));
+        EXPECT_EQ(journal.getCommittedTransaction(), 2u);
+    }
+
+    // A descriptor claiming a huge length fails its own checksum
+    uint32_t length = 0x7FFFFFFF;
+    ASSERT_TRUE(device->write(transactionOffset(2) + 16, &length, sizeof(length)));
+    Journal journal(device, 0, 32 * 1024);
+    std::vector<Journal::JournalEntry> entries;
+    journal.readJournal(entries);
+    ASSERT_EQ(entries.size(), 1u);
+    EXPECT_EQ(entries[0].header.j_sequence, 1u);
+}
+
+// Test case for fsck finding and repairing damaged metadata
+TEST(FsckTest, CheckAndRepair) {
+    MkfsOptions mkfs;
+    mkfs.imageSize = 16 * 1024 * 1024; // two groups
+    FileSystemOptions options;
+    options.writebackIntervalMs = 0;
+    int config, data, big;
+    std::vector<uint32_t> created;
+    std::vector<char> contents(3000);
+    for (size_t i = 0; i < contents.size(); ++i) {
+        contents[i] = static_cast<char>(i * 31 + 7);
+    }
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.initialize(mkfs));
+        int etc = fs.create(FileSystem::ROOT_INODE, "etc", Inode::DIRECTORY | 0755);
+        ASSERT_GE(etc, 0);
+        config = fs.create(etc, "a.conf", 0644);
+        data = fs.create(etc, "data", 0644);
+        ASSERT_GE(config, 0);
+        ASSERT_GE(data, 0);
+        ASSERT_EQ(fs.write(config, 0, "key=value", 9), 9);
+        ASSERT_EQ(fs.write(data, 0, contents.data(), contents.size()), 3000);
+        big = fs.createFile(0x81A4, 300 * 1024);
+        ASSERT_GE(big, 0);
+        ASSERT_TRUE(fs.createFiles(20, 0x81A4, 2048, created));
+        fs.deleteFile(created.back());
+        created.pop_back();
+    }
+
+    // A clean image, checked by one worker and by several with small reads
+    FsckReport report;
+    FsckOptions single;
+    single.threads = 1;
+    ASSERT_TRUE(Fsck("fs_disk.img", single).run(report));
+    EXPECT_TRUE(report.clean());
+    EXPECT_TRUE(report.problems.empty());
+    EXPECT_EQ(report.inodesInUse, 24u); // root, etc, a.conf, data, big and 19 more
+    EXPECT_EQ(report.directories, 2u);
+    EXPECT_EQ(report.unattached, 20u);
+    EXPECT_LE(report.inodeTableReads, 2u); // one per initialized group
+    FsckOptions parallel;
+    parallel.threads = 4;
+    parallel.scanBytes = 1000; // ten inodes per read
+    FsckReport again;
+    ASSERT_TRUE(Fsck("fs_disk.img", parallel).run(again));
+    EXPECT_TRUE(again.clean());
+    EXPECT_EQ(again.inodesInUse, report.inodesInUse);
+    EXPECT_EQ(again.blocksInUse, report.blocksInUse);
+    EXPECT_GT(again.inodeTableReads, 25u);
+
+    // Damage: bitmaps, counts, an inode that was freed behind its entry's back
+    // and an inode that fails its checksum
+    auto device = std::make_shared<BlockDevice>("fs_disk.img");
+    auto metadata = std::make_shared<BufferCache>(device);
+    BlockGroup group(metadata, Superblock::GROUP_DESC_BLOCK * 1024);
+    ASSERT_TRUE(group.readGroupDescFromDisk(0));
+    BlockGroup::Ext4GroupDesc desc = group.getGroupDesc();
+    auto flipBit = [&](uint64_t block, uint32_t index) {
+        char byte;
+        ASSERT_TRUE(device->read(block * 1024 + index / 8, &byte, 1));
+        byte = static_cast<char>(byte ^ (1 << (index % 8)));
+        ASSERT_TRUE(device->write(block * 1024 + index / 8, &byte, 1));
+    };
+    auto changeInode = [&](uint32_t number, const std::function<void(Inode::Ext4Inode &)> &change, bool checksum) {
+        uint64_t offset = desc.bg_inode_table * 1024ull + number * sizeof(Inode::Ext4Inode);
+        Inode::Ext4Inode inode;
+        ASSERT_TRUE(device->read(offset, &inode, sizeof(inode)));
+        change(inode);
+        if (checksum) {
+            Inode::setChecksum(inode, offset);
+        }
+        ASSERT_TRUE(device->write(offset, &inode, sizeof(inode)));
+    };
+    std::vector<ExtentTree::Extent> extents;
+    {
+        FileSystem fs("fs_disk.img", options);
+        ASSERT_TRUE(fs.getExtents(data, extents));
+    }
+    ASSERT_EQ(extents.size(), 1u);
+    flipBit(desc.bg_block_bitmap, static_cast<uint32_t>(extents[0].physical)); // in use, marked free
+    flipBit(desc.bg_block_bitmap, 8000);                                       // leaked
+    flipBit(desc.bg_inode_bitmap, 200);                                        // free, marked in use
+    changeInode(data, [](Inode::Ext4Inode &inode) { inode.i_links_count = 5; }, true);
+    changeInode(config, [](Inode::Ext4Inode &inode) { inode.i_dtime = 1; }, true);
+    changeInode(created[0], [](Inode::Ext4Inode &inode) { inode.i_size ^= 1; }, false);
+    group.getGroupDesc().bg_used_dirs_count += 3;
+    group.writeGroupDescToDisk(0);
+    ASSERT_TRUE(metadata->sync());
+
+    auto imageChecksum = []() {
+        std::ifstream in("fs_disk.img", std::ios::binary);
+        std::ostringstream image;
+        image << in.rdbuf();
+        return Crc32c::compute(image.str().data(), image.str().size());
+    };
+    uint32_t damaged = imageChecksum();
+    ASSERT_TRUE(Fsck("fs_disk.img", parallel).run(report));
+    EXPECT_FALSE(report.clean());
+    EXPECT_GE(report.errors, 7u);
+    EXPECT_EQ(report.repaired, 0u);
+    EXPECT_EQ(imageChecksum(), damaged); // checking alone writes nothing
+    auto found = [&report](const std::string &text) {
+        return std::any_of(report.problems.begin(), report.problems.end(),
+                           [&text](const std::string &problem) { return problem.find(text) != std::string::npos; });
+    };
+    EXPECT_TRUE(found(" are in use but marked free"));
+    EXPECT_TRUE(found(" are marked in use but unused"));
+    EXPECT_TRUE(found("inode 200 is marked in use but is free"));
+    EXPECT_TRUE(found("inode " + std::to_string(data) + ": link count is 5, should be 1"));
+    EXPECT_TRUE(found("entry 'a.conf' names inode " + std::to_string(config)));
+    EXPECT_TRUE(found("inode " + std::to_string(created[0]) + ": checksum mismatch"));
+    EXPECT_TRUE(found("directory count is 5, should be 2"));
+
+    FsckOptions repair = parallel;
+    repair.repair = true;
+    ASSERT_TRUE(Fsck("fs_disk.img", repair).run(again));
+    EXPECT_EQ(again.errors, report.errors);
+    EXPECT_EQ(again.repaired, again.errors);
+    ASSERT_TRUE(Fsck("fs_disk.img", single).run(report));
+    EXPECT_TRUE(report.clean());
+    EXPECT_EQ(report.inodesInUse, 22u); // a.conf and the damaged inode are gone
+    for (const auto &problem : report.problems) {
+        ADD_FAILURE() << problem;
+    }
+
+    FileSystem fs("fs_disk.img", options);
+    int etc = fs.lookup(FileSystem::ROOT_INODE, "etc");
+    ASSERT_GE(etc, 0);
+    EXPECT_EQ(fs.lookup(etc, "a.conf"), -1);
+    std::vector<char> readBack(contents.size());
+    ASSERT_EQ(fs.read(data, 0, readBack.data(), readBack.size()), 3000);
+    EXPECT_EQ(readBack, contents);
+    Inode::Ext4Inode info;
+    ASSERT_TRUE(fs.stat(data, info));
+    EXPECT_EQ(info.i_links_count, 1u);
+    EXPECT_FALSE(fs.stat(created[0], info));
+}
+
+// Test case for fsck replaying a journal left by a crash
+TEST(FsckTest, ReplaysJournal) {
+    int file;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize());
+        file = fs.create(FileSystem::ROOT_INODE, "log", 0644);
+        ASSERT_GE(file, 0);
+        std::string record(5000, 'r');
+        ASSERT_EQ(fs.write(file, 0, record.data(), record.size()), 5000);
+        ASSERT_TRUE(fs.fsync(file));
+
+        // Crash: the metadata is only in the cache and the journal
+        std::ifstream in("fs_disk.img", std::ios::binary);
+        std::ofstream out("fs_crash.img", std::ios::binary | std::ios::trunc);
+        out << in.rdbuf();
+    }
+
+    FsckReport report;
+    ASSERT_TRUE(Fsck("fs_crash.img").run(report));
+    EXPECT_FALSE(report.clean());
+    EXPECT_FALSE(report.journalReplayed);
+
+    FsckOptions repair;
+    repair.repair = true;
+    ASSERT_TRUE(Fsck("fs_crash.img", repair).run(report));
+    EXPECT_TRUE(report.journalReplayed);
+    EXPECT_TRUE(report.clean());
+    ASSERT_TRUE(Fsck("fs_crash.img").run(report));
+    EXPECT_TRUE(report.clean());
+
+    FileSystem recovered("fs_crash.img");
+    Inode::Ext4Inode info;
+    ASSERT_TRUE(recovered.stat(file, info));
+    EXPECT_EQ(info.i_size, 5000u);
+}
+
+// Test case for fsck -n on an image whose journal superblock is damaged
+TEST(FsckTest, DamagedJournalSuperblock) {
+    uint64_t journalOffset;
+    {
+        FileSystem fs("fs_disk.img");
+        ASSERT_TRUE(fs.initialize());
+        ASSERT_GE(fs.create(FileSystem::ROOT_INODE, "kept", 0644), 0);
+        const Superblock::Ext4Superblock &sb = fs.getSuperblock();
+        journalOffset = static_cast<uint64_t>(sb.s_journal_block) * (1024u << sb.s_log_block_size);
+    }
+    {
+        std::fstream image("fs_disk.img", std::ios::binary | std::ios::in | std::ios::out);
+        uint32_t badMagic = 0xDEADBEEF;
+        image.seekp(static_cast<std::streamoff>(journalOffset));
+        image.write(reinterpret_cast<const char *>(&badMagic), sizeof(badMagic));
+    }
+    auto contents = [] {
+        std::ifstream in("fs_disk.img", std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    std::string before = contents();
+
+    // A check without repairs reports the damage and writes nothing
+    FsckReport report;
+    ASSERT_TRUE(Fsck("fs_disk.img").run(report));
+    EXPECT_FALSE(report.clean());
+    EXPECT_EQ(report.repaired, 0u);
+    EXPECT_TRUE(contents() == before);
+
+    // Repairing formats a fresh journal
+    FsckOptions repair;
+    repair.repair = true;
+    ASSERT_TRUE(Fsck("fs_disk.img", repair).run(report));
+    EXPECT_EQ(report.errors, 1u);
+    EXPECT_EQ(report.repaired, 1u);
+    ASSERT_TRUE(Fsck("fs_disk.img").run(report));
+    EXPECT_TRUE(report.clean());
+    FileSystem fs("fs_disk.img");
+    EXPECT_GE(fs.lookup(FileSystem::ROOT_INODE, "kept"), 0);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,75 @@
+#include "Fsck.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// fs_fsck [-n | -y] [-j threads] [-v] image
+//
+// Checks an unmounted image; -y repairs it (replaying its journal first), -n
+// (the default) only reads it. Exit codes follow e2fsck: 0 clean, 1 errors
+// were corrected, 4 errors are left, 8 the image could not be checked.
+
+namespace {
+
+void usage() {
+    std::cerr << "usage: fs_fsck [-n | -y] [-j threads] [-v] image" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    FsckOptions options;
+    bool verbose = false;
+    std::string image;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-y") == 0) {
+            options.repair = true;
+        } else if (std::strcmp(argv[i], "-n") == 0) {
+            options.repair = false;
+        } else if (std::strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (argv[i][0] != '-' && image.empty()) {
+            image = argv[i];
+        } else {
+            usage();
+            return 8;
+        }
+    }
+    if (image.empty()) {
+        usage();
+        return 8;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Fsck fsck(image, options);
+    FsckReport report;
+    if (!fsck.run(report)) {
+        return 8;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t shown = verbose ? report.problems.size() : std::min<size_t>(report.problems.size(), 20);
+    for (size_t i = 0; i < shown; ++i) {
+        std::cout << report.problems[i] << std::endl;
+    }
+    if (report.errors > shown) {
+        std::cout << "... " << report.errors - shown << " more" << std::endl;
+    }
+    if (report.journalReplayed) {
+        std::cout << "Journal replayed." << std::endl;
+    }
+    std::cout << image << ": " << report.inodesInUse << " inodes (" << report.directories << " directories, "
+              << report.unattached << " without a name), " << report.blocksInUse << " blocks in use; "
+              << report.errors << " errors, " << report.repaired << " repaired; " << report.inodeTableReads
+              << " inode table reads in " << seconds << " s" << std::endl;
+
+    if (report.errors == 0) {
+        return 0;
+    }
+    return report.errors > report.repaired ? 4 : 1;
+}
@@ -0,0 +1,82 @@
+#include "TraceReplay.h"
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// fs_replay [-r] [-j threads] trace image
+//
+// Formats 'image' with the geometry the trace was recorded on and replays the
+// trace against it, as fast as possible or, with -r, at the recorded pace.
+// Prints the throughput and, per operation, the count and the latency
+// distribution. Exit codes: 0 replayed as recorded, 1 some calls succeeded or
+// failed differently, 2 the trace could not be replayed.
+
+namespace {
+
+void usage() {
+    std::cerr << "usage: fs_replay [-r] [-j threads] trace image" << std::endl;
+}
+
+double micros(uint64_t nanos) {
+    return static_cast<double>(nanos) / 1000;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    ReplayOptions options;
+    std::string trace;
+    std::string image;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-r") == 0) {
+            options.realTime = true;
+        } else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (argv[i][0] != '-' && trace.empty()) {
+            trace = argv[i];
+        } else if (argv[i][0] != '-' && image.empty()) {
+            image = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (trace.empty() || image.empty()) {
+        usage();
+        return 2;
+    }
+
+    // The file system reports every file it creates on std::cout; keep the
+    // report readable
+    std::streambuf *output = std::cout.rdbuf(nullptr);
+    TraceReplay replay(trace, image, options);
+    ReplayReport report;
+    bool ok = replay.run(report);
+    std::cout.rdbuf(output);
+    std::cout.clear();
+    if (!ok) {
+        return 2;
+    }
+
+    std::cout << trace << ": " << report.operations << " operations in " << report.seconds << " s ("
+              << static_cast<uint64_t>(report.seconds > 0 ? report.operations / report.seconds : 0) << " ops/s), "
+              << report.mismatches << " mismatches" << std::endl;
+    std::cout << std::left << std::setw(14) << "operation" << std::right << std::setw(10) << "count" << std::setw(12)
+              << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "p99.9 us" << std::setw(12) << "max us"
+              << std::setw(12) << "MiB" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (size_t op = 0; op < Trace::OPERATION_COUNT; ++op) {
+        const Stats::OperationStats &stats = report.perOperation[op];
+        if (stats.count == 0) {
+            continue;
+        }
+        std::cout << std::left << std::setw(14) << Trace::operationName(static_cast<Trace::Operation>(op))
+                  << std::right << std::setw(10) << stats.count << std::setw(12) << micros(stats.percentile(0.5))
+                  << std::setw(12) << micros(stats.percentile(0.99)) << std::setw(12)
+                  << micros(stats.percentile(0.999)) << std::setw(12) << micros(stats.maxNanos) << std::setw(12)
+                  << static_cast<double>(stats.bytes) / (1024 * 1024) << std::endl;
+    }
+    return report.mismatches == 0 ? 0 : 1;
+}